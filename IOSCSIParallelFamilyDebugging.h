@@ -79,6 +79,10 @@ IOSCSIParallelFamilyDebugAssert ( 	const char * componentNameString,
 	error )
 
 
+/* The tracepoints (see SCSIParallelTrace.h). */
+#include "SCSIParallelTrace.h"
+
+
 #endif	/* KERNEL */
 
 
@@ -35,7 +35,10 @@
 #include "SCSIParallelWorkLoop.h"
 
 // Libkern includes
+#include <mach/kmod.h>
 #include <libkern/OSAtomic.h>
+#include <libkern/c++/OSArray.h>
+#include <libkern/c++/OSCollectionIterator.h>
 #include <libkern/c++/OSData.h>
 #include <libkern/c++/OSDictionary.h>
 #include <libkern/c++/OSNumber.h>
@@ -47,6 +50,8 @@
 #include <IOKit/IOFilterInterruptEventSource.h>
 #include <IOKit/IOKitKeys.h>
 #include <IOKit/IOCommandPool.h>
+#include <IOKit/IOUserClient.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
 #include <IOKit/storage/IOStorageProtocolCharacteristics.h>
 #include <IOKit/storage/IOStorageDeviceCharacteristics.h>
 
@@ -74,13 +79,13 @@
 #if ( SCSI_PARALLEL_INTERFACE_CONTROLLER_DEBUGGING_LEVEL >= 2 )
 #define ERROR_LOG(x)		IOLog x
 #else
-#define ERROR_LOG(x)		
+#define ERROR_LOG(x)		SCSI_PARALLEL_TRACE ( kSCSIParallelTraceCategory_Controller, x )
 #endif
 
 #if ( SCSI_PARALLEL_INTERFACE_CONTROLLER_DEBUGGING_LEVEL >= 3 )
 #define STATUS_LOG(x)		IOLog x
 #else
-#define STATUS_LOG(x)		
+#define STATUS_LOG(x)		SCSI_PARALLEL_TRACE ( kSCSIParallelTraceCategory_Controller | kSCSIParallelTraceStatus, x )
 #endif
 
 
@@ -108,9 +113,129 @@ enum
 enum
 {
 	kPhysicalInterconnectDictionaryEntryCount	= 3,
-	kHBAContraintsDictionaryEntryCount			= 7
+	kHBAContraintsDictionaryEntryCount			= 7,
+	kRecoveryStepDictionaryEntryCount			= 3,
+	kTaskPoolDictionaryEntryCount				= 7,
+	kHoldingQueueDictionaryEntryCount			= 5
 };
 
+// The number of free tasks held back for urgent tasks, unless the HBA sets
+// kIOTaskReserveKey. The reserve is never more than a quarter of the tasks.
+#define kDefaultTaskReserve							2
+
+// The largest number of tasks handed to ProcessParallelTasks in one call.
+#define kMaxParallelTaskBatchSize					32
+
+// The number of tasks held while services are suspended, and how long (in
+// milliseconds) each may be held, unless the HBA sets kIOHoldingQueueSizeKey
+// or kIOHoldingQueueTimeoutKey.
+#define kDefaultHoldingQueueSize					256
+#define kDefaultHoldingQueueTimeout					10000
+
+// The number of buffers in a sized bounce buffer pool, unless there are
+// fewer tasks, and the most wired memory they may use between them.
+#define kDefaultBounceBufferCount					32
+#define kMaxBounceBufferPoolBytes					( 16 * 1024 * 1024 )
+
+// The most data buffers which may be registered with a controller.
+#define kMaxRegisteredBufferCount					32
+
+// Default grace periods (in milliseconds) for each step of the timeout
+// recovery ladder, indexed by recovery step.
+static const UInt32 sRecoveryGracePeriodDefaults[] =
+{
+	0,			// kSCSIParallelRecoveryStep_None
+	5000,		// kSCSIParallelRecoveryStep_AbortTask
+	10000,		// kSCSIParallelRecoveryStep_LogicalUnitReset
+	10000,		// kSCSIParallelRecoveryStep_TargetReset
+	30000		// kSCSIParallelRecoveryStep_BusReset
+};
+
+// Property keys for each step of the timeout recovery ladder, indexed by
+// recovery step.
+static const char * sRecoveryStepKeys[] =
+{
+	NULL,
+	kIOAbortTaskGracePeriodKey,
+	kIOLogicalUnitResetGracePeriodKey,
+	kIOTargetResetGracePeriodKey,
+	kIOBusResetGracePeriodKey
+};
+
+// Accessors for the binary compatibility expansion data.
+#define fRecoveryEnabled			fIOSCSIParallelInterfaceControllerExpansionData->fRecoveryEnabled
+#define fRecoveryGracePeriod		fIOSCSIParallelInterfaceControllerExpansionData->fRecoveryGracePeriod
+#define fRecoveryAttempts			fIOSCSIParallelInterfaceControllerExpansionData->fRecoveryAttempts
+#define fRecoveryRecovered			fIOSCSIParallelInterfaceControllerExpansionData->fRecoveryRecovered
+#define fRecoveryCollateralTasks	fIOSCSIParallelInterfaceControllerExpansionData->fRecoveryCollateralTasks
+#define fRecoveryFailed				fIOSCSIParallelInterfaceControllerExpansionData->fRecoveryFailed
+#define fRecoveryTotalTime			fIOSCSIParallelInterfaceControllerExpansionData->fRecoveryTotalTime
+#define fRecoveryMaximumTime		fIOSCSIParallelInterfaceControllerExpansionData->fRecoveryMaximumTime
+#define fAdmissionPoolSize			fIOSCSIParallelInterfaceControllerExpansionData->fAdmissionPoolSize
+#define fAdmissionOutstanding		fIOSCSIParallelInterfaceControllerExpansionData->fAdmissionOutstanding
+#define fAdmissionReserved			fIOSCSIParallelInterfaceControllerExpansionData->fAdmissionReserved
+#define fAdmissionReservedOutstanding	fIOSCSIParallelInterfaceControllerExpansionData->fAdmissionReservedOutstanding
+#define fAdmissionActiveWeight		fIOSCSIParallelInterfaceControllerExpansionData->fAdmissionActiveWeight
+#define fAdmissionContenders		fIOSCSIParallelInterfaceControllerExpansionData->fAdmissionContenders
+#define fAdmissionWaiters			fIOSCSIParallelInterfaceControllerExpansionData->fAdmissionWaiters
+#define fAdmissionUrgentWaiters		fIOSCSIParallelInterfaceControllerExpansionData->fAdmissionUrgentWaiters
+#define fAdmissionUrgentStreak		fIOSCSIParallelInterfaceControllerExpansionData->fAdmissionUrgentStreak
+#define fAdmissionReturns			fIOSCSIParallelInterfaceControllerExpansionData->fAdmissionReturns
+#define fAdmissionLock				fIOSCSIParallelInterfaceControllerExpansionData->fAdmissionLock
+#define fTaskReserve				fIOSCSIParallelInterfaceControllerExpansionData->fTaskReserve
+#define fTaskReserveUsed			fIOSCSIParallelInterfaceControllerExpansionData->fTaskReserveUsed
+#define fTaskReserveWaits			fIOSCSIParallelInterfaceControllerExpansionData->fTaskReserveWaits
+#define fTaskReserveTotalWaitTime	fIOSCSIParallelInterfaceControllerExpansionData->fTaskReserveTotalWaitTime
+#define fTaskReserveMaximumWaitTime	fIOSCSIParallelInterfaceControllerExpansionData->fTaskReserveMaximumWaitTime
+#define fTaskPoolMaximumOutstanding	fIOSCSIParallelInterfaceControllerExpansionData->fTaskPoolMaximumOutstanding
+#define fTaskPoolEmpty				fIOSCSIParallelInterfaceControllerExpansionData->fTaskPoolEmpty
+#define fTaskPoolWaits				fIOSCSIParallelInterfaceControllerExpansionData->fTaskPoolWaits
+#define fTaskPoolTotalWaitTime		fIOSCSIParallelInterfaceControllerExpansionData->fTaskPoolTotalWaitTime
+#define fTaskPoolMaximumWaitTime	fIOSCSIParallelInterfaceControllerExpansionData->fTaskPoolMaximumWaitTime
+#define fTaskPoolWaitHistogram		fIOSCSIParallelInterfaceControllerExpansionData->fTaskPoolWaitHistogram
+#define fTaskPoolOccupancyTime		fIOSCSIParallelInterfaceControllerExpansionData->fTaskPoolOccupancyTime
+#define fTaskPoolOccupancyStart		fIOSCSIParallelInterfaceControllerExpansionData->fTaskPoolOccupancyStart
+#define fDMACommandPoolEmpty		fIOSCSIParallelInterfaceControllerExpansionData->fDMACommandPoolEmpty
+#define fInterruptTime				fIOSCSIParallelInterfaceControllerExpansionData->fInterruptTime
+#define fDeferredCompletionList		fIOSCSIParallelInterfaceControllerExpansionData->fDeferredCompletionList
+#define fCompletionEvent			fIOSCSIParallelInterfaceControllerExpansionData->fCompletionEvent
+#define fSubmissionList				fIOSCSIParallelInterfaceControllerExpansionData->fSubmissionList
+#define fSubmissionBatchSize		fIOSCSIParallelInterfaceControllerExpansionData->fSubmissionBatchSize
+#define fSubmissionEvent			fIOSCSIParallelInterfaceControllerExpansionData->fSubmissionEvent
+#define fHoldingQueueHead			fIOSCSIParallelInterfaceControllerExpansionData->fHoldingQueueHead
+#define fHoldingQueueTail			fIOSCSIParallelInterfaceControllerExpansionData->fHoldingQueueTail
+#define fHoldingQueueCount			fIOSCSIParallelInterfaceControllerExpansionData->fHoldingQueueCount
+#define fHoldingQueueSize			fIOSCSIParallelInterfaceControllerExpansionData->fHoldingQueueSize
+#define fHoldingQueueTimeout		fIOSCSIParallelInterfaceControllerExpansionData->fHoldingQueueTimeout
+#define fHoldingQueueMaximumDepth	fIOSCSIParallelInterfaceControllerExpansionData->fHoldingQueueMaximumDepth
+#define fHoldingQueueHeld			fIOSCSIParallelInterfaceControllerExpansionData->fHoldingQueueHeld
+#define fHoldingQueueExpired		fIOSCSIParallelInterfaceControllerExpansionData->fHoldingQueueExpired
+#define fHoldingQueueRefused		fIOSCSIParallelInterfaceControllerExpansionData->fHoldingQueueRefused
+#define fHoldingTimer				fIOSCSIParallelInterfaceControllerExpansionData->fHoldingTimer
+#define fHBAPropertyTransaction		fIOSCSIParallelInterfaceControllerExpansionData->fHBAPropertyTransaction
+#define fHBAPropertyTransactionDepth	fIOSCSIParallelInterfaceControllerExpansionData->fHBAPropertyTransactionDepth
+#define fHBAPropertyTransactionOwner	fIOSCSIParallelInterfaceControllerExpansionData->fHBAPropertyTransactionOwner
+#define fStatistics					fIOSCSIParallelInterfaceControllerExpansionData->fStatistics
+#define fDMAAddressBits				fIOSCSIParallelInterfaceControllerExpansionData->fDMAAddressBits
+#define fDMAAlignment				fIOSCSIParallelInterfaceControllerExpansionData->fDMAAlignment
+#define fDMAMaximumSegmentSize		fIOSCSIParallelInterfaceControllerExpansionData->fDMAMaximumSegmentSize
+#define fDMAMaximumTransferSize		fIOSCSIParallelInterfaceControllerExpansionData->fDMAMaximumTransferSize
+#define fBounceBuffers				fIOSCSIParallelInterfaceControllerExpansionData->fBounceBuffers
+#define fBounceBufferCount			fIOSCSIParallelInterfaceControllerExpansionData->fBounceBufferCount
+#define fBounceBufferFreeCount		fIOSCSIParallelInterfaceControllerExpansionData->fBounceBufferFreeCount
+#define fBounceBufferSize			fIOSCSIParallelInterfaceControllerExpansionData->fBounceBufferSize
+#define fBounceBufferLock			fIOSCSIParallelInterfaceControllerExpansionData->fBounceBufferLock
+#define fBounceBufferHits			fIOSCSIParallelInterfaceControllerExpansionData->fBounceBufferHits
+#define fBounceBufferMisses			fIOSCSIParallelInterfaceControllerExpansionData->fBounceBufferMisses
+#define fBounceBufferBytesCopied	fIOSCSIParallelInterfaceControllerExpansionData->fBounceBufferBytesCopied
+#define fRegisteredBuffers			fIOSCSIParallelInterfaceControllerExpansionData->fRegisteredBuffers
+#define fRegisteredBufferCount		fIOSCSIParallelInterfaceControllerExpansionData->fRegisteredBufferCount
+#define fRegisteredBufferLock		fIOSCSIParallelInterfaceControllerExpansionData->fRegisteredBufferLock
+#define fRegisteredBufferTasks		fIOSCSIParallelInterfaceControllerExpansionData->fRegisteredBufferTasks
+#define fDMACommandPool				fIOSCSIParallelInterfaceControllerExpansionData->fDMACommandPool
+#define fDMACommandCount			fIOSCSIParallelInterfaceControllerExpansionData->fDMACommandCount
+#define fNullDMACommand				fIOSCSIParallelInterfaceControllerExpansionData->fNullDMACommand
+
 
 //-----------------------------------------------------------------------------
 //	Static initialization
@@ -126,9 +251,69 @@ SInt32	IOSCSIParallelInterfaceController::fSCSIParallelDomainCount = 0;
 static IOSCSIParallelInterfaceDevice *
 GetDevice (	SCSIParallelTaskIdentifier 	parallelTask );
 
+static inline bool
+IsTargetActive ( SCSIParallelTaskAdmission * admission );
+
+static inline bool
+IsTargetContending ( SCSIParallelTaskAdmission * admission );
+
 static void
 CopyProtocolCharacteristicsProperties ( OSDictionary * dict, IOService * service );
 
+extern "C" kern_return_t
+IOSCSIParallelFamilyModuleStart ( kmod_info_t * ki, void * data );
+
+extern "C" kern_return_t
+IOSCSIParallelFamilyModuleStop ( kmod_info_t * ki, void * data );
+
+
+#if 0
+#pragma mark -
+#pragma mark Module Start and Stop
+#pragma mark -
+#endif
+
+
+//-----------------------------------------------------------------------------
+//	IOSCSIParallelFamilyModuleStart - Sets up the state shared by every
+//									  controller when the kext is loaded.
+//-----------------------------------------------------------------------------
+
+kern_return_t
+IOSCSIParallelFamilyModuleStart ( kmod_info_t * ki, void * data )
+{
+	
+	kern_return_t	status = KERN_FAILURE;
+	
+	require ( SCSIParallelPathGroup::InitializePathGroups ( ), ErrorExit );
+	
+	status = KERN_SUCCESS;
+	
+	
+ErrorExit:
+	
+	
+	return status;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	IOSCSIParallelFamilyModuleStop - Tears down the state shared by every
+//									 controller when the kext is unloaded.
+//-----------------------------------------------------------------------------
+
+kern_return_t
+IOSCSIParallelFamilyModuleStop ( kmod_info_t * ki, void * data )
+{
+	
+	SCSIParallelPathGroup::TerminatePathGroups ( );
+	IOSCSIParallelFamilyTraceTerminate ( );
+	
+	return KERN_SUCCESS;
+	
+}
+
 
 #if 0
 #pragma mark -
@@ -147,12 +332,38 @@ IOSCSIParallelInterfaceController::handleOpen ( IOService *		client,
 												void *			arg )
 {
 	
-	bool	result = false;
+	IOSCSIParallelInterfaceDevice *	target		= NULL;
+	SCSIParallelTaskAdmission *		admission	= NULL;
+	bool							result		= false;
 	
 	STATUS_LOG ( ( "+IOSCSIParallelInterfaceController::handleOpen\n" ) );
 	
 	result = fClients->setObject ( client );
 	
+	// Set aside the reservation of a target device for as long as it has
+	// the controller open. A target which was closed and reopened before
+	// its tasks drained still has its reservation.
+	target = OSDynamicCast ( IOSCSIParallelInterfaceDevice, client );
+	if ( ( result == true ) && ( target != NULL ) )
+	{
+		
+		admission = target->GetTaskAdmission ( );
+		
+		IOSimpleLockLock ( fAdmissionLock );
+		
+		admission->fOpen = true;
+		if ( admission->fReserved == false )
+		{
+			
+			fAdmissionReserved += admission->fReservation;
+			admission->fReserved = true;
+			
+		}
+		
+		IOSimpleLockUnlock ( fAdmissionLock );
+		
+	}
+	
 	STATUS_LOG ( ( "-IOSCSIParallelInterfaceController::handleOpen\n" ) );
 	
 	return result;
@@ -170,7 +381,26 @@ IOSCSIParallelInterfaceController::handleClose (
 							IOOptionBits	options )
 {
 	
+	IOSCSIParallelInterfaceDevice *	target		= NULL;
+	SCSIParallelTaskAdmission *		admission	= NULL;
+	
 	STATUS_LOG ( ( "IOSCSIParallelInterfaceController::handleClose\n" ) );
+	
+	// The reservation of a target device is given up once the tasks charged
+	// to it have drained (see ReleaseTaskReservation).
+	target = OSDynamicCast ( IOSCSIParallelInterfaceDevice, client );
+	if ( ( target != NULL ) && ( fClients->containsObject ( client ) == true ) )
+	{
+		
+		admission = target->GetTaskAdmission ( );
+		
+		IOSimpleLockLock ( fAdmissionLock );
+		admission->fOpen = false;
+		ReleaseTaskReservation ( admission );
+		IOSimpleLockUnlock ( fAdmissionLock );
+		
+	}
+	
 	fClients->removeObject ( client );
 	
 }
@@ -220,6 +450,10 @@ IOSCSIParallelInterfaceController::start ( IOService * provider )
 	OSNumber *		number		= NULL;
 	bool			result		= false;
 	
+	// Set up the tracepoints before anything is traced.
+	IOSCSIParallelFamilyTraceInitialize ( );
+	setProperty ( kIOTraceCategoriesKey, gSCSIParallelTraceCategories, 32 );
+	
 	STATUS_LOG ( ( "IOSCSIParallelInterfaceController start.\n" ) );
 	
 	fSCSIDomainIdentifier = OSIncrementAtomic ( &fSCSIParallelDomainCount );
@@ -241,6 +475,16 @@ IOSCSIParallelInterfaceController::start ( IOService * provider )
 	fHBACanAcceptClientRequests = false;
 	fClients					= OSSet::withCapacity ( 1 );
 	
+	fIOSCSIParallelInterfaceControllerExpansionData = IONew ( ExpansionData, 1 );
+	require_nonzero ( fIOSCSIParallelInterfaceControllerExpansionData, EXPANSION_DATA_ALLOC_FAILURE );
+	bzero ( fIOSCSIParallelInterfaceControllerExpansionData, sizeof ( ExpansionData ) );
+	
+	// The controller works without statistics if they can't be allocated.
+	fStatistics = IOSCSIParallelInterfaceDevice::AllocateStatistics ( );
+	
+	fAdmissionLock = IOSimpleLockAlloc ( );
+	require_nonzero ( fAdmissionLock, DEVICE_LOCK_ALLOC_FAILURE );
+	
 	fDeviceLock = IOSimpleLockAlloc ( );
 	require_nonzero ( fDeviceLock, DEVICE_LOCK_ALLOC_FAILURE );
 	
@@ -326,10 +570,25 @@ IOSCSIParallelInterfaceController::start ( IOService * provider )
 	
 	fSupportedTaskCount = ReportMaximumTaskCount ( );
 	
+	// Pick up the grace periods for timeout recovery.
+	InitializeTimeoutRecovery ( );
+	
+	// See if the HBA wants its tasks in batches.
+	InitializeBatchedSubmission ( );
+	
+	// Size the queue for tasks submitted while services are suspended.
+	InitializeHoldingQueue ( );
+	
 	// Allocate the SCSIParallelTasks and the pool
 	result = AllocateSCSIParallelTasks ( );
 	require ( result, TASK_ALLOCATE_FAILURE );
 	
+	// Hold a few of them back for recovery traffic.
+	InitializeTaskReserve ( );
+	
+	// The pool starts out empty of outstanding tasks.
+	fTaskPoolOccupancyStart = mach_absolute_time ( );
+	
 	// The HBA has been fully initialized and is now ready to provide
 	// its services to the system.
 	fHBAHasBeenInitialized = true;
@@ -417,6 +676,11 @@ WORKLOOP_CREATE_FAILURE:
 	
 DEVICE_LOCK_ALLOC_FAILURE:
 	// DEVICE_LOCK_ALLOC_FAILURE:
+	// The expansion data and the admission lock are released in free().
+	
+	
+EXPANSION_DATA_ALLOC_FAILURE:
+	// EXPANSION_DATA_ALLOC_FAILURE:
 	// Call the superclass to stop.
 	super::stop ( provider );
 	
@@ -433,6 +697,74 @@ PROVIDER_START_FAILURE:
 }
 
 
+//-----------------------------------------------------------------------------
+//	serializeProperties - Refreshes the statistics before the properties
+//						  are serialized.							  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+bool
+IOSCSIParallelInterfaceController::serializeProperties ( OSSerialize * s ) const
+{
+	
+	// The statistics change with every task, so they are only published
+	// when somebody looks at them.
+	( ( IOSCSIParallelInterfaceController * ) this )->UpdateStatistics ( );
+	( ( IOSCSIParallelInterfaceController * ) this )->UpdateTaskReserveStatistics ( );
+	( ( IOSCSIParallelInterfaceController * ) this )->UpdateTaskPoolStatistics ( );
+	( ( IOSCSIParallelInterfaceController * ) this )->UpdateHoldingQueueStatistics ( );
+	
+	// The trace categories may have been changed through another controller.
+	( ( IOSCSIParallelInterfaceController * ) this )->setProperty ( kIOTraceCategoriesKey, gSCSIParallelTraceCategories, 32 );
+	
+	if ( fBounceBuffers != NULL )
+	{
+		( ( IOSCSIParallelInterfaceController * ) this )->UpdateBounceBufferStatistics ( );
+	}
+	
+	if ( fRegisteredBuffers != NULL )
+	{
+		( ( IOSCSIParallelInterfaceController * ) this )->UpdateRegisteredBufferStatistics ( );
+	}
+	
+	return super::serializeProperties ( s );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	setProperties - Enables and disables tracepoints.				  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+IOReturn
+IOSCSIParallelInterfaceController::setProperties ( OSObject * properties )
+{
+	
+	OSDictionary *	dict	= NULL;
+	OSNumber *		number	= NULL;
+	IOReturn		status	= kIOReturnUnsupported;
+	
+	dict = OSDynamicCast ( OSDictionary, properties );
+	require_nonzero ( dict, ErrorExit );
+	
+	number = OSDynamicCast ( OSNumber, dict->getObject ( kIOTraceCategoriesKey ) );
+	require_nonzero_quiet ( number, ErrorExit );
+	
+	// Tracepoints record the commands sent to every Target.
+	status = IOUserClient::clientHasPrivilege ( current_task ( ), kIOClientPrivilegeAdministrator );
+	require_success ( status, ErrorExit );
+	
+	IOSCSIParallelFamilySetTraceCategories ( number->unsigned32BitValue ( ) );
+	setProperty ( kIOTraceCategoriesKey, gSCSIParallelTraceCategories, 32 );
+	
+	
+ErrorExit:
+	
+	
+	return status;
+	
+}
+
+
 //-----------------------------------------------------------------------------
 //	stop - Ends provided services.									  [PRIVATE]
 //-----------------------------------------------------------------------------
@@ -482,6 +814,39 @@ IOSCSIParallelInterfaceController::free ( void )
 		
 	}
 	
+	if ( fIOSCSIParallelInterfaceControllerExpansionData != NULL )
+	{
+		
+		// Drop any property transaction which was never committed.
+		if ( fHBAPropertyTransaction != NULL )
+		{
+			
+			fHBAPropertyTransaction->release ( );
+			fHBAPropertyTransaction = NULL;
+			
+		}
+		
+		if ( fStatistics != NULL )
+		{
+			
+			IOSCSIParallelInterfaceDevice::FreeStatistics ( fStatistics );
+			fStatistics = NULL;
+			
+		}
+		
+		if ( fAdmissionLock != NULL )
+		{
+			
+			IOSimpleLockFree ( fAdmissionLock );
+			fAdmissionLock = NULL;
+			
+		}
+		
+		IODelete ( fIOSCSIParallelInterfaceControllerExpansionData, ExpansionData, 1 );
+		fIOSCSIParallelInterfaceControllerExpansionData = NULL;
+		
+	}
+	
 	super::free ( );
 	
 }
@@ -500,9 +865,14 @@ IOSCSIParallelInterfaceController::willTerminate (
 	
 	SCSITargetIdentifier	index = 0;
 	
-	// Prevent any new requests from being sent to the controller.
+	// Prevent any new requests from being sent to the controller, and
+	// fail those which were being held.
 	fHBACanAcceptClientRequests = false;
 	
+	fWorkLoop->closeGate ( );
+	ExpireHeldParallelTasks ( 0xFFFFFFFFFFFFFFFFULL );
+	fWorkLoop->openGate ( );
+	
 	for ( index = 0; index < fHighestSupportedDeviceID; index++ )
 	{		
 		DestroyTargetForID ( index );
@@ -585,9 +955,7 @@ IOSCSIParallelInterfaceController::SetHBAProperty (
 									OSObject *	 	value )
 {
 	
-	bool			result 		= false;
-	OSDictionary *	hbaDict		= NULL;
-	OSDictionary *	copyDict	= NULL;
+	bool	result = false;
 	
 	require_nonzero ( key, ErrorExit );
 	require_nonzero ( value, ErrorExit );
@@ -608,122 +976,13 @@ IOSCSIParallelInterfaceController::SetHBAProperty (
 		goto ErrorExit;
 		
 	}
-
-	copyDict = OSDynamicCast ( OSDictionary, copyProperty ( kIOPropertyControllerCharacteristicsKey ) );
-	require_nonzero ( copyDict, ErrorExit );
-	
-	hbaDict = ( OSDictionary * ) copyDict->copyCollection ( );
-	copyDict->release ( );
-	
-	require_nonzero ( hbaDict, ErrorExit );
-	
-	if ( strcmp ( key, kIOPropertyVendorNameKey ) == 0 )
-	{
-		result = hbaDict->setObject ( key, value );
-	}
-	
-	else if ( strcmp ( key, kIOPropertyProductNameKey ) == 0 )
-	{
-		result = hbaDict->setObject ( key, value );
-	}
-	
-	else if ( strcmp ( key, kIOPropertyProductRevisionLevelKey ) == 0 )
-	{
-		result = hbaDict->setObject ( key, value );
-	}
-	
-	else if ( strcmp ( key, kIOPropertyPortDescriptionKey ) == 0 )
-	{
-		result = hbaDict->setObject ( key, value );
-	}
-	
-	else if ( strcmp ( key, kIOPropertyPortSpeedKey ) == 0 )
-	{
-		result = hbaDict->setObject ( key, value );
-	}
-	
-	else if ( strcmp ( key, kIOPropertySCSIParallelSignalingTypeKey ) == 0 )
-	{
-		result = hbaDict->setObject ( key, value );
-	}
-	
-	else if ( strcmp ( key, kIOPropertyFibreChannelCableDescriptionKey ) == 0 )
-	{
-		result = hbaDict->setObject ( key, value );
-	}
-	
-	else if ( strcmp ( key, kIOPropertyFibreChannelPortWorldWideNameKey ) == 0 )
-	{
-		
-		OSData * data = OSDynamicCast ( OSData, value );
-		
-		require_nonzero ( data, ErrorExit );
-		require ( ( data->getLength ( ) == kWorldWideNameDataSize ), ErrorExit );
-		result = hbaDict->setObject ( key, value );
-		result = hbaDict->setObject ( kIOPropertySCSIPortIdentifierKey, value );
-		
-	}
-	
-	else if ( strcmp ( key, kIOPropertyFibreChannelNodeWorldWideNameKey ) == 0 )
-	{
-		
-		OSData * data = OSDynamicCast ( OSData, value );
-		
-		require_nonzero ( data, ErrorExit );
-		require ( ( data->getLength ( ) == kWorldWideNameDataSize ), ErrorExit );
-		result = hbaDict->setObject ( key, value );
-		
-	}
-	
-	else if ( strcmp ( key, kIOPropertyFibreChannelAddressIdentifierKey ) == 0 )
-	{
-		
-		OSData * data = OSDynamicCast ( OSData, value );
-		
-		require_nonzero ( data, ErrorExit );
-		require ( ( data->getLength ( ) == kAddressIdentifierDataSize ), ErrorExit );
-		result = hbaDict->setObject ( key, value );
-		
-	}
-	
-	else if ( strcmp ( key, kIOPropertyFibreChannelALPAKey ) == 0 )
-	{
-		
-		OSData * data = OSDynamicCast ( OSData, value );
-		
-		require_nonzero ( data, ErrorExit );
-		require ( ( data->getLength ( ) == kALPADataSize ), ErrorExit );
-		result = hbaDict->setObject ( key, value );
-		
-	}
-	
-	else if ( strcmp ( key, kIOPropertyPortTopologyKey ) == 0 )
-	{
-		result = hbaDict->setObject ( key, value );
-	}
-	
-	else if ( strcmp ( key, kIOPropertySASAddressKey ) == 0 )
-	{
-		
-		OSData * data = OSDynamicCast ( OSData, value );
-		
-		require_nonzero ( data, ErrorExit );
-		require ( ( data->getLength ( ) == kSASAddressDataSize ), ErrorExit );
-		result = hbaDict->setObject ( key, value );
-		result = hbaDict->setObject ( kIOPropertySCSIPortIdentifierKey, value );
-		
-	}	
 	
-	else
-	{
-		ERROR_LOG ( ( "SetHBAProperty: Unrecognized property key = %s", key ) );
-	}
+	result = BeginHBAPropertyTransaction ( );
+	require ( result, ErrorExit );
 	
-	setProperty ( kIOPropertyControllerCharacteristicsKey, hbaDict );
-	hbaDict->release ( );
-	hbaDict = NULL;
+	result = SetHBAPropertyInDictionary ( fHBAPropertyTransaction, key, value );
 	
-	messageClients ( kIOMessageServicePropertyChange );
+	CommitHBAPropertyTransaction ( );
 	
 	
 ErrorExit:
@@ -742,8 +1001,7 @@ void
 IOSCSIParallelInterfaceController::RemoveHBAProperty ( const char * key )
 {
 	
-	OSDictionary *	hbaDict		= NULL;
-	OSDictionary *	copyDict	= NULL;
+	bool	result = false;
 	
 	require_nonzero ( key, ErrorExit );
 	
@@ -763,26 +1021,17 @@ IOSCSIParallelInterfaceController::RemoveHBAProperty ( const char * key )
 		
 	}
 	
-	copyDict = OSDynamicCast ( OSDictionary, copyProperty ( kIOPropertyControllerCharacteristicsKey ) );
-	require_nonzero ( copyDict, ErrorExit );
-	
-	hbaDict = ( OSDictionary * ) copyDict->copyCollection ( );
-	copyDict->release ( );
-	
-	require_nonzero ( hbaDict, ErrorExit );
+	result = BeginHBAPropertyTransaction ( );
+	require ( result, ErrorExit );
 	
-	if ( hbaDict->getObject ( key ) != NULL )
+	if ( fHBAPropertyTransaction->getObject ( key ) != NULL )
 	{
 		
-		hbaDict->removeObject ( key );
+		fHBAPropertyTransaction->removeObject ( key );
 		
 	}
 	
-	setProperty ( kIOPropertyControllerCharacteristicsKey, hbaDict );
-	hbaDict->release ( );
-	hbaDict = NULL;
-	
-	messageClients ( kIOMessageServicePropertyChange );
+	CommitHBAPropertyTransaction ( );
 	
 	
 ErrorExit:
@@ -793,13 +1042,231 @@ ErrorExit:
 }
 
 
-#if 0
-#pragma mark -
-#pragma mark WorkLoop Management
-#pragma mark -
-#endif
-
-
+//-----------------------------------------------------------------------------
+//	BeginHBAPropertyTransaction - Starts a property transaction.	   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+bool
+IOSCSIParallelInterfaceController::BeginHBAPropertyTransaction ( void )
+{
+	
+	bool			result		= false;
+	OSDictionary *	copyDict	= NULL;
+	thread_t		thread		= current_thread ( );
+	
+	fWorkLoop->closeGate ( );
+	
+	// The transaction is open across gate releases. Wait for another
+	// thread's transaction to be committed, so that our changes are not
+	// published with it.
+	while ( ( fHBAPropertyTransactionDepth != 0 ) && ( fHBAPropertyTransactionOwner != thread ) )
+	{
+		fControllerGate->commandSleep ( &fHBAPropertyTransactionDepth, THREAD_UNINT );
+	}
+	
+	// Only the outermost transaction takes a copy of the dictionary.
+	if ( fHBAPropertyTransactionDepth == 0 )
+	{
+		
+		copyDict = OSDynamicCast ( OSDictionary, copyProperty ( kIOPropertyControllerCharacteristicsKey ) );
+		require_nonzero ( copyDict, ErrorExit );
+		
+		fHBAPropertyTransaction = ( OSDictionary * ) copyDict->copyCollection ( );
+		copyDict->release ( );
+		
+		require_nonzero ( fHBAPropertyTransaction, ErrorExit );
+		
+		fHBAPropertyTransactionOwner = thread;
+		
+	}
+	
+	fHBAPropertyTransactionDepth++;
+	result = true;
+	
+	
+ErrorExit:
+	
+	
+	fWorkLoop->openGate ( );
+	
+	return result;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	CommitHBAPropertyTransaction - 	Ends a property transaction, publishing
+//									the changes if it is the outermost one.
+//																	   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::CommitHBAPropertyTransaction ( void )
+{
+	
+	fWorkLoop->closeGate ( );
+	
+	require_nonzero ( fHBAPropertyTransactionDepth, ErrorExit );
+	require ( ( fHBAPropertyTransactionOwner == current_thread ( ) ), ErrorExit );
+	
+	fHBAPropertyTransactionDepth--;
+	if ( fHBAPropertyTransactionDepth == 0 )
+	{
+		
+		setProperty ( kIOPropertyControllerCharacteristicsKey, fHBAPropertyTransaction );
+		fHBAPropertyTransaction->release ( );
+		fHBAPropertyTransaction = NULL;
+		fHBAPropertyTransactionOwner = NULL;
+		
+		// Let any thread waiting to start a transaction go.
+		fControllerGate->commandWakeup ( &fHBAPropertyTransactionDepth, false );
+		
+		messageClients ( kIOMessageServicePropertyChange );
+		
+	}
+	
+	
+ErrorExit:
+	
+	
+	fWorkLoop->openGate ( );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	SetHBAPropertyInDictionary - 	Validates a property and sets it in the
+//									given controller characteristics
+//									dictionary.						  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+bool
+IOSCSIParallelInterfaceController::SetHBAPropertyInDictionary (
+									OSDictionary *	hbaDict,
+									const char *	key,
+									OSObject *	 	value )
+{
+	
+	bool	result = false;
+	
+	if ( strcmp ( key, kIOPropertyVendorNameKey ) == 0 )
+	{
+		result = hbaDict->setObject ( key, value );
+	}
+	
+	else if ( strcmp ( key, kIOPropertyProductNameKey ) == 0 )
+	{
+		result = hbaDict->setObject ( key, value );
+	}
+	
+	else if ( strcmp ( key, kIOPropertyProductRevisionLevelKey ) == 0 )
+	{
+		result = hbaDict->setObject ( key, value );
+	}
+	
+	else if ( strcmp ( key, kIOPropertyPortDescriptionKey ) == 0 )
+	{
+		result = hbaDict->setObject ( key, value );
+	}
+	
+	else if ( strcmp ( key, kIOPropertyPortSpeedKey ) == 0 )
+	{
+		result = hbaDict->setObject ( key, value );
+	}
+	
+	else if ( strcmp ( key, kIOPropertySCSIParallelSignalingTypeKey ) == 0 )
+	{
+		result = hbaDict->setObject ( key, value );
+	}
+	
+	else if ( strcmp ( key, kIOPropertyFibreChannelCableDescriptionKey ) == 0 )
+	{
+		result = hbaDict->setObject ( key, value );
+	}
+	
+	else if ( strcmp ( key, kIOPropertyFibreChannelPortWorldWideNameKey ) == 0 )
+	{
+		
+		OSData * data = OSDynamicCast ( OSData, value );
+		
+		require_nonzero ( data, ErrorExit );
+		require ( ( data->getLength ( ) == kWorldWideNameDataSize ), ErrorExit );
+		result = hbaDict->setObject ( key, value );
+		result = hbaDict->setObject ( kIOPropertySCSIPortIdentifierKey, value );
+		
+	}
+	
+	else if ( strcmp ( key, kIOPropertyFibreChannelNodeWorldWideNameKey ) == 0 )
+	{
+		
+		OSData * data = OSDynamicCast ( OSData, value );
+		
+		require_nonzero ( data, ErrorExit );
+		require ( ( data->getLength ( ) == kWorldWideNameDataSize ), ErrorExit );
+		result = hbaDict->setObject ( key, value );
+		
+	}
+	
+	else if ( strcmp ( key, kIOPropertyFibreChannelAddressIdentifierKey ) == 0 )
+	{
+		
+		OSData * data = OSDynamicCast ( OSData, value );
+		
+		require_nonzero ( data, ErrorExit );
+		require ( ( data->getLength ( ) == kAddressIdentifierDataSize ), ErrorExit );
+		result = hbaDict->setObject ( key, value );
+		
+	}
+	
+	else if ( strcmp ( key, kIOPropertyFibreChannelALPAKey ) == 0 )
+	{
+		
+		OSData * data = OSDynamicCast ( OSData, value );
+		
+		require_nonzero ( data, ErrorExit );
+		require ( ( data->getLength ( ) == kALPADataSize ), ErrorExit );
+		result = hbaDict->setObject ( key, value );
+		
+	}
+	
+	else if ( strcmp ( key, kIOPropertyPortTopologyKey ) == 0 )
+	{
+		result = hbaDict->setObject ( key, value );
+	}
+	
+	else if ( strcmp ( key, kIOPropertySASAddressKey ) == 0 )
+	{
+		
+		OSData * data = OSDynamicCast ( OSData, value );
+		
+		require_nonzero ( data, ErrorExit );
+		require ( ( data->getLength ( ) == kSASAddressDataSize ), ErrorExit );
+		result = hbaDict->setObject ( key, value );
+		result = hbaDict->setObject ( kIOPropertySCSIPortIdentifierKey, value );
+		
+	}	
+	
+	else
+	{
+		ERROR_LOG ( ( "SetHBAProperty: Unrecognized property key = %s", key ) );
+	}
+	
+	
+ErrorExit:
+	
+	
+	return result;
+	
+}
+
+
+#if 0
+#pragma mark -
+#pragma mark WorkLoop Management
+#pragma mark -
+#endif
+
+
 //-----------------------------------------------------------------------------
 //	GetWorkLoop - Gets the workloop.								[PROTECTED]
 //-----------------------------------------------------------------------------
@@ -881,11 +1348,86 @@ IOSCSIParallelInterfaceController::CreateWorkLoop ( IOService * provider )
 	status = fWorkLoop->addEventSource ( fControllerGate );
 	require_success ( status,  ADD_GATE_EVENT_FAILURE );
 	
+	// Create the event source used to finish completions made outside
+	// of the gate. It has no provider, it is signalled by the family.
+	fCompletionEvent = IOInterruptEventSource::interruptEventSource (
+		this,
+		&IOSCSIParallelInterfaceController::DeferredCompletionOccurred );
+	require_nonzero ( fCompletionEvent, ALLOCATE_COMPLETION_EVENT_FAILURE );
+	
+	// Add the completion event source to the workloop.
+	status = fWorkLoop->addEventSource ( fCompletionEvent );
+	require_success ( status, ADD_COMPLETION_EVENT_FAILURE );
+	
+	// Create the event source used to send batched tasks which did not
+	// fill a batch. It has no provider, it is signalled by the family.
+	fSubmissionEvent = IOInterruptEventSource::interruptEventSource (
+		this,
+		&IOSCSIParallelInterfaceController::SubmissionOccurred );
+	require_nonzero ( fSubmissionEvent, ALLOCATE_SUBMISSION_EVENT_FAILURE );
+	
+	// Add the submission event source to the workloop.
+	status = fWorkLoop->addEventSource ( fSubmissionEvent );
+	require_success ( status, ADD_SUBMISSION_EVENT_FAILURE );
+	
+	// Create the timer which fails tasks held for too long while services
+	// are suspended.
+	fHoldingTimer = IOTimerEventSource::timerEventSource (
+		this,
+		&IOSCSIParallelInterfaceController::HoldingTimeoutOccurred );
+	require_nonzero ( fHoldingTimer, ALLOCATE_HOLDING_TIMER_FAILURE );
+	
+	// Add the holding timer to the workloop.
+	status = fWorkLoop->addEventSource ( fHoldingTimer );
+	require_success ( status, ADD_HOLDING_TIMER_FAILURE );
+	
 	result = true;
 	
 	return result;
 	
 	
+ADD_HOLDING_TIMER_FAILURE:
+	
+	
+	require_nonzero_quiet ( fHoldingTimer, ALLOCATE_HOLDING_TIMER_FAILURE );
+	fHoldingTimer->release ( );
+	fHoldingTimer = NULL;
+	
+	
+ALLOCATE_HOLDING_TIMER_FAILURE:
+	
+	
+	fWorkLoop->removeEventSource ( fSubmissionEvent );
+	
+	
+ADD_SUBMISSION_EVENT_FAILURE:
+	
+	
+	require_nonzero_quiet ( fSubmissionEvent, ALLOCATE_SUBMISSION_EVENT_FAILURE );
+	fSubmissionEvent->release ( );
+	fSubmissionEvent = NULL;
+	
+	
+ALLOCATE_SUBMISSION_EVENT_FAILURE:
+	
+	
+	fWorkLoop->removeEventSource ( fCompletionEvent );
+	
+	
+ADD_COMPLETION_EVENT_FAILURE:
+	
+	
+	require_nonzero_quiet ( fCompletionEvent, ALLOCATE_COMPLETION_EVENT_FAILURE );
+	fCompletionEvent->release ( );
+	fCompletionEvent = NULL;
+	
+	
+ALLOCATE_COMPLETION_EVENT_FAILURE:
+	
+	
+	fWorkLoop->removeEventSource ( fControllerGate );
+	
+	
 ADD_GATE_EVENT_FAILURE:
 	
 	
@@ -956,6 +1498,34 @@ IOSCSIParallelInterfaceController::ReleaseWorkLoop ( void )
 		// Remove all the event sources from the workloop
 		// and deallocate them.
 		
+		if ( fHoldingTimer != NULL )
+		{
+			
+			fHoldingTimer->cancelTimeout ( );
+			fWorkLoop->removeEventSource ( fHoldingTimer );
+			fHoldingTimer->release ( );
+			fHoldingTimer = NULL;
+			
+		}
+		
+		if ( fSubmissionEvent != NULL )
+		{
+			
+			fWorkLoop->removeEventSource ( fSubmissionEvent );
+			fSubmissionEvent->release ( );
+			fSubmissionEvent = NULL;
+			
+		}
+		
+		if ( fCompletionEvent != NULL )
+		{
+			
+			fWorkLoop->removeEventSource ( fCompletionEvent );
+			fCompletionEvent->release ( );
+			fCompletionEvent = NULL;
+			
+		}
+		
 		if ( fControllerGate != NULL )
 		{
 			
@@ -1006,9 +1576,26 @@ SCSIParallelTaskIdentifier
 IOSCSIParallelInterfaceController::GetSCSIParallelTask ( bool blockForCommand )
 {
 	
-	SCSIParallelTask *		parallelTask = NULL;
+	SCSIParallelTask *		parallelTask	= NULL;
+	UInt64					startTime		= 0;
+	UInt64					elapsed			= 0;
+	
+	parallelTask = ( SCSIParallelTask * ) fParallelTaskPool->getCommand ( false );
+	
+	// Only time the callers which actually have to wait for a task.
+	if ( ( parallelTask == NULL ) && ( blockForCommand == true ) )
+	{
+		
+		startTime		= mach_absolute_time ( );
+		parallelTask	= ( SCSIParallelTask * ) fParallelTaskPool->getCommand ( true );
+		absolutetime_to_nanoseconds ( mach_absolute_time ( ) - startTime, &elapsed );
+		
+		IOSimpleLockLock ( fAdmissionLock );
+		RecordTaskPoolWait ( elapsed / kMicrosecondScale );
+		IOSimpleLockUnlock ( fAdmissionLock );
+		
+	}
 	
-	parallelTask = ( SCSIParallelTask * ) fParallelTaskPool->getCommand ( blockForCommand );
 	if ( parallelTask != NULL )
 	{
 		parallelTask->ResetForNewTask ( );
@@ -1028,34 +1615,106 @@ IOSCSIParallelInterfaceController::FreeSCSIParallelTask (
 							SCSIParallelTaskIdentifier returnTask )
 {
 
-	SCSIParallelTask *	parallelTask	= NULL;
-	IOReturn			status			= kIOReturnSuccess;
+	SCSIParallelTask *				parallelTask	= NULL;
+	SCSIParallelDMACommand *		command			= NULL;
+	IOSCSIParallelInterfaceDevice *	target			= NULL;
+	IOReturn						status			= kIOReturnSuccess;
+	IOInterruptState				lockState		= 0;
+	UInt32							waiters			= 0;
 
 	parallelTask = OSDynamicCast ( SCSIParallelTask, returnTask );
 
 	require_nonzero ( parallelTask, ERROR_EXIT_NULL_TASK );
 
 	parallelTask->SetSCSITaskIdentifier ( NULL );
-
-	status = parallelTask->clearMemoryDescriptor ( false );
-
-	if ( status != kIOReturnSuccess )
-	{
-
-		ERROR_LOG ( ( "FreeSCSIParallelTask: Task %p seems to be still active. "
-					"IODMACommand::complete ( ) may not have been called for "
-					"this task.", returnTask ) );
-
-	}	
-
-	fParallelTaskPool->returnCommand ( ( IOCommand * ) returnTask );
-	
-	return;
 	
+	// A task with a DMA command of its own keeps it.
+	command = parallelTask->fDMACommand;
+	if ( command != parallelTask->fIdentifier )
+	{
+		parallelTask->fDMACommand = NULL;
+	}
 	
-ERROR_EXIT_NULL_TASK:
-
-
+	if ( command != NULL )
+	{
+		
+		status = command->clearMemoryDescriptor ( false );
+		
+		if ( status != kIOReturnSuccess )
+		{
+			
+			ERROR_LOG ( ( "FreeSCSIParallelTask: Task %p seems to be still active. "
+						"IODMACommand::complete ( ) may not have been called for "
+						"this task.", returnTask ) );
+			
+		}
+		
+		// Drop the command's reference on its registered buffer.
+		if ( command->fRegisteredBuffer != NULL )
+		{
+			
+			ReleaseRegisteredBuffer ( command->fRegisteredBuffer );
+			command->fRegisteredBuffer			= NULL;
+			command->fRegisteredPrepareCount	= 0;
+			
+		}
+		
+	}
+	
+	// Give the bounce buffer back to the pool.
+	if ( parallelTask->fBounceBuffer != NULL )
+	{
+		
+		lockState = IOSimpleLockLockDisableInterrupt ( fBounceBufferLock );
+		fBounceBuffers[fBounceBufferFreeCount++] = parallelTask->fBounceBuffer;
+		IOSimpleLockUnlockEnableInterrupt ( fBounceBufferLock, lockState );
+		
+		parallelTask->fBounceBuffer = NULL;
+		
+	}
+	
+	if ( ( command != NULL ) && ( command != parallelTask->fIdentifier ) )
+	{
+		fDMACommandPool->returnCommand ( command );
+	}
+	
+	target = parallelTask->fAdmissionTarget;
+	parallelTask->fAdmissionTarget = NULL;
+	
+	// The task goes back to the pool before it is uncharged, so that a
+	// target let in by the uncharge finds it there.
+	fParallelTaskPool->returnCommand ( ( IOCommand * ) returnTask );
+	
+	IOSimpleLockLock ( fAdmissionLock );
+	
+	if ( target != NULL )
+	{
+		UnchargeTaskFromTarget ( target );
+	}
+	
+	fAdmissionReturns++;
+	waiters = fAdmissionWaiters;
+	
+	IOSimpleLockUnlock ( fAdmissionLock );
+	
+	// Beyond returning the task to the pool, which takes the gate briefly,
+	// the gate is only taken if a target is waiting for a task, to let it
+	// try again.
+	if ( waiters != 0 )
+	{
+		
+		fWorkLoop->closeGate ( );
+		WakeTaskAdmissionWaiters ( );
+		fWorkLoop->openGate ( );
+		
+	}
+	
+	return;
+	
+	
+ERROR_EXIT_NULL_TASK:
+
+
 	STATUS_LOG ( ( "FreeSCSIParallelTask: Encountered a NULL task pointer!\n" ) );
 
 	return;
@@ -1063,6 +1722,203 @@ ERROR_EXIT_NULL_TASK:
 }
 
 
+//-----------------------------------------------------------------------------
+//	GetSCSIParallelTaskForTarget - 	Gets a parallel task from the pool and
+//									charges it to a target.			   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+SCSIParallelTaskIdentifier
+IOSCSIParallelInterfaceController::GetSCSIParallelTaskForTarget (
+							IOSCSIParallelInterfaceDevice *	target,
+							bool							blockForCommand,
+							bool							urgent,
+							bool							reserved )
+{
+	
+	SCSIParallelTaskAdmission *		admission		= NULL;
+	SCSIParallelTaskIdentifier		parallelTask	= NULL;
+	UInt64							startTime		= 0;
+	UInt64							elapsed			= 0;
+	UInt32							returns			= 0;
+	bool							admitted		= false;
+	bool							wasActive		= false;
+	bool							wasContending	= false;
+	bool							poolEmpty		= false;
+	
+	admission = target->GetTaskAdmission ( );
+	
+	while ( true )
+	{
+		
+		// Charge the task to the target before it is taken from the pool,
+		// so that the decision and the charge are made together. The
+		// decision is made under fAdmissionLock. Taking the task from the
+		// pool takes the gate briefly, and the gate is only held across a
+		// wait if the target has to wait.
+		IOSimpleLockLock ( fAdmissionLock );
+		
+		returns		= fAdmissionReturns;
+		admitted	= IsTaskAdmissible ( admission, urgent, reserved );
+		if ( admitted == true )
+		{
+			ChargeTaskToTarget ( target, urgent, reserved );
+		}
+		
+		IOSimpleLockUnlock ( fAdmissionLock );
+		
+		if ( admitted == true )
+		{
+			
+			parallelTask = GetSCSIParallelTask ( false );
+			if ( parallelTask != NULL )
+			{
+				
+				( ( SCSIParallelTask * ) parallelTask )->fAdmissionTarget = target;
+				break;
+				
+			}
+			
+			// Admission would have let the task in had there been one.
+			IOSimpleLockLock ( fAdmissionLock );
+			UnchargeTaskFromTarget ( target );
+			IOSimpleLockUnlock ( fAdmissionLock );
+			
+			poolEmpty = true;
+			
+		}
+		
+		if ( blockForCommand == false )
+		{
+			
+			IOSimpleLockLock ( fAdmissionLock );
+			
+			wasActive		= IsTargetActive ( admission );
+			wasContending	= IsTargetContending ( admission );
+			
+			// The target has been turned away. Its client will try again
+			// when one of its tasks completes. Until then other targets
+			// are held to their share.
+			admission->fDeferred = true;
+			admission->fDeferrals++;
+			
+			if ( poolEmpty == true )
+			{
+				
+				admission->fPoolEmpty++;
+				fTaskPoolEmpty++;
+				
+			}
+			
+			UpdateTaskAdmissionState ( admission, wasActive, wasContending );
+			
+			IOSimpleLockUnlock ( fAdmissionLock );
+			break;
+			
+		}
+		
+		if ( startTime == 0 )
+		{
+			startTime = mach_absolute_time ( );
+		}
+		
+		// A waiting thread is woken with the gate held once a task has been
+		// returned to the pool (see FreeSCSIParallelTask). If one was
+		// returned since we last looked, try again rather than wait for the
+		// next one.
+		fWorkLoop->closeGate ( );
+		IOSimpleLockLock ( fAdmissionLock );
+		
+		if ( fAdmissionReturns == returns )
+		{
+			
+			wasActive		= IsTargetActive ( admission );
+			wasContending	= IsTargetContending ( admission );
+			
+			admission->fWaiters++;
+			fAdmissionWaiters++;
+			UpdateTaskAdmissionState ( admission, wasActive, wasContending );
+			
+			// Urgent tasks wait apart so that they can be woken first.
+			if ( urgent == true )
+			{
+				
+				fAdmissionUrgentWaiters++;
+				IOSimpleLockUnlock ( fAdmissionLock );
+				
+				fControllerGate->commandSleep ( &fAdmissionUrgentWaiters, THREAD_UNINT );
+				
+				IOSimpleLockLock ( fAdmissionLock );
+				fAdmissionUrgentWaiters--;
+				
+			}
+			
+			else
+			{
+				
+				IOSimpleLockUnlock ( fAdmissionLock );
+				fControllerGate->commandSleep ( &fAdmissionWaiters, THREAD_UNINT );
+				IOSimpleLockLock ( fAdmissionLock );
+				
+			}
+			
+			wasActive		= IsTargetActive ( admission );
+			wasContending	= IsTargetContending ( admission );
+			
+			admission->fWaiters--;
+			fAdmissionWaiters--;
+			UpdateTaskAdmissionState ( admission, wasActive, wasContending );
+			
+		}
+		
+		IOSimpleLockUnlock ( fAdmissionLock );
+		fWorkLoop->openGate ( );
+		
+	}
+	
+	if ( startTime != 0 )
+	{
+		
+		absolutetime_to_nanoseconds ( mach_absolute_time ( ) - startTime, &elapsed );
+		elapsed /= kMicrosecondScale;
+		
+		IOSimpleLockLock ( fAdmissionLock );
+		
+		admission->fWaits++;
+		admission->fTotalWaitTime += elapsed;
+		if ( elapsed > admission->fMaximumWaitTime )
+		{
+			admission->fMaximumWaitTime = elapsed;
+		}
+		
+		// Only a wait on an empty pool says anything about its size. A
+		// target held back by admission alone is accounted for above.
+		if ( poolEmpty == true )
+		{
+			RecordTaskPoolWait ( elapsed );
+		}
+		
+		// The wait of recovery traffic is what the reserve is meant to bound.
+		if ( reserved == true )
+		{
+			
+			fTaskReserveWaits++;
+			fTaskReserveTotalWaitTime += elapsed;
+			if ( elapsed > fTaskReserveMaximumWaitTime )
+			{
+				fTaskReserveMaximumWaitTime = elapsed;
+			}
+			
+		}
+		
+		IOSimpleLockUnlock ( fAdmissionLock );
+		
+	}
+	
+	return parallelTask;
+	
+}
+
+
 //-----------------------------------------------------------------------------
 //	AllocateSCSIParallelTasks - Allocates parallel tasks for the pool.
 //																	  [PRIVATE]
@@ -1080,6 +1936,7 @@ IOSCSIParallelInterfaceController::AllocateSCSIParallelTasks ( void )
 	OSNumber *			value			= NULL;
 	OSDictionary *		constraints		= NULL;
 	OSObject *			obj				= NULL;
+	bool				pooled			= false;
 	
 	// Default alignment is 16-byte aligned, 32-bit memory only.
 	taskSize 	= ReportHBASpecificTaskDataSize ( );
@@ -1135,9 +1992,17 @@ IOSCSIParallelInterfaceController::AllocateSCSIParallelTasks ( void )
 		setProperty ( kIOHierarchicalLogicalUnitSupportKey, obj );
 	}
 
+	// Work out the DMA specification for the tasks before they are made.
+	SetDMASpecification ( constraints );
+	
 	constraints->release ( );
 	constraints = NULL;
 	
+	// Unless the HBA asked for a pool of DMA commands apart from the tasks,
+	// every task has a DMA command of its own, which the HBA is given in
+	// place of the task, as HBAs which use the task as an IODMACommand expect.
+	pooled = ( getProperty ( kIODMACommandPoolSizeKey ) != NULL );
+	
 	fParallelTaskPool = IOCommandPool::withWorkLoop ( fWorkLoop );
 	require_nonzero ( fParallelTaskPool, POOL_CREATION_FAILURE );
 	
@@ -1146,11 +2011,17 @@ IOSCSIParallelInterfaceController::AllocateSCSIParallelTasks ( void )
 	parallelTask = SCSIParallelTask::Create ( taskSize, mask );
 	require_nonzero ( parallelTask, TASK_CREATION_FAILURE );
 	
-	result = InitializeDMASpecification ( parallelTask );
-	require ( result, TASK_INIT_FAILURE );
+	if ( pooled == false )
+	{
+		
+		result = InitializeTaskDMACommand ( parallelTask );
+		require ( result, TASK_INIT_FAILURE );
+		
+	}
 	
 	// Send the single command into the pool.
 	fParallelTaskPool->returnCommand ( parallelTask );
+	fAdmissionPoolSize = 1;
 	
 	// Now try to allocate the remaining Tasks that the HBA reports that it
 	// can support.
@@ -1162,17 +2033,23 @@ IOSCSIParallelInterfaceController::AllocateSCSIParallelTasks ( void )
 		if ( parallelTask != NULL )
 		{
 			
-			result = InitializeDMASpecification ( parallelTask );
-			if ( result == false )
+			if ( pooled == false )
 			{
 				
-				parallelTask->release ( );
-				break;
+				result = InitializeTaskDMACommand ( parallelTask );
+				if ( result == false )
+				{
+					
+					parallelTask->release ( );
+					break;
+					
+				}
 				
 			}
 			
 			// Send the next command into the pool.
 			fParallelTaskPool->returnCommand ( parallelTask );
+			fAdmissionPoolSize++;
 			
 		}
 		
@@ -1188,17 +2065,43 @@ IOSCSIParallelInterfaceController::AllocateSCSIParallelTasks ( void )
 		
 	}
 	
-	// Since at least a single SCSI Parallel Task was allocated, this
-	// HBA can function.
+	if ( pooled == true )
+	{
+		
+		// Only the tasks which transfer data are given a DMA command, from
+		// a pool of their own.
+		result = AllocateDMACommands ( );
+		require ( result, DMA_COMMAND_CREATION_FAILURE );
+		
+	}
+	
+	else
+	{
+		fDMACommandCount = fAdmissionPoolSize;
+	}
+	
+	// Set up the bounce buffers, if the HBA asked for them.
+	AllocateBounceBuffers ( fDMACommandCount );
+	AllocateRegisteredBuffers ( );
+	
+	// Since at least a single SCSI Parallel Task and DMA command were
+	// allocated, this HBA can function.
 	result = true;
 	
 	return result;
 	
 	
+DMA_COMMAND_CREATION_FAILURE:
+	
+	
+	DeallocateSCSIParallelTasks ( );
+	
+	return result;
+	
+	
 TASK_INIT_FAILURE:
 	
 	
-	require_nonzero ( parallelTask, TASK_CREATION_FAILURE );
 	parallelTask->release ( );
 	parallelTask = NULL;
 	
@@ -1231,6 +2134,10 @@ IOSCSIParallelInterfaceController::DeallocateSCSIParallelTasks ( void )
 	
 	SCSIParallelTask *	parallelTask = NULL;
 	
+	DeallocateBounceBuffers ( );
+	DeallocateRegisteredBuffers ( );
+	DeallocateDMACommands ( );
+	
 	require_nonzero ( fParallelTaskPool, Exit );
 	
 	parallelTask = ( SCSIParallelTask * ) fParallelTaskPool->getCommand ( false );
@@ -1253,108 +2160,395 @@ Exit:
 	
 }
 
-
-#if 0
-#pragma mark -
-#pragma mark SCSI Parallel Task Execution
-#pragma mark -
-#endif
-
-
 //-----------------------------------------------------------------------------
-//	ExecuteParallelTask - Executes a parallel task.					   [PUBLIC]
+//	AllocateDMACommands - Allocates DMA commands for the pool.		  [PRIVATE]
 //-----------------------------------------------------------------------------
 
-SCSIServiceResponse 
-IOSCSIParallelInterfaceController::ExecuteParallelTask ( 
-							SCSIParallelTaskIdentifier 			parallelRequest )
+bool
+IOSCSIParallelInterfaceController::AllocateDMACommands ( void )
 {
 	
-	SCSIServiceResponse	serviceResponse = kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
+	SCSIParallelDMACommand *	command		= NULL;
+	OSNumber *					value		= NULL;
+	UInt32						count		= 0;
+	UInt32						index		= 0;
+	bool						result		= false;
 	
-	// If the controller has requested a suspend,
-	// return the command and let it add it back to the queue.
-	if ( fHBACanAcceptClientRequests == true )
+	// One for each task, unless the HBA asked for fewer.
+	count = fSupportedTaskCount;
+	
+	value = OSDynamicCast ( OSNumber, getProperty ( kIODMACommandPoolSizeKey ) );
+	if ( ( value != NULL ) && ( value->unsigned32BitValue ( ) < count ) )
+	{
+		count = value->unsigned32BitValue ( );
+	}
+	
+	if ( count == 0 )
+	{
+		count = 1;
+	}
+	
+	// The tasks which transfer no data share a command, so that the HBA
+	// still gets one for every task. It is never given a buffer.
+	fNullDMACommand = SCSIParallelDMACommand::Create ( );
+	require_nonzero ( fNullDMACommand, ErrorExit );
+	
+	result = InitializeDMASpecification ( fNullDMACommand );
+	require ( result, ReleaseNullCommand );
+	
+	fDMACommandPool = IOCommandPool::withWorkLoop ( fWorkLoop );
+	require_nonzero ( fDMACommandPool, ReleaseNullCommand );
+	
+	fDMACommandCount = 0;
+	
+	for ( index = 0; index < count; index++ )
 	{
 		
-		// If the controller has not suspended, send the task now.
-		serviceResponse = ProcessParallelTask ( parallelRequest );
+		command = SCSIParallelDMACommand::Create ( );
+		if ( command == NULL )
+		{
+			break;
+		}
+		
+		result = InitializeDMASpecification ( command );
+		if ( result == false )
+		{
+			
+			command->release ( );
+			break;
+			
+		}
+		
+		fDMACommandPool->returnCommand ( command );
+		fDMACommandCount++;
 		
 	}
 	
-	return serviceResponse;
+	// As long as a single DMA command could be allocated, the HBA can
+	// function.
+	require_nonzero ( fDMACommandCount, ReleasePool );
+	
+	setProperty ( kIODMACommandPoolSizeKey, fDMACommandCount, 32 );
+	
+	return true;
+	
+	
+ReleasePool:
+	
+	
+	fDMACommandPool->release ( );
+	fDMACommandPool = NULL;
+	
+	
+ReleaseNullCommand:
+	
+	
+	fNullDMACommand->release ( );
+	fNullDMACommand = NULL;
+	
+	
+ErrorExit:
+	
+	
+	return false;
 	
 }
 
 
 //-----------------------------------------------------------------------------
-//	CompleteParallelTask - Completes a parallel task.				[PROTECTED]
+//	DeallocateDMACommands - Deallocates DMA commands in the pool.	  [PRIVATE]
 //-----------------------------------------------------------------------------
 
-void	
-IOSCSIParallelInterfaceController::CompleteParallelTask ( 
-							SCSIParallelTaskIdentifier 	parallelRequest,
-							SCSITaskStatus	 			completionStatus,
-							SCSIServiceResponse 		serviceResponse )
+void
+IOSCSIParallelInterfaceController::DeallocateDMACommands ( void )
 {
 	
-	IOSCSIParallelInterfaceDevice *		target = NULL;
-	
-	STATUS_LOG ( ( "+IOSCSIParallelInterfaceController::CompleteParallelTask\n" ) );
+	SCSIParallelDMACommand *	command = NULL;
 	
-	// We should be within a synchronized context (i.e. holding the workloop lock),
-	// but some subclassers aren't so bright. <sigh>
-	if ( fWorkLoop->inGate ( ) == false )
+	if ( fNullDMACommand != NULL )
 	{
 		
-		// Let's make sure to grab the lock and call this routine again.
-		fControllerGate->runAction (
-			OSMemberFunctionCast (
-				IOCommandGate::Action,
-				this,
-				&IOSCSIParallelInterfaceController::CompleteParallelTask ),
-			parallelRequest,
-			( void * ) completionStatus,
-			( void * ) serviceResponse );
-		
-		goto Exit;
+		fNullDMACommand->release ( );
+		fNullDMACommand = NULL;
 		
 	}
 	
-	// Remove the task from the timeout list.
-	( ( SCSIParallelTimer * ) fTimerEvent )->RemoveTask ( parallelRequest );
+	require_nonzero_quiet ( fDMACommandPool, Exit );
 	
-	target = GetDevice ( parallelRequest );
-	require_nonzero ( target, Exit );
+	command = ( SCSIParallelDMACommand * ) fDMACommandPool->getCommand ( false );
+	while ( command != NULL )
+	{
+		
+		command->release ( );
+		command = ( SCSIParallelDMACommand * ) fDMACommandPool->getCommand ( false );
+		
+	}
 	
-	// Complete the command
-	target->CompleteSCSITask (	parallelRequest, 
-								serviceResponse, 
-								completionStatus );
+	fDMACommandPool->release ( );
+	fDMACommandPool = NULL;
+	fDMACommandCount = 0;
 	
 	
 Exit:
 	
 	
-	STATUS_LOG ( ( "-IOSCSIParallelInterfaceController::CompleteParallelTask\n" ) );
 	return;
 	
 }
 
 
 //-----------------------------------------------------------------------------
-//	FindTaskForAddress - Finds a task by its address (ITLQ nexus)	   [PUBLIC]
+//	InitializeTaskDMACommand - 	Gives a task a DMA command of its own, which
+//								the HBA is given as the task.		  [PRIVATE]
 //-----------------------------------------------------------------------------
 
-SCSIParallelTaskIdentifier
-IOSCSIParallelInterfaceController::FindTaskForAddress ( 
-							SCSIDeviceIdentifier 		theT,
-							SCSILogicalUnitNumber		theL,
-							SCSITaggedTaskIdentifier	theQ )
+bool
+IOSCSIParallelInterfaceController::InitializeTaskDMACommand (
+							SCSIParallelTask *	task )
 {
 	
-	SCSIParallelTaskIdentifier			task	= NULL;
-	IOSCSIParallelInterfaceDevice *		target 	= NULL;
+	SCSIParallelDMACommand *	command	= NULL;
+	bool						result	= false;
+	
+	command = SCSIParallelDMACommand::Create ( );
+	require_nonzero ( command, ErrorExit );
+	
+	result = InitializeDMASpecification ( command );
+	require ( result, ReleaseCommand );
+	
+	// The task frees the command along with itself.
+	command->fTask		= task;
+	task->fDMACommand	= command;
+	task->fIdentifier	= command;
+	
+	return true;
+	
+	
+ReleaseCommand:
+	
+	
+	command->release ( );
+	command = NULL;
+	
+	
+ErrorExit:
+	
+	
+	return false;
+	
+}
+
+
+#if 0
+#pragma mark -
+#pragma mark SCSI Parallel Task Execution
+#pragma mark -
+#endif
+
+
+//-----------------------------------------------------------------------------
+//	ExecuteParallelTask - Executes a parallel task.					   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+SCSIServiceResponse 
+IOSCSIParallelInterfaceController::ExecuteParallelTask ( 
+							SCSIParallelTaskIdentifier 			parallelRequest )
+{
+	
+	SCSIParallelTask *	task			= ( SCSIParallelTask * ) parallelRequest;
+	SCSIServiceResponse	serviceResponse = kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
+	UInt64				now				= mach_absolute_time ( );
+	
+	// A task which was not taken from the pool for a client's request, such
+	// as a piece of a split task, starts its latency breakdown here.
+	if ( task->fStageStartTime == 0 )
+	{
+		task->fStageStartTime = now;
+	}
+	
+	// A resent task goes through the HBA again.
+	task->MarkStage ( kSCSIParallelTaskStage_Executed, now );
+	task->fStageTime[kSCSIParallelTaskStage_Interrupted]	= 0;
+	task->fStageTime[kSCSIParallelTaskStage_HBACompleted]	= 0;
+	
+	RecordTaskSubmission ( parallelRequest );
+	
+	// If the controller has requested a suspend, or the tasks held while
+	// it was suspended are still being sent, the task waits its turn. This
+	// is checked without the gate so that tasks are not serialized on it
+	// while nothing is held, HoldParallelTask checks again with the gate
+	// held. The count of held tasks only drops to zero once the last one
+	// has been handed to the HBA, so a task which sees none can not
+	// overtake them. A task which races a suspension is handed to the HBA,
+	// as it was before tasks were held. SubmitBatchedParallelTasks checks
+	// for a suspension again on the workloop, with the gate held.
+	if ( ( fHBACanAcceptClientRequests == true ) && ( fHoldingQueueCount == 0 ) )
+	{
+		serviceResponse = SubmitParallelTask ( parallelRequest );
+	}
+	
+	else
+	{
+		serviceResponse = HoldParallelTask ( parallelRequest );
+	}
+	
+	// The device completes a task that was not accepted itself.
+	if ( serviceResponse != kSCSIServiceResponse_Request_In_Process )
+	{
+		RecordTaskCompletion ( parallelRequest, serviceResponse, kSCSITaskStatus_No_Status );
+	}
+	
+	return serviceResponse;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	CompleteParallelTask - Completes a parallel task.				[PROTECTED]
+//-----------------------------------------------------------------------------
+
+void	
+IOSCSIParallelInterfaceController::CompleteParallelTask ( 
+							SCSIParallelTaskIdentifier 	parallelRequest,
+							SCSITaskStatus	 			completionStatus,
+							SCSIServiceResponse 		serviceResponse )
+{
+	
+	IOSCSIParallelInterfaceDevice *		target		= NULL;
+	SCSIParallelTask *					task		= SCSIParallelTask::FromIdentifier ( parallelRequest );
+	UInt64								now			= 0;
+	UInt64								interrupt	= 0;
+	
+	STATUS_LOG ( ( "+IOSCSIParallelInterfaceController::CompleteParallelTask\n" ) );
+	
+	// Note when the HBA completed the task. A deferred completion is only
+	// noted the first time through, not when it is finished on the workloop.
+	if ( ( task != NULL ) && ( task->fStageTime[kSCSIParallelTaskStage_HBACompleted] == 0 ) )
+	{
+		
+		now			= mach_absolute_time ( );
+		interrupt	= fInterruptTime;
+		
+		// The last interrupt before the completion is taken to be the one
+		// for the task, if it came after the task was sent.
+		if ( ( interrupt > ( task->fStageStartTime + task->fStageTime[kSCSIParallelTaskStage_Executed] ) ) &&
+			 ( interrupt <= now ) )
+		{
+			task->MarkStage ( kSCSIParallelTaskStage_Interrupted, interrupt );
+		}
+		
+		task->MarkStage ( kSCSIParallelTaskStage_HBACompleted, now );
+		
+	}
+	
+	// We should be within a synchronized context (i.e. holding the workloop lock),
+	// but some subclassers complete tasks from their own threads. Rather than
+	// have them wait on the gate for every task, queue the completion and
+	// finish it on the workloop.
+	if ( fWorkLoop->inGate ( ) == false )
+	{
+		
+		// The task stays on the timeout and outstanding lists until the
+		// completion is finished. Mark it so that TimeoutOccurred() and
+		// ReclaimTasksForNexus() leave it alone in the meantime.
+		if ( task != NULL )
+		{
+			task->fState = kSCSIParallelTaskState_Deferred;
+		}
+		
+		DeferParallelTaskCompletion ( task, completionStatus, serviceResponse );
+		goto Exit;
+		
+	}
+	
+	// The HBA is done with the task. A task which is completed while it is
+	// still held, for instance by an HBA which fails all its outstanding
+	// tasks when it resets, must not be sent once it has been freed.
+	if ( task != NULL )
+	{
+		
+		task->fState = kSCSIParallelTaskState_Family;
+		UnholdParallelTask ( task );
+		
+	}
+	
+	// Remove the task from the timeout list.
+	( ( SCSIParallelTimer * ) fTimerEvent )->RemoveTask ( task );
+	
+	target = GetDevice ( task );
+	require_nonzero ( target, Exit );
+	
+	// If timeout recovery was in progress for this task, the task has
+	// been recovered.
+	if ( target->GetRecoveryTask ( ) == task )
+	{
+		EndTimeoutRecovery ( target, true );
+	}
+	
+	RecordTaskCompletion ( task, serviceResponse, completionStatus );
+	
+	// Complete the command
+	target->CompleteSCSITask (	task, 
+								serviceResponse, 
+								completionStatus );
+	
+	
+Exit:
+	
+	
+	STATUS_LOG ( ( "-IOSCSIParallelInterfaceController::CompleteParallelTask\n" ) );
+	return;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	ReleaseParallelTask - 	Releases a task the HBA dropped because of a Task
+//							Management function.					[PROTECTED]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::ReleaseParallelTask (
+							SCSIParallelTaskIdentifier 	parallelRequest )
+{
+	
+	SCSIParallelTask *	task = SCSIParallelTask::FromIdentifier ( parallelRequest );
+	
+	require_nonzero ( task, Exit );
+	
+	// Serialize against ReclaimTasksForNexus(), which only reclaims the
+	// tasks the HBA does not have.
+	fWorkLoop->closeGate ( );
+	
+	if ( task->fState == kSCSIParallelTaskState_HBA )
+	{
+		task->fState = kSCSIParallelTaskState_Released;
+	}
+	
+	fWorkLoop->openGate ( );
+	
+	
+Exit:
+	
+	
+	return;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	FindTaskForAddress - Finds a task by its address (ITLQ nexus)	   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+SCSIParallelTaskIdentifier
+IOSCSIParallelInterfaceController::FindTaskForAddress ( 
+							SCSIDeviceIdentifier 		theT,
+							SCSILogicalUnitNumber		theL,
+							SCSITaggedTaskIdentifier	theQ )
+{
+	
+	SCSIParallelTaskIdentifier			task	= NULL;
+	IOSCSIParallelInterfaceDevice *		target 	= NULL;
 	
 	target = GetTargetForID ( theT );
 	require_nonzero ( target, Exit );
@@ -1363,6 +2557,12 @@ IOSCSIParallelInterfaceController::FindTaskForAddress (
 	// the task on its outstanding queue.
 	task = target->FindTaskForAddress ( theL, theQ );
 	
+	// The HBA knows the task by its identifier.
+	if ( task != NULL )
+	{
+		task = ( ( SCSIParallelTask * ) task )->fIdentifier;
+	}
+	
 	
 Exit:
 	
@@ -1392,6 +2592,12 @@ IOSCSIParallelInterfaceController::FindTaskForControllerIdentifier (
 	// the task on its outstanding queue.
 	task = target->FindTaskForControllerIdentifier ( theIdentifier );
 	
+	// The HBA knows the task by its identifier.
+	if ( task != NULL )
+	{
+		task = ( ( SCSIParallelTask * ) task )->fIdentifier;
+	}
+	
 	
 Exit:
 	
@@ -1400,9 +2606,106 @@ Exit:
 	
 }
 
-// The completion callback for the SAM-2 Task Management functions.
-// The implementation for these will be added when the support for these
-// are added in the SCSI Parallel Interface Device object
+
+//-----------------------------------------------------------------------------
+//	ReclaimTasksForNexus - Reclaims the outstanding tasks for a nexus after
+//						   a Task Management function completes.	   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+UInt32
+IOSCSIParallelInterfaceController::ReclaimTasksForNexus (
+							SCSITargetIdentifier 		theT,
+							SCSILogicalUnitNumber		theL,
+							SCSITaggedTaskIdentifier	theQ,
+							SCSIParallelTaskNexus		theNexus )
+{
+	
+	SCSIParallelTaskIdentifier			task			= NULL;
+	SCSIParallelTaskIdentifier			recoveryTask	= NULL;
+	IOSCSIParallelInterfaceDevice *		target 			= NULL;
+	UInt8								step			= kSCSIParallelRecoveryStep_None;
+	UInt32								count			= 0;
+	UInt32								collateral		= 0;
+	
+	STATUS_LOG ( ( "+IOSCSIParallelInterfaceController::ReclaimTasksForNexus\n" ) );
+	
+	target = GetTargetForID ( theT );
+	require_nonzero ( target, Exit );
+	
+	// Hold the workloop lock while the tasks are reclaimed. This serializes
+	// us against CompleteParallelTask(), ReleaseParallelTask() and
+	// TimeoutOccurred() so that the HBA can not complete a task out from
+	// underneath us.
+	fWorkLoop->closeGate ( );
+	
+	// If a step of the timeout recovery is in progress for this Target, the
+	// other tasks it reclaims are counted against the step.
+	recoveryTask	= target->GetRecoveryTask ( );
+	step			= target->GetRecoveryStep ( );
+	
+	task = target->FindTaskForNexus ( theL, theQ, theNexus );
+	while ( task != NULL )
+	{
+		
+		// Remove the task from the timeout list.
+		( ( SCSIParallelTimer * ) fTimerEvent )->RemoveTask ( task );
+		
+		// If timeout recovery was in progress for this task, the task has
+		// been recovered.
+		if ( target->GetRecoveryTask ( ) == task )
+		{
+			EndTimeoutRecovery ( target, true );
+		}
+		
+		else if ( recoveryTask != NULL )
+		{
+			collateral++;
+		}
+		
+		count++;
+		
+		// A held task was never sent, it is taken off the holding queue
+		// so that it is not sent after the task management function.
+		UnholdParallelTask ( ( SCSIParallelTask * ) task );
+		
+		RecordTaskCompletion ( task,
+							   kSCSIServiceResponse_TASK_COMPLETE,
+							   kSCSITaskStatus_TASK_ABORTED );
+		
+		// The HBA does not have this task. Complete it back to the client,
+		// which also removes it from the outstanding task list.
+		target->CompleteSCSITask ( task,
+								   kSCSIServiceResponse_TASK_COMPLETE,
+								   kSCSITaskStatus_TASK_ABORTED );
+		
+		task = target->FindTaskForNexus ( theL, theQ, theNexus );
+		
+	}
+	
+	if ( collateral > 0 )
+	{
+		
+		fRecoveryCollateralTasks[step] += collateral;
+		UpdateTimeoutRecoveryStatistics ( );
+		
+	}
+	
+	fWorkLoop->openGate ( );
+	
+	
+Exit:
+	
+	
+	STATUS_LOG ( ( "-IOSCSIParallelInterfaceController::ReclaimTasksForNexus\n" ) );
+	return count;
+	
+}
+
+
+// The completion callbacks for the SAM-2 Task Management functions. If the
+// function completed successfully, the tasks for the affected nexus which the
+// HBA does not have are reclaimed. A failed function leaves the outstanding
+// tasks untouched so that the normal timeout handling can still recover them.
 
 //-----------------------------------------------------------------------------
 //	CompleteAbortTask - Completes the AbortTaskRequest.	 			[PROTECTED]
@@ -1415,6 +2718,12 @@ IOSCSIParallelInterfaceController::CompleteAbortTask (
 					SCSITaggedTaskIdentifier	theQ,
 					SCSIServiceResponse 		serviceResponse )
 {
+	
+	if ( serviceResponse == kSCSIServiceResponse_FUNCTION_COMPLETE )
+	{
+		ReclaimTasksForNexus ( theT, theL, theQ, kSCSIParallelTaskNexus_I_T_L_Q );
+	}
+	
 }
 
 
@@ -1428,6 +2737,12 @@ IOSCSIParallelInterfaceController::CompleteAbortTaskSet (
 					SCSILogicalUnitNumber		theL,
 					SCSIServiceResponse 		serviceResponse )
 {
+	
+	if ( serviceResponse == kSCSIServiceResponse_FUNCTION_COMPLETE )
+	{
+		ReclaimTasksForNexus ( theT, theL, 0, kSCSIParallelTaskNexus_I_T_L );
+	}
+	
 }
 
 
@@ -1441,6 +2756,9 @@ IOSCSIParallelInterfaceController::CompleteClearACA (
 					SCSILogicalUnitNumber		theL,
 					SCSIServiceResponse 		serviceResponse )
 {
+	
+	// CLEAR ACA does not abort any tasks, so there is nothing to reclaim.
+	
 }
 
 
@@ -1454,6 +2772,12 @@ IOSCSIParallelInterfaceController::CompleteClearTaskSet (
 					SCSILogicalUnitNumber		theL,
 					SCSIServiceResponse 		serviceResponse )
 {
+	
+	if ( serviceResponse == kSCSIServiceResponse_FUNCTION_COMPLETE )
+	{
+		ReclaimTasksForNexus ( theT, theL, 0, kSCSIParallelTaskNexus_I_T_L );
+	}
+	
 }
 
 
@@ -1468,6 +2792,12 @@ IOSCSIParallelInterfaceController::CompleteLogicalUnitReset (
 					SCSILogicalUnitNumber		theL,
 					SCSIServiceResponse 		serviceResponse )
 {
+	
+	if ( serviceResponse == kSCSIServiceResponse_FUNCTION_COMPLETE )
+	{
+		ReclaimTasksForNexus ( theT, theL, 0, kSCSIParallelTaskNexus_I_T_L );
+	}
+	
 }
 
 
@@ -1480,6 +2810,32 @@ IOSCSIParallelInterfaceController::CompleteTargetReset (
 					SCSITargetIdentifier 		theT,
 					SCSIServiceResponse 		serviceResponse )
 {
+	
+	if ( serviceResponse == kSCSIServiceResponse_FUNCTION_COMPLETE )
+	{
+		ReclaimTasksForNexus ( theT, 0, 0, kSCSIParallelTaskNexus_I_T );
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	CompleteBusReset - Completes the ResetBusRequest.		  		[PROTECTED]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::CompleteBusReset (
+					SCSIServiceResponse 		serviceResponse )
+{
+	
+	if ( serviceResponse == kSCSIServiceResponse_FUNCTION_COMPLETE )
+	{
+		
+		NotifyClientsOfBusReset ( );
+		ReclaimTasksForBusReset ( );
+		
+	}
+	
 }
 
 
@@ -1506,7 +2862,14 @@ IOSCSIParallelInterfaceController::FilterInterrupt (
 							OSObject *						theObject, 
 							IOFilterInterruptEventSource *	theSource  )
 {
-	return ( ( IOSCSIParallelInterfaceController * ) theObject )->FilterInterruptRequest ( );
+	
+	IOSCSIParallelInterfaceController *	controller = ( IOSCSIParallelInterfaceController * ) theObject;
+	
+	// Note when the interrupt came in for the task latency breakdown.
+	controller->fInterruptTime = mach_absolute_time ( );
+	
+	return controller->FilterInterruptRequest ( );
+	
 }
 
 
@@ -1572,280 +2935,3385 @@ IOSCSIParallelInterfaceController::SignalInterrupt ( void )
 
 #if 0
 #pragma mark -
-#pragma mark Timeout Management
+#pragma mark Deferred Completion
 #pragma mark -
 #endif
 
 
 //-----------------------------------------------------------------------------
-//	SetTimeoutForTask - Sets the timeout.					  		[PROTECTED]
+//	DeferParallelTaskCompletion - 	Queues the completion of a task made
+//									outside of the gate. This never blocks.
+//																	  [PRIVATE]
 //-----------------------------------------------------------------------------
 
 void
-IOSCSIParallelInterfaceController::SetTimeoutForTask (
-							SCSIParallelTaskIdentifier 		parallelTask,
-							UInt32							timeoutOverride )
+IOSCSIParallelInterfaceController::DeferParallelTaskCompletion (
+							SCSIParallelTaskIdentifier	parallelRequest,
+							SCSITaskStatus 				completionStatus,
+							SCSIServiceResponse 		serviceResponse )
 {
 	
-	( ( SCSIParallelTimer * ) fTimerEvent )->SetTimeout (	parallelTask,
-															timeoutOverride );
+	SCSIParallelTask *	task	= ( SCSIParallelTask * ) parallelRequest;
+	void *				head	= NULL;
 	
-}
-
-
-//-----------------------------------------------------------------------------
-//	TimeoutOccurred - Calls the timeout handler.			  		  [PRIVATE]
+	task->fDeferredTaskStatus		= completionStatus;
+	task->fDeferredServiceResponse	= serviceResponse;
+	
+	// Push the task on to the list. The workloop only ever takes the whole
+	// list at once, so there is no ABA problem here.
+	do
+	{
+		
+		head = fDeferredCompletionList;
+		task->fDeferredCompletionNext = ( SCSIParallelTask * ) head;
+		
+	} while ( OSCompareAndSwapPtr ( head, task, &fDeferredCompletionList ) == false );
+	
+	// Only the task that made the list non-empty needs to signal the
+	// workloop, the others will be picked up with it.
+	if ( head == NULL )
+	{
+		fCompletionEvent->interruptOccurred ( NULL, NULL, 0 );
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	DeferredCompletionOccurred - Called on the workloop to finish deferred
+//								 completions.						  [PRIVATE]
 //-----------------------------------------------------------------------------
 
 void
-IOSCSIParallelInterfaceController::TimeoutOccurred ( 
-							OSObject *					theObject, 
-							IOTimerEventSource * 		theSender )
+IOSCSIParallelInterfaceController::DeferredCompletionOccurred (
+							OSObject *					theObject,
+							IOInterruptEventSource *	theSource,
+							int							count )
+{
+	( ( IOSCSIParallelInterfaceController * ) theObject )->CompleteDeferredParallelTasks ( );
+}
+
+
+//-----------------------------------------------------------------------------
+//	CompleteDeferredParallelTasks - Finishes all deferred completions, in the
+//									order they were made.			  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::CompleteDeferredParallelTasks ( void )
 {
 	
-	SCSIParallelTimer *			timer		= NULL;
-	SCSIParallelTaskIdentifier	expiredTask	= NULL;
+	SCSIParallelTask *	list	= NULL;
+	SCSIParallelTask *	task	= NULL;
+	SCSIParallelTask *	next	= NULL;
 	
-	timer = OSDynamicCast ( SCSIParallelTimer, theSender );
-	if ( timer != NULL )
+	// Take the whole list.
+	do
+	{
+		list = ( SCSIParallelTask * ) fDeferredCompletionList;
+	} while ( OSCompareAndSwapPtr ( list, NULL, &fDeferredCompletionList ) == false );
+	
+	// The list is newest first, reverse it.
+	while ( list != NULL )
 	{
 		
-		timer->BeginTimeoutContext ( );
+		next = list->fDeferredCompletionNext;
+		list->fDeferredCompletionNext = task;
+		task = list;
+		list = next;
 		
-		expiredTask = timer->GetExpiredTask ( );
-		while ( expiredTask != NULL )
+	}
+	
+	while ( task != NULL )
+	{
+		
+		// Completing the task returns it to the pool, so get the next one
+		// first.
+		next = task->fDeferredCompletionNext;
+		task->fDeferredCompletionNext = NULL;
+		
+		CompleteParallelTask ( task,
+							   task->fDeferredTaskStatus,
+							   task->fDeferredServiceResponse );
+		
+		task = next;
+		
+	}
+	
+}
+
+
+#if 0
+#pragma mark -
+#pragma mark Batched Submission
+#pragma mark -
+#endif
+
+
+//-----------------------------------------------------------------------------
+//	InitializeBatchedSubmission - Picks up the batch size from the HBA's
+//								  personality.						  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::InitializeBatchedSubmission ( void )
+{
+	
+	OSNumber *	number = NULL;
+	
+	fSubmissionList			= NULL;
+	fSubmissionBatchSize	= 1;
+	
+	number = OSDynamicCast ( OSNumber, getProperty ( kIOParallelTaskBatchSizeKey ) );
+	if ( number != NULL )
+	{
+		
+		fSubmissionBatchSize = number->unsigned32BitValue ( );
+		
+		if ( fSubmissionBatchSize > kMaxParallelTaskBatchSize )
 		{
-			
-			( ( IOSCSIParallelInterfaceController * ) theObject )->HandleTimeout ( expiredTask );
-			expiredTask = timer->GetExpiredTask ( );
-			
+			fSubmissionBatchSize = kMaxParallelTaskBatchSize;
 		}
 		
-		timer->EndTimeoutContext ( );
+		if ( fSubmissionBatchSize == 0 )
+		{
+			fSubmissionBatchSize = 1;
+		}
 		
-		// Rearm the timer
-		timer->Rearm ( );
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	QueueParallelTaskForSubmission - 	Adds a task to the batch being
+//										collected. This never blocks.
+//																	  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::QueueParallelTaskForSubmission (
+							SCSIParallelTaskIdentifier	parallelRequest )
+{
+	
+	SCSIParallelTask *	task	= ( SCSIParallelTask * ) parallelRequest;
+	void *				head	= NULL;
+	
+	// Push the task on to the list. The list is only ever taken as a
+	// whole, so there is no ABA problem here.
+	do
+	{
 		
+		head = fSubmissionList;
+		task->fBatchedSubmissionNext = ( SCSIParallelTask * ) head;
+		
+	} while ( OSCompareAndSwapPtr ( head, task, &fSubmissionList ) == false );
+	
+	// The task that made the list non-empty has the workloop send
+	// whatever has been collected by the time it runs. The tasks are
+	// never sent from here, so that a later batch can not overtake an
+	// earlier one.
+	if ( head == NULL )
+	{
+		fSubmissionEvent->interruptOccurred ( NULL, NULL, 0 );
 	}
 	
 }
 
 
 //-----------------------------------------------------------------------------
-//	HandleTimeout - Generic timeout handler. Subclasses should override.
-//															  		[PROTECTED]
+//	SubmissionOccurred - Called on the workloop to send a partial batch.
+//																	  [PRIVATE]
 //-----------------------------------------------------------------------------
 
 void
-IOSCSIParallelInterfaceController::HandleTimeout (
-						SCSIParallelTaskIdentifier			parallelRequest )
+IOSCSIParallelInterfaceController::SubmissionOccurred (
+							OSObject *					theObject,
+							IOInterruptEventSource *	theSource,
+							int							count )
+{
+	( ( IOSCSIParallelInterfaceController * ) theObject )->SubmitBatchedParallelTasks ( );
+}
+
+
+//-----------------------------------------------------------------------------
+//	SubmitBatchedParallelTasks - 	Hands all collected tasks to the HBA in
+//									batches, in the order they were
+//									submitted. Called on the workloop.
+//																	  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::SubmitBatchedParallelTasks ( void )
 {
 	
-	check ( parallelRequest != NULL );
-	CompleteParallelTask ( 	parallelRequest,
-							kSCSITaskStatus_TaskTimeoutOccurred,
-							kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE );
+	SCSIParallelTaskIdentifier	parallelRequests[kMaxParallelTaskBatchSize];
+	SCSIServiceResponse			serviceResponses[kMaxParallelTaskBatchSize];
+	SCSIParallelTask *			list	= NULL;
+	SCSIParallelTask *			task	= NULL;
+	SCSIParallelTask *			next	= NULL;
+	UInt32						count	= 0;
+	UInt32						index	= 0;
+	
+	// Take the whole list.
+	do
+	{
+		list = ( SCSIParallelTask * ) fSubmissionList;
+	} while ( OSCompareAndSwapPtr ( list, NULL, &fSubmissionList ) == false );
+	
+	// The list is newest first, reverse it.
+	while ( list != NULL )
+	{
+		
+		next = list->fBatchedSubmissionNext;
+		list->fBatchedSubmissionNext = task;
+		task = list;
+		list = next;
+		
+	}
+	
+	while ( task != NULL )
+	{
+		
+		// Fill the next batch. The HBA may complete a task as soon as it
+		// has it, so unlink each task before handing it over.
+		for ( count = 0; ( task != NULL ) && ( count < fSubmissionBatchSize ); count++ )
+		{
+			
+			next = task->fBatchedSubmissionNext;
+			task->fBatchedSubmissionNext = NULL;
+			
+			parallelRequests[count] = task->fIdentifier;
+			serviceResponses[count] = kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
+			
+			task = next;
+			
+		}
+		
+		// The controller may have been suspended since the tasks were
+		// submitted, in which case they are held until it resumes.
+		if ( fHBACanAcceptClientRequests == true )
+		{
+			
+			for ( index = 0; index < count; index++ )
+			{
+				SCSIParallelTask::FromIdentifier ( parallelRequests[index] )->fState = kSCSIParallelTaskState_HBA;
+			}
+			
+			ProcessParallelTasks ( parallelRequests, serviceResponses, count );
+			
+		}
+		
+		else
+		{
+			
+			for ( index = 0; index < count; index++ )
+			{
+				serviceResponses[index] = HoldParallelTask ( SCSIParallelTask::FromIdentifier ( parallelRequests[index] ) );
+			}
+			
+		}
+		
+		// The device has already been told these tasks are in process,
+		// so complete any the HBA did not accept.
+		for ( index = 0; index < count; index++ )
+		{
+			
+			if ( serviceResponses[index] != kSCSIServiceResponse_Request_In_Process )
+			{
+				
+				CompleteParallelTask ( parallelRequests[index],
+									   kSCSITaskStatus_No_Status,
+									   serviceResponses[index] );
+				
+			}
+			
+		}
+		
+	}
 	
 }
 
 
 #if 0
 #pragma mark -
-#pragma mark SCSI Parallel Device Management
+#pragma mark Holding Queue
 #pragma mark -
 #endif
 
 
 //-----------------------------------------------------------------------------
-//	CreateTargetForID - Creates a target device for the ID specified.
-//																	[PROTECTED]
+//	InitializeHoldingQueue - Picks up the size and timeout of the holding
+//							 queue from the HBA's personality.		  [PRIVATE]
 //-----------------------------------------------------------------------------
 
-bool
-IOSCSIParallelInterfaceController::CreateTargetForID (
-										SCSITargetIdentifier	targetID )
+void
+IOSCSIParallelInterfaceController::InitializeHoldingQueue ( void )
 {
 	
-	OSDictionary *	dict 	= NULL;
-	bool			result	= false;
+	OSNumber *	number = NULL;
 	
-	dict = OSDictionary::withCapacity ( 0 );
-	require_nonzero ( dict, DICT_CREATION_FAILED );
+	fHoldingQueueHead			= NULL;
+	fHoldingQueueTail			= NULL;
+	fHoldingQueueCount			= 0;
+	fHoldingQueueSize			= kDefaultHoldingQueueSize;
+	fHoldingQueueTimeout		= kDefaultHoldingQueueTimeout;
+	fHoldingQueueMaximumDepth	= 0;
+	fHoldingQueueHeld			= 0;
+	fHoldingQueueExpired		= 0;
+	fHoldingQueueRefused		= 0;
 	
-	result = CreateTargetForID ( targetID, dict );
+	number = OSDynamicCast ( OSNumber, getProperty ( kIOHoldingQueueSizeKey ) );
+	if ( number != NULL )
+	{
+		fHoldingQueueSize = number->unsigned32BitValue ( );
+	}
 	
-	dict->release ( );
-	dict = NULL;
+	number = OSDynamicCast ( OSNumber, getProperty ( kIOHoldingQueueTimeoutKey ) );
+	if ( number != NULL )
+	{
+		fHoldingQueueTimeout = number->unsigned32BitValue ( );
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	SubmitParallelTask - Hands a task to the HBA, or to the batch being
+//						 collected for it.							  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+SCSIServiceResponse
+IOSCSIParallelInterfaceController::SubmitParallelTask (
+							SCSIParallelTaskIdentifier	parallelRequest )
+{
 	
+	SCSIParallelTask *	task			= ( SCSIParallelTask * ) parallelRequest;
+	SCSIServiceResponse	serviceResponse = kSCSIServiceResponse_Request_In_Process;
 	
-DICT_CREATION_FAILED:
+	if ( fSubmissionBatchSize > 1 )
+	{
+		
+		// The HBA takes its tasks in batches, the task will be sent
+		// with the others.
+		QueueParallelTaskForSubmission ( parallelRequest );
+		
+	}
+	
+	else
+	{
+		
+		// The HBA may complete the task before this returns, so it has to
+		// be marked as the HBA's first.
+		task->fState = kSCSIParallelTaskState_HBA;
+		
+		serviceResponse = ProcessParallelTask ( task->fIdentifier );
+		if ( serviceResponse != kSCSIServiceResponse_Request_In_Process )
+		{
+			task->fState = kSCSIParallelTaskState_Family;
+		}
+		
+	}
+	
+	return serviceResponse;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	HoldParallelTask -	Puts a task on the holding queue while services
+//						are suspended.								  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+SCSIServiceResponse
+IOSCSIParallelInterfaceController::HoldParallelTask (
+							SCSIParallelTaskIdentifier	parallelRequest )
+{
+	
+	SCSIParallelTask *	task			= ( SCSIParallelTask * ) parallelRequest;
+	SCSIServiceResponse	serviceResponse = kSCSIServiceResponse_Request_In_Process;
+	UInt64				interval		= 0;
+	bool				send			= false;
+	
+	fWorkLoop->closeGate ( );
+	
+	// Services may have been resumed in the meantime. The task is sent
+	// after any which are still held.
+	if ( fHBACanAcceptClientRequests == true )
+	{
+		
+		SendHeldParallelTasks ( );
+		send = true;
+		
+	}
+	
+	else if ( fHoldingQueueCount >= fHoldingQueueSize )
+	{
+		
+		// The queue is full, the task fails as if there were none.
+		fHoldingQueueRefused++;
+		serviceResponse = kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
+		
+	}
+	
+	else
+	{
+		
+		clock_interval_to_absolutetime_interval ( fHoldingQueueTimeout, kMillisecondScale, &interval );
+		
+		task->fHoldingDeadline			= mach_absolute_time ( ) + interval;
+		task->fBatchedSubmissionNext	= NULL;
+		task->fHeld						= true;
+		
+		if ( fHoldingQueueTail != NULL )
+		{
+			fHoldingQueueTail->fBatchedSubmissionNext = task;
+		}
+		
+		else
+		{
+			
+			// The first task held sets the timer, the timer is reset for
+			// the next one as each task is sent or fails.
+			fHoldingQueueHead = task;
+			fHoldingTimer->wakeAtTime ( *( AbsoluteTime * ) &task->fHoldingDeadline );
+			
+		}
+		
+		fHoldingQueueTail = task;
+		fHoldingQueueCount++;
+		fHoldingQueueHeld++;
+		
+		if ( fHoldingQueueCount > fHoldingQueueMaximumDepth )
+		{
+			fHoldingQueueMaximumDepth = fHoldingQueueCount;
+		}
+		
+	}
+	
+	fWorkLoop->openGate ( );
+	
+	if ( send == true )
+	{
+		serviceResponse = SubmitParallelTask ( parallelRequest );
+	}
+	
+	return serviceResponse;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	SendHeldParallelTasks - Sends the held tasks in the order they were
+//							submitted. Called with the gate held.	  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::SendHeldParallelTasks ( void )
+{
+	
+	SCSIParallelTask *	task			= NULL;
+	SCSIServiceResponse	serviceResponse = kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
 	
+	// The HBA may suspend services again while the tasks are being sent,
+	// in which case the rest wait for it to resume.
+	while ( ( fHoldingQueueHead != NULL ) && ( fHBACanAcceptClientRequests == true ) )
+	{
+		
+		task = fHoldingQueueHead;
+		
+		fHoldingQueueHead = task->fBatchedSubmissionNext;
+		if ( fHoldingQueueHead == NULL )
+		{
+			fHoldingQueueTail = NULL;
+		}
+		
+		task->fBatchedSubmissionNext	= NULL;
+		task->fHeld						= false;
+		
+		// The HBA already completed the task, its completion only has to
+		// be finished on the workloop (see CompleteParallelTask).
+		if ( task->fState == kSCSIParallelTaskState_Deferred )
+		{
+			
+			fHoldingQueueCount--;
+			continue;
+			
+		}
+		
+		// The time held is part of the task's setup, not of the HBA's.
+		task->MarkStage ( kSCSIParallelTaskStage_Executed, mach_absolute_time ( ) );
+		
+		serviceResponse = SubmitParallelTask ( task );
+		
+		// New tasks are held until the task has been sent, so that none
+		// overtakes it.
+		fHoldingQueueCount--;
+		
+		// The device has already been told the task is in process.
+		if ( serviceResponse != kSCSIServiceResponse_Request_In_Process )
+		{
+			
+			CompleteParallelTask ( task,
+								   kSCSITaskStatus_No_Status,
+								   serviceResponse );
+			
+		}
+		
+	}
+	
+	if ( fHoldingQueueHead == NULL )
+	{
+		fHoldingTimer->cancelTimeout ( );
+	}
+	
+	else
+	{
+		fHoldingTimer->wakeAtTime ( *( AbsoluteTime * ) &fHoldingQueueHead->fHoldingDeadline );
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	ExpireHeldParallelTasks - 	Fails the held tasks whose deadline is at
+//								or before the given time. Called with the
+//								gate held.							  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::ExpireHeldParallelTasks ( UInt64 time )
+{
+	
+	SCSIParallelTask *	task = NULL;
+	
+	// The tasks are held in the order they were submitted, so the oldest
+	// is always at the head.
+	while ( ( fHoldingQueueHead != NULL ) && ( fHoldingQueueHead->fHoldingDeadline <= time ) )
+	{
+		
+		task = fHoldingQueueHead;
+		
+		fHoldingQueueHead = task->fBatchedSubmissionNext;
+		if ( fHoldingQueueHead == NULL )
+		{
+			fHoldingQueueTail = NULL;
+		}
+		
+		task->fBatchedSubmissionNext	= NULL;
+		task->fHeld						= false;
+		fHoldingQueueCount--;
+		
+		// A task which the HBA already completed is finished by its
+		// deferred completion.
+		if ( task->fState == kSCSIParallelTaskState_Deferred )
+		{
+			continue;
+		}
+		
+		fHoldingQueueExpired++;
+		
+		CompleteParallelTask ( task,
+							   kSCSITaskStatus_No_Status,
+							   kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE );
+		
+	}
+	
+	if ( fHoldingQueueHead == NULL )
+	{
+		fHoldingTimer->cancelTimeout ( );
+	}
+	
+	else
+	{
+		fHoldingTimer->wakeAtTime ( *( AbsoluteTime * ) &fHoldingQueueHead->fHoldingDeadline );
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	UnholdParallelTask - 	Takes a task off the holding queue, if it is on
+//							it, without sending or failing it. Called with
+//							the gate held.							  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::UnholdParallelTask ( SCSIParallelTask * task )
+{
+	
+	SCSIParallelTask *	previous = NULL;
+	
+	require_quiet ( ( task->fHeld == true ), Exit );
+	
+	// The queue is only linked forward, so look for the task before it.
+	if ( fHoldingQueueHead == task )
+	{
+		fHoldingQueueHead = task->fBatchedSubmissionNext;
+	}
+	
+	else
+	{
+		
+		previous = fHoldingQueueHead;
+		while ( previous->fBatchedSubmissionNext != task )
+		{
+			previous = previous->fBatchedSubmissionNext;
+		}
+		
+		previous->fBatchedSubmissionNext = task->fBatchedSubmissionNext;
+		
+	}
+	
+	if ( fHoldingQueueTail == task )
+	{
+		fHoldingQueueTail = previous;
+	}
+	
+	task->fBatchedSubmissionNext	= NULL;
+	task->fHeld						= false;
+	fHoldingQueueCount--;
+	
+	// The timer is left as it is. If it was set for this task, it only
+	// finds nothing to expire and is set again for the next one.
+	
+	
+Exit:
+	
+	
+	return;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	HoldingTimeoutOccurred - Fails the tasks held for too long.		   [STATIC]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::HoldingTimeoutOccurred (
+							OSObject *				owner,
+							IOTimerEventSource *	sender )
+{
+	( ( IOSCSIParallelInterfaceController * ) owner )->ExpireHeldParallelTasks ( mach_absolute_time ( ) );
+}
+
+
+//-----------------------------------------------------------------------------
+//	UpdateHoldingQueueStatistics - Publishes the holding queue statistics.
+//																	  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::UpdateHoldingQueueStatistics ( void )
+{
+	
+	OSDictionary *	dict	= NULL;
+	OSNumber *		number	= NULL;
+	
+	const char *	keys[kHoldingQueueDictionaryEntryCount] =
+	{
+		kIOHoldingQueueDepthKey,
+		kIOHoldingQueueMaximumDepthKey,
+		kIOHoldingQueueHeldKey,
+		kIOHoldingQueueExpiredKey,
+		kIOHoldingQueueRefusedKey
+	};
+	
+	UInt64			values[kHoldingQueueDictionaryEntryCount] =
+	{
+		fHoldingQueueCount,
+		fHoldingQueueMaximumDepth,
+		fHoldingQueueHeld,
+		fHoldingQueueExpired,
+		fHoldingQueueRefused
+	};
+	
+	dict = OSDictionary::withCapacity ( kHoldingQueueDictionaryEntryCount );
+	require_nonzero ( dict, ErrorExit );
+	
+	for ( UInt32 index = 0; index < kHoldingQueueDictionaryEntryCount; index++ )
+	{
+		
+		number = OSNumber::withNumber ( values[index], 64 );
+		if ( number != NULL )
+		{
+			
+			dict->setObject ( keys[index], number );
+			number->release ( );
+			number = NULL;
+			
+		}
+		
+	}
+	
+	setProperty ( kIOHoldingQueueStatisticsKey, dict );
+	dict->release ( );
+	dict = NULL;
+	
+	
+ErrorExit:
+	
+	
+	return;
+	
+}
+
+
+#if 0
+#pragma mark -
+#pragma mark Timeout Management
+#pragma mark -
+#endif
+
+
+//-----------------------------------------------------------------------------
+//	SetTimeoutForTask - Sets the timeout.					  		[PROTECTED]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::SetTimeoutForTask (
+							SCSIParallelTaskIdentifier 		parallelTask,
+							UInt32							timeoutOverride )
+{
+	
+	( ( SCSIParallelTimer * ) fTimerEvent )->SetTimeout (	SCSIParallelTask::FromIdentifier ( parallelTask ),
+															timeoutOverride );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	TimeoutOccurred - Calls the timeout handler.			  		  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::TimeoutOccurred ( 
+							OSObject *					theObject, 
+							IOTimerEventSource * 		theSender )
+{
+	
+	IOSCSIParallelInterfaceController *	controller	= NULL;
+	SCSIParallelTimer *					timer		= NULL;
+	SCSIParallelTaskIdentifier			expiredTask	= NULL;
+	
+	controller	= ( IOSCSIParallelInterfaceController * ) theObject;
+	timer		= OSDynamicCast ( SCSIParallelTimer, theSender );
+	if ( timer != NULL )
+	{
+		
+		timer->BeginTimeoutContext ( );
+		
+		expiredTask = timer->GetExpiredTask ( );
+		while ( expiredTask != NULL )
+		{
+			
+			// The HBA already completed a deferred task, its completion only
+			// has to be finished on the workloop (see CompleteParallelTask).
+			if ( ( ( SCSIParallelTask * ) expiredTask )->fState == kSCSIParallelTaskState_Deferred )
+			{
+				
+				expiredTask = timer->GetExpiredTask ( );
+				continue;
+				
+			}
+			
+			controller->RecordTaskTimeout ( expiredTask );
+			
+			// Escalate the timeout recovery for this task. The HBA is only
+			// told about the timeout once every step has been tried without
+			// success.
+			if ( controller->RecoverTimedOutTask ( expiredTask ) == false )
+			{
+				controller->HandleTimeout ( ( ( SCSIParallelTask * ) expiredTask )->fIdentifier );
+			}
+			
+			expiredTask = timer->GetExpiredTask ( );
+			
+		}
+		
+		timer->EndTimeoutContext ( );
+		
+		// Rearm the timer
+		timer->Rearm ( );
+		
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	HandleTimeout - Generic timeout handler. Subclasses should override.
+//															  		[PROTECTED]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::HandleTimeout (
+						SCSIParallelTaskIdentifier			parallelRequest )
+{
+	
+	check ( parallelRequest != NULL );
+	CompleteParallelTask ( 	parallelRequest,
+							kSCSITaskStatus_TaskTimeoutOccurred,
+							kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE );
+	
+}
+
+
+#if 0
+#pragma mark -
+#pragma mark I/O Statistics
+#pragma mark -
+#endif
+
+
+//-----------------------------------------------------------------------------
+//	RecordTaskSubmission - Counts a task handed to the controller.	  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::RecordTaskSubmission (
+							SCSIParallelTaskIdentifier		parallelRequest )
+{
+	
+	SCSIParallelTask *					task				= ( SCSIParallelTask * ) parallelRequest;
+	IOSCSIParallelInterfaceDevice *		target				= NULL;
+	SCSIParallelStatistics *			targetStatistics	= NULL;
+	
+	target = GetDevice ( parallelRequest );
+	if ( target != NULL )
+	{
+		targetStatistics = target->GetStatistics ( );
+	}
+	
+	IOSCSIParallelInterfaceDevice::AddStatistic ( fStatistics, kSCSIParallelStatistic_TasksSubmitted, 1 );
+	IOSCSIParallelInterfaceDevice::AddStatistic ( targetStatistics, kSCSIParallelStatistic_TasksSubmitted, 1 );
+	
+	// A task which has been retried is being sent again from the
+	// resend list.
+	if ( task->fTaskRetryCount > 0 )
+	{
+		
+		IOSCSIParallelInterfaceDevice::AddStatistic ( fStatistics, kSCSIParallelStatistic_Resends, 1 );
+		IOSCSIParallelInterfaceDevice::AddStatistic ( targetStatistics, kSCSIParallelStatistic_Resends, 1 );
+		
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	RecordTaskCompletion - Counts a completed task.					  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::RecordTaskCompletion (
+							SCSIParallelTaskIdentifier		parallelRequest,
+							SCSIServiceResponse				serviceResponse,
+							SCSITaskStatus					completionStatus )
+{
+	
+	SCSIParallelDMACommand *			command				= ( ( SCSIParallelTask * ) parallelRequest )->fDMACommand;
+	IOSCSIParallelInterfaceDevice *		target				= NULL;
+	SCSIParallelStatistics *			targetStatistics	= NULL;
+	UInt64								bytes				= 0;
+	UInt64								mappingTime			= 0;
+	UInt32								counter				= 0;
+	
+	target = GetDevice ( parallelRequest );
+	if ( target != NULL )
+	{
+		targetStatistics = target->GetStatistics ( );
+	}
+	
+	IOSCSIParallelInterfaceDevice::AddStatistic ( fStatistics, kSCSIParallelStatistic_TasksCompleted, 1 );
+	IOSCSIParallelInterfaceDevice::AddStatistic ( targetStatistics, kSCSIParallelStatistic_TasksCompleted, 1 );
+	
+	// The time the HBA spent mapping the task for DMA.
+	if ( ( command != NULL ) && ( command->fDMAMappings != 0 ) )
+	{
+		
+		absolutetime_to_nanoseconds ( command->fDMAMappingTime, &mappingTime );
+		
+		IOSCSIParallelInterfaceDevice::AddStatistic ( fStatistics, kSCSIParallelStatistic_DMAMappings, command->fDMAMappings );
+		IOSCSIParallelInterfaceDevice::AddStatistic ( targetStatistics, kSCSIParallelStatistic_DMAMappings, command->fDMAMappings );
+		IOSCSIParallelInterfaceDevice::AddStatistic ( fStatistics, kSCSIParallelStatistic_DMAMappingTime, mappingTime );
+		IOSCSIParallelInterfaceDevice::AddStatistic ( targetStatistics, kSCSIParallelStatistic_DMAMappingTime, mappingTime );
+		
+		command->fDMAMappings		= 0;
+		command->fDMAMappingTime	= 0;
+		
+	}
+	
+	bytes = GetRealizedDataTransferCount ( parallelRequest );
+	if ( bytes != 0 )
+	{
+		
+		if ( GetDataTransferDirection ( parallelRequest ) == kSCSIDataTransfer_FromTargetToInitiator )
+		{
+			counter = kSCSIParallelStatistic_BytesRead;
+		}
+		
+		else
+		{
+			counter = kSCSIParallelStatistic_BytesWritten;
+		}
+		
+		IOSCSIParallelInterfaceDevice::AddStatistic ( fStatistics, counter, bytes );
+		IOSCSIParallelInterfaceDevice::AddStatistic ( targetStatistics, counter, bytes );
+		
+	}
+	
+	// TASK SET FULL is counted as a resend when the task is sent again.
+	if ( ( serviceResponse != kSCSIServiceResponse_TASK_COMPLETE ) ||
+		 ( ( completionStatus != kSCSITaskStatus_GOOD ) &&
+		   ( completionStatus != kSCSITaskStatus_TASK_SET_FULL ) ) )
+	{
+		
+		IOSCSIParallelInterfaceDevice::AddStatistic ( fStatistics, kSCSIParallelStatistic_Errors, 1 );
+		IOSCSIParallelInterfaceDevice::AddStatistic ( targetStatistics, kSCSIParallelStatistic_Errors, 1 );
+		
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	RecordTaskTimeout - Counts a task which timed out.				  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::RecordTaskTimeout (
+							SCSIParallelTaskIdentifier		parallelRequest )
+{
+	
+	IOSCSIParallelInterfaceDevice *		target = NULL;
+	
+	IOSCSIParallelInterfaceDevice::AddStatistic ( fStatistics, kSCSIParallelStatistic_Timeouts, 1 );
+	
+	target = GetDevice ( parallelRequest );
+	if ( target != NULL )
+	{
+		IOSCSIParallelInterfaceDevice::AddStatistic ( target->GetStatistics ( ), kSCSIParallelStatistic_Timeouts, 1 );
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	UpdateStatistics - Publishes the I/O statistics for the controller.
+//																	  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::UpdateStatistics ( void )
+{
+	
+	OSDictionary *	dict	= NULL;
+	OSNumber *		number	= NULL;
+	
+	dict = IOSCSIParallelInterfaceDevice::CreateStatisticsDictionary ( fStatistics );
+	require_nonzero_quiet ( dict, ErrorExit );
+	
+	// Keep fOutstandingRequests up to date with the queue depth as of this
+	// read. It is not maintained on the I/O path.
+	number = OSDynamicCast ( OSNumber, dict->getObject ( kIOStatisticsQueueDepthKey ) );
+	if ( number != NULL )
+	{
+		
+		fOutstandingRequests = ( number->unsigned64BitValue ( ) > 0xFFFF ) ?
+								0xFFFF : number->unsigned16BitValue ( );
+		
+	}
+	
+	setProperty ( kIOStatisticsKey, dict );
+	dict->release ( );
+	dict = NULL;
+	
+	
+ErrorExit:
+	
+	
+	return;
+	
+}
+
+
+#if 0
+#pragma mark -
+#pragma mark Task Admission
+#pragma mark -
+#endif
+
+
+//-----------------------------------------------------------------------------
+//	IsTaskAdmissible - 	Determines if a target may be given another task
+//						from the pool. Called with fAdmissionLock held.
+//																	  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+bool
+IOSCSIParallelInterfaceController::IsTaskAdmissible (
+							SCSIParallelTaskAdmission *		admission,
+							bool							urgent,
+							bool							reserved )
+{
+	
+	UInt32	available		= 0;
+	UInt32	unused			= 0;
+	UInt32	unreserved		= 0;
+	UInt32	contenders		= 0;
+	UInt32	weight			= 0;
+	UInt32	share			= 0;
+	
+	// Urgent tasks are never held back. Other tasks stand aside while
+	// urgent tasks are waiting, unless the urgent tasks have had enough
+	// turns in a row.
+	if ( urgent == true )
+	{
+		return true;
+	}
+	
+	if ( ( fAdmissionUrgentWaiters != 0 ) &&
+		 ( fAdmissionUrgentStreak < kSCSIParallelMaxUrgentTaskStreak ) )
+	{
+		return false;
+	}
+	
+	// The reserved tasks are only for the tasks which may use them, such as
+	// recovery traffic, whatever the target's reservation, cap or share.
+	if ( IsTaskReserveReached ( ) == true )
+	{
+		return reserved;
+	}
+	
+	// A target never gets more than its cap.
+	if ( ( admission->fCap != 0 ) && ( admission->fOutstanding >= admission->fCap ) )
+	{
+		return false;
+	}
+	
+	// A target always gets its reservation. A target with nothing
+	// outstanding is always let in as well, so that it makes progress.
+	if ( ( admission->fOutstanding < admission->fReservation ) ||
+		 ( admission->fOutstanding == 0 ) )
+	{
+		return true;
+	}
+	
+	// Beyond its reservation a target borrows from the unreserved tasks, but
+	// must leave enough for the other targets to use their reservations.
+	if ( fAdmissionPoolSize > fAdmissionOutstanding )
+	{
+		available = fAdmissionPoolSize - fAdmissionOutstanding;
+	}
+	
+	if ( fAdmissionReserved > fAdmissionReservedOutstanding )
+	{
+		unused = fAdmissionReserved - fAdmissionReservedOutstanding;
+	}
+	
+	if ( available <= unused )
+	{
+		return false;
+	}
+	
+	// Borrowing is unlimited until another target is left wanting.
+	contenders = fAdmissionContenders;
+	if ( IsTargetContending ( admission ) == true )
+	{
+		contenders--;
+	}
+	
+	if ( contenders == 0 )
+	{
+		return true;
+	}
+	
+	// Otherwise the target is held to its weighted share of the unreserved
+	// tasks among the busy targets.
+	if ( fAdmissionPoolSize > fAdmissionReserved )
+	{
+		unreserved = fAdmissionPoolSize - fAdmissionReserved;
+	}
+	
+	weight = fAdmissionActiveWeight;
+	if ( weight < admission->fWeight )
+	{
+		weight = admission->fWeight;
+	}
+	
+	share = ( UInt32 ) ( ( ( UInt64 ) unreserved * admission->fWeight ) / weight );
+	if ( share == 0 )
+	{
+		share = 1;
+	}
+	
+	return ( ( admission->fOutstanding - admission->fReservation ) < share );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	ChargeTaskToTarget - 	Charges a task to a target. Called with
+//							fAdmissionLock held.					  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::ChargeTaskToTarget (
+							IOSCSIParallelInterfaceDevice *	target,
+							bool							urgent,
+							bool							reserved )
+{
+	
+	SCSIParallelTaskAdmission *		admission		= NULL;
+	bool							wasActive		= false;
+	bool							wasContending	= false;
+	
+	admission 		= target->GetTaskAdmission ( );
+	wasActive		= IsTargetActive ( admission );
+	wasContending	= IsTargetContending ( admission );
+	
+	// Count the tasks which took one of the reserved tasks.
+	if ( ( reserved == true ) && ( IsTaskReserveReached ( ) == true ) )
+	{
+		fTaskReserveUsed++;
+	}
+	
+	if ( admission->fOutstanding < admission->fReservation )
+	{
+		fAdmissionReservedOutstanding++;
+	}
+	
+	RecordTaskPoolOccupancy ( );
+	
+	admission->fOutstanding++;
+	fAdmissionOutstanding++;
+	
+	if ( fAdmissionOutstanding > fTaskPoolMaximumOutstanding )
+	{
+		fTaskPoolMaximumOutstanding = fAdmissionOutstanding;
+	}
+	
+	if ( admission->fOutstanding > admission->fMaximumOutstanding )
+	{
+		admission->fMaximumOutstanding = admission->fOutstanding;
+	}
+	
+	admission->fDeferred = false;
+	
+	// Count the urgent tasks handed out ahead of other waiting tasks.
+	if ( ( urgent == true ) && ( fAdmissionWaiters > fAdmissionUrgentWaiters ) )
+	{
+		fAdmissionUrgentStreak++;
+	}
+	
+	else if ( urgent == false )
+	{
+		fAdmissionUrgentStreak = 0;
+	}
+	
+	UpdateTaskAdmissionState ( admission, wasActive, wasContending );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	UnchargeTaskFromTarget - 	Uncharges a task from the target it was
+//								charged to. Called with fAdmissionLock
+//								held.								  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::UnchargeTaskFromTarget (
+							IOSCSIParallelInterfaceDevice *	target )
+{
+	
+	SCSIParallelTaskAdmission *		admission		= NULL;
+	bool							wasActive		= false;
+	bool							wasContending	= false;
+	
+	admission 		= target->GetTaskAdmission ( );
+	wasActive		= IsTargetActive ( admission );
+	wasContending	= IsTargetContending ( admission );
+	
+	RecordTaskPoolOccupancy ( );
+	
+	admission->fOutstanding--;
+	fAdmissionOutstanding--;
+	
+	if ( admission->fOutstanding < admission->fReservation )
+	{
+		fAdmissionReservedOutstanding--;
+	}
+	
+	// A target that was turned away is retried by its client when one of
+	// its tasks completes, so it no longer holds the others back.
+	admission->fDeferred = false;
+	
+	UpdateTaskAdmissionState ( admission, wasActive, wasContending );
+	
+	// A closed target gives up its reservation once its tasks have drained.
+	if ( admission->fOutstanding == 0 )
+	{
+		ReleaseTaskReservation ( admission );
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	ReleaseTaskReservation - 	Gives up the reservation of a target which
+//								has been closed and has no tasks charged to
+//								it. Called with fAdmissionLock held.  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::ReleaseTaskReservation (
+							SCSIParallelTaskAdmission *		admission )
+{
+	
+	if ( ( admission->fOpen == false ) &&
+		 ( admission->fReserved == true ) &&
+		 ( admission->fOutstanding == 0 ) )
+	{
+		
+		fAdmissionReserved		-= admission->fReservation;
+		admission->fReserved	= false;
+		
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	UpdateTaskAdmissionState - 	Accounts for a target becoming busy or idle,
+//								or starting or stopping to contend for
+//								tasks. Called with fAdmissionLock held.
+//																	  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::UpdateTaskAdmissionState (
+							SCSIParallelTaskAdmission *		admission,
+							bool							wasActive,
+							bool							wasContending )
+{
+	
+	bool	isActive		= IsTargetActive ( admission );
+	bool	isContending	= IsTargetContending ( admission );
+	
+	if ( ( isActive == true ) && ( wasActive == false ) )
+	{
+		fAdmissionActiveWeight += admission->fWeight;
+	}
+	
+	else if ( ( isActive == false ) && ( wasActive == true ) )
+	{
+		fAdmissionActiveWeight -= admission->fWeight;
+	}
+	
+	if ( ( isContending == true ) && ( wasContending == false ) )
+	{
+		fAdmissionContenders++;
+	}
+	
+	else if ( ( isContending == false ) && ( wasContending == true ) )
+	{
+		fAdmissionContenders--;
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	WakeTaskAdmissionWaiters - 	Wakes the threads waiting for a task once
+//								one has been returned to the pool. Called
+//								with the gate held.					  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::WakeTaskAdmissionWaiters ( void )
+{
+	
+	bool	wakeUrgent	= false;
+	bool	wakeOthers	= false;
+	
+	IOSimpleLockLock ( fAdmissionLock );
+	
+	// Urgent tasks are woken one at a time ahead of the others, until they
+	// have had enough turns in a row.
+	wakeUrgent = ( ( fAdmissionUrgentWaiters != 0 ) &&
+				   ( ( fAdmissionUrgentStreak < kSCSIParallelMaxUrgentTaskStreak ) ||
+					 ( fAdmissionWaiters == fAdmissionUrgentWaiters ) ) );
+	wakeOthers = ( fAdmissionWaiters != 0 );
+	
+	IOSimpleLockUnlock ( fAdmissionLock );
+	
+	if ( wakeUrgent == true )
+	{
+		fControllerGate->commandWakeup ( &fAdmissionUrgentWaiters, true );
+	}
+	
+	else if ( wakeOthers == true )
+	{
+		fControllerGate->commandWakeup ( &fAdmissionWaiters, false );
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	InitializeTaskReserve - Picks up the number of reserved tasks from the
+//							HBA's personality.						  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::InitializeTaskReserve ( void )
+{
+	
+	OSNumber *	number = NULL;
+	
+	fTaskReserve					= kDefaultTaskReserve;
+	fTaskReserveUsed				= 0;
+	fTaskReserveWaits				= 0;
+	fTaskReserveTotalWaitTime		= 0;
+	fTaskReserveMaximumWaitTime		= 0;
+	
+	number = OSDynamicCast ( OSNumber, getProperty ( kIOTaskReserveKey ) );
+	if ( number != NULL )
+	{
+		fTaskReserve = number->unsigned32BitValue ( );
+	}
+	
+	// Leave most of the tasks for everybody else. An HBA with only a few
+	// tasks has no reserve.
+	if ( fTaskReserve > ( fAdmissionPoolSize / 4 ) )
+	{
+		fTaskReserve = fAdmissionPoolSize / 4;
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	IsTaskReserveReached - 	Checks if only the reserved tasks are left.
+//							Called with fAdmissionLock held.		  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+bool
+IOSCSIParallelInterfaceController::IsTaskReserveReached ( void )
+{
+	return ( ( fTaskReserve != 0 ) &&
+			 ( ( fAdmissionOutstanding + fTaskReserve ) >= fAdmissionPoolSize ) );
+}
+
+
+//-----------------------------------------------------------------------------
+//	UpdateTaskReserveStatistics - Publishes the reserved task statistics.
+//																	  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::UpdateTaskReserveStatistics ( void )
+{
+	
+	OSDictionary *	dict	= NULL;
+	OSNumber *		number	= NULL;
+	
+	dict = OSDictionary::withCapacity ( 5 );
+	require_nonzero ( dict, ErrorExit );
+	
+	number = OSNumber::withNumber ( fTaskReserve, 64 );
+	if ( number != NULL )
+	{
+		
+		dict->setObject ( kIOTaskReserveSizeKey, number );
+		number->release ( );
+		
+	}
+	
+	number = OSNumber::withNumber ( fTaskReserveUsed, 64 );
+	if ( number != NULL )
+	{
+		
+		dict->setObject ( kIOTaskReserveUsedKey, number );
+		number->release ( );
+		
+	}
+	
+	number = OSNumber::withNumber ( fTaskReserveWaits, 64 );
+	if ( number != NULL )
+	{
+		
+		dict->setObject ( kIOTaskReserveWaitsKey, number );
+		number->release ( );
+		
+	}
+	
+	number = OSNumber::withNumber ( fTaskReserveTotalWaitTime, 64 );
+	if ( number != NULL )
+	{
+		
+		dict->setObject ( kIOTaskReserveTotalWaitTimeKey, number );
+		number->release ( );
+		
+	}
+	
+	number = OSNumber::withNumber ( fTaskReserveMaximumWaitTime, 64 );
+	if ( number != NULL )
+	{
+		
+		dict->setObject ( kIOTaskReserveMaximumWaitTimeKey, number );
+		number->release ( );
+		
+	}
+	
+	setProperty ( kIOTaskReserveStatisticsKey, dict );
+	dict->release ( );
+	dict = NULL;
+	
+	
+ErrorExit:
+	
+	
+	return;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	RecordTaskPoolWait - Accounts for a wait (in microseconds) for a task
+//						 from the pool. Called with fAdmissionLock held.
+//																	  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::RecordTaskPoolWait ( UInt64 elapsed )
+{
+	
+	UInt32	bucket = 0;
+	
+	fTaskPoolWaits++;
+	fTaskPoolTotalWaitTime += elapsed;
+	if ( elapsed > fTaskPoolMaximumWaitTime )
+	{
+		fTaskPoolMaximumWaitTime = elapsed;
+	}
+	
+	// Bucket n counts the waits shorter than 2^n microseconds.
+	while ( ( bucket < ( kSCSIParallelTaskPoolWaitBucketCount - 1 ) ) &&
+			( elapsed >= ( 1ULL << bucket ) ) )
+	{
+		bucket++;
+	}
+	
+	fTaskPoolWaitHistogram[bucket]++;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	RecordTaskPoolOccupancy - 	Charges the time since the last change in the
+//								number of outstanding tasks to the current
+//								occupancy. Called with fAdmissionLock
+//								held.								  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::RecordTaskPoolOccupancy ( void )
+{
+	
+	UInt64	now		= mach_absolute_time ( );
+	UInt32	bucket	= kSCSIParallelTaskPoolOccupancyBucketCount - 1;
+	
+	require_nonzero_quiet ( fTaskPoolOccupancyStart, Exit );
+	require_nonzero_quiet ( fAdmissionPoolSize, Exit );
+	
+	// The last bucket is kept for an exhausted pool.
+	if ( fAdmissionOutstanding < fAdmissionPoolSize )
+	{
+		bucket = ( fAdmissionOutstanding * ( kSCSIParallelTaskPoolOccupancyBucketCount - 1 ) ) / fAdmissionPoolSize;
+	}
+	
+	fTaskPoolOccupancyTime[bucket] += now - fTaskPoolOccupancyStart;
+	
+	
+Exit:
+	
+	
+	fTaskPoolOccupancyStart = now;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	UpdateTaskPoolStatistics - Publishes the task pool pressure statistics.
+//																	  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::UpdateTaskPoolStatistics ( void )
+{
+	
+	OSDictionary *	dict		= NULL;
+	OSArray *		histogram	= NULL;
+	OSArray *		occupancy	= NULL;
+	OSNumber *		number		= NULL;
+	UInt64			time		= 0;
+	UInt32			index		= 0;
+	UInt64			waits[kSCSIParallelTaskPoolWaitBucketCount];
+	UInt64			times[kSCSIParallelTaskPoolOccupancyBucketCount];
+	UInt64			values[kTaskPoolDictionaryEntryCount];
+	
+	const char *	keys[kTaskPoolDictionaryEntryCount] =
+	{
+		kIOTaskPoolSizeKey,
+		kIOTaskPoolMaximumOutstandingKey,
+		kIOTaskPoolEmptyKey,
+		kIOTaskPoolWaitsKey,
+		kIOTaskPoolTotalWaitTimeKey,
+		kIOTaskPoolMaximumWaitTimeKey,
+		kIOTaskPoolDMACommandPoolEmptyKey
+	};
+	
+	// Take a consistent snapshot, charging the time at the current
+	// occupancy up to now.
+	IOSimpleLockLock ( fAdmissionLock );
+	
+	RecordTaskPoolOccupancy ( );
+	
+	bcopy ( fTaskPoolWaitHistogram, waits, sizeof ( waits ) );
+	bcopy ( fTaskPoolOccupancyTime, times, sizeof ( times ) );
+	
+	values[0] = fAdmissionPoolSize;
+	values[1] = fTaskPoolMaximumOutstanding;
+	values[2] = fTaskPoolEmpty;
+	values[3] = fTaskPoolWaits;
+	values[4] = fTaskPoolTotalWaitTime;
+	values[5] = fTaskPoolMaximumWaitTime;
+	values[6] = fDMACommandPoolEmpty;
+	
+	IOSimpleLockUnlock ( fAdmissionLock );
+	
+	dict = OSDictionary::withCapacity ( kTaskPoolDictionaryEntryCount + 2 );
+	require_nonzero ( dict, ErrorExit );
+	
+	for ( index = 0; index < kTaskPoolDictionaryEntryCount; index++ )
+	{
+		
+		number = OSNumber::withNumber ( values[index], 64 );
+		if ( number != NULL )
+		{
+			
+			dict->setObject ( keys[index], number );
+			number->release ( );
+			number = NULL;
+			
+		}
+		
+	}
+	
+	histogram = OSArray::withCapacity ( kSCSIParallelTaskPoolWaitBucketCount );
+	require_nonzero ( histogram, ReleaseDictionary );
+	
+	for ( index = 0; index < kSCSIParallelTaskPoolWaitBucketCount; index++ )
+	{
+		
+		number = OSNumber::withNumber ( waits[index], 64 );
+		require_nonzero ( number, ReleaseHistogram );
+		
+		histogram->setObject ( number );
+		number->release ( );
+		number = NULL;
+		
+	}
+	
+	occupancy = OSArray::withCapacity ( kSCSIParallelTaskPoolOccupancyBucketCount );
+	require_nonzero ( occupancy, ReleaseHistogram );
+	
+	for ( index = 0; index < kSCSIParallelTaskPoolOccupancyBucketCount; index++ )
+	{
+		
+		absolutetime_to_nanoseconds ( times[index], &time );
+		
+		number = OSNumber::withNumber ( time / kMillisecondScale, 64 );
+		require_nonzero ( number, ReleaseOccupancy );
+		
+		occupancy->setObject ( number );
+		number->release ( );
+		number = NULL;
+		
+	}
+	
+	dict->setObject ( kIOTaskPoolWaitHistogramKey, histogram );
+	dict->setObject ( kIOTaskPoolOccupancyTimeKey, occupancy );
+	
+	setProperty ( kIOTaskPoolStatisticsKey, dict );
+	
+	
+ReleaseOccupancy:
+	
+	
+	occupancy->release ( );
+	occupancy = NULL;
+	
+	
+ReleaseHistogram:
+	
+	
+	histogram->release ( );
+	histogram = NULL;
+	
+	
+ReleaseDictionary:
+	
+	
+	dict->release ( );
+	dict = NULL;
+	
+	
+ErrorExit:
+	
+	
+	return;
+	
+}
+
+
+#if 0
+#pragma mark -
+#pragma mark Timeout Recovery
+#pragma mark -
+#endif
+
+
+//-----------------------------------------------------------------------------
+//	InitializeTimeoutRecovery - Sets the grace periods for each step of the
+//								timeout recovery ladder.			  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::InitializeTimeoutRecovery ( void )
+{
+	
+	OSDictionary *	dict	= NULL;
+	OSNumber *		number	= NULL;
+	UInt8			step	= 0;
+	
+	// The HBA child class opts in to the ladder, and may override the
+	// defaults, in its personality. An HBA which doesn't may not complete
+	// or release the tasks its Task Management functions reclaim, so the
+	// ladder would only hold up its own timeout handling.
+	dict = OSDynamicCast ( OSDictionary, getProperty ( kIOTimeoutRecoveryKey ) );
+	fRecoveryEnabled = ( dict != NULL );
+	
+	for ( step = kSCSIParallelRecoveryStep_AbortTask; step < kSCSIParallelRecoveryStepCount; step++ )
+	{
+		
+		fRecoveryGracePeriod[step] = sRecoveryGracePeriodDefaults[step];
+		
+		if ( dict != NULL )
+		{
+			
+			number = OSDynamicCast ( OSNumber, dict->getObject ( sRecoveryStepKeys[step] ) );
+			if ( number != NULL )
+			{
+				fRecoveryGracePeriod[step] = number->unsigned32BitValue ( );
+			}
+			
+		}
+		
+	}
+	
+	UpdateTimeoutRecoveryStatistics ( );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	RecoverTimedOutTask - 	Escalates the timeout recovery for a task to the
+//							next step of the ladder. Returns false once the
+//							ladder has been exhausted.				  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+bool
+IOSCSIParallelInterfaceController::RecoverTimedOutTask (
+							SCSIParallelTaskIdentifier		parallelRequest )
+{
+	
+	IOSCSIParallelInterfaceDevice *		target			= NULL;
+	SCSIParallelTaskIdentifier			recoveryTask	= NULL;
+	SCSIServiceResponse					serviceResponse	= kSCSIServiceResponse_FUNCTION_REJECTED;
+	UInt8								step			= kSCSIParallelRecoveryStep_None;
+	bool								result			= false;
+	
+	// The HBA handles the timeout itself unless it opted in.
+	require_quiet ( fRecoveryEnabled, Exit );
+	
+	target = GetDevice ( parallelRequest );
+	require_nonzero ( target, Exit );
+	
+	recoveryTask = target->GetRecoveryTask ( );
+	if ( recoveryTask == NULL )
+	{
+		
+		// Start recovering this task.
+		target->BeginRecovery ( parallelRequest );
+		recoveryTask = parallelRequest;
+		
+	}
+	
+	if ( recoveryTask != parallelRequest )
+	{
+		
+		// Another task of this target is being recovered, and the step in
+		// progress may well recover this task too. Give it the same grace
+		// period before trying again.
+		SetTimeoutForTask ( parallelRequest, fRecoveryGracePeriod[target->GetRecoveryStep ( )] );
+		result = true;
+		goto Exit;
+		
+	}
+	
+	step = target->GetRecoveryStep ( );
+	while ( ++step < kSCSIParallelRecoveryStepCount )
+	{
+		
+		// A grace period of zero disables the step.
+		if ( fRecoveryGracePeriod[step] == 0 )
+		{
+			continue;
+		}
+		
+		target->SetRecoveryStep ( step );
+		fRecoveryAttempts[step]++;
+		
+		// Arm the grace period before issuing the step, since the step may
+		// reclaim the task before it returns.
+		SetTimeoutForTask ( parallelRequest, fRecoveryGracePeriod[step] );
+		
+		serviceResponse = IssueRecoveryStep ( step, target, parallelRequest );
+		if ( ( serviceResponse == kSCSIServiceResponse_FUNCTION_COMPLETE ) ||
+			 ( serviceResponse == kSCSIServiceResponse_Request_In_Process ) )
+		{
+			
+			// The step was accepted. Either the task has already been
+			// reclaimed, or the grace period will tell us if it wasn't.
+			result = true;
+			break;
+			
+		}
+		
+		// The step was rejected, escalate to the next one.
+		( ( SCSIParallelTimer * ) fTimerEvent )->RemoveTask ( parallelRequest );
+		
+	}
+	
+	if ( result == false )
+	{
+		
+		// Every step has been tried without recovering the task.
+		EndTimeoutRecovery ( target, false );
+		
+	}
+	
+	UpdateTimeoutRecoveryStatistics ( );
+	
+	
+Exit:
+	
+	
+	return result;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	IssueRecoveryStep - Issues a step of the timeout recovery ladder. 
+//																	  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+SCSIServiceResponse
+IOSCSIParallelInterfaceController::IssueRecoveryStep (
+							UInt8							step,
+							IOSCSIParallelInterfaceDevice *	target,
+							SCSIParallelTaskIdentifier		parallelRequest )
+{
+	
+	SCSIServiceResponse			serviceResponse	= kSCSIServiceResponse_FUNCTION_REJECTED;
+	SCSITargetIdentifier		theT			= 0;
+	SCSILogicalUnitNumber		theL			= 0;
+	SCSITaggedTaskIdentifier	theQ			= 0;
+	
+	theT = target->GetTargetIdentifier ( );
+	theL = GetLogicalUnitNumber ( parallelRequest );
+	theQ = GetTaggedTaskIdentifier ( parallelRequest );
+	
+	// The tasks reclaimed along with the task being recovered are counted
+	// against the step by ReclaimTasksForNexus().
+	switch ( step )
+	{
+		
+		case kSCSIParallelRecoveryStep_AbortTask:
+		{
+			
+			serviceResponse = AbortTaskRequest ( theT, theL, theQ );
+			if ( serviceResponse == kSCSIServiceResponse_FUNCTION_COMPLETE )
+			{
+				ReclaimTasksForNexus ( theT, theL, theQ, kSCSIParallelTaskNexus_I_T_L_Q );
+			}
+			
+		}
+		break;
+		
+		case kSCSIParallelRecoveryStep_LogicalUnitReset:
+		{
+			
+			serviceResponse = LogicalUnitResetRequest ( theT, theL );
+			if ( serviceResponse == kSCSIServiceResponse_FUNCTION_COMPLETE )
+			{
+				ReclaimTasksForNexus ( theT, theL, 0, kSCSIParallelTaskNexus_I_T_L );
+			}
+			
+		}
+		break;
+		
+		case kSCSIParallelRecoveryStep_TargetReset:
+		{
+			
+			serviceResponse = TargetResetRequest ( theT );
+			if ( serviceResponse == kSCSIServiceResponse_FUNCTION_COMPLETE )
+			{
+				ReclaimTasksForNexus ( theT, 0, 0, kSCSIParallelTaskNexus_I_T );
+			}
+			
+		}
+		break;
+		
+		case kSCSIParallelRecoveryStep_BusReset:
+		{
+			
+			serviceResponse = ResetBusRequest ( );
+			if ( serviceResponse == kSCSIServiceResponse_FUNCTION_COMPLETE )
+			{
+				
+				NotifyClientsOfBusReset ( );
+				ReclaimTasksForBusReset ( );
+				
+			}
+			
+		}
+		break;
+		
+		default:
+			break;
+		
+	}
+	
+	return serviceResponse;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	EndTimeoutRecovery - Ends the timeout recovery for a target.	  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::EndTimeoutRecovery (
+							IOSCSIParallelInterfaceDevice *	target,
+							bool							recovered )
+{
+	
+	UInt8	step	= 0;
+	UInt64	elapsed	= 0;
+	
+	step	= target->GetRecoveryStep ( );
+	elapsed = target->EndRecovery ( );
+	
+	if ( recovered == true )
+	{
+		fRecoveryRecovered[step]++;
+	}
+	
+	else
+	{
+		fRecoveryFailed++;
+	}
+	
+	fRecoveryTotalTime += elapsed;
+	if ( elapsed > fRecoveryMaximumTime )
+	{
+		fRecoveryMaximumTime = elapsed;
+	}
+	
+	UpdateTimeoutRecoveryStatistics ( );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	ReclaimTasksForBusReset - Reclaims the tasks of every target after a
+//							  bus reset.							  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::ReclaimTasksForBusReset ( void )
+{
+	
+	OSSet *							clients		= NULL;
+	OSCollectionIterator *			iterator	= NULL;
+	OSObject *						object		= NULL;
+	IOSCSIParallelInterfaceDevice *	target		= NULL;
+	bool							recovering	= false;
+	UInt32							count		= 0;
+	UInt32							collateral	= 0;
+	
+	// Work on a snapshot of the clients, since reclaiming tasks completes
+	// them back to the client drivers.
+	clients = OSSet::withSet ( fClients );
+	require_nonzero ( clients, ErrorExit );
+	
+	iterator = OSCollectionIterator::withCollection ( clients );
+	require_nonzero ( iterator, ReleaseClients );
+	
+	fWorkLoop->closeGate ( );
+	
+	while ( ( object = iterator->getNextObject ( ) ) != NULL )
+	{
+		
+		target = OSDynamicCast ( IOSCSIParallelInterfaceDevice, object );
+		if ( target != NULL )
+		{
+			
+			recovering = ( target->GetRecoveryTask ( ) != NULL );
+			count = ReclaimTasksForNexus ( target->GetTargetIdentifier ( ),
+										   0,
+										   0,
+										   kSCSIParallelTaskNexus_I_T );
+			
+			// The tasks of a Target which is being recovered are counted by
+			// ReclaimTasksForNexus(). The tasks of the other Targets are
+			// collateral of the bus reset.
+			if ( recovering == false )
+			{
+				collateral += count;
+			}
+			
+		}
+		
+	}
+	
+	if ( collateral > 0 )
+	{
+		
+		fRecoveryCollateralTasks[kSCSIParallelRecoveryStep_BusReset] += collateral;
+		UpdateTimeoutRecoveryStatistics ( );
+		
+	}
+	
+	fWorkLoop->openGate ( );
+	
+	iterator->release ( );
+	iterator = NULL;
+	
+	
+ReleaseClients:
+	
+	
+	clients->release ( );
+	clients = NULL;
+	
+	
+ErrorExit:
+	
+	
+	return;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	UpdateTimeoutRecoveryStatistics - Publishes the timeout recovery
+//									  statistics.					  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::UpdateTimeoutRecoveryStatistics ( void )
+{
+	
+	OSDictionary *	dict		= NULL;
+	OSDictionary *	stepDict	= NULL;
+	OSNumber *		number		= NULL;
+	UInt8			step		= 0;
+	
+	dict = OSDictionary::withCapacity ( kSCSIParallelRecoveryStepCount + 2 );
+	require_nonzero ( dict, ErrorExit );
+	
+	for ( step = kSCSIParallelRecoveryStep_AbortTask; step < kSCSIParallelRecoveryStepCount; step++ )
+	{
+		
+		stepDict = OSDictionary::withCapacity ( kRecoveryStepDictionaryEntryCount );
+		if ( stepDict == NULL )
+		{
+			continue;
+		}
+		
+		number = OSNumber::withNumber ( fRecoveryAttempts[step], 64 );
+		if ( number != NULL )
+		{
+			
+			stepDict->setObject ( kIOTimeoutRecoveryAttemptsKey, number );
+			number->release ( );
+			number = NULL;
+			
+		}
+		
+		number = OSNumber::withNumber ( fRecoveryRecovered[step], 64 );
+		if ( number != NULL )
+		{
+			
+			stepDict->setObject ( kIOTimeoutRecoveryRecoveredKey, number );
+			number->release ( );
+			number = NULL;
+			
+		}
+		
+		number = OSNumber::withNumber ( fRecoveryCollateralTasks[step], 64 );
+		if ( number != NULL )
+		{
+			
+			stepDict->setObject ( kIOTimeoutRecoveryCollateralTasksKey, number );
+			number->release ( );
+			number = NULL;
+			
+		}
+		
+		dict->setObject ( sRecoveryStepKeys[step], stepDict );
+		stepDict->release ( );
+		stepDict = NULL;
+		
+	}
+	
+	number = OSNumber::withNumber ( fRecoveryFailed, 64 );
+	if ( number != NULL )
+	{
+		
+		dict->setObject ( kIOTimeoutRecoveryFailedKey, number );
+		number->release ( );
+		number = NULL;
+		
+	}
+	
+	number = OSNumber::withNumber ( fRecoveryTotalTime, 64 );
+	if ( number != NULL )
+	{
+		
+		dict->setObject ( kIOTimeoutRecoveryTotalTimeKey, number );
+		number->release ( );
+		number = NULL;
+		
+	}
+	
+	number = OSNumber::withNumber ( fRecoveryMaximumTime, 64 );
+	if ( number != NULL )
+	{
+		
+		dict->setObject ( kIOTimeoutRecoveryMaximumTimeKey, number );
+		number->release ( );
+		number = NULL;
+		
+	}
+	
+	setProperty ( kIOTimeoutRecoveryStatisticsKey, dict );
+	dict->release ( );
+	dict = NULL;
+	
+	
+ErrorExit:
+	
+	
+	return;
+	
+}
+
+
+#if 0
+#pragma mark -
+#pragma mark SCSI Parallel Device Management
+#pragma mark -
+#endif
+
+
+//-----------------------------------------------------------------------------
+//	CreateTargetForID - Creates a target device for the ID specified.
+//																	[PROTECTED]
+//-----------------------------------------------------------------------------
+
+bool
+IOSCSIParallelInterfaceController::CreateTargetForID (
+										SCSITargetIdentifier	targetID )
+{
+	
+	OSDictionary *	dict 	= NULL;
+	bool			result	= false;
+	
+	dict = OSDictionary::withCapacity ( 0 );
+	require_nonzero ( dict, DICT_CREATION_FAILED );
+	
+	result = CreateTargetForID ( targetID, dict );
+	
+	dict->release ( );
+	dict = NULL;
+	
+	
+DICT_CREATION_FAILED:
+	
+	
+	return result;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	CreateTargetForID - Creates a target device for the ID specified.
+//																	[PROTECTED]
+//-----------------------------------------------------------------------------
+
+bool
+IOSCSIParallelInterfaceController::CreateTargetForID (
+										SCSITargetIdentifier	targetID,
+										OSDictionary * 			properties )
+{
+	
+	IOSCSIParallelInterfaceDevice *		newDevice 	= NULL;
+	IORegistryEntry *					entry		= NULL;
+	bool								result		= false;
+	
+	// Some subclasses like to create targets from within the StartController() override.
+	// In those cases, fHBACanAcceptClientRequests is still false. We force it to true
+	// in this case since a target is getting created - the HBA must be ready for I/O
+	// by that time...
+	if ( fHBACanAcceptClientRequests == false )
+		fHBACanAcceptClientRequests = true;
+	
+	// Verify that the device ID is not that of the initiator.
+	require ( ( targetID != fInitiatorIdentifier ), INVALID_PARAMETER_EXIT );
+	
+	// First check to see if this device already exists
+	require ( ( GetTargetForID ( targetID ) == NULL ), INVALID_PARAMETER_EXIT );
+	
+	// See if the controller has a device tree entry it wants us to hook this
+	// target upto (e.g. to get io-device-location keys).
+	entry = OSDynamicCast ( IORegistryEntry, properties->getObject ( kIOPropertyDeviceTreeEntryKey ) );
+	
+	// Create the IOSCSIParallelInterfaceDevice object
+	newDevice = IOSCSIParallelInterfaceDevice::CreateTarget (
+									targetID,
+									ReportHBASpecificDeviceDataSize ( ),
+									entry );
+	require_nonzero ( newDevice, DEVICE_CREATION_FAILED_EXIT );
+	
+	AddDeviceToTargetList ( newDevice );
+	
+	result = newDevice->attach ( this );
+	require ( result, ATTACH_FAILED_EXIT );
+	
+	result = newDevice->SetInitialTargetProperties ( properties );
+	require ( result, START_FAILED_EXIT );
+	
+	result = newDevice->start ( this );
+	require ( result, START_FAILED_EXIT );
+	
+	newDevice->release ( );
+	
+	// The SCSI Device was successfully created.
+	result = true;
+	
+	return result;
+	
+	
+START_FAILED_EXIT:
+	
+	
+	// Detach the target device
+	newDevice->detach ( this );
+	
+	
+ATTACH_FAILED_EXIT:	
+	
+	
+	RemoveDeviceFromTargetList ( newDevice );
+	
+	// The device can now be destroyed.
+	newDevice->DestroyTarget ( );
+	
+	
+DEVICE_CREATION_FAILED_EXIT:
+INVALID_PARAMETER_EXIT:
+	
+	
+	return result;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	DestroyTargetForID - Destroys a target device for the ID specified.
+//																	[PROTECTED]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::DestroyTargetForID (
+									SCSITargetIdentifier		targetID )
+{
+	
+	IOSCSIParallelInterfaceDevice *		victimDevice = NULL;
+	
+	victimDevice = GetTargetForID ( targetID );
+	if ( victimDevice == NULL )
+	{
+		
+		// There is no object for this target in the device list,
+		// so return without doing anything.
+		return;
+		
+	}
+	
+	// Remove the IOSCSIParallelInterfaceDevice from the device list.
+	RemoveDeviceFromTargetList ( victimDevice );
+	
+	// The device can now be destroyed.
+	victimDevice->DestroyTarget ( );
+	victimDevice->terminate ( );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	SetTargetProperty - Sets a property for the specified target.	[PROTECTED]
+//-----------------------------------------------------------------------------
+
+bool
+IOSCSIParallelInterfaceController::SetTargetProperty (
+					SCSIDeviceIdentifier 				targetID,
+					const char * 						key,
+					OSObject *							value )
+{
+	
+	bool								result	= false;
+	IOSCSIParallelInterfaceDevice * 	device	= NULL;
+	
+	device = GetTargetForID ( targetID );
+	
+	require_nonzero ( device, ErrorExit );
+	result = device->SetTargetProperty ( key, value );
+	
+	
+ErrorExit:
+	
+	
+	return result;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	RemoveTargetProperty - Removes a property from the specified target.
+//																	[PROTECTED]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::RemoveTargetProperty (
+					SCSIDeviceIdentifier 				targetID,
+					const char * 						key )
+{
+	
+	IOSCSIParallelInterfaceDevice * 	device	= NULL;
+	
+	device = GetTargetForID ( targetID );
+	
+	require_nonzero ( device, ErrorExit );
+	device->RemoveTargetProperty ( key );
+	
+	
+ErrorExit:
+	
+	
+	return;
+	
+}
+
+
+#if 0
+#pragma mark -
+#pragma mark Device List Management
+#pragma mark -
+#endif
+
+/*
+ * The following member routines are used to manage the array of linked lists, the Device
+ * List, that allow quick access to the SCSI Parallel Device objects.  These routines
+ * have intricate knowledge about the layout of the Device List since they are responsible
+ * for managing it and so they are the only ones that are allowed to directly access that 
+ * structure.  Any other routine that needs to retrieve an element from the Device List 
+ * must use these routines to obtain it so that if necessity causes to the Device List
+ * structure to change, they are not broken.
+ */
+
+
+//-----------------------------------------------------------------------------
+//	BeginTargetPropertyTransaction - 	Starts a property transaction for the
+//										specified target.			[PROTECTED]
+//-----------------------------------------------------------------------------
+
+bool
+IOSCSIParallelInterfaceController::BeginTargetPropertyTransaction (
+					SCSIDeviceIdentifier 				targetID )
+{
+	
+	bool								result	= false;
+	IOSCSIParallelInterfaceDevice * 	device	= NULL;
+	
+	device = GetTargetForID ( targetID );
+	
+	require_nonzero ( device, ErrorExit );
+	result = device->BeginTargetPropertyTransaction ( );
+	
+	
+ErrorExit:
+	
+	
+	return result;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	CommitTargetPropertyTransaction - 	Ends a property transaction for the
+//										specified target.			[PROTECTED]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::CommitTargetPropertyTransaction (
+					SCSIDeviceIdentifier 				targetID )
+{
+	
+	IOSCSIParallelInterfaceDevice * 	device	= NULL;
+	
+	device = GetTargetForID ( targetID );
+	
+	require_nonzero ( device, ErrorExit );
+	device->CommitTargetPropertyTransaction ( );
+	
+	
+ErrorExit:
+	
+	
+	return;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	InitializeDeviceList - Initializes device list.					  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::InitializeDeviceList ( void )
+{
+	
+	// Initialize the SCSI Parallel Device Array to all NULL pointers
+	for ( UInt32 i = 0; i < kSCSIParallelDeviceListArrayCount; i++ )
+	{
+		fParallelDeviceList[i] = NULL;
+	}
+	
+}		
+
+
+//-----------------------------------------------------------------------------
+//	GetTargetForID - Gets the device object for the specified targetID.
+//																	[PROTECTED]
+//-----------------------------------------------------------------------------
+
+IOSCSIParallelInterfaceDevice *
+IOSCSIParallelInterfaceController::GetTargetForID ( SCSITargetIdentifier targetID )
+{
+	
+	IOSCSIParallelInterfaceDevice *		device		= NULL;
+	IOInterruptState					lockState	= 0;
+	UInt8								indexID		= 0;
+	
+	require ( ( targetID >= 0 ), INVALID_PARAMETER_FAILURE );
+	require ( ( targetID <= fHighestSupportedDeviceID ), INVALID_PARAMETER_FAILURE );
+	require ( ( targetID != fInitiatorIdentifier ), INVALID_PARAMETER_FAILURE );
+	
+	lockState = IOSimpleLockLockDisableInterrupt ( fDeviceLock );
+	
+	// Hash the index.
+	indexID = targetID & kSCSIParallelDeviceListIndexMask;
+	
+	// Walk the list for the indexID
+	device = fParallelDeviceList[indexID];
+	
+	while ( device != NULL )
+	{
+		
+		if ( device->GetTargetIdentifier ( ) == targetID )
+		{
+			
+			// This is the device in which the client is interested, break
+			// so that the current pointer will be returned.
+			break;
+			
+		}
+		
+		// Get the next element in the list
+		device = device->GetNextDeviceInList ( );
+		
+	}
+	
+	IOSimpleLockUnlockEnableInterrupt ( fDeviceLock, lockState );
+	
+	
+INVALID_PARAMETER_FAILURE:
+	
+	
+	return device;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	AddDeviceToTargetList - Adds a device to the target list.		  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::AddDeviceToTargetList (
+							IOSCSIParallelInterfaceDevice *				newDevice )
+{
+	
+	UInt8					indexID		= 0;
+	IOInterruptState		lockState	= 0;
+	
+	STATUS_LOG ( ( "+IOSCSIParallelInterfaceController::AddDeviceToTargetList\n" ) );
+	
+	lockState = IOSimpleLockLockDisableInterrupt ( fDeviceLock );
+	
+	// Hash the index.
+	indexID = newDevice->GetTargetIdentifier ( ) & kSCSIParallelDeviceListIndexMask;
+	
+	// Set the pointer in the SCSI Device array
+	if ( fParallelDeviceList[indexID] == NULL )
+	{
+		
+		// This is the first device object created for this
+		// index, set the array pointer to the new object. 
+		fParallelDeviceList[indexID] = newDevice;
+		newDevice->SetNextDeviceInList ( NULL );
+		newDevice->SetPreviousDeviceInList ( NULL );
+		
+	}
+	
+	else
+	{
+		
+		// This is not the first device object for this index, 
+		// walk the list at this index and add it to the end.
+		IOSCSIParallelInterfaceDevice *	currentDevice;
+		
+		currentDevice = fParallelDeviceList[indexID];
+		while ( currentDevice->GetNextDeviceInList ( ) != NULL )
+		{
+			currentDevice = currentDevice->GetNextDeviceInList ( );
+		}
+		
+		currentDevice->SetNextDeviceInList ( newDevice );
+		newDevice->SetNextDeviceInList ( NULL );
+		newDevice->SetPreviousDeviceInList ( currentDevice );
+		
+	}
+	
+	IOSimpleLockUnlockEnableInterrupt ( fDeviceLock, lockState );
+	
+	STATUS_LOG ( ( "-IOSCSIParallelInterfaceController::AddDeviceToTargetList\n" ) );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	RemoveDeviceFromTargetList - Removes a device from the target list.
+//																	  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::RemoveDeviceFromTargetList (
+							IOSCSIParallelInterfaceDevice * 	victimDevice )
+{
+	
+	IOSCSIParallelInterfaceDevice *		nextDevice	= NULL;
+	IOSCSIParallelInterfaceDevice *		prevDevice	= NULL;
+	IOInterruptState					lockState	= 0;
+	
+	lockState = IOSimpleLockLockDisableInterrupt ( fDeviceLock );
+	
+	nextDevice = victimDevice->GetNextDeviceInList ( );
+	prevDevice = victimDevice->GetPreviousDeviceInList ( );
+	
+	if ( prevDevice != NULL )
+	{
+		
+		// There is a previous device, set it to the victim's next device
+		prevDevice->SetNextDeviceInList ( nextDevice );
+		
+	}
+	
+	else
+	{
+		
+		// There is not a previous device, set the pointer in the array
+		// to the victim's next device.
+		UInt8	indexID = 0;
+		
+		// Hash the index.
+		indexID = victimDevice->GetTargetIdentifier ( ) & kSCSIParallelDeviceListIndexMask;
+		
+		// Set the Device List element to point at the device object that was following
+		// the device object that is being removed.  If there was no next device, 
+		// the nextDevice pointer will be NULL causing the Device List no longer have
+		// any devices at this index.
+		fParallelDeviceList[indexID] = nextDevice;
+		
+	}
+	
+	if ( nextDevice != NULL )
+	{
+		
+		// The next device is not NULL, set it to the victim's previous
+		nextDevice->SetPreviousDeviceInList ( prevDevice );
+		
+	}
+	
+	// Clear out the victim's previous and next pointers
+	victimDevice->SetNextDeviceInList ( NULL );
+	victimDevice->SetPreviousDeviceInList ( NULL );
+	
+	IOSimpleLockUnlockEnableInterrupt ( fDeviceLock, lockState );
+	
+}
+
+
+#if 0
+#pragma mark -
+#pragma mark Controller Child Class 
+#pragma mark -
+#endif
+
+
+//-----------------------------------------------------------------------------
+//	DoesHBAPerformAutoSense - Default implementation.				   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+bool 
+IOSCSIParallelInterfaceController::DoesHBAPerformAutoSense ( void )
+{
+	return false;
+}
+
+
+//-----------------------------------------------------------------------------
+//	DoesHBASupportMultiPathing - Default implementation.			   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+bool 
+IOSCSIParallelInterfaceController::DoesHBASupportMultiPathing ( void )
+{
+
+	OSString *		interface	= NULL;
+	OSDictionary *	dict		= NULL;
+	bool			result		= true;
+
+	
+	// Get Protocol Characteristics.
+	dict = OSDynamicCast ( OSDictionary, getProperty ( kIOPropertyProtocolCharacteristicsKey ) );
+	
+	if ( dict != NULL )
+	{
+	
+		interface = OSDynamicCast ( OSString, dict->getObject ( kIOPropertyPhysicalInterconnectTypeKey ) );
+		
+		if ( interface != NULL )
+		{
+		
+			if ( ( interface->isEqualTo ( kIOPropertyPhysicalInterconnectTypeSCSIParallel ) ) ||
+				( interface->isEqualTo ( kIOPropertyPhysicalInterconnectTypeSerialAttachedSCSI ) ) )
+			{
+	
+				// No Multipathing for parallel SCSI and SAS by default. 
+				result = false;
+	
+			}
+	
+		}
+		
+	}
+	
+	return result;
+}
+
+
+//-----------------------------------------------------------------------------
+//	ResetBusRequest - Default implementation.						   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+SCSIServiceResponse
+IOSCSIParallelInterfaceController::ResetBusRequest ( void )
+{
+	return kSCSIServiceResponse_FUNCTION_REJECTED;
+}
+
+
+//-----------------------------------------------------------------------------
+//	ReportHBAConstraints - Default implementation.				 	   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::ReportHBAConstraints (
+	OSDictionary *		constraints )
+{
+	
+	UInt64			value	= 0;
+	OSNumber *		number	= NULL;
+	
+	// Default alignment is 16-byte aligned, 32-bit memory only.
+	value = 0x00000000FFFFFFF0ULL;
+	
+	number = OSNumber::withNumber ( value, 64 );
+	if ( number != NULL )
+	{
+		
+		constraints->setObject ( kIOMinimumHBADataAlignmentMaskKey, number );
+		number->release ( );
+		
+	}
+	
+	// 32-bit addressing by default.
+	value = 32;
+	number = OSNumber::withNumber ( value, 64 );
+	if ( number != NULL )
+	{
+		
+		constraints->setObject ( kIOMaximumSegmentAddressableBitCountKey, number );
+		number->release ( );
+		
+	}
+	
+	// 4-byte alignment by default.
+	value = 4;
+	number = OSNumber::withNumber ( value, 64 );
+	if ( number != NULL )
+	{
+		
+		constraints->setObject ( kIOMinimumSegmentAlignmentByteCountKey, number );
+		number->release ( );
+		
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	InitializeDMASpecification - Default implementation.		 	[PROTECTED]
+//-----------------------------------------------------------------------------
+
+bool
+IOSCSIParallelInterfaceController::InitializeDMASpecification (
+	IODMACommand * command )
+{
+	
+	bool							result		= false;
+	IODMACommand::SegmentFunction	outSegFunc	= kIODMACommandOutputHost32;
+	
+	// Only hand out 64-bit segments to an HBA which asked for the
+	// specification to be derived from its constraints and can address
+	// above 4GB. Other HBAs may generate 32-bit segments.
+	if ( fDMAAddressBits > 32 )
+	{
+		outSegFunc = kIODMACommandOutputHost64;
+	}
+	
+	result = command->initWithSpecification (
+		outSegFunc,
+		fDMAAddressBits,
+		fDMAMaximumSegmentSize,
+		IODMACommand::kMapped,
+		fDMAMaximumTransferSize,
+		fDMAAlignment
+		);
+	
+	return result;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	SetDMASpecification - 	Sets the DMA specification used by the default
+//							InitializeDMASpecification, from the HBA
+//							constraints if the HBA asked for it.	  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::SetDMASpecification (
+	OSDictionary *		constraints )
+{
+	
+	OSDictionary *	dict			= NULL;
+	OSNumber *		number			= NULL;
+	OSBoolean *		derive			= NULL;
+	UInt64			segmentSize		= 0;
+	UInt64			segmentCount	= 0;
+	UInt64			readCount		= 0;
+	UInt64			writeCount		= 0;
+	
+	// The defaults are the specification the family has always used: 32
+	// address bits, page sized segments, 1MB I/O and 4-byte aligned
+	// segments. Only an HBA which asks for it gets a specification derived
+	// from its constraints, as an HBA which generates 32-bit segments or
+	// relies on page sized segments would break otherwise.
+	fDMAAddressBits				= 32;
+	fDMAAlignment				= 4;
+	fDMAMaximumSegmentSize		= 4096;
+	fDMAMaximumTransferSize		= 1048576;
+	
+	derive = OSDynamicCast ( OSBoolean, getProperty ( kIODMASpecificationFromConstraintsKey ) );
+	require_quiet ( ( ( derive != NULL ) && ( derive->isTrue ( ) == true ) ), PUBLISH );
+	
+	number = OSDynamicCast ( OSNumber, constraints->getObject ( kIOMaximumSegmentAddressableBitCountKey ) );
+	if ( ( number != NULL ) && ( number->unsigned32BitValue ( ) != 0 ) )
+	{
+		
+		fDMAAddressBits = number->unsigned32BitValue ( );
+		if ( fDMAAddressBits > 64 )
+		{
+			fDMAAddressBits = 64;
+		}
+		
+	}
+	
+	number = OSDynamicCast ( OSNumber, constraints->getObject ( kIOMinimumSegmentAlignmentByteCountKey ) );
+	if ( ( number != NULL ) && ( number->unsigned32BitValue ( ) != 0 ) )
+	{
+		fDMAAlignment = number->unsigned32BitValue ( );
+	}
+	
+	// A segment may be as large as the HBA allows in both directions.
+	number = OSDynamicCast ( OSNumber, constraints->getObject ( kIOMaximumSegmentByteCountReadKey ) );
+	if ( number != NULL )
+	{
+		segmentSize = number->unsigned64BitValue ( );
+	}
+	
+	number = OSDynamicCast ( OSNumber, constraints->getObject ( kIOMaximumSegmentByteCountWriteKey ) );
+	if ( ( number != NULL ) && ( number->unsigned64BitValue ( ) != 0 ) )
+	{
+		
+		if ( ( segmentSize == 0 ) || ( number->unsigned64BitValue ( ) < segmentSize ) )
+		{
+			segmentSize = number->unsigned64BitValue ( );
+		}
+		
+	}
+	
+	if ( segmentSize != 0 )
+	{
+		fDMAMaximumSegmentSize = segmentSize;
+	}
+	
+	// A transfer in either direction must fit in the segments the HBA
+	// takes, so the smaller of the segment counts bounds it.
+	number = OSDynamicCast ( OSNumber, constraints->getObject ( kIOMaximumSegmentCountReadKey ) );
+	if ( number != NULL )
+	{
+		readCount = number->unsigned64BitValue ( );
+	}
+	
+	number = OSDynamicCast ( OSNumber, constraints->getObject ( kIOMaximumSegmentCountWriteKey ) );
+	if ( number != NULL )
+	{
+		writeCount = number->unsigned64BitValue ( );
+	}
+	
+	segmentCount = readCount;
+	if ( ( segmentCount == 0 ) || ( ( writeCount != 0 ) && ( writeCount < segmentCount ) ) )
+	{
+		segmentCount = writeCount;
+	}
+	
+	if ( segmentCount != 0 )
+	{
+		fDMAMaximumTransferSize = segmentCount * fDMAMaximumSegmentSize;
+	}
+	
+	
+PUBLISH:
+	
+	
+	dict = OSDictionary::withCapacity ( 4 );
+	require_nonzero ( dict, ErrorExit );
+	
+	number = OSNumber::withNumber ( fDMAAddressBits, 32 );
+	if ( number != NULL )
+	{
+		
+		dict->setObject ( kIODMASpecificationAddressBitsKey, number );
+		number->release ( );
+		
+	}
+	
+	number = OSNumber::withNumber ( fDMAMaximumSegmentSize, 64 );
+	if ( number != NULL )
+	{
+		
+		dict->setObject ( kIODMASpecificationMaximumSegmentSizeKey, number );
+		number->release ( );
+		
+	}
+	
+	number = OSNumber::withNumber ( fDMAMaximumTransferSize, 64 );
+	if ( number != NULL )
+	{
+		
+		dict->setObject ( kIODMASpecificationMaximumTransferSizeKey, number );
+		number->release ( );
+		
+	}
+	
+	number = OSNumber::withNumber ( fDMAAlignment, 32 );
+	if ( number != NULL )
+	{
+		
+		dict->setObject ( kIODMASpecificationAlignmentKey, number );
+		number->release ( );
+		
+	}
+	
+	setProperty ( kIODMASpecificationKey, dict );
+	dict->release ( );
+	dict = NULL;
+	
+	
+ErrorExit:
+	
+	
+	return;
+	
+}
+
+
+#if 0
+#pragma mark -
+#pragma mark Bounce Buffers
+#pragma mark -
+#endif
+
+
+//-----------------------------------------------------------------------------
+//	AllocateBounceBuffers - Allocates the bounce buffer pool if the HBA asked
+//							for one. A buffer can be reached by the HBA and
+//							holds the largest transfer, unless the pool is
+//							sized by the controller.				  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::AllocateBounceBuffers ( UInt32 taskCount )
+{
+	
+	OSObject *					obj			= NULL;
+	OSNumber *					number		= NULL;
+	OSBoolean *					boolean		= NULL;
+	IOBufferMemoryDescriptor *	buffer		= NULL;
+	UInt64						size		= 0;
+	UInt64						mask		= 0;
+	UInt64						alignment	= 0;
+	UInt32						count		= 0;
+	UInt32						index		= 0;
+	
+	obj = getProperty ( kIOBounceBufferPoolKey );
+	require_nonzero_quiet ( obj, ErrorExit );
+	
+	size = round_page ( fDMAMaximumTransferSize );
+	
+	number = OSDynamicCast ( OSNumber, obj );
+	if ( number != NULL )
+	{
+		count = number->unsigned32BitValue ( );
+	}
+	
+	boolean = OSDynamicCast ( OSBoolean, obj );
+	if ( ( boolean != NULL ) && ( boolean->isTrue ( ) ) )
+	{
+		count = kDefaultBounceBufferCount;
+	}
+	
+	// More buffers than tasks could never be used.
+	if ( count > taskCount )
+	{
+		count = taskCount;
+	}
+	
+	require_quiet ( ( count != 0 ), ErrorExit );
+	
+	// A pool sized by the controller keeps its number of buffers within the
+	// wired memory limit by making them smaller. Sizing the buffers for the
+	// largest transfer instead would leave a single buffer if the HBA can
+	// transfer several megabytes, so tasks would queue for it. A transfer
+	// larger than a buffer is left to IODMACommand.
+	if ( boolean != NULL )
+	{
+		
+		if ( size > trunc_page ( kMaxBounceBufferPoolBytes / count ) )
+		{
+			size = trunc_page ( kMaxBounceBufferPoolBytes / count );
+		}
+		
+		if ( size < PAGE_SIZE )
+		{
+			size = PAGE_SIZE;
+		}
+		
+	}
+	
+	// The buffers must be addressable and start on a segment boundary.
+	alignment = ( fDMAAlignment > PAGE_SIZE ) ? fDMAAlignment : PAGE_SIZE;
+	mask = ( fDMAAddressBits >= 64 ) ? ~0ULL : ( ( 1ULL << fDMAAddressBits ) - 1 );
+	mask &= ~( alignment - 1 );
+	
+	fBounceBufferLock = IOSimpleLockAlloc ( );
+	require_nonzero ( fBounceBufferLock, ErrorExit );
+	
+	fBounceBuffers = IONew ( IOBufferMemoryDescriptor *, count );
+	require_nonzero ( fBounceBuffers, ErrorExit );
+	
+	for ( index = 0; index < count; index++ )
+	{
+		
+		buffer = IOBufferMemoryDescriptor::inTaskWithPhysicalMask (
+			kernel_task,
+			kIODirectionInOut,
+			size,
+			mask );
+		
+		if ( buffer == NULL )
+		{
+			break;
+		}
+		
+		if ( buffer->prepare ( ) != kIOReturnSuccess )
+		{
+			
+			buffer->release ( );
+			break;
+			
+		}
+		
+		fBounceBuffers[index] = buffer;
+		
+	}
+	
+	// As with the tasks, the pool works as long as it has one buffer.
+	if ( index == 0 )
+	{
+		
+		ERROR_LOG ( ( "AllocateBounceBuffers: no bounce buffers could be allocated\n" ) );
+		IODelete ( fBounceBuffers, IOBufferMemoryDescriptor *, count );
+		fBounceBuffers = NULL;
+		goto ErrorExit;
+		
+	}
+	
+	// Fewer buffers could be allocated than asked for. Trim the array so
+	// its size is the number of buffers, or keep the larger one if it
+	// can't be replaced.
+	if ( index < count )
+	{
+		
+		IOBufferMemoryDescriptor **	buffers = NULL;
+		
+		buffers = IONew ( IOBufferMemoryDescriptor *, index );
+		if ( buffers != NULL )
+		{
+			
+			bcopy ( fBounceBuffers, buffers, index * sizeof ( IOBufferMemoryDescriptor * ) );
+			IODelete ( fBounceBuffers, IOBufferMemoryDescriptor *, count );
+			fBounceBuffers = buffers;
+			count = index;
+			
+		}
+		
+	}
+	
+	fBounceBufferCount		= count;
+	fBounceBufferFreeCount	= index;
+	fBounceBufferSize		= size;
+	
+	UpdateBounceBufferStatistics ( );
+	
+	return;
+	
+	
+ErrorExit:
+	
+	
+	if ( fBounceBufferLock != NULL )
+	{
+		
+		IOSimpleLockFree ( fBounceBufferLock );
+		fBounceBufferLock = NULL;
+		
+	}
+	
+	return;
+	
+}
+
+//-----------------------------------------------------------------------------
+//	DeallocateBounceBuffers - Deallocates the bounce buffer pool. All tasks
+//							  must have been returned.				  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::DeallocateBounceBuffers ( void )
+{
+	
+	UInt32	index = 0;
+	
+	require_nonzero_quiet ( fBounceBuffers, Exit );
+	
+	check ( fBounceBufferFreeCount <= fBounceBufferCount );
+	
+	for ( index = 0; index < fBounceBufferFreeCount; index++ )
+	{
+		
+		fBounceBuffers[index]->complete ( );
+		fBounceBuffers[index]->release ( );
+		fBounceBuffers[index] = NULL;
+		
+	}
+	
+	IODelete ( fBounceBuffers, IOBufferMemoryDescriptor *, fBounceBufferCount );
+	fBounceBuffers			= NULL;
+	fBounceBufferCount		= 0;
+	fBounceBufferFreeCount	= 0;
+	
+	IOSimpleLockFree ( fBounceBufferLock );
+	fBounceBufferLock = NULL;
+	
+	
+Exit:
+	
+	
+	return;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	IsBounceBufferNeeded - 	Determines if the HBA can't reach part of a data
+//							buffer, either because a segment is above the
+//							addressable range or is not aligned.	  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+bool
+IOSCSIParallelInterfaceController::IsBounceBufferNeeded (
+							IOMemoryDescriptor *	buffer,
+							UInt64					offset,
+							UInt64					length )
+{
+	
+	addr64_t	address		= 0;
+	addr64_t	maxAddress	= 0;
+	IOByteCount	segmentSize	= 0;
+	
+	maxAddress = ( fDMAAddressBits >= 64 ) ? ~0ULL : ( ( 1ULL << fDMAAddressBits ) - 1 );
+	
+	while ( length > 0 )
+	{
+		
+		address = buffer->getPhysicalSegment64 ( offset, &segmentSize );
+		if ( ( address == 0 ) || ( segmentSize == 0 ) )
+		{
+			return true;
+		}
+		
+		if ( segmentSize > length )
+		{
+			segmentSize = length;
+		}
+		
+		if ( ( address + segmentSize - 1 ) > maxAddress )
+		{
+			return true;
+		}
+		
+		if ( ( address & ( fDMAAlignment - 1 ) ) != 0 )
+		{
+			return true;
+		}
+		
+		offset += segmentSize;
+		length -= segmentSize;
+		
+	}
 	
-	return result;
+	return false;
 	
 }
 
 
 //-----------------------------------------------------------------------------
-//	CreateTargetForID - Creates a target device for the ID specified.
-//																	[PROTECTED]
+//	SetTaskDMABuffer - 	Sets the data buffer of a task for DMA, staging the
+//						data through a bounce buffer if the HBA can't reach
+//						the buffer.									   [PUBLIC]
 //-----------------------------------------------------------------------------
 
-bool
-IOSCSIParallelInterfaceController::CreateTargetForID (
-										SCSITargetIdentifier	targetID,
-										OSDictionary * 			properties )
+IOReturn
+IOSCSIParallelInterfaceController::SetTaskDMABuffer (
+							SCSIParallelTaskIdentifier		parallelTask,
+							IOMemoryDescriptor *			buffer )
 {
 	
-	IOSCSIParallelInterfaceDevice *		newDevice 	= NULL;
-	IORegistryEntry *					entry		= NULL;
-	bool								result		= false;
-	
-	// Some subclasses like to create targets from within the StartController() override.
-	// In those cases, fHBACanAcceptClientRequests is still false. We force it to true
-	// in this case since a target is getting created - the HBA must be ready for I/O
-	// by that time...
-	if ( fHBACanAcceptClientRequests == false )
-		fHBACanAcceptClientRequests = true;
-	
-	// Verify that the device ID is not that of the initiator.
-	require ( ( targetID != fInitiatorIdentifier ), INVALID_PARAMETER_EXIT );
-	
-	// First check to see if this device already exists
-	require ( ( GetTargetForID ( targetID ) == NULL ), INVALID_PARAMETER_EXIT );
-	
-	// See if the controller has a device tree entry it wants us to hook this
-	// target upto (e.g. to get io-device-location keys).
-	entry = OSDynamicCast ( IORegistryEntry, properties->getObject ( kIOPropertyDeviceTreeEntryKey ) );
-	
-	// Create the IOSCSIParallelInterfaceDevice object
-	newDevice = IOSCSIParallelInterfaceDevice::CreateTarget (
-									targetID,
-									ReportHBASpecificDeviceDataSize ( ),
-									entry );
-	require_nonzero ( newDevice, DEVICE_CREATION_FAILED_EXIT );
-	
-	AddDeviceToTargetList ( newDevice );
-	
-	result = newDevice->attach ( this );
-	require ( result, ATTACH_FAILED_EXIT );
-	
-	result = newDevice->SetInitialTargetProperties ( properties );
-	require ( result, START_FAILED_EXIT );
-	
-	result = newDevice->start ( this );
-	require ( result, START_FAILED_EXIT );
-	
-	newDevice->release ( );
+	SCSIParallelTask *				task			= ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelDMACommand *		command			= task->fDMACommand;
+	IOBufferMemoryDescriptor *		bounce			= NULL;
+	SCSIParallelRegisteredBuffer *	registration	= NULL;
+	UInt64							offset			= 0;
+	UInt64							length			= 0;
+	UInt32							index			= 0;
+	IOInterruptState				lockState		= 0;
+	
+	// A task which transfers no data has no DMA command, and its buffer is
+	// never mapped.
+	require_nonzero_quiet ( command, Exit );
+	
+	// A task whose buffer is registered uses the buffer's mapping. A task
+	// sent again for the next piece of a split task already has it.
+	if ( ( command->fRegisteredBuffer == NULL ) && ( fRegisteredBufferCount != 0 ) )
+	{
+		
+		lockState = IOSimpleLockLockDisableInterrupt ( fRegisteredBufferLock );
+		
+		for ( index = 0; index < fRegisteredBufferCount; index++ )
+		{
+			
+			if ( fRegisteredBuffers[index]->fBuffer == buffer )
+			{
+				
+				registration = fRegisteredBuffers[index];
+				registration->fReferenceCount++;
+				break;
+				
+			}
+			
+		}
+		
+		IOSimpleLockUnlockEnableInterrupt ( fRegisteredBufferLock, lockState );
+		
+		if ( registration != NULL )
+		{
+			
+			command->fRegisteredBuffer = registration;
+			OSIncrementAtomic64 ( &fRegisteredBufferTasks );
+			
+		}
+		
+	}
 	
-	// The SCSI Device was successfully created.
-	result = true;
+	require_quiet ( ( command->fRegisteredBuffer == NULL ), SetBuffer );
+	require_nonzero_quiet ( fBounceBuffers, SetBuffer );
 	
-	return result;
+	offset = task->GetClientDataBufferOffset ( );
+	length = task->GetRequestedDataTransferCount ( );
 	
+	// A transfer too large for a bounce buffer is left to IODMACommand.
+	require_quiet ( ( length != 0 ), SetBuffer );
+	require_quiet ( ( length <= fBounceBufferSize ), SetBuffer );
 	
-START_FAILED_EXIT:
+	// A task which is sent again for the next piece of a split task keeps
+	// the bounce buffer it has. A piece is never larger than the one before
+	// it, so it fits.
+	bounce = task->fBounceBuffer;
+	if ( bounce == NULL )
+	{
+		
+		require_quiet ( IsBounceBufferNeeded ( buffer, offset, length ), SetBuffer );
+		
+		lockState = IOSimpleLockLockDisableInterrupt ( fBounceBufferLock );
+		if ( fBounceBufferFreeCount > 0 )
+		{
+			bounce = fBounceBuffers[--fBounceBufferFreeCount];
+		}
+		IOSimpleLockUnlockEnableInterrupt ( fBounceBufferLock, lockState );
+		
+		if ( bounce == NULL )
+		{
+			
+			// The pool is empty, IODMACommand will have to copy the data.
+			OSIncrementAtomic64 ( &fBounceBufferMisses );
+			goto SetBuffer;
+			
+		}
+		
+	}
 	
+	if ( task->GetDataTransferDirection ( ) == kSCSIDataTransfer_FromInitiatorToTarget )
+	{
+		
+		buffer->readBytes ( offset, bounce->getBytesNoCopy ( ), length );
+		OSAddAtomic64 ( length, &fBounceBufferBytesCopied );
+		
+	}
 	
-	// Detach the target device
-	newDevice->detach ( this );
+	OSIncrementAtomic64 ( &fBounceBufferHits );
 	
+	task->fBounceBuffer = bounce;
+	buffer = bounce;
 	
-ATTACH_FAILED_EXIT:	
 	
+SetBuffer:
 	
-	RemoveDeviceFromTargetList ( newDevice );
 	
-	// The device can now be destroyed.
-	newDevice->DestroyTarget ( );
+	return command->SetBuffer ( buffer );
 	
 	
-DEVICE_CREATION_FAILED_EXIT:
-INVALID_PARAMETER_EXIT:
+Exit:
 	
 	
-	return result;
+	return kIOReturnSuccess;
 	
 }
 
 
 //-----------------------------------------------------------------------------
-//	DestroyTargetForID - Destroys a target device for the ID specified.
-//																	[PROTECTED]
+//	AttachTaskDMACommand - 	Gives a task which transfers data a DMA command
+//							from the pool.							   [PUBLIC]
 //-----------------------------------------------------------------------------
 
-void
-IOSCSIParallelInterfaceController::DestroyTargetForID (
-									SCSITargetIdentifier		targetID )
+bool
+IOSCSIParallelInterfaceController::AttachTaskDMACommand (
+							SCSIParallelTaskIdentifier		parallelTask,
+							bool							blockForCommand )
 {
 	
-	IOSCSIParallelInterfaceDevice *		victimDevice = NULL;
+	SCSIParallelTask *	task = ( SCSIParallelTask * ) parallelTask;
 	
-	victimDevice = GetTargetForID ( targetID );
-	if ( victimDevice == NULL )
+	if ( task->fDMACommand == NULL )
 	{
 		
-		// There is no object for this target in the device list,
-		// so return without doing anything.
-		return;
+		task->fDMACommand = ( SCSIParallelDMACommand * ) fDMACommandPool->getCommand ( blockForCommand );
+		if ( task->fDMACommand == NULL )
+		{
+			OSIncrementAtomic64 ( &fDMACommandPoolEmpty );
+		}
 		
 	}
 	
-	// Remove the IOSCSIParallelInterfaceDevice from the device list.
-	RemoveDeviceFromTargetList ( victimDevice );
-	
-	// The device can now be destroyed.
-	victimDevice->DestroyTarget ( );
-	victimDevice->terminate ( );
+	return ( task->fDMACommand != NULL );
 	
 }
 
 
 //-----------------------------------------------------------------------------
-//	SetTargetProperty - Sets a property for the specified target.	[PROTECTED]
+//	CompleteTaskDMABuffer - Copies the data a task read into its bounce buffer
+//							out to the client's buffer.				   [PUBLIC]
 //-----------------------------------------------------------------------------
 
-bool
-IOSCSIParallelInterfaceController::SetTargetProperty (
-					SCSIDeviceIdentifier 				targetID,
-					const char * 						key,
-					OSObject *							value )
+void
+IOSCSIParallelInterfaceController::CompleteTaskDMABuffer (
+							SCSIParallelTaskIdentifier		parallelTask )
 {
 	
-	bool								result	= false;
-	IOSCSIParallelInterfaceDevice * 	device	= NULL;
+	SCSIParallelTask *		task	= ( SCSIParallelTask * ) parallelTask;
+	IOMemoryDescriptor *	buffer	= NULL;
+	UInt64					length	= 0;
 	
-	device = GetTargetForID ( targetID );
+	require_nonzero_quiet ( task->fBounceBuffer, Exit );
+	require_quiet ( ( task->GetDataTransferDirection ( ) == kSCSIDataTransfer_FromTargetToInitiator ), Exit );
 	
-	require_nonzero ( device, ErrorExit );
-	result = device->SetTargetProperty ( key, value );
+	buffer = task->GetClientDataBuffer ( );
+	require_nonzero ( buffer, Exit );
 	
+	// Only copy what the HBA actually transferred.
+	length = task->GetRealizedDataTransferCount ( );
+	if ( length > task->GetRequestedDataTransferCount ( ) )
+	{
+		length = task->GetRequestedDataTransferCount ( );
+	}
 	
-ErrorExit:
+	require_quiet ( ( length != 0 ), Exit );
 	
+	buffer->writeBytes ( task->GetClientDataBufferOffset ( ),
+						 task->fBounceBuffer->getBytesNoCopy ( ),
+						 length );
+	
+	OSAddAtomic64 ( length, &fBounceBufferBytesCopied );
+	
+	
+Exit:
 	
-	return result;
+	
+	return;
 	
 }
 
 
 //-----------------------------------------------------------------------------
-//	RemoveTargetProperty - Removes a property from the specified target.
-//																	[PROTECTED]
+//	UpdateBounceBufferStatistics - 	Publishes the bounce buffer pool
+//									statistics.						  [PRIVATE]
 //-----------------------------------------------------------------------------
 
 void
-IOSCSIParallelInterfaceController::RemoveTargetProperty (
-					SCSIDeviceIdentifier 				targetID,
-					const char * 						key )
+IOSCSIParallelInterfaceController::UpdateBounceBufferStatistics ( void )
 {
 	
-	IOSCSIParallelInterfaceDevice * 	device	= NULL;
+	OSDictionary *	dict	= NULL;
+	OSNumber *		number	= NULL;
+	UInt32			index	= 0;
 	
-	device = GetTargetForID ( targetID );
+	const struct
+	{
+		const char *	key;
+		UInt64			value;
+	} values[] =
+	{
+		{ kIOBounceBufferCountKey,			fBounceBufferCount },
+		{ kIOBounceBufferSizeKey,			fBounceBufferSize },
+		{ kIOBounceBufferHitsKey,			( UInt64 ) fBounceBufferHits },
+		{ kIOBounceBufferMissesKey,			( UInt64 ) fBounceBufferMisses },
+		{ kIOBounceBufferBytesCopiedKey,	( UInt64 ) fBounceBufferBytesCopied }
+	};
 	
-	require_nonzero ( device, ErrorExit );
-	device->RemoveTargetProperty ( key );
+	dict = OSDictionary::withCapacity ( sizeof ( values ) / sizeof ( values[0] ) );
+	require_nonzero ( dict, ErrorExit );
+	
+	for ( index = 0; index < sizeof ( values ) / sizeof ( values[0] ); index++ )
+	{
+		
+		number = OSNumber::withNumber ( values[index].value, 64 );
+		if ( number != NULL )
+		{
+			
+			dict->setObject ( values[index].key, number );
+			number->release ( );
+			
+		}
+		
+	}
+	
+	setProperty ( kIOBounceBufferStatisticsKey, dict );
+	dict->release ( );
+	dict = NULL;
 	
 	
 ErrorExit:
@@ -1858,339 +6326,403 @@ ErrorExit:
 
 #if 0
 #pragma mark -
-#pragma mark Device List Management
+#pragma mark Registered Buffers
 #pragma mark -
 #endif
 
-/*
- * The following member routines are used to manage the array of linked lists, the Device
- * List, that allow quick access to the SCSI Parallel Device objects.  These routines
- * have intricate knowledge about the layout of the Device List since they are responsible
- * for managing it and so they are the only ones that are allowed to directly access that 
- * structure.  Any other routine that needs to retrieve an element from the Device List 
- * must use these routines to obtain it so that if necessity causes to the Device List
- * structure to change, they are not broken.
- */
+
+//-----------------------------------------------------------------------------
+//	AllocateRegisteredBuffers - Allocates the table of registered buffers.
+//																	  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::AllocateRegisteredBuffers ( void )
+{
+	
+	fRegisteredBufferLock = IOSimpleLockAlloc ( );
+	require_nonzero ( fRegisteredBufferLock, ErrorExit );
+	
+	fRegisteredBuffers = IONew ( SCSIParallelRegisteredBuffer *, kMaxRegisteredBufferCount );
+	require_nonzero ( fRegisteredBuffers, ErrorExit );
+	
+	fRegisteredBufferCount = 0;
+	
+	return;
+	
+	
+ErrorExit:
+	
+	
+	// Buffers can't be registered, but the controller works without them.
+	if ( fRegisteredBufferLock != NULL )
+	{
+		
+		IOSimpleLockFree ( fRegisteredBufferLock );
+		fRegisteredBufferLock = NULL;
+		
+	}
+	
+	return;
+	
+}
 
 
 //-----------------------------------------------------------------------------
-//	InitializeDeviceList - Initializes device list.					  [PRIVATE]
+//	DeallocateRegisteredBuffers - 	Releases the buffers which are still
+//									registered and frees the table. All
+//									tasks must have been returned.	  [PRIVATE]
 //-----------------------------------------------------------------------------
 
 void
-IOSCSIParallelInterfaceController::InitializeDeviceList ( void )
+IOSCSIParallelInterfaceController::DeallocateRegisteredBuffers ( void )
 {
 	
-	// Initialize the SCSI Parallel Device Array to all NULL pointers
-	for ( UInt32 i = 0; i < kSCSIParallelDeviceListArrayCount; i++ )
+	require_nonzero_quiet ( fRegisteredBuffers, Exit );
+	
+	while ( fRegisteredBufferCount > 0 )
 	{
-		fParallelDeviceList[i] = NULL;
+		
+		fRegisteredBufferCount--;
+		ReleaseRegisteredBuffer ( fRegisteredBuffers[fRegisteredBufferCount] );
+		fRegisteredBuffers[fRegisteredBufferCount] = NULL;
+		
 	}
 	
-}		
+	IODelete ( fRegisteredBuffers, SCSIParallelRegisteredBuffer *, kMaxRegisteredBufferCount );
+	fRegisteredBuffers = NULL;
+	
+	IOSimpleLockFree ( fRegisteredBufferLock );
+	fRegisteredBufferLock = NULL;
+	
+	
+Exit:
+	
+	
+	return;
+	
+}
 
 
 //-----------------------------------------------------------------------------
-//	GetTargetForID - Gets the device object for the specified targetID.
-//																	[PROTECTED]
+//	RegisterDataBuffer - 	Registers a client's data buffer. The buffer is
+//							prepared and its segments are generated once
+//							for all of the tasks which use it.		   [PUBLIC]
 //-----------------------------------------------------------------------------
 
-IOSCSIParallelInterfaceDevice *
-IOSCSIParallelInterfaceController::GetTargetForID ( SCSITargetIdentifier targetID )
+IOReturn
+IOSCSIParallelInterfaceController::RegisterDataBuffer (
+							IOMemoryDescriptor *			buffer )
 {
 	
-	IOSCSIParallelInterfaceDevice *		device		= NULL;
-	IOInterruptState					lockState	= 0;
-	UInt8								indexID		= 0;
+	SCSIParallelRegisteredBuffer *	registration	= NULL;
+	SCSIParallelDMACommand *		command			= NULL;
+	IODMACommand::Segment64			segment;
+	IOReturn						status			= kIOReturnBadArgument;
+	IOInterruptState				lockState		= 0;
+	UInt64							length			= 0;
+	UInt64							offset			= 0;
+	UInt64							segmentOffset	= 0;
+	UInt64							minimumSegment	= 0;
+	UInt32							count			= 0;
+	UInt32							index			= 0;
+	bool							prepared		= false;
+	bool							matched			= false;
+	
+	require_nonzero ( buffer, ErrorExit );
+	
+	length = buffer->getLength ( );
+	require ( ( length != 0 ), ErrorExit );
+	
+	status = kIOReturnNoResources;
+	require_nonzero ( fRegisteredBuffers, ErrorExit );
+	
+	// The segments are generated with the DMA specification of the default
+	// InitializeDMASpecification. Tasks are set up with InitializeDMASpecification,
+	// so the HBA must not have changed how it shapes their segments.
+	status = kIOReturnNoMemory;
+	command = SCSIParallelDMACommand::Create ( );
+	require_nonzero ( command, ErrorExit );
+	
+	if ( InitializeDMASpecification ( command ) == true )
+	{
+		
+		matched = command->HasSegmentSpecification ( fDMAAddressBits,
+													 fDMAMaximumSegmentSize,
+													 fDMAAlignment );
+		
+	}
 	
-	require ( ( targetID >= 0 ), INVALID_PARAMETER_FAILURE );
-	require ( ( targetID <= fHighestSupportedDeviceID ), INVALID_PARAMETER_FAILURE );
-	require ( ( targetID != fInitiatorIdentifier ), INVALID_PARAMETER_FAILURE );
+	command->release ( );
+	command = NULL;
 	
-	lockState = IOSimpleLockLockDisableInterrupt ( fDeviceLock );
+	status = kIOReturnUnsupported;
+	require ( matched, ErrorExit );
 	
-	// Hash the index.
-	indexID = targetID & kSCSIParallelDeviceListIndexMask;
+	// The buffer stays wired for as long as it is registered.
+	status = buffer->prepare ( );
+	require_success ( status, ErrorExit );
+	prepared = true;
+	
+	// IODMACommand would have to copy a buffer the HBA can't reach on
+	// every task, so there would be nothing to gain by registering it.
+	status = kIOReturnNotPermitted;
+	require ( ( IsBounceBufferNeeded ( buffer, 0, length ) == false ), ErrorExit );
+	
+	status = kIOReturnNoMemory;
+	registration = ( SCSIParallelRegisteredBuffer * ) IOMalloc ( sizeof ( SCSIParallelRegisteredBuffer ) );
+	require_nonzero ( registration, ErrorExit );
+	bzero ( registration, sizeof ( SCSIParallelRegisteredBuffer ) );
+	
+	registration->fBuffer			= buffer;
+	registration->fReferenceCount	= 1;
+	
+	// Only the first and the last segment can be smaller than a page,
+	// unless the HBA's segments are.
+	minimumSegment = ( fDMAMaximumSegmentSize < PAGE_SIZE ) ? fDMAMaximumSegmentSize : PAGE_SIZE;
+	registration->fSegmentCapacity = ( length / minimumSegment ) + 2;
+	
+	registration->fSegments = IONew ( SCSIParallelRegisteredSegment, registration->fSegmentCapacity );
+	require_nonzero ( registration->fSegments, ErrorExit );
+	
+	// The buffer is mapped with the DMA specification of the tasks, less
+	// the maximum transfer. A task only ever uses part of it.
+	registration->fCommand = IODMACommand::withSpecification (
+		kIODMACommandOutputHost64,
+		fDMAAddressBits,
+		fDMAMaximumSegmentSize,
+		IODMACommand::kMapped,
+		0,
+		fDMAAlignment );
+	require_nonzero ( registration->fCommand, ErrorExit );
+	
+	status = registration->fCommand->setMemoryDescriptor ( buffer, true );
+	require_success ( status, ErrorExit );
+	
+	while ( offset < length )
+	{
+		
+		status = kIOReturnInternalError;
+		require ( ( registration->fSegmentCount < registration->fSegmentCapacity ), ErrorExit );
+		
+		segmentOffset	= offset;
+		count			= 1;
+		
+		status = registration->fCommand->gen64IOVMSegments ( &offset, &segment, &count );
+		require_success ( status, ErrorExit );
+		
+		status = kIOReturnInternalError;
+		require ( ( count == 1 ), ErrorExit );
+		
+		registration->fSegments[registration->fSegmentCount].fOffset	= segmentOffset;
+		registration->fSegments[registration->fSegmentCount].fAddress	= segment.fIOVMAddr;
+		registration->fSegments[registration->fSegmentCount].fLength	= segment.fLength;
+		registration->fSegmentCount++;
+		
+	}
 	
-	// Walk the list for the indexID
-	device = fParallelDeviceList[indexID];
+	lockState = IOSimpleLockLockDisableInterrupt ( fRegisteredBufferLock );
 	
-	while ( device != NULL )
+	status = kIOReturnSuccess;
+	for ( index = 0; index < fRegisteredBufferCount; index++ )
 	{
 		
-		if ( device->GetTargetIdentifier ( ) == targetID )
+		if ( fRegisteredBuffers[index]->fBuffer == buffer )
 		{
 			
-			// This is the device in which the client is interested, break
-			// so that the current pointer will be returned.
+			status = kIOReturnExclusiveAccess;
 			break;
 			
 		}
 		
-		// Get the next element in the list
-		device = device->GetNextDeviceInList ( );
-		
 	}
 	
-	IOSimpleLockUnlockEnableInterrupt ( fDeviceLock, lockState );
-	
-	
-INVALID_PARAMETER_FAILURE:
-	
+	if ( ( status == kIOReturnSuccess ) && ( fRegisteredBufferCount == kMaxRegisteredBufferCount ) )
+	{
+		status = kIOReturnNoResources;
+	}
 	
-	return device;
+	if ( status == kIOReturnSuccess )
+	{
+		
+		buffer->retain ( );
+		fRegisteredBuffers[fRegisteredBufferCount++] = registration;
+		
+	}
 	
-}
-
-
-//-----------------------------------------------------------------------------
-//	AddDeviceToTargetList - Adds a device to the target list.		  [PRIVATE]
-//-----------------------------------------------------------------------------
-
-void
-IOSCSIParallelInterfaceController::AddDeviceToTargetList (
-							IOSCSIParallelInterfaceDevice *				newDevice )
-{
+	IOSimpleLockUnlockEnableInterrupt ( fRegisteredBufferLock, lockState );
 	
-	UInt8					indexID		= 0;
-	IOInterruptState		lockState	= 0;
+	require_success ( status, ErrorExit );
 	
-	STATUS_LOG ( ( "+IOSCSIParallelInterfaceController::AddDeviceToTargetList\n" ) );
+	return kIOReturnSuccess;
 	
-	lockState = IOSimpleLockLockDisableInterrupt ( fDeviceLock );
 	
-	// Hash the index.
-	indexID = newDevice->GetTargetIdentifier ( ) & kSCSIParallelDeviceListIndexMask;
+ErrorExit:
 	
-	// Set the pointer in the SCSI Device array
-	if ( fParallelDeviceList[indexID] == NULL )
-	{
-		
-		// This is the first device object created for this
-		// index, set the array pointer to the new object. 
-		fParallelDeviceList[indexID] = newDevice;
-		newDevice->SetNextDeviceInList ( NULL );
-		newDevice->SetPreviousDeviceInList ( NULL );
-		
-	}
 	
-	else
+	if ( registration != NULL )
 	{
 		
-		// This is not the first device object for this index, 
-		// walk the list at this index and add it to the end.
-		IOSCSIParallelInterfaceDevice *	currentDevice;
+		if ( registration->fCommand != NULL )
+		{
+			
+			registration->fCommand->clearMemoryDescriptor ( true );
+			registration->fCommand->release ( );
+			
+		}
 		
-		currentDevice = fParallelDeviceList[indexID];
-		while ( currentDevice->GetNextDeviceInList ( ) != NULL )
+		if ( registration->fSegments != NULL )
 		{
-			currentDevice = currentDevice->GetNextDeviceInList ( );
+			IODelete ( registration->fSegments, SCSIParallelRegisteredSegment, registration->fSegmentCapacity );
 		}
 		
-		currentDevice->SetNextDeviceInList ( newDevice );
-		newDevice->SetNextDeviceInList ( NULL );
-		newDevice->SetPreviousDeviceInList ( currentDevice );
+		IOFree ( registration, sizeof ( SCSIParallelRegisteredBuffer ) );
+		registration = NULL;
 		
 	}
 	
-	IOSimpleLockUnlockEnableInterrupt ( fDeviceLock, lockState );
+	if ( prepared == true )
+	{
+		buffer->complete ( );
+	}
 	
-	STATUS_LOG ( ( "-IOSCSIParallelInterfaceController::AddDeviceToTargetList\n" ) );
+	return status;
 	
 }
 
 
 //-----------------------------------------------------------------------------
-//	RemoveDeviceFromTargetList - Removes a device from the target list.
-//																	  [PRIVATE]
+//	UnregisterDataBuffer - 	Unregisters a client's data buffer. It is
+//							freed once no task is using it.			   [PUBLIC]
 //-----------------------------------------------------------------------------
 
-void
-IOSCSIParallelInterfaceController::RemoveDeviceFromTargetList (
-							IOSCSIParallelInterfaceDevice * 	victimDevice )
+IOReturn
+IOSCSIParallelInterfaceController::UnregisterDataBuffer (
+							IOMemoryDescriptor *			buffer )
 {
 	
-	IOSCSIParallelInterfaceDevice *		nextDevice	= NULL;
-	IOSCSIParallelInterfaceDevice *		prevDevice	= NULL;
-	IOInterruptState					lockState	= 0;
+	SCSIParallelRegisteredBuffer *	registration	= NULL;
+	IOInterruptState				lockState		= 0;
+	UInt32							index			= 0;
 	
-	lockState = IOSimpleLockLockDisableInterrupt ( fDeviceLock );
+	require_nonzero_quiet ( fRegisteredBuffers, ErrorExit );
 	
-	nextDevice = victimDevice->GetNextDeviceInList ( );
-	prevDevice = victimDevice->GetPreviousDeviceInList ( );
+	lockState = IOSimpleLockLockDisableInterrupt ( fRegisteredBufferLock );
 	
-	if ( prevDevice != NULL )
+	for ( index = 0; index < fRegisteredBufferCount; index++ )
 	{
 		
-		// There is a previous device, set it to the victim's next device
-		prevDevice->SetNextDeviceInList ( nextDevice );
+		if ( fRegisteredBuffers[index]->fBuffer == buffer )
+		{
+			
+			registration = fRegisteredBuffers[index];
+			fRegisteredBuffers[index] = fRegisteredBuffers[--fRegisteredBufferCount];
+			fRegisteredBuffers[fRegisteredBufferCount] = NULL;
+			break;
+			
+		}
 		
 	}
 	
-	else
-	{
-		
-		// There is not a previous device, set the pointer in the array
-		// to the victim's next device.
-		UInt8	indexID = 0;
-		
-		// Hash the index.
-		indexID = victimDevice->GetTargetIdentifier ( ) & kSCSIParallelDeviceListIndexMask;
-		
-		// Set the Device List element to point at the device object that was following
-		// the device object that is being removed.  If there was no next device, 
-		// the nextDevice pointer will be NULL causing the Device List no longer have
-		// any devices at this index.
-		fParallelDeviceList[indexID] = nextDevice;
-		
-	}
+	IOSimpleLockUnlockEnableInterrupt ( fRegisteredBufferLock, lockState );
 	
-	if ( nextDevice != NULL )
-	{
-		
-		// The next device is not NULL, set it to the victim's previous
-		nextDevice->SetPreviousDeviceInList ( prevDevice );
-		
-	}
+	require_nonzero_quiet ( registration, ErrorExit );
 	
-	// Clear out the victim's previous and next pointers
-	victimDevice->SetNextDeviceInList ( NULL );
-	victimDevice->SetPreviousDeviceInList ( NULL );
+	ReleaseRegisteredBuffer ( registration );
 	
-	IOSimpleLockUnlockEnableInterrupt ( fDeviceLock, lockState );
+	return kIOReturnSuccess;
+	
+	
+ErrorExit:
+	
+	
+	return kIOReturnNotFound;
 	
-}
-
-
-#if 0
-#pragma mark -
-#pragma mark Controller Child Class 
-#pragma mark -
-#endif
-
-
-//-----------------------------------------------------------------------------
-//	DoesHBAPerformAutoSense - Default implementation.				   [PUBLIC]
-//-----------------------------------------------------------------------------
-
-bool 
-IOSCSIParallelInterfaceController::DoesHBAPerformAutoSense ( void )
-{
-	return false;
 }
 
 
 //-----------------------------------------------------------------------------
-//	DoesHBASupportMultiPathing - Default implementation.			   [PUBLIC]
+//	ReleaseRegisteredBuffer - 	Drops a reference on a registered buffer,
+//								freeing it with the last one.		  [PRIVATE]
 //-----------------------------------------------------------------------------
 
-bool 
-IOSCSIParallelInterfaceController::DoesHBASupportMultiPathing ( void )
+void
+IOSCSIParallelInterfaceController::ReleaseRegisteredBuffer (
+							SCSIParallelRegisteredBuffer *	registration )
 {
-
-	OSString *		interface	= NULL;
-	OSDictionary *	dict		= NULL;
-	bool			result		= true;
-
 	
-	// Get Protocol Characteristics.
-	dict = OSDynamicCast ( OSDictionary, getProperty ( kIOPropertyProtocolCharacteristicsKey ) );
+	IOInterruptState	lockState	= 0;
+	bool				last		= false;
 	
-	if ( dict != NULL )
-	{
+	lockState = IOSimpleLockLockDisableInterrupt ( fRegisteredBufferLock );
+	registration->fReferenceCount--;
+	last = ( registration->fReferenceCount == 0 );
+	IOSimpleLockUnlockEnableInterrupt ( fRegisteredBufferLock, lockState );
 	
-		interface = OSDynamicCast ( OSString, dict->getObject ( kIOPropertyPhysicalInterconnectTypeKey ) );
-		
-		if ( interface != NULL )
-		{
-		
-			if ( ( interface->isEqualTo ( kIOPropertyPhysicalInterconnectTypeSCSIParallel ) ) ||
-				( interface->isEqualTo ( kIOPropertyPhysicalInterconnectTypeSerialAttachedSCSI ) ) )
-			{
+	require_quiet ( last, Exit );
 	
-				// No Multipathing for parallel SCSI and SAS by default. 
-				result = false;
+	registration->fCommand->clearMemoryDescriptor ( true );
+	registration->fCommand->release ( );
+	registration->fCommand = NULL;
 	
-			}
+	registration->fBuffer->complete ( );
+	registration->fBuffer->release ( );
+	registration->fBuffer = NULL;
 	
-		}
-		
-	}
+	IODelete ( registration->fSegments, SCSIParallelRegisteredSegment, registration->fSegmentCapacity );
+	IOFree ( registration, sizeof ( SCSIParallelRegisteredBuffer ) );
+	
+	
+Exit:
+	
+	
+	return;
 	
-	return result;
 }
 
 
 //-----------------------------------------------------------------------------
-//	ReportHBAConstraints - Default implementation.				 	   [PUBLIC]
+//	UpdateRegisteredBufferStatistics - 	Publishes the registered buffer
+//										statistics.					  [PRIVATE]
 //-----------------------------------------------------------------------------
 
 void
-IOSCSIParallelInterfaceController::ReportHBAConstraints (
-	OSDictionary *		constraints )
+IOSCSIParallelInterfaceController::UpdateRegisteredBufferStatistics ( void )
 {
 	
-	UInt64			value	= 0;
+	OSDictionary *	dict	= NULL;
 	OSNumber *		number	= NULL;
 	
-	// Default alignment is 16-byte aligned, 32-bit memory only.
-	value = 0x00000000FFFFFFF0ULL;
+	dict = OSDictionary::withCapacity ( 2 );
+	require_nonzero ( dict, ErrorExit );
 	
-	number = OSNumber::withNumber ( value, 64 );
+	number = OSNumber::withNumber ( fRegisteredBufferCount, 32 );
 	if ( number != NULL )
 	{
 		
-		constraints->setObject ( kIOMinimumHBADataAlignmentMaskKey, number );
+		dict->setObject ( kIORegisteredBufferCountKey, number );
 		number->release ( );
 		
 	}
 	
-	// 32-bit addressing by default.
-	value = 32;
-	number = OSNumber::withNumber ( value, 64 );
+	number = OSNumber::withNumber ( ( UInt64 ) fRegisteredBufferTasks, 64 );
 	if ( number != NULL )
 	{
 		
-		constraints->setObject ( kIOMaximumSegmentAddressableBitCountKey, number );
+		dict->setObject ( kIORegisteredBufferTasksKey, number );
 		number->release ( );
 		
 	}
 	
-	// 4-byte alignment by default.
-	value = 4;
-	number = OSNumber::withNumber ( value, 64 );
-	if ( number != NULL )
-	{
-		
-		constraints->setObject ( kIOMinimumSegmentAlignmentByteCountKey, number );
-		number->release ( );
-		
-	}
+	setProperty ( kIORegisteredBufferStatisticsKey, dict );
+	dict->release ( );
+	dict = NULL;
 	
-}
-
-
-//-----------------------------------------------------------------------------
-//	InitializeDMASpecification - Default implementation.		 	[PROTECTED]
-//-----------------------------------------------------------------------------
-
-bool
-IOSCSIParallelInterfaceController::InitializeDMASpecification (
-	IODMACommand * command )
-{
 	
-	bool	result = false;
+ErrorExit:
 	
-	result = command->initWithSpecification (
-		kIODMACommandOutputHost32,
-		32,			// addressBits
-		4096,		// PAGE_SIZE
-		IODMACommand::kMapped,
-		1048576,	// 1MB I/O
-		4			// 4-byte aligned segments
-		);
 	
-	return result;
+	return;
 	
 }
 
@@ -2222,6 +6754,27 @@ IOSCSIParallelInterfaceController::CreateDeviceInterrupt (
 }
 
 
+//-----------------------------------------------------------------------------
+//	ProcessParallelTasks - Default implementation.				 	[PROTECTED]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceController::ProcessParallelTasks (
+							SCSIParallelTaskIdentifier	parallelRequests[],
+							SCSIServiceResponse			serviceResponses[],
+							UInt32						count )
+{
+	
+	UInt32	index = 0;
+	
+	for ( index = 0; index < count; index++ )
+	{
+		serviceResponses[index] = ProcessParallelTask ( parallelRequests[index] );
+	}
+	
+}
+
+
 //-----------------------------------------------------------------------------
 //	SuspendServices - Suspends services temporarily.				[PROTECTED]
 //-----------------------------------------------------------------------------
@@ -2244,8 +6797,14 @@ void
 IOSCSIParallelInterfaceController::ResumeServices ( void )
 {
 	
-	// The HBA child class has allowed the submission of tasks.
+	fWorkLoop->closeGate ( );
+	
+	// The HBA child class has allowed the submission of tasks. Send the
+	// ones which were held in the meantime first.
 	fHBACanAcceptClientRequests = true;
+	SendHeldParallelTasks ( );
+	
+	fWorkLoop->openGate ( );
 	
 }
 
@@ -2271,18 +6830,16 @@ IOSCSIParallelInterfaceController::NotifyClientsOfPortStatusChange (
 												SCSIPortStatus newStatus )
 {
 	
-	OSDictionary *	hbaDict		= NULL;
-	OSDictionary *	copyDict	= NULL;
 	OSString *		string 		= NULL;
 	char *			linkStatus	= NULL;
+	bool			result		= false;
 	
-	copyDict = OSDynamicCast ( OSDictionary, copyProperty ( kIOPropertyControllerCharacteristicsKey ) );
-	require_nonzero ( copyDict, ErrorExit );
-	
-	hbaDict = ( OSDictionary * ) copyDict->copyCollection ( );
-	copyDict->release ( );
+	// Hold the gate so the status joins any property transaction the HBA
+	// has open.
+	fWorkLoop->closeGate ( );
 	
-	require_nonzero ( hbaDict, ErrorExit );
+	result = BeginHBAPropertyTransaction ( );
+	require ( result, ErrorExit );
 	
 	switch ( newStatus )
 	{
@@ -2308,20 +6865,20 @@ IOSCSIParallelInterfaceController::NotifyClientsOfPortStatusChange (
 	if ( string != NULL )
 	{
 		
-		hbaDict->setObject ( kIOPropertyPortStatusKey, string );
+		fHBAPropertyTransaction->setObject ( kIOPropertyPortStatusKey, string );
 		string->release ( );
 		string = NULL;
 		
 	}
 	
-	setProperty ( kIOPropertyControllerCharacteristicsKey, hbaDict );
-	hbaDict->release ( );
-	hbaDict = NULL;
+	CommitHBAPropertyTransaction ( );
 	
 	
 ErrorExit:
 	
 	
+	fWorkLoop->openGate ( );
+	
 	messageClients ( kSCSIPort_NotificationStatusChange, ( void * ) newStatus );
 	
 }
@@ -2343,7 +6900,7 @@ IOSCSIParallelInterfaceController::GetSCSITaskIdentifier (
 							SCSIParallelTaskIdentifier 	parallelTask )
 {
 	
-	SCSIParallelTask *	tempTask = ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelTask *	tempTask = SCSIParallelTask::FromIdentifier ( parallelTask );
 	
 	if ( tempTask == NULL )
 	{
@@ -2364,7 +6921,7 @@ IOSCSIParallelInterfaceController::GetTargetIdentifier (
 							SCSIParallelTaskIdentifier 	parallelTask )
 {
 	
-	SCSIParallelTask *	tempTask = ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelTask *	tempTask = SCSIParallelTask::FromIdentifier ( parallelTask );
 	
 	if ( tempTask == NULL )
 	{
@@ -2384,7 +6941,7 @@ static IOSCSIParallelInterfaceDevice *
 GetDevice (	SCSIParallelTaskIdentifier 	parallelTask )
 {
 	
-	SCSIParallelTask *	tempTask = ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelTask *	tempTask = SCSIParallelTask::FromIdentifier ( parallelTask );
 	
 	if ( tempTask == NULL )
 	{
@@ -2396,6 +6953,30 @@ GetDevice (	SCSIParallelTaskIdentifier 	parallelTask )
 }
 
 
+//-----------------------------------------------------------------------------
+//	IsTargetActive - Determines if a target is using or waiting for tasks.
+//																	   [STATIC]
+//-----------------------------------------------------------------------------
+
+static inline bool
+IsTargetActive ( SCSIParallelTaskAdmission * admission )
+{
+	return ( ( admission->fOutstanding != 0 ) || IsTargetContending ( admission ) );
+}
+
+
+//-----------------------------------------------------------------------------
+//	IsTargetContending - Determines if a target is waiting for tasks or was
+//						 turned away.								   [STATIC]
+//-----------------------------------------------------------------------------
+
+static inline bool
+IsTargetContending ( SCSIParallelTaskAdmission * admission )
+{
+	return ( ( admission->fWaiters != 0 ) || ( admission->fDeferred == true ) );
+}
+
+
 //-----------------------------------------------------------------------------
 //	CopyProtocolCharacteristicsProperties - Copies properties from object
 //											to dictionary.			   [STATIC]
@@ -2515,7 +7096,7 @@ IOSCSIParallelInterfaceController::GetLogicalUnitNumber (
 							SCSIParallelTaskIdentifier 		parallelTask )
 {
 	
-	SCSIParallelTask *	tempTask = ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelTask *	tempTask = SCSIParallelTask::FromIdentifier ( parallelTask );
 	
 	if ( tempTask == NULL )
 	{
@@ -2536,7 +7117,7 @@ IOSCSIParallelInterfaceController::GetLogicalUnitBytes (
 							SCSILogicalUnitBytes *          logicalUnitBytes )
 {
 
-	SCSIParallelTask *  tempTask = ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelTask *  tempTask = SCSIParallelTask::FromIdentifier ( parallelTask );
    
 	if ( tempTask == NULL )
 	{
@@ -2559,7 +7140,7 @@ IOSCSIParallelInterfaceController::GetTaggedTaskIdentifier (
 							SCSIParallelTaskIdentifier		parallelTask )
 {
 	
-	SCSIParallelTask *	tempTask = ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelTask *	tempTask = SCSIParallelTask::FromIdentifier ( parallelTask );
 	
 	if ( tempTask == NULL )
 	{
@@ -2580,7 +7161,7 @@ IOSCSIParallelInterfaceController::GetTaskAttribute (
 							SCSIParallelTaskIdentifier 		parallelTask )
 {
 	
-	SCSIParallelTask *	tempTask = ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelTask *	tempTask = SCSIParallelTask::FromIdentifier ( parallelTask );
 	
 	if ( tempTask == NULL )
 	{
@@ -2601,7 +7182,7 @@ IOSCSIParallelInterfaceController::GetCommandDescriptorBlockSize (
 							SCSIParallelTaskIdentifier 		parallelTask )
 {
 	
-	SCSIParallelTask *	tempTask = ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelTask *	tempTask = SCSIParallelTask::FromIdentifier ( parallelTask );
 	
 	if ( tempTask == NULL )
 	{
@@ -2624,7 +7205,7 @@ IOSCSIParallelInterfaceController::GetCommandDescriptorBlock (
 							SCSICommandDescriptorBlock * 	cdbData )
 {
 	
-	SCSIParallelTask *	tempTask = ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelTask *	tempTask = SCSIParallelTask::FromIdentifier ( parallelTask );
 	
 	if ( tempTask == NULL )
 	{
@@ -2645,7 +7226,7 @@ IOSCSIParallelInterfaceController::GetDataTransferDirection (
 							SCSIParallelTaskIdentifier 		parallelTask )
 {
 	
-	SCSIParallelTask *	tempTask = ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelTask *	tempTask = SCSIParallelTask::FromIdentifier ( parallelTask );
 	
 	if ( tempTask == NULL )
 	{
@@ -2666,7 +7247,7 @@ IOSCSIParallelInterfaceController::GetRequestedDataTransferCount (
 							SCSIParallelTaskIdentifier 		parallelTask )
 {
 	
-	SCSIParallelTask *	tempTask = ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelTask *	tempTask = SCSIParallelTask::FromIdentifier ( parallelTask );
 	
 	if ( tempTask == NULL )
 	{
@@ -2687,7 +7268,7 @@ IOSCSIParallelInterfaceController::GetRealizedDataTransferCount (
 							SCSIParallelTaskIdentifier 		parallelTask )
 {
 	
-	SCSIParallelTask *	tempTask = ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelTask *	tempTask = SCSIParallelTask::FromIdentifier ( parallelTask );
 	
 	if ( tempTask == NULL )
 	{
@@ -2709,7 +7290,7 @@ IOSCSIParallelInterfaceController::SetRealizedDataTransferCount (
 				UInt64 							realizedTransferCountInBytes )
 {
 	
-	SCSIParallelTask *	tempTask = ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelTask *	tempTask = SCSIParallelTask::FromIdentifier ( parallelTask );
 	
 	if ( tempTask == NULL )
 	{
@@ -2732,7 +7313,7 @@ IOSCSIParallelInterfaceController::IncrementRealizedDataTransferCount (
 				UInt64 							realizedTransferCountInBytes )
 {
 	
-	SCSIParallelTask *	tempTask = ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelTask *	tempTask = SCSIParallelTask::FromIdentifier ( parallelTask );
 	
 	if ( tempTask == NULL )
 	{
@@ -2753,7 +7334,7 @@ IOSCSIParallelInterfaceController::GetDataBuffer (
 							SCSIParallelTaskIdentifier 		parallelTask )
 {
 	
-	SCSIParallelTask *	tempTask = ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelTask *	tempTask = SCSIParallelTask::FromIdentifier ( parallelTask );
 	
 	if ( tempTask == NULL )
 	{
@@ -2775,7 +7356,7 @@ IOSCSIParallelInterfaceController::GetDataBufferOffset (
 							SCSIParallelTaskIdentifier 		parallelTask )
 {
 	
-	SCSIParallelTask *	tempTask = ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelTask *	tempTask = SCSIParallelTask::FromIdentifier ( parallelTask );
 	
 	if ( tempTask == NULL )
 	{
@@ -2795,7 +7376,18 @@ IODMACommand *
 IOSCSIParallelInterfaceController::GetDMACommand ( 
 							SCSIParallelTaskIdentifier 		parallelTask )
 {
-	return ( IODMACommand * ) parallelTask;
+	
+	SCSIParallelDMACommand *	command = SCSIParallelTask::FromIdentifier ( parallelTask )->fDMACommand;
+	
+	// A task from a pooled HBA which transfers no data has no command of
+	// its own.
+	if ( command == NULL )
+	{
+		command = fNullDMACommand;
+	}
+	
+	return command;
+	
 }
 
 
@@ -2809,7 +7401,7 @@ IOSCSIParallelInterfaceController::GetTimeoutDuration (
 							SCSIParallelTaskIdentifier 		parallelTask )
 {
 	
-	SCSIParallelTask *	tempTask = ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelTask *	tempTask = SCSIParallelTask::FromIdentifier ( parallelTask );
 	
 	if ( tempTask == NULL )
 	{
@@ -2832,7 +7424,7 @@ IOSCSIParallelInterfaceController::SetAutoSenseData (
 							UInt8							senseDataSize )
 {
 	
-	SCSIParallelTask *	tempTask = ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelTask *	tempTask = SCSIParallelTask::FromIdentifier ( parallelTask );
 	
 	if ( tempTask == NULL )
 	{
@@ -2855,7 +7447,7 @@ IOSCSIParallelInterfaceController::GetAutoSenseData (
  							UInt8							senseDataSize )
 {
 	
-	SCSIParallelTask *	tempTask = ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelTask *	tempTask = SCSIParallelTask::FromIdentifier ( parallelTask );
 	
 	if ( tempTask == NULL )
 	{
@@ -2876,7 +7468,7 @@ IOSCSIParallelInterfaceController::GetAutoSenseDataSize (
  							SCSIParallelTaskIdentifier 		parallelTask )
 {
 	
-	SCSIParallelTask *	tempTask = ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelTask *	tempTask = SCSIParallelTask::FromIdentifier ( parallelTask );
 	
 	if ( tempTask == NULL )
 	{
@@ -2899,7 +7491,7 @@ IOSCSIParallelInterfaceController::GetSCSIParallelFeatureNegotiation (
 							SCSIParallelFeature 			requestedFeature )
 {
 	
-	SCSIParallelTask *	tempTask = ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelTask *	tempTask = SCSIParallelTask::FromIdentifier ( parallelTask );
 	
 	if ( tempTask == NULL )
 	{
@@ -2921,7 +7513,7 @@ IOSCSIParallelInterfaceController::GetSCSIParallelFeatureNegotiationCount (
 							SCSIParallelTaskIdentifier 		parallelTask)
 {
 	
-	SCSIParallelTask *	tempTask = ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelTask *	tempTask = SCSIParallelTask::FromIdentifier ( parallelTask );
 	
 	if ( tempTask == NULL )
 	{
@@ -2946,7 +7538,7 @@ IOSCSIParallelInterfaceController::SetSCSIParallelFeatureNegotiationResult (
 							SCSIParallelFeatureResult 		newResult )
 {
 	
-	SCSIParallelTask *	tempTask = ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelTask *	tempTask = SCSIParallelTask::FromIdentifier ( parallelTask );
 	
 	if ( tempTask == NULL )
 	{
@@ -2970,7 +7562,7 @@ IOSCSIParallelInterfaceController::GetSCSIParallelFeatureNegotiationResult (
 							SCSIParallelFeature 		requestedFeature )
 {
 	
-	SCSIParallelTask *	tempTask = ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelTask *	tempTask = SCSIParallelTask::FromIdentifier ( parallelTask );
 	
 	if ( tempTask == NULL )
 	{
@@ -2992,7 +7584,7 @@ IOSCSIParallelInterfaceController::GetSCSIParallelFeatureNegotiationResultCount
 							SCSIParallelTaskIdentifier 		parallelTask )
 {
 	
-	SCSIParallelTask *	tempTask = ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelTask *	tempTask = SCSIParallelTask::FromIdentifier ( parallelTask );
 	
 	if ( tempTask == NULL )
 	{
@@ -3015,7 +7607,7 @@ IOSCSIParallelInterfaceController::SetControllerTaskIdentifier (
 							UInt64 							newIdentifier )
 {
 	
-	SCSIParallelTask *	tempTask = ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelTask *	tempTask = SCSIParallelTask::FromIdentifier ( parallelTask );
 	
 	if ( tempTask == NULL )
 	{
@@ -3037,7 +7629,7 @@ IOSCSIParallelInterfaceController::GetControllerTaskIdentifier (
 							SCSIParallelTaskIdentifier 		parallelTask )
 {
 	
-	SCSIParallelTask *	tempTask = ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelTask *	tempTask = SCSIParallelTask::FromIdentifier ( parallelTask );
 	
 	if ( tempTask == NULL )
 	{
@@ -3058,7 +7650,7 @@ IOSCSIParallelInterfaceController::GetHBADataSize (
 							SCSIParallelTaskIdentifier 	parallelTask )
 {
 	
-	SCSIParallelTask *	tempTask = ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelTask *	tempTask = SCSIParallelTask::FromIdentifier ( parallelTask );
 	
 	if ( tempTask == NULL )
 	{
@@ -3079,7 +7671,7 @@ IOSCSIParallelInterfaceController::GetHBADataPointer (
 							SCSIParallelTaskIdentifier 	parallelTask )
 {
 	
-	SCSIParallelTask *	tempTask = ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelTask *	tempTask = SCSIParallelTask::FromIdentifier ( parallelTask );
 	
 	if ( tempTask == NULL )
 	{
@@ -3100,7 +7692,7 @@ IOSCSIParallelInterfaceController::GetHBADataDescriptor (
 							SCSIParallelTaskIdentifier 	parallelTask )
 {
 	
-	SCSIParallelTask *	tempTask = ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelTask *	tempTask = SCSIParallelTask::FromIdentifier ( parallelTask );
 	
 	if ( tempTask == NULL )
 	{
@@ -3175,7 +7767,7 @@ OSMetaClassDefineReservedUsed ( IOSCSIParallelInterfaceController,  1 );		// Use
 OSMetaClassDefineReservedUsed ( IOSCSIParallelInterfaceController,  2 );		// Used for ReportHBAConstraints
 
 OSMetaClassDefineReservedUsed ( IOSCSIParallelInterfaceController,  3 );		// Used for DoesHBASupportMultiPathing
-OSMetaClassDefineReservedUnused ( IOSCSIParallelInterfaceController,  4 );
+OSMetaClassDefineReservedUsed ( IOSCSIParallelInterfaceController,  4 );		// Used for ResetBusRequest
 OSMetaClassDefineReservedUnused ( IOSCSIParallelInterfaceController,  5 );
 OSMetaClassDefineReservedUnused ( IOSCSIParallelInterfaceController,  6 );
 OSMetaClassDefineReservedUnused ( IOSCSIParallelInterfaceController,  7 );
@@ -3186,7 +7778,7 @@ OSMetaClassDefineReservedUsed ( IOSCSIParallelInterfaceController, 10 );		// Use
 OSMetaClassDefineReservedUsed ( IOSCSIParallelInterfaceController, 11 );		// Used for InitializeDMASpecification
 OSMetaClassDefineReservedUsed ( IOSCSIParallelInterfaceController, 12 );		// Used for CreateDeviceInterrupt
 
-OSMetaClassDefineReservedUnused ( IOSCSIParallelInterfaceController, 13 );
+OSMetaClassDefineReservedUsed ( IOSCSIParallelInterfaceController, 13 );		// Used for ProcessParallelTasks
 OSMetaClassDefineReservedUnused ( IOSCSIParallelInterfaceController, 14 );
 OSMetaClassDefineReservedUnused ( IOSCSIParallelInterfaceController, 15 );
 OSMetaClassDefineReservedUnused ( IOSCSIParallelInterfaceController, 16 );
@@ -75,6 +75,238 @@
 // at a minimum of being 2-byte aligned.
 #define kIOMinimumHBADataAlignmentMaskKey			"HBA Data Alignment"
 
+// Timeout recovery. An HBA child class which completes or releases the tasks
+// reclaimed by its Task Management functions may opt in to timeout recovery
+// by placing a dictionary under kIOTimeoutRecoveryKey in its personality.
+// When a task times out, the family then escalates through ABORT TASK,
+// LOGICAL UNIT RESET, TARGET RESET and finally a bus reset, giving each step
+// a grace period (in milliseconds) to recover the task before moving on to
+// the next one. The dictionary may tune the grace periods with the keys
+// below. A grace period of zero skips that step entirely. Without the
+// dictionary, HandleTimeout is called as soon as a task times out.
+#define kIOTimeoutRecoveryKey						"Timeout Recovery"
+#define kIOAbortTaskGracePeriodKey					"Abort Task Grace Period"
+#define kIOLogicalUnitResetGracePeriodKey			"Logical Unit Reset Grace Period"
+#define kIOTargetResetGracePeriodKey				"Target Reset Grace Period"
+#define kIOBusResetGracePeriodKey					"Bus Reset Grace Period"
+
+// The statistics for timeout recovery are published by the controller under
+// this key. There is one dictionary per recovery step (keyed by the grace
+// period keys above) reporting the number of attempts, the number of tasks
+// recovered by that step, and the number of other tasks (collateral I/O) that
+// it reclaimed along with them.
+#define kIOTimeoutRecoveryStatisticsKey				"Timeout Recovery Statistics"
+#define kIOTimeoutRecoveryAttemptsKey				"Attempts"
+#define kIOTimeoutRecoveryRecoveredKey				"Recovered"
+#define kIOTimeoutRecoveryCollateralTasksKey		"Collateral Tasks"
+#define kIOTimeoutRecoveryFailedKey					"Failed"
+#define kIOTimeoutRecoveryTotalTimeKey				"Total Recovery Time (ms)"
+#define kIOTimeoutRecoveryMaximumTimeKey			"Maximum Recovery Time (ms)"
+
+// Task admission. All targets on a controller share its pool of SCSI Parallel
+// Tasks. Each target may be given a reservation (tasks only it may use), a cap
+// (the most tasks it may hold at once, zero for no cap) and a weight (its share
+// of the unreserved tasks relative to the other busy targets). A target that
+// has used its reservation may borrow from the unreserved tasks freely until
+// another target is left waiting, at which point it is held to its weighted
+// share. The HBA child class may set the defaults for all targets by placing
+// a dictionary under kIOTaskAdmissionKey in its personality, and may override
+// them for a single target in the properties passed to CreateTargetForID.
+#define kIOTaskAdmissionKey							"Task Admission"
+#define kIOTaskReservationKey						"Task Reservation"
+#define kIOTaskCapKey								"Task Cap"
+#define kIOTaskWeightKey							"Task Weight"
+
+// The task admission statistics are published by each target device under
+// this key. Pool Empty counts the deferrals of the target's tasks that were
+// admissible but found no free task in the pool.
+#define kIOTaskAdmissionStatisticsKey				"Task Admission Statistics"
+#define kIOTaskAdmissionOutstandingKey				"Outstanding Tasks"
+#define kIOTaskAdmissionMaximumOutstandingKey		"Maximum Outstanding Tasks"
+#define kIOTaskAdmissionDeferralsKey				"Deferrals"
+#define kIOTaskAdmissionWaitsKey					"Waits"
+#define kIOTaskAdmissionTotalWaitTimeKey			"Total Wait Time (us)"
+#define kIOTaskAdmissionMaximumWaitTimeKey			"Maximum Wait Time (us)"
+#define kIOTaskAdmissionPoolEmptyKey				"Pool Empty"
+
+// Reserved tasks. The controller holds the last few free tasks back for
+// recovery traffic: urgent (HEAD OF QUEUE or ACA) tasks, REQUEST SENSE and
+// TEST UNIT READY. Other tasks are turned away once only the reserve is left,
+// so that recovery does not wait behind bulk I/O on a busy HBA. The HBA child
+// class may set the number of reserved tasks with this key in its personality,
+// zero for none. The reserve statistics are published by the controller under
+// the statistics key.
+#define kIOTaskReserveKey							"Task Reserve"
+#define kIOTaskReserveStatisticsKey					"Task Reserve Statistics"
+#define kIOTaskReserveSizeKey						"Reserved Tasks"
+#define kIOTaskReserveUsedKey						"Reserved Tasks Used"
+#define kIOTaskReserveWaitsKey						"Waits"
+#define kIOTaskReserveTotalWaitTimeKey				"Total Wait Time (us)"
+#define kIOTaskReserveMaximumWaitTimeKey			"Maximum Wait Time (us)"
+
+// Task pool pressure. The controller publishes under this key how often and
+// how long requests waited for a task because the pool was empty, how often a
+// request was turned away because the pool was empty, and how long the pool
+// spent at each level of occupancy, to help the HBA child class size
+// ReportMaximumTaskCount and kIODMACommandPoolSizeKey. Waits for admission
+// alone are published per target under kIOTaskAdmissionStatisticsKey.
+// The wait time histogram counts the waits shorter than 1, 2, 4 ...
+// microseconds, its last entry the longer ones. The occupancy time holds the
+// milliseconds spent with 0-9%, 10-19% ... 90-99% of the pool outstanding,
+// its last entry the time the pool was exhausted.
+#define kIOTaskPoolStatisticsKey					"Task Pool Statistics"
+#define kIOTaskPoolSizeKey							"Tasks"
+#define kIOTaskPoolMaximumOutstandingKey			"Maximum Outstanding Tasks"
+#define kIOTaskPoolEmptyKey							"Pool Empty"
+#define kIOTaskPoolWaitsKey							"Waits"
+#define kIOTaskPoolTotalWaitTimeKey					"Total Wait Time (us)"
+#define kIOTaskPoolMaximumWaitTimeKey				"Maximum Wait Time (us)"
+#define kIOTaskPoolWaitHistogramKey					"Wait Time Histogram (us)"
+#define kIOTaskPoolOccupancyTimeKey					"Occupancy Time (ms)"
+#define kIOTaskPoolDMACommandPoolEmptyKey			"DMA Command Pool Empty"
+
+// Task latency breakdown. Each target device publishes under this key a
+// histogram of the time its tasks spent in each stage: waiting for a task
+// from the pool, being set up before they were handed to the controller, in
+// the HBA until the interrupt for their completion (or until the completion,
+// if the HBA has no interrupt filter), from that interrupt to the HBA's call
+// to CompleteParallelTask, and from there until they were handed back to the
+// client, as well as in total. Bucket n counts the times shorter than 2^n
+// microseconds, the last bucket the longer ones.
+#define kIOTaskStageLatencyKey						"Task Stage Latency (us)"
+#define kIOTaskStagePoolWaitKey						"Pool Wait"
+#define kIOTaskStageSetupKey						"Setup"
+#define kIOTaskStageHBAKey							"HBA"
+#define kIOTaskStageInterruptKey					"Interrupt"
+#define kIOTaskStageCompletionKey					"Completion"
+#define kIOTaskStageTotalKey						"Total"
+
+// Batched submission. By default each task is handed to the HBA child class
+// with ProcessParallelTask as soon as it is submitted. An HBA which can post
+// several commands to the hardware with a single doorbell may set this key in
+// its personality to the largest number of tasks it wants in one call to
+// ProcessParallelTasks. Submitted tasks are then collected until the workloop
+// gets to run, and are handed over from it in batches of at most that many.
+#define kIOParallelTaskBatchSizeKey					"Parallel Task Batch Size"
+
+// Holding queue. While the HBA child class has suspended services (see
+// SuspendServices), submitted tasks are held by the family instead of being
+// failed, and are handed to the HBA in the order they were submitted once
+// ResumeServices is called. A task which finds the queue full, or is held
+// for longer than the timeout, fails as before. A held task which is
+// completed by the HBA, or reclaimed after a task management function, is
+// taken off the queue and never sent. The HBA child class may set the size
+// of the queue (zero to fail tasks at once) and the timeout, in milliseconds,
+// with these keys in its personality. The holding statistics are published
+// by the controller under the statistics key.
+#define kIOHoldingQueueSizeKey						"Holding Queue Size"
+#define kIOHoldingQueueTimeoutKey					"Holding Queue Timeout"
+#define kIOHoldingQueueStatisticsKey				"Holding Queue Statistics"
+#define kIOHoldingQueueDepthKey						"Held Tasks"
+#define kIOHoldingQueueMaximumDepthKey				"Maximum Held Tasks"
+#define kIOHoldingQueueHeldKey						"Tasks Held"
+#define kIOHoldingQueueExpiredKey					"Tasks Expired"
+#define kIOHoldingQueueRefusedKey					"Tasks Refused"
+
+// Multipathing. When an HBA reports that it supports multipathing (see
+// DoesHBASupportMultiPathing), Targets which report the same logical unit
+// designator for LUN 0 in their Device Identification VPD page (83h) are
+// grouped, whichever controller they were found on, and presented once by a
+// SCSIParallelMultipathDevice which stays until the last path goes away.
+// Tasks for the group are spread over the paths whose ports are up, by the
+// policy named with this key in the personality of the controller which
+// found the Target first. The default policy is round robin.
+#define kIOMultipathPolicyKey						"Multipath Policy"
+#define kIOMultipathPolicyRoundRobinKey				"Round Robin"
+#define kIOMultipathPolicyLeastQueueDepthKey		"Least Queue Depth"
+#define kIOMultipathPolicyLeastLatencyKey			"Least Latency"
+
+// I/O statistics, published by the controller and by each target under this
+// key. The counters only ever increase, so a monitor derives rates (e.g. IOPS)
+// from the difference between two reads. The queue depth is the number of
+// tasks submitted but not yet completed at the time of the read. The DMA
+// mapping counters count the calls the HBA child class makes to prepare() on
+// the DMA command of a task, and the time spent in them, so the average cost
+// of mapping an I/O is the time divided by the mappings.
+#define kIOStatisticsKey							"Statistics"
+#define kIOStatisticsTasksSubmittedKey				"Tasks Submitted"
+#define kIOStatisticsTasksCompletedKey				"Tasks Completed"
+#define kIOStatisticsBytesReadKey					"Bytes Read"
+#define kIOStatisticsBytesWrittenKey				"Bytes Written"
+#define kIOStatisticsErrorsKey						"Errors"
+#define kIOStatisticsTimeoutsKey					"Timeouts"
+#define kIOStatisticsResendsKey						"Resends"
+#define kIOStatisticsDMAMappingsKey					"DMA Mappings"
+#define kIOStatisticsDMAMappingTimeKey				"DMA Mapping Time (ns)"
+#define kIOStatisticsQueueDepthKey					"Queue Depth"
+
+// The DMA specification used by the default InitializeDMASpecification is
+// published by the controller under this key. It is 32 address bits, 32-bit
+// page sized segments, 4-byte alignment and 1MB transfers, unless the HBA
+// sets kIODMASpecificationFromConstraintsKey to true in its personality.
+// The specification is then derived from the constraints reported by
+// ReportHBAConstraints: the segments are 64-bit if the HBA can address more
+// than 32 bits, and a transfer is bounded by the smaller of the read and
+// write segment counts. An HBA which overrides InitializeDMASpecification
+// is not affected.
+#define kIODMASpecificationFromConstraintsKey		"DMA Specification From Constraints"
+#define kIODMASpecificationKey						"DMA Specification"
+#define kIODMASpecificationAddressBitsKey			"Address Bits"
+#define kIODMASpecificationMaximumSegmentSizeKey	"Maximum Segment Size"
+#define kIODMASpecificationMaximumTransferSizeKey	"Maximum Transfer Size"
+#define kIODMASpecificationAlignmentKey				"Segment Alignment"
+
+// The number of DMA commands the controller keeps. By default every task has
+// a DMA command of its own, and the SCSIParallelTaskIdentifier the HBA is
+// given for the task is that IODMACommand, for HBAs which use it as one. An
+// HBA which reports a large task count from ReportMaximumTaskCount for tagged
+// queueing may set this key in its personality to keep fewer DMA commands, in
+// a pool apart from the tasks. Only a task which transfers data is then given
+// one, and the HBA must get it with GetDMACommand instead of using the
+// SCSIParallelTaskIdentifier as an IODMACommand. The number kept is then
+// published by the controller under this key.
+#define kIODMACommandPoolSizeKey					"DMA Command Pool Size"
+
+// Bounce buffers. An HBA which can't reach all of memory (see
+// kIOMaximumSegmentAddressableBitCountKey) or needs aligned segments may set
+// this key in its personality to have the controller keep a pool of buffers it
+// can reach. A task whose data buffer has a segment the HBA can't reach is then
+// staged through one of them: the data is copied in before a write is sent and
+// copied out when a read completes, and GetDataBuffer returns the bounce buffer.
+// A value of true keeps 32 buffers, or one per task if there are fewer tasks,
+// which share 16MB of wired memory and are no larger than the maximum transfer.
+// A transfer larger than a buffer is not staged, and is left to IODMACommand.
+// A number sets the number of buffers, each holding the maximum transfer. The
+// pool statistics are published by the controller under the statistics key.
+#define kIOBounceBufferPoolKey						"Bounce Buffer Pool"
+#define kIOBounceBufferStatisticsKey				"Bounce Buffer Statistics"
+#define kIOBounceBufferCountKey						"Buffers"
+#define kIOBounceBufferSizeKey						"Buffer Size"
+#define kIOBounceBufferHitsKey						"Bounced Tasks"
+#define kIOBounceBufferMissesKey					"Pool Empty"
+#define kIOBounceBufferBytesCopiedKey				"Bytes Copied"
+
+// Registered buffers (see IOSCSIParallelInterfaceDevice::RegisterDataBuffer).
+// The number of buffers registered with the controller and the number of
+// tasks which used one are published by the controller under this key.
+#define kIORegisteredBufferStatisticsKey			"Registered Buffer Statistics"
+#define kIORegisteredBufferCountKey					"Buffers"
+#define kIORegisteredBufferTasksKey					"Tasks"
+
+// Command trace capture. Setting this key on a target device to a number
+// starts recording each task sent to the Target, up to that many tasks
+// (true records kSCSIParallelTraceDefaultRecordCount). Setting it to false
+// stops the capture and publishes the trace as an OSData under the data key,
+// in the format described in SCSIParallelTrace.h.
+#define kIOCommandTraceKey							"Command Trace"
+#define kIOCommandTraceDataKey						"Command Trace Data"
+
+// Tracepoints. Setting this key on any controller to a mask of the categories
+// in IOSCSIParallelFamilyDebugging.h enables the family's tracepoints in
+// those categories on all controllers, zero disables them. The records are
+// written to the system log. The spi_trace boot-arg sets the mask at boot.
+#define kIOTraceCategoriesKey						"Trace Categories"
+
 // The Feature Selectors used to identify features of the SCSI Parallel
 // Interface.  These are used by the DoesHBASupportSCSIParallelFeature
 // to report whether the HBA supports a given SCSI Parallel Interface
@@ -177,6 +409,22 @@ enum
 	kSCSIParallelTaskControllerIDQueueHead 		= 0
 };
 
+// The nexus affected by a SAM-2 Task Management function. This is used
+// to determine which outstanding tasks must be reclaimed once the function
+// has completed, so that tasks for any other nexus are left undisturbed.
+typedef enum SCSIParallelTaskNexus
+{
+	// ABORT TASK affects only the task identified by the I_T_L_Q nexus.
+	kSCSIParallelTaskNexus_I_T_L_Q				= 0,
+	
+	// ABORT TASK SET, CLEAR TASK SET and LOGICAL UNIT RESET affect all
+	// tasks for the I_T_L nexus.
+	kSCSIParallelTaskNexus_I_T_L				= 1,
+	
+	// TARGET RESET affects all tasks for the I_T nexus.
+	kSCSIParallelTaskNexus_I_T					= 2
+} SCSIParallelTaskNexus;
+
 // Notifications
 enum
 {
@@ -186,6 +434,24 @@ enum
 // Forward declaration for the internally used Parallel Device object.
 class IOSCSIParallelInterfaceDevice;
 
+// Forward declaration for the task admission state of a Parallel Device.
+struct SCSIParallelTaskAdmission;
+
+// Forward declaration for the I/O statistics of a controller or Device.
+struct SCSIParallelStatistics;
+
+// Forward declaration for the bounce buffers.
+class IOBufferMemoryDescriptor;
+
+// Forward declaration for the registered buffers.
+struct SCSIParallelRegisteredBuffer;
+
+// Forward declaration for the tasks on the holding queue.
+class SCSIParallelTask;
+
+// Forward declaration for the DMA commands of the tasks.
+class SCSIParallelDMACommand;
+
 // This is the identifier that is used to specify a given parallel Task.
 typedef OSObject *	SCSIParallelTaskIdentifier;
 
@@ -237,6 +503,114 @@ public:
 	
 	void FreeSCSIParallelTask ( SCSIParallelTaskIdentifier returnTask );
 	
+	/*!
+		@function GetSCSIParallelTaskForTarget
+		@abstract Method to allow a target device to get a SCSIParallelTask
+		@discussion Get a SCSIParallelTask from the controller on behalf of a
+		target device. The task is charged to the target and is only handed out
+		if the target's reservation, cap and weighted share allow it (see
+		kIOTaskAdmissionKey). The task is uncharged when it is returned with
+		FreeSCSIParallelTask.
+		Urgent tasks (HEAD OF QUEUE or ACA) are not held to the cap or share
+		and are given the next free task ahead of other waiting tasks, but
+		only a limited number in a row so that the other tasks keep moving.
+		Only tasks for which reserved is true may use the reserved tasks (see
+		kIOTaskReserveKey).
+		@param target is the target device the task is charged to.
+		@param blockForCommand If the blockForCommand parameter is set to false
+		and the target may not be given a SCSIParallelTask, this method will
+		return NULL, otherwise it will wait until one may be given before
+		returning. This must be false on the workloop thread.
+		@param urgent is true if the task is for an urgent (HEAD OF QUEUE or
+		ACA) request.
+		@param reserved is true if the task may use the reserved tasks, as
+		urgent and recovery (REQUEST SENSE or TEST UNIT READY) requests may.
+		@result If a SCSI Parallel Task may be given to the target, a reference
+		to it will be returned.
+	*/
+	
+	SCSIParallelTaskIdentifier	GetSCSIParallelTaskForTarget (
+							IOSCSIParallelInterfaceDevice *	target,
+							bool							blockForCommand,
+							bool							urgent,
+							bool							reserved );
+	
+	/*!
+		@function SetTaskDMABuffer
+		@abstract Method to allow a target device to set the data buffer of a
+		SCSIParallelTask for DMA.
+		@discussion If the controller keeps a bounce buffer pool (see
+		kIOBounceBufferPoolKey) and the HBA can't reach all of the buffer, the
+		task is given a bounce buffer instead, and for a write the data is
+		copied into it. The bounce buffer is returned to the pool by
+		FreeSCSIParallelTask.
+		@param parallelTask is the task.
+		@param buffer is the data buffer of the client's request.
+		@result kIOReturnSuccess if the buffer was set.
+	*/
+	
+	IOReturn	SetTaskDMABuffer (
+							SCSIParallelTaskIdentifier		parallelTask,
+							IOMemoryDescriptor *			buffer );
+	
+	/*!
+		@function AttachTaskDMACommand
+		@abstract Method to allow a target device to get a DMA command for a
+		SCSIParallelTask which transfers data.
+		@discussion By default the task has a DMA command of its own and this
+		does nothing. If the HBA set kIODMACommandPoolSizeKey, the DMA command is
+		taken from the controller's pool of them and is returned to it by
+		FreeSCSIParallelTask. This must be done before SetTaskDMABuffer.
+		@param parallelTask is the task.
+		@param blockForCommand If the blockForCommand parameter is set to false
+		and there is no free DMA command, this method will return false,
+		otherwise it will wait for one. This must be false on the workloop
+		thread.
+		@result true if the task has a DMA command.
+	*/
+	
+	bool		AttachTaskDMACommand (
+							SCSIParallelTaskIdentifier		parallelTask,
+							bool							blockForCommand );
+	
+	/*!
+		@function CompleteTaskDMABuffer
+		@abstract Method to allow a target device to finish the data transfer
+		of a completed SCSIParallelTask.
+		@discussion If the task read into a bounce buffer, the realized data is
+		copied out to the data buffer of the client's request. This must be
+		called before the client's request is completed.
+		@param parallelTask is the task.
+	*/
+	
+	void		CompleteTaskDMABuffer ( SCSIParallelTaskIdentifier parallelTask );
+	
+	/*!
+		@function RegisterDataBuffer
+		@abstract Method to allow a target device to register a client's
+		data buffer.
+		@discussion See IOSCSIParallelInterfaceDevice::RegisterDataBuffer.
+		@param buffer is the data buffer.
+		@result kIOReturnSuccess if the buffer was registered,
+		kIOReturnNoResources if too many buffers are registered,
+		kIOReturnNotPermitted if the HBA can't reach the buffer, or
+		kIOReturnUnsupported if the HBA's InitializeDMASpecification shapes
+		segments differently from the one derived from its constraints.
+	*/
+	
+	IOReturn	RegisterDataBuffer ( IOMemoryDescriptor * buffer );
+	
+	/*!
+		@function UnregisterDataBuffer
+		@abstract Method to allow a target device to unregister a client's
+		data buffer.
+		@param buffer is the data buffer.
+		@result kIOReturnSuccess if the buffer was unregistered, or
+		kIOReturnNotFound if it was not registered.
+	*/
+	
+	IOReturn	UnregisterDataBuffer ( IOMemoryDescriptor * buffer );
+	
 	/*!
 		@function FindTaskForAddress
 		@abstract Find a task for a given Task Address, if one exists.
@@ -282,7 +656,10 @@ public:
 		@function ExecuteParallelTask
 		@abstract Submit a SCSIParallelTask for execution.
 		@discussion	The ExecuteParallelTask call is made by the client to submit 
-		a SCSIParallelTask for execution.
+		a SCSIParallelTask for execution. If the HBA takes its tasks in batches
+		(see kIOParallelTaskBatchSizeKey), the task is queued and
+		kSCSIServiceResponse_Request_In_Process is returned; any failure to
+		send it is reported through its completion.
 		@param parallelRequest is a reference to the SCSIParallelTaskIdentifier
 		to be executed.
 		@result is an appropriate SCSIServiceResponse which are defined in the
@@ -292,6 +669,33 @@ public:
 	SCSIServiceResponse ExecuteParallelTask ( 
 							SCSIParallelTaskIdentifier	parallelRequest );
 	
+	/*!
+		@function ReclaimTasksForNexus
+		@abstract Reclaim the outstanding tasks for a nexus.
+		@discussion	The ReclaimTasksForNexus call is made once a SAM-2 Task
+		Management function has completed successfully. Every task of the
+		specified nexus which the HBA does not have, either because it is
+		waiting to be resent or because the HBA released it with
+		ReleaseParallelTask, is removed from the timeout and resend lists and
+		completed back to the client with a status of TASK_ABORTED. The HBA
+		must still complete any other task of the nexus itself. Tasks for any
+		other nexus are not disturbed.
+		@param theT is the Target component of the nexus.
+		@param theL is the Logical Unit component of the nexus. Ignored for
+		an I_T nexus.
+		@param theQ is the Queue Tag component of the nexus. Ignored for an
+		I_T or I_T_L nexus.
+		@param theNexus is the SCSIParallelTaskNexus affected by the Task
+		Management function.
+		@result returns the number of tasks which were reclaimed.
+	*/
+	
+	UInt32	ReclaimTasksForNexus (
+							SCSITargetIdentifier 		theT,
+							SCSILogicalUnitNumber		theL,
+							SCSITaggedTaskIdentifier	theQ,
+							SCSIParallelTaskNexus		theNexus );
+	
 	// --- Public API methods provided by HBA child classes ----
 	
 	/*!
@@ -417,8 +821,25 @@ public:
 	virtual bool	DoesHBASupportMultiPathing ( void );
 							
 	
+	/*!
+		@function ResetBusRequest
+		@abstract Request a reset of the bus.
+		@discussion	Called by the family as the last step of timeout recovery,
+		once ABORT TASK, LOGICAL UNIT RESET and TARGET RESET have failed to
+		recover a task. For serial interconnects, this should reset the link.
+		The controller can complete this immediately by returning
+		kSCSIServiceResponse_FUNCTION_COMPLETE, or return
+		kSCSIServiceResponse_Request_In_Process and call CompleteBusReset()
+		once the reset has been performed. All outstanding tasks on the domain
+		are reclaimed when the reset completes. The default implementation
+		returns kSCSIServiceResponse_FUNCTION_REJECTED.
+		@result A valid SCSIServiceResponse.
+	*/
+	OSMetaClassDeclareReservedUsed ( IOSCSIParallelInterfaceController, 4 );
+	
+	virtual SCSIServiceResponse	ResetBusRequest ( void );
+	
 	// Padding for the Client API
-	OSMetaClassDeclareReservedUnused ( IOSCSIParallelInterfaceController, 4 );
 	OSMetaClassDeclareReservedUnused ( IOSCSIParallelInterfaceController, 5 );
 	OSMetaClassDeclareReservedUnused ( IOSCSIParallelInterfaceController, 6 );
 	OSMetaClassDeclareReservedUnused ( IOSCSIParallelInterfaceController, 7 );
@@ -535,6 +956,28 @@ protected:
 	void	RemoveTargetProperty ( SCSIDeviceIdentifier 		targetID,
 								   const char *		 			key );
 	
+	/*!
+		@function BeginTargetPropertyTransaction
+		@abstract Starts a property transaction for a specific target.
+		@discussion Until the matching call to CommitTargetPropertyTransaction(),
+		the changes made by SetTargetProperty() and RemoveTargetProperty() for
+		the target are collected and then published all at once. Transactions
+		may be nested; only the outermost commit publishes the changes.
+		@param targetID The SCSIDeviceIdentifier of the target.
+		@result returns true if the transaction was started, otherwise false.
+		CommitTargetPropertyTransaction() must only be called if true is returned.
+	*/
+	
+	bool	BeginTargetPropertyTransaction ( SCSIDeviceIdentifier targetID );
+	
+	/*!
+		@function CommitTargetPropertyTransaction
+		@abstract Ends a property transaction for a specific target.
+		@param targetID The SCSIDeviceIdentifier of the target.
+	*/
+	
+	void	CommitTargetPropertyTransaction ( SCSIDeviceIdentifier targetID );
+	
 	// ---- Methods for HBA specifics. ----
 	
 	/*!
@@ -575,6 +1018,30 @@ protected:
 	
 	void	RemoveHBAProperty ( const char * key );
 	
+	/*!
+		@function BeginHBAPropertyTransaction
+		@abstract Starts a property transaction for this object.
+		@discussion Until the matching call to CommitHBAPropertyTransaction(),
+		the changes made by SetHBAProperty() and RemoveHBAProperty() are
+		collected and then published, and clients notified, all at once.
+		Transactions may be nested; only the outermost commit publishes the
+		changes. A transaction belongs to the thread which began it; other
+		threads wait for the outermost commit before they change anything.
+		Must not be called on the workloop while another thread's transaction
+		is open.
+		@result returns true if the transaction was started, otherwise false.
+		CommitHBAPropertyTransaction() must only be called if true is returned.
+	*/
+	
+	bool	BeginHBAPropertyTransaction ( void );
+	
+	/*!
+		@function CommitHBAPropertyTransaction
+		@abstract Ends a property transaction for this object.
+	*/
+	
+	void	CommitHBAPropertyTransaction ( void );
+	
 	// These methods will not be called before the InitializeController() call,
 	// and will not be called after the TerminateController() call.  But in the
 	// interval between those calls, they shall report the correct requested
@@ -722,7 +1189,10 @@ protected:
 		services without a visible difference to the client. The driver may 
 		receive multiple SuspendServices calls without receiving a 
 		ResumeServices call and should ignore any after the first until a 
-		ResumeServices call is received.
+		ResumeServices call is received. Tasks submitted while services are
+		suspended are held by the family (see kIOHoldingQueueSizeKey). The
+		HBA child class may also call this itself, for instance while its
+		firmware is being reset.
 	*/
 	
 	virtual void	SuspendServices ( void );
@@ -731,7 +1201,12 @@ protected:
 		@function ResumeServices
 		@abstract Called to resume controller services
 		@discussion Method that will be called to resume services
-		provided by the driver. ( See SuspendServices discussion )
+		provided by the driver. ( See SuspendServices discussion ) The tasks
+		held while services were suspended are sent to the HBA, in the order
+		they were submitted, before this returns. They are handed to
+		ProcessParallelTask (or queued for ProcessParallelTasks) with the
+		workloop gate held. An override must call the superclass
+		implementation once it is ready for them.
 	*/
 	
 	virtual void	ResumeServices ( void );
@@ -788,7 +1263,8 @@ protected:
 		@abstract Called by client to process a parallel task.
 		@discussion This method is called to process a parallel task (i.e. put
 		the command on the bus). The HBA specific sublcass must implement this 
-		method.
+		method. It is usually called without the workloop gate, but with the
+		gate held for the tasks sent by ResumeServices.
 		@param parallelRequest A valid SCSIParallelTaskIdentifier.
 		@result serviceResponse (see <IOKit/scsi/SCSITask.h>)
 	*/
@@ -801,7 +1277,10 @@ protected:
 		@abstract Parallel Task Completion
 		@discussion The HBA specific sublcass inherits the CompleteParallelTask() 
 		method which shall be called when the HBA has completed the processing 
-		of a parallel task.
+		of a parallel task. If it is called without holding the workloop gate,
+		the completion is queued without blocking and finished on the workloop
+		thread shortly after, so the HBA must not touch the task once this
+		method has been called.
 		@param parallelTask A valid SCSIParallelTaskIdentifier.
 		@param completionStatus The status of the SCSI bus.
 		@param serviceResponse (see <IOKit/scsi/SCSITask.h>)
@@ -812,6 +1291,20 @@ protected:
 						SCSITaskStatus 				completionStatus,
 						SCSIServiceResponse 		serviceResponse );
 	
+	/*!
+		@function ReleaseParallelTask
+		@abstract Releases a parallel task without completing it.
+		@discussion The HBA specific subclass may call ReleaseParallelTask()
+		for a task it has dropped because of a SAM-2 Task Management function,
+		instead of completing it. It must do so before the function is
+		completed, the task is then reclaimed with the others of the nexus
+		(see ReclaimTasksForNexus) and the HBA must not touch it again.
+		@param parallelTask A valid SCSIParallelTaskIdentifier.
+	*/
+	
+	void	ReleaseParallelTask (
+						SCSIParallelTaskIdentifier	parallelRequest );
+	
 	
 	// Completion routines for the SCSI Task Management functions as described
 	// in the SCSI ArchitectureModel - 2 (SAM-2) specification.  Each of these
@@ -851,6 +1344,9 @@ protected:
 						SCSITargetIdentifier 		theT,
 						SCSIServiceResponse 		serviceResponse );
 	
+	void 	CompleteBusReset (
+						SCSIServiceResponse 		serviceResponse );
+	
 	/*!
 		@function NotifyClientsOfBusReset
 		@abstract Method called to notify clients that a bus reset has occurred.
@@ -1110,6 +1606,9 @@ protected:
 		is further responsible for calling complete() on the IODMACommand object once
 		all DMA operations have finished.
 		NB: Subclasses should not call IODMACommand::setMemoryDescriptor().
+		If the HBA sets kIODMACommandPoolSizeKey, a task which transfers no
+		data shares an IODMACommand with no memory descriptor, which must not
+		be prepared.
 		@param parallelTask A valid SCSIParallelTaskIdentifier.
 		@result returns pointer to an IODMACommand which is used in conjunction
 		with the task.
@@ -1363,7 +1862,12 @@ protected:
 		@discussion Method to handle command timeouts. This should
 		be overridden by the child class in order to clean up HBA
 		specific structures after a timeout has occurred. This method
-		is called on the workloop (it holds the gate).
+		is called on the workloop (it holds the gate). A timed out task
+		is first escalated through the timeout recovery ladder (see
+		kIOTimeoutRecoveryKey), if the HBA opted in to it, so this method
+		is then only called once every step of the ladder has failed to
+		recover the task. Otherwise it is called as soon as the task times
+		out.
 		@param parallelRequest A valid SCSIParallelTaskIdentifier.
 	*/
 	
@@ -1434,6 +1938,10 @@ protected:
 		@param command A pointer to a valid IODMACommand object. Subclasses
 		should override this method and call IODMACommand::initWithSpecification()
 		supplying the proper arguments to that method based on the DMA strategy.
+		The default implementation uses 32-bit page sized segments for 1MB
+		transfers, unless the HBA asks for the specification to be derived
+		from the address bits, segment size, segment count and alignment
+		reported in ReportHBAConstraints (see kIODMASpecificationKey).
 		@result boolean value indicating success or failure.
 	*/
 	OSMetaClassDeclareReservedUsed ( IOSCSIParallelInterfaceController, 11 );
@@ -1467,8 +1975,31 @@ protected:
 											IOFilterInterruptEventSource::Filter	filter,
 											IOService *								provider );
 	
+	/*!
+		@function ProcessParallelTasks
+		@abstract Called to process several parallel tasks at once.
+		@discussion This method is called instead of ProcessParallelTask when
+		the HBA child class has enabled batched submission by setting
+		kIOParallelTaskBatchSizeKey in its personality. The tasks are passed in
+		the order in which they were submitted. The HBA child class may override
+		this method to put all of the commands on the bus at once (e.g. with a
+		single doorbell write). It is always called on the workloop, with the
+		gate held. The default implementation calls ProcessParallelTask for
+		each task in turn.
+		@param parallelRequests An array of valid SCSIParallelTaskIdentifiers.
+		@param serviceResponses An array which receives the serviceResponse
+		(see <IOKit/scsi/SCSITask.h>) for each task, as ProcessParallelTask
+		would have returned it.
+		@param count The number of tasks in the arrays.
+	*/
+	OSMetaClassDeclareReservedUsed ( IOSCSIParallelInterfaceController, 13 );
+	
+	virtual void	ProcessParallelTasks (
+							SCSIParallelTaskIdentifier	parallelRequests[],
+							SCSIServiceResponse			serviceResponses[],
+							UInt32						count );
+	
 	// Padding for the Child Class API
-	OSMetaClassDeclareReservedUnused ( IOSCSIParallelInterfaceController, 13 );
 	OSMetaClassDeclareReservedUnused ( IOSCSIParallelInterfaceController, 14 );
 	OSMetaClassDeclareReservedUnused ( IOSCSIParallelInterfaceController, 15 );
 	OSMetaClassDeclareReservedUnused ( IOSCSIParallelInterfaceController, 16 );
@@ -1481,8 +2012,174 @@ protected:
 	
 private:
 	
+	// The steps of the timeout recovery ladder, in order of escalation.
+	enum
+	{
+		kSCSIParallelRecoveryStep_None				= 0,
+		kSCSIParallelRecoveryStep_AbortTask			= 1,
+		kSCSIParallelRecoveryStep_LogicalUnitReset	= 2,
+		kSCSIParallelRecoveryStep_TargetReset		= 3,
+		kSCSIParallelRecoveryStep_BusReset			= 4,
+		kSCSIParallelRecoveryStepCount				= 5
+	};
+	
+	// The buckets of the task pool statistics (see kIOTaskPoolStatisticsKey).
+	enum
+	{
+		kSCSIParallelTaskPoolWaitBucketCount		= 24,
+		kSCSIParallelTaskPoolOccupancyBucketCount	= 11
+	};
+	
 	// binary compatibility instance variable expansion
-	struct ExpansionData { };
+	struct ExpansionData
+	{
+		
+		// Timeout recovery grace periods (in milliseconds) and statistics,
+		// indexed by recovery step. fRecoveryEnabled is set if the HBA
+		// opted in to timeout recovery.
+		bool		fRecoveryEnabled;
+		UInt32		fRecoveryGracePeriod[kSCSIParallelRecoveryStepCount];
+		UInt64		fRecoveryAttempts[kSCSIParallelRecoveryStepCount];
+		UInt64		fRecoveryRecovered[kSCSIParallelRecoveryStepCount];
+		UInt64		fRecoveryCollateralTasks[kSCSIParallelRecoveryStepCount];
+		UInt64		fRecoveryFailed;
+		UInt64		fRecoveryTotalTime;
+		UInt64		fRecoveryMaximumTime;
+		
+		// Task admission accounting for the pool of SCSI Parallel Tasks. The
+		// number of tasks in the pool and charged to targets, the sum of the
+		// reservations of open targets and how much of them is in use, the
+		// sum of the weights of busy targets, the number of targets which were
+		// turned away or are waiting, the number of waiting threads, and the
+		// number of tasks returned to the pool. These, the admission state of
+		// the targets and the task reserve and task pool statistics below are
+		// protected by fAdmissionLock rather than by the workloop gate. The
+		// admission decision itself does not hold the gate, but the task pool
+		// (an IOCommandPool) still takes it briefly to get or return a task.
+		// The gate is held across a wait only by threads which wait for a
+		// task, and to wake them. The number of waiting threads is only
+		// changed with both held.
+		UInt32		fAdmissionPoolSize;
+		UInt32		fAdmissionOutstanding;
+		UInt32		fAdmissionReserved;
+		UInt32		fAdmissionReservedOutstanding;
+		UInt32		fAdmissionActiveWeight;
+		UInt32		fAdmissionContenders;
+		UInt32		fAdmissionWaiters;
+		UInt32		fAdmissionReturns;
+		IOSimpleLock *	fAdmissionLock;
+		
+		// The number of waiting threads with urgent (HEAD OF QUEUE or ACA)
+		// tasks, and the number of urgent tasks handed out in a row while
+		// other tasks were waiting.
+		UInt32		fAdmissionUrgentWaiters;
+		UInt32		fAdmissionUrgentStreak;
+		
+		// The number of free tasks held back for urgent tasks, the number of
+		// urgent tasks that were given one of them, and how long urgent
+		// tasks waited for a task.
+		UInt32		fTaskReserve;
+		UInt64		fTaskReserveUsed;
+		UInt64		fTaskReserveWaits;
+		UInt64		fTaskReserveTotalWaitTime;
+		UInt64		fTaskReserveMaximumWaitTime;
+		
+		// Task pool pressure statistics: the most tasks outstanding at once,
+		// the requests turned away because the pool was empty, the waits for
+		// a task, and the time (in absolute time units) spent at each level
+		// of occupancy since fTaskPoolOccupancyStart. fDMACommandPoolEmpty is
+		// updated atomically.
+		UInt32		fTaskPoolMaximumOutstanding;
+		UInt64		fTaskPoolEmpty;
+		UInt64		fTaskPoolWaits;
+		UInt64		fTaskPoolTotalWaitTime;
+		UInt64		fTaskPoolMaximumWaitTime;
+		UInt64		fTaskPoolWaitHistogram[kSCSIParallelTaskPoolWaitBucketCount];
+		UInt64		fTaskPoolOccupancyTime[kSCSIParallelTaskPoolOccupancyBucketCount];
+		UInt64		fTaskPoolOccupancyStart;
+		volatile SInt64	fDMACommandPoolEmpty;
+		
+		// The time the HBA's interrupt filter last ran, for the task
+		// latency breakdown.
+		volatile UInt64	fInterruptTime;
+		
+		// Tasks completed outside of the gate are pushed on to this list
+		// (newest first) without blocking and are completed on the workloop
+		// when fCompletionEvent fires.
+		void * volatile				fDeferredCompletionList;
+		IOInterruptEventSource *	fCompletionEvent;
+		
+		// When batched submission is enabled, submitted tasks are pushed on
+		// to this list (newest first) without blocking, and are handed to the
+		// HBA child class, fSubmissionBatchSize at a time, when fSubmissionEvent
+		// fires. Only the workloop takes the list, so batches stay in order.
+		void * volatile				fSubmissionList;
+		UInt32						fSubmissionBatchSize;
+		IOInterruptEventSource *	fSubmissionEvent;
+		
+		// Tasks submitted while services are suspended are held on this
+		// list (oldest first, linked by fBatchedSubmissionNext) until they
+		// are sent, or fail when fHoldingTimer fires. The list is protected
+		// by the gate.
+		SCSIParallelTask *			fHoldingQueueHead;
+		SCSIParallelTask *			fHoldingQueueTail;
+		UInt32						fHoldingQueueCount;
+		UInt32						fHoldingQueueSize;
+		UInt32						fHoldingQueueTimeout;
+		UInt32						fHoldingQueueMaximumDepth;
+		UInt64						fHoldingQueueHeld;
+		UInt64						fHoldingQueueExpired;
+		UInt64						fHoldingQueueRefused;
+		IOTimerEventSource *		fHoldingTimer;
+		
+		// The copy of the controller characteristics dictionary being
+		// changed by the open property transaction, how deeply it is nested
+		// and the thread which owns it. These are only changed with the
+		// workloop gate held, and the copy is only used by the owner.
+		OSDictionary *				fHBAPropertyTransaction;
+		UInt32						fHBAPropertyTransactionDepth;
+		thread_t					fHBAPropertyTransactionOwner;
+		
+		// The I/O statistics for all targets on this controller.
+		SCSIParallelStatistics *	fStatistics;
+		
+		// The DMA specification used by the default
+		// InitializeDMASpecification (see kIODMASpecificationKey).
+		UInt32						fDMAAddressBits;
+		UInt32						fDMAAlignment;
+		UInt64						fDMAMaximumSegmentSize;
+		UInt64						fDMAMaximumTransferSize;
+		
+		// The bounce buffer pool (see kIOBounceBufferPoolKey). The first
+		// fBounceBufferFreeCount entries of fBounceBuffers are free, the
+		// others are held by tasks. They are protected by fBounceBufferLock.
+		IOBufferMemoryDescriptor **	fBounceBuffers;
+		UInt32						fBounceBufferCount;
+		UInt32						fBounceBufferFreeCount;
+		UInt64						fBounceBufferSize;
+		IOSimpleLock *				fBounceBufferLock;
+		
+		// The bounce buffer pool statistics.
+		volatile SInt64				fBounceBufferHits;
+		volatile SInt64				fBounceBufferMisses;
+		volatile SInt64				fBounceBufferBytesCopied;
+		
+		// The registered buffers, protected by fRegisteredBufferLock, and
+		// the number of tasks which used one.
+		SCSIParallelRegisteredBuffer **	fRegisteredBuffers;
+		UInt32						fRegisteredBufferCount;
+		IOSimpleLock *				fRegisteredBufferLock;
+		volatile SInt64				fRegisteredBufferTasks;
+		
+		// The pool for the available DMA commands, which are only given to
+		// tasks which transfer data, and the number of them. The pool is
+		// only used if the HBA set kIODMACommandPoolSizeKey, in which case
+		// tasks which transfer no data share fNullDMACommand.
+		IOCommandPool *				fDMACommandPool;
+		UInt32						fDMACommandCount;
+		SCSIParallelDMACommand *	fNullDMACommand;
+		
+	};
 	ExpansionData * fIOSCSIParallelInterfaceControllerExpansionData;
 	
 	IOService *					fProvider;
@@ -1528,11 +2225,36 @@ private:
 	
 	bool						AllocateSCSIParallelTasks ( void );
 	void						DeallocateSCSIParallelTasks ( void );
+	void						SetDMASpecification ( OSDictionary * constraints );
+	bool						AllocateDMACommands ( void );
+	void						DeallocateDMACommands ( void );
+	bool						InitializeTaskDMACommand ( SCSIParallelTask * task );
+	
+	// Bounce buffer pool support routines.
+	void						AllocateBounceBuffers ( UInt32 taskCount );
+	void						DeallocateBounceBuffers ( void );
+	bool						IsBounceBufferNeeded (
+									IOMemoryDescriptor *	buffer,
+									UInt64					offset,
+									UInt64					length );
+	void						UpdateBounceBufferStatistics ( void );
+	
+	// Registered buffer support routines.
+	void						AllocateRegisteredBuffers ( void );
+	void						DeallocateRegisteredBuffers ( void );
+	void						ReleaseRegisteredBuffer (
+									SCSIParallelRegisteredBuffer *	registration );
+	void						UpdateRegisteredBufferStatistics ( void );
 	
 	IOWorkLoop *				getWorkLoop ( void ) const;
 	bool 						CreateWorkLoop ( IOService * provider );
 	void 						ReleaseWorkLoop ( void );
 	
+	bool						SetHBAPropertyInDictionary (
+									OSDictionary *	hbaDict,
+									const char *	key,
+									OSObject *	 	value );
+	
 	// SCSI Parallel Device List
 	// The SCSI Parallel Device List will consist of 16 elements to represent 
 	// identifiers that end in 0h through Fh.  Each array element will point
@@ -1567,14 +2289,99 @@ private:
 	
 	static void		TimeoutOccurred ( OSObject * owner, IOTimerEventSource * sender );
 	
+	// Deferred completion support routines.
+	static void		DeferredCompletionOccurred (
+							OSObject *					theObject,
+							IOInterruptEventSource *	theSource,
+							int							count );
+	void			DeferParallelTaskCompletion (
+							SCSIParallelTaskIdentifier	parallelRequest,
+							SCSITaskStatus 				completionStatus,
+							SCSIServiceResponse 		serviceResponse );
+	void			CompleteDeferredParallelTasks ( void );
+	
+	// Batched submission support routines.
+	void			InitializeBatchedSubmission ( void );
+	void			QueueParallelTaskForSubmission (
+							SCSIParallelTaskIdentifier	parallelRequest );
+	static void		SubmissionOccurred (
+							OSObject *					theObject,
+							IOInterruptEventSource *	theSource,
+							int							count );
+	void			SubmitBatchedParallelTasks ( void );
+	
+	// Holding queue support routines.
+	void			InitializeHoldingQueue ( void );
+	SCSIServiceResponse	SubmitParallelTask (
+							SCSIParallelTaskIdentifier	parallelRequest );
+	SCSIServiceResponse	HoldParallelTask (
+							SCSIParallelTaskIdentifier	parallelRequest );
+	void			SendHeldParallelTasks ( void );
+	void			ExpireHeldParallelTasks ( UInt64 time );
+	void			UnholdParallelTask ( SCSIParallelTask * task );
+	static void		HoldingTimeoutOccurred ( OSObject * owner, IOTimerEventSource * sender );
+	void			UpdateHoldingQueueStatistics ( void );
+	
+	// Timeout recovery support routines.
+	void			InitializeTimeoutRecovery ( void );
+	bool			RecoverTimedOutTask ( 
+							SCSIParallelTaskIdentifier		parallelRequest );
+	SCSIServiceResponse	IssueRecoveryStep (
+							UInt8							step,
+							IOSCSIParallelInterfaceDevice *	target,
+							SCSIParallelTaskIdentifier		parallelRequest );
+	void			EndTimeoutRecovery (
+							IOSCSIParallelInterfaceDevice *	target,
+							bool							recovered );
+	void			ReclaimTasksForBusReset ( void );
+	void			UpdateTimeoutRecoveryStatistics ( void );
+	
+	// Task admission support routines.
+	bool			IsTaskAdmissible (
+							SCSIParallelTaskAdmission *		admission,
+							bool							urgent,
+							bool							reserved );
+	void			ChargeTaskToTarget (
+							IOSCSIParallelInterfaceDevice *	target,
+							bool							urgent,
+							bool							reserved );
+	void			WakeTaskAdmissionWaiters ( void );
+	void			InitializeTaskReserve ( void );
+	bool			IsTaskReserveReached ( void );
+	void			UpdateTaskReserveStatistics ( void );
+	void			RecordTaskPoolWait ( UInt64 elapsed );
+	void			RecordTaskPoolOccupancy ( void );
+	void			UpdateTaskPoolStatistics ( void );
+	void			UnchargeTaskFromTarget (
+							IOSCSIParallelInterfaceDevice *	target );
+	void			ReleaseTaskReservation (
+							SCSIParallelTaskAdmission *		admission );
+	void			UpdateTaskAdmissionState (
+							SCSIParallelTaskAdmission *		admission,
+							bool							wasActive,
+							bool							wasContending );
+	
 	static bool		FilterInterrupt (
 							OSObject *						theObject,
 							IOFilterInterruptEventSource *	theSource );
 	
+	// I/O statistics support routines.
+	void			RecordTaskSubmission (
+							SCSIParallelTaskIdentifier		parallelRequest );
+	void			RecordTaskCompletion (
+							SCSIParallelTaskIdentifier		parallelRequest,
+							SCSIServiceResponse				serviceResponse,
+							SCSITaskStatus					completionStatus );
+	void			RecordTaskTimeout (
+							SCSIParallelTaskIdentifier		parallelRequest );
+	void			UpdateStatistics ( void );
+	
 	// IOService support methods
 	// These shall not be overridden by the HBA child classes.
 	bool			start ( IOService * 				provider );
 	void			stop ( 	IOService *  				provider );
+	IOReturn		setProperties ( OSObject * properties );
+	bool			serializeProperties ( OSSerialize * s ) const;
 	
 	
 protected:
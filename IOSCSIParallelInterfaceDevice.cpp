@@ -27,13 +27,18 @@
 //-----------------------------------------------------------------------------
 
 // Libkern includes
+#include <libkern/c++/OSArray.h>
 #include <libkern/c++/OSData.h>
 #include <libkern/c++/OSDictionary.h>
+#include <libkern/c++/OSNumber.h>
+#include <libkern/OSAtomic.h>
+#include <libkern/OSByteOrder.h>
 
 // General IOKit includes
 #include <IOKit/IOBufferMemoryDescriptor.h>
 #include <IOKit/IOMessage.h>
 #include <IOKit/IODeviceTreeSupport.h>
+#include <IOKit/IOUserClient.h>
 
 // IOKit storage includes
 #include <IOKit/storage/IOStorageDeviceCharacteristics.h>
@@ -45,6 +50,7 @@
 
 // SCSI Parallel Family includes
 #include "IOSCSIParallelInterfaceDevice.h"
+#include "SCSIParallelMultipathDevice.h"
 
 
 //-----------------------------------------------------------------------------
@@ -69,13 +75,13 @@
 #if ( SCSI_PARALLEL_DEVICE_DEBUGGING_LEVEL >= 2 )
 #define ERROR_LOG(x)           IOLog x
 #else
-#define ERROR_LOG(x)
+#define ERROR_LOG(x)           SCSI_PARALLEL_TRACE ( kSCSIParallelTraceCategory_Device, x )
 #endif
 
 #if ( SCSI_PARALLEL_DEVICE_DEBUGGING_LEVEL >= 3 )
 #define STATUS_LOG(x)          IOLog x
 #else
-#define STATUS_LOG(x)
+#define STATUS_LOG(x)          SCSI_PARALLEL_TRACE ( kSCSIParallelTraceCategory_Device | kSCSIParallelTraceStatus, x )
 #endif
 
 
@@ -89,9 +95,13 @@ OSDefineMetaClassAndStructors ( IOSCSIParallelInterfaceDevice, IOSCSIProtocolSer
 
 #define kIOPropertyIOUnitKey		"IOUnit"
 #define kIODeviceLocationKey		"io-device-location"
+#define kIOMultipathIdentifierKey	"Multipath Identifier"
 
 #define kMaxTaskRetryCount			3
 
+// The most pieces of a split READ or WRITE which are sent at the same time.
+#define kMaxSplitPieceCount			8
+
 enum
 {
 	kWorldWideNameDataSize 		= 8,
@@ -101,6 +111,64 @@ enum
 	kSCSIPortIdentifierDataSize = 8
 };
 
+enum
+{
+	kTaskAdmissionDictionaryEntryCount	= 10,
+	kStatisticsDictionaryEntryCount		= kSCSIParallelStatisticCount + 1
+};
+
+// The allocation length and timeout, in milliseconds, of the INQUIRY for
+// the Device Identification VPD page.
+enum
+{
+	kDeviceIdentificationPageSize		= 255,
+	kDeviceIdentificationTimeout		= 10000
+};
+
+
+//-----------------------------------------------------------------------------
+//	Structures
+//-----------------------------------------------------------------------------
+
+// The state shared with the completion of a command the device sends to its
+// Target on its own.
+typedef struct SCSIParallelDeviceCommand
+{
+	IOLock *	fLock;
+	bool		fDone;
+} SCSIParallelDeviceCommand;
+
+// Property keys for each of the I/O counters, indexed by counter.
+static const char * sStatisticsKeys[] =
+{
+	kIOStatisticsTasksSubmittedKey,
+	kIOStatisticsTasksCompletedKey,
+	kIOStatisticsBytesReadKey,
+	kIOStatisticsBytesWrittenKey,
+	kIOStatisticsErrorsKey,
+	kIOStatisticsTimeoutsKey,
+	kIOStatisticsResendsKey,
+	kIOStatisticsDMAMappingsKey,
+	kIOStatisticsDMAMappingTimeKey
+};
+
+
+//-----------------------------------------------------------------------------
+//	Prototypes
+//-----------------------------------------------------------------------------
+
+static bool
+GetReadWriteBlocks ( UInt8 *	cdb,
+					 UInt8		cdbSize,
+					 UInt64 *	logicalBlockAddress,
+					 UInt64 *	blockCount );
+
+static void
+SetReadWriteBlocks ( UInt8 *	cdb,
+					 UInt64		logicalBlockAddress,
+					 UInt64		blockCount );
+
+
 // Used by power manager to figure out what states we support
 // The default implementation supports two basic states: ON and OFF
 // ON state means the device can be used on this transport layer
@@ -138,7 +206,11 @@ IOSCSIParallelInterfaceDevice::SetInitialTargetProperties (
 	setProperty ( kIOPropertyProtocolCharacteristicsKey, protocolDict );
 	protocolDict->release ( );
 	protocolDict = NULL;
-		
+	
+	// Publish all of the properties at once.
+	result = BeginTargetPropertyTransaction ( );
+	require ( result, INIT_FAILURE );
+	
 	// Set the properties from the dictionary
 	value = properties->getObject ( kIOPropertyFibreChannelNodeWorldWideNameKey );
 	SetTargetProperty ( kIOPropertyFibreChannelNodeWorldWideNameKey, value );
@@ -158,6 +230,10 @@ IOSCSIParallelInterfaceDevice::SetInitialTargetProperties (
 	value = properties->getObject ( kIOPropertyRetryCountKey );
 	SetTargetProperty ( kIOPropertyRetryCountKey, value );
 	
+	CommitTargetPropertyTransaction ( );
+	
+	InitializeTaskAdmission ( properties );
+	
 	result = true;
 	
 	
@@ -177,9 +253,8 @@ bool
 IOSCSIParallelInterfaceDevice::start ( IOService * provider )
 {
 	
-	OSDictionary *	protocolDict	= NULL;
-	OSDictionary *	copyDict		= NULL;
 	bool			result			= false;
+	thread_t		thread			= NULL;
 	char			unit[10];
 	
 	// Save access to the controller object so that Tasks can be sent
@@ -207,17 +282,7 @@ IOSCSIParallelInterfaceDevice::start ( IOService * provider )
 	// Setup power management for this object.
 	InitializePowerManagement ( provider );
 	
-	copyDict = OSDynamicCast ( OSDictionary, copyProperty ( kIOPropertyProtocolCharacteristicsKey ) );
-	if ( copyDict != NULL )
-	{
-		
-		protocolDict = ( OSDictionary * ) copyDict->copyCollection ( );
-		copyDict->release ( );
-		copyDict = NULL;
-		
-	}
-	
-	if ( protocolDict != NULL )
+	if ( BeginTargetPropertyTransaction ( ) == true )
 	{
 		
 		OSNumber *	targetID = NULL;
@@ -227,7 +292,7 @@ IOSCSIParallelInterfaceDevice::start ( IOService * provider )
 		if ( targetID != NULL )
 		{
 			
-			protocolDict->setObject ( kIOPropertySCSITargetIdentifierKey, targetID );
+			fPropertyTransaction->setObject ( kIOPropertySCSITargetIdentifierKey, targetID );
 						
 			// Set the Unit number used to build the device tree path
 			setProperty ( kIOPropertyIOUnitKey, targetID );
@@ -236,9 +301,7 @@ IOSCSIParallelInterfaceDevice::start ( IOService * provider )
 			
 		}
 		
-		setProperty ( kIOPropertyProtocolCharacteristicsKey, protocolDict );
-		protocolDict->release ( );
-		protocolDict = NULL;
+		CommitTargetPropertyTransaction ( );
 		
 	}
 	
@@ -246,9 +309,34 @@ IOSCSIParallelInterfaceDevice::start ( IOService * provider )
     snprintf ( unit, 10, "%x", ( int ) fTargetIdentifier );
     setLocation ( unit );
 	
-	// The device and this driver have been succesfully configured
-	// and are ready to provide their services, call CreateSCSITargetDevice().
-	CreateSCSITargetDevice ( );
+	// If the Target may be reachable through other controllers, it is
+	// presented once it has been identified. That takes a command to the
+	// Target, which is not waited for here as start may be called on the
+	// controller's workloop.
+	if ( fMultiPathSupport == true )
+	{
+		
+		// Released by the thread once it is done.
+		retain ( );
+		
+		kernel_thread_start ( 
+			OSMemberFunctionCast (
+				thread_continue_t,
+				this,
+				&IOSCSIParallelInterfaceDevice::JoinPathGroup ),
+			this,
+			&thread );
+		
+	}
+	
+	else
+	{
+		
+		// The device and this driver have been succesfully configured
+		// and are ready to provide their services, call CreateSCSITargetDevice().
+		CreateSCSITargetDevice ( );
+		
+	}
 	
 	return true;
 	
@@ -271,7 +359,24 @@ PROVIDER_CAST_FAILURE:
 void
 IOSCSIParallelInterfaceDevice::stop ( IOService * provider )
 {
+	
+	SCSIParallelPathGroup *	group = NULL;
+	
+	// A path which is still being identified does not join its group.
+	IOSimpleLockLock ( fQueueLock );
+	fStopped = true;
+	group = fPathGroup;
+	IOSimpleLockUnlock ( fQueueLock );
+	
+	// Take this path out of its group. The multipath device keeps the
+	// Target presented over the other paths, and goes away with the last.
+	if ( group != NULL )
+	{
+		group->RemovePath ( this );
+	}
+	
 	super::stop ( provider );
+	
 }
 
 
@@ -331,11 +436,82 @@ IOSCSIParallelInterfaceDevice::free ( void )
 		
 	}
 	
+	// Drop any property transaction which was never committed.
+	if ( fPropertyTransaction != NULL )
+	{
+		
+		fPropertyTransaction->release ( );
+		fPropertyTransaction = NULL;
+		
+	}
+	
+	if ( fPropertyTransactionLock != NULL )
+	{
+		
+		IOLockFree ( fPropertyTransactionLock );
+		fPropertyTransactionLock = NULL;
+		
+	}
+	
+	if ( fStatistics != NULL )
+	{
+		
+		FreeStatistics ( fStatistics );
+		fStatistics = NULL;
+		
+	}
+	
+	if ( fPathGroup != NULL )
+	{
+		
+		fPathGroup->release ( );
+		fPathGroup = NULL;
+		
+	}
+	
+	if ( fMultipathDevice != NULL )
+	{
+		
+		fMultipathDevice->release ( );
+		fMultipathDevice = NULL;
+		
+	}
+	
+	// Drop any command trace which was never stopped.
+	if ( fTraceRecords != NULL )
+	{
+		
+		IOFree ( fTraceRecords, fTraceCapacity * sizeof ( SCSIParallelTraceRecord ) );
+		fTraceRecords	= NULL;
+		fTraceCapacity	= 0;
+		
+	}
+	
 	super::free ( );
 	
 }
 
 
+//-----------------------------------------------------------------------------
+//	serializeProperties - Refreshes the statistics before the properties
+//						  are serialized.							   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+bool
+IOSCSIParallelInterfaceDevice::serializeProperties ( OSSerialize * s ) const
+{
+	
+	// The statistics change with every task, so they are only published
+	// when somebody looks at them.
+	( ( IOSCSIParallelInterfaceDevice * ) this )->UpdateTaskAdmissionStatistics ( );
+	( ( IOSCSIParallelInterfaceDevice * ) this )->UpdateStatistics ( );
+	( ( IOSCSIParallelInterfaceDevice * ) this )->UpdateLatencyStatistics ( );
+	
+	return super::serializeProperties ( s );
+	
+}
+
+
 //-----------------------------------------------------------------------------
 //	message															   [PUBLIC]
 //-----------------------------------------------------------------------------
@@ -374,6 +550,16 @@ IOSCSIParallelInterfaceDevice::message (
 		case kSCSIPort_NotificationStatusChange:
 		{
 			
+			// Stop sending tasks over this path while its port is down.
+			if ( fPathGroup != NULL )
+			{
+				
+				fPathGroup->SetPathOnline (
+					this,
+					( ( SCSIPortStatus ) ( uintptr_t ) argument == kSCSIPort_StatusOnline ) );
+				
+			}
+			
 			// Port status is changing, let target device object know
 			// about it.
 			messageClients ( kSCSIPort_NotificationStatusChange, argument );
@@ -401,6 +587,12 @@ IOReturn
 IOSCSIParallelInterfaceDevice::requestProbe ( IOOptionBits options )
 {
 	
+	// The multipath device presents the Target.
+	if ( fPathGroup != NULL )
+	{
+		return kIOReturnNotPermitted;
+	}
+	
 	// See if this device already has any opens on it.
 	if ( isOpen ( ) == false )
 	{
@@ -420,6 +612,72 @@ IOSCSIParallelInterfaceDevice::requestProbe ( IOOptionBits options )
 	
 }
 
+
+//-----------------------------------------------------------------------------
+//	setProperties - Starts and stops command trace capture.			   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+IOReturn
+IOSCSIParallelInterfaceDevice::setProperties ( OSObject * properties )
+{
+	
+	OSDictionary *	dict		= NULL;
+	OSObject *		value		= NULL;
+	OSNumber *		number		= NULL;
+	UInt32			recordCount	= 0;
+	IOReturn		status		= kIOReturnUnsupported;
+	
+	dict = OSDynamicCast ( OSDictionary, properties );
+	require_nonzero ( dict, ErrorExit );
+	
+	value = dict->getObject ( kIOCommandTraceKey );
+	require_nonzero_quiet ( value, ErrorExit );
+	
+	// A capture copies every command sent to the Target.
+	status = IOUserClient::clientHasPrivilege ( current_task ( ), kIOClientPrivilegeAdministrator );
+	require_success ( status, ErrorExit );
+	
+	if ( value == kOSBooleanTrue )
+	{
+		recordCount = kSCSIParallelTraceDefaultRecordCount;
+	}
+	
+	else if ( value != kOSBooleanFalse )
+	{
+		
+		number = OSDynamicCast ( OSNumber, value );
+		require_nonzero_action ( number, ErrorExit, status = kIOReturnBadArgument );
+		
+		recordCount = number->unsigned32BitValue ( );
+		if ( recordCount > kSCSIParallelTraceMaximumRecordCount )
+		{
+			recordCount = kSCSIParallelTraceMaximumRecordCount;
+		}
+		
+	}
+	
+	if ( recordCount == 0 )
+	{
+		
+		StopCommandTrace ( );
+		status = kIOReturnSuccess;
+		
+	}
+	
+	else
+	{
+		status = StartCommandTrace ( recordCount ) ? kIOReturnSuccess : kIOReturnNoMemory;
+	}
+	
+	
+ErrorExit:
+	
+	
+	return status;
+	
+}
+
+
 //-----------------------------------------------------------------------------
 // InitializePowerManagement - 	Register the driver with our policy-maker
 //								(also in the same class).			[PROTECTED]
@@ -525,6 +783,10 @@ IOSCSIParallelInterfaceDevice::InitTarget (
 	fQueueLock = IOSimpleLockAlloc ( );
 	require_nonzero ( fQueueLock, ERROR_EXIT );
 	
+	// Allocate the lock for property transactions
+	fPropertyTransactionLock = IOLockAlloc ( );
+	require_nonzero ( fPropertyTransactionLock, PROPERTY_LOCK_ALLOC_FAILURE );
+	
 	if ( entry != NULL )
 	{
 		
@@ -550,6 +812,35 @@ IOSCSIParallelInterfaceDevice::InitTarget (
 	
 	fAllowResends = true;
 	
+	fRecoveryTask		= NULL;
+	fRecoveryStep		= 0;
+	fRecoveryStartTime	= 0;
+	
+	fOrderedTaskCount	= 0;
+	fUrgentResendStreak	= 0;
+	
+	fPropertyTransaction		= NULL;
+	fPropertyTransactionDepth	= 0;
+	fPropertyTransactionOwner	= NULL;
+	
+	fPathGroup			= NULL;
+	fMultipathDevice	= NULL;
+	fStopped			= false;
+	
+	fTraceRecords		= NULL;
+	fTraceCapacity		= 0;
+	fTraceNext			= 0;
+	fTraceDropped		= 0;
+	fTraceGeneration	= 0;
+	fTraceStartTime		= 0;
+	
+	// No reservation or cap and an equal share by default.
+	bzero ( &fTaskAdmission, sizeof ( fTaskAdmission ) );
+	fTaskAdmission.fWeight = 1;
+	
+	// The target works without statistics if they can't be allocated.
+	fStatistics = AllocateStatistics ( );
+	
 	// Set Multipath support to 'true' by default. 
 	// The HBA driver will be queried and this will be
 	// updated.
@@ -572,6 +863,13 @@ HBA_DATA_ALLOC_FAILURE:
 ATTACH_TO_PARENT_FAILURE:
 	
 	
+	IOLockFree ( fPropertyTransactionLock );
+	fPropertyTransactionLock = NULL;
+	
+	
+PROPERTY_LOCK_ALLOC_FAILURE:
+	
+	
 	require_nonzero_quiet ( fQueueLock, ERROR_EXIT );
 	IOSimpleLockFree ( fQueueLock );
 	fQueueLock = NULL;
@@ -678,8 +976,6 @@ void
 IOSCSIParallelInterfaceDevice::DetermineParallelFeatures ( UInt8 * inqData )
 {
 	
-	OSDictionary *	dict			= NULL;
-	OSDictionary *	copyDict		= NULL;
 	OSNumber *		features		= NULL;
 	UInt64			deviceFeatures	= 0;
 	UInt64			ITNexusFeatures	= 0;
@@ -782,23 +1078,14 @@ IOSCSIParallelInterfaceDevice::DetermineParallelFeatures ( UInt8 * inqData )
 		
 	}
 	
-	copyDict = ( OSDictionary * ) copyProperty ( kIOPropertyProtocolCharacteristicsKey );
-	if ( copyDict != NULL )
-	{
-		
-		dict = ( OSDictionary * ) copyDict->copyCollection ( );
-		copyDict->release ( );
-		
-	}
-	
-	if ( dict != NULL )
+	if ( BeginTargetPropertyTransaction ( ) == true )
 	{
 		
 		features = OSNumber::withNumber ( deviceFeatures, 64 );
 		if ( features != NULL )
 		{
 			
-			dict->setObject ( kIOPropertySCSIDeviceFeaturesKey, features );
+			fPropertyTransaction->setObject ( kIOPropertySCSIDeviceFeaturesKey, features );
 			features->release ( );
 			features = NULL;
 			
@@ -808,15 +1095,13 @@ IOSCSIParallelInterfaceDevice::DetermineParallelFeatures ( UInt8 * inqData )
 		if ( features != NULL )
 		{
 			
-			dict->setObject ( kIOPropertySCSI_I_T_NexusFeaturesKey, features );
+			fPropertyTransaction->setObject ( kIOPropertySCSI_I_T_NexusFeaturesKey, features );
 			features->release ( );
 			features = NULL;
 			
 		}
 		
-		setProperty ( kIOPropertyProtocolCharacteristicsKey, dict );
-		dict->release ( );
-		dict = NULL;
+		CommitTargetPropertyTransaction ( );
 		
 	}
 	
@@ -824,65 +1109,568 @@ IOSCSIParallelInterfaceDevice::DetermineParallelFeatures ( UInt8 * inqData )
 
 
 //-----------------------------------------------------------------------------
-//	GetTargetIdentifier - Retrieves the SCSITargetIdentifier for this device.
-//																	   [PUBLIC]
+//	InitializeTaskAdmission - 	Sets the reservation, cap and weight for this
+//								Target.								  [PRIVATE]
 //-----------------------------------------------------------------------------
 
-SCSITargetIdentifier
-IOSCSIParallelInterfaceDevice::GetTargetIdentifier ( void )
+void
+IOSCSIParallelInterfaceDevice::InitializeTaskAdmission (
+							OSDictionary *				properties )
 {
-	return fTargetIdentifier;
+	
+	OSDictionary *	dicts[2]	= { NULL, NULL };
+	OSNumber *		number		= NULL;
+	IOService *		provider	= NULL;
+	
+	// The defaults for all targets come from the controller's personality,
+	// the overrides for this Target from the properties it was created with.
+	provider = getProvider ( );
+	if ( provider != NULL )
+	{
+		dicts[0] = OSDynamicCast ( OSDictionary, provider->getProperty ( kIOTaskAdmissionKey ) );
+	}
+	
+	dicts[1] = properties;
+	
+	for ( UInt32 index = 0; index < 2; index++ )
+	{
+		
+		if ( dicts[index] == NULL )
+		{
+			continue;
+		}
+		
+		number = OSDynamicCast ( OSNumber, dicts[index]->getObject ( kIOTaskReservationKey ) );
+		if ( number != NULL )
+		{
+			fTaskAdmission.fReservation = number->unsigned32BitValue ( );
+		}
+		
+		number = OSDynamicCast ( OSNumber, dicts[index]->getObject ( kIOTaskCapKey ) );
+		if ( number != NULL )
+		{
+			fTaskAdmission.fCap = number->unsigned32BitValue ( );
+		}
+		
+		number = OSDynamicCast ( OSNumber, dicts[index]->getObject ( kIOTaskWeightKey ) );
+		if ( number != NULL )
+		{
+			fTaskAdmission.fWeight = number->unsigned32BitValue ( );
+		}
+		
+	}
+	
+	// A Target can't be guaranteed more than it is allowed to use, and
+	// every Target gets some share.
+	if ( ( fTaskAdmission.fCap != 0 ) &&
+		 ( fTaskAdmission.fReservation > fTaskAdmission.fCap ) )
+	{
+		fTaskAdmission.fReservation = fTaskAdmission.fCap;
+	}
+	
+	if ( fTaskAdmission.fWeight == 0 )
+	{
+		fTaskAdmission.fWeight = 1;
+	}
+	
+	UpdateTaskAdmissionStatistics ( );
+	
 }
 
 
 //-----------------------------------------------------------------------------
-//	GetHBADataPointer - Retrieves the pointer to the HBA Data for this device.
-//																	   [PUBLIC]
+//	UpdateTaskAdmissionStatistics - Publishes the task admission state.
+//																	  [PRIVATE]
 //-----------------------------------------------------------------------------
 
-void *
-IOSCSIParallelInterfaceDevice::GetHBADataPointer ( void )
+void
+IOSCSIParallelInterfaceDevice::UpdateTaskAdmissionStatistics ( void )
 {
-	return fHBAData;
+	
+	OSDictionary *	dict	= NULL;
+	OSNumber *		number	= NULL;
+	
+	const char *	keys[kTaskAdmissionDictionaryEntryCount] =
+	{
+		kIOTaskReservationKey,
+		kIOTaskCapKey,
+		kIOTaskWeightKey,
+		kIOTaskAdmissionOutstandingKey,
+		kIOTaskAdmissionMaximumOutstandingKey,
+		kIOTaskAdmissionDeferralsKey,
+		kIOTaskAdmissionWaitsKey,
+		kIOTaskAdmissionTotalWaitTimeKey,
+		kIOTaskAdmissionMaximumWaitTimeKey,
+		kIOTaskAdmissionPoolEmptyKey
+	};
+	
+	UInt64			values[kTaskAdmissionDictionaryEntryCount] =
+	{
+		fTaskAdmission.fReservation,
+		fTaskAdmission.fCap,
+		fTaskAdmission.fWeight,
+		fTaskAdmission.fOutstanding,
+		fTaskAdmission.fMaximumOutstanding,
+		fTaskAdmission.fDeferrals,
+		fTaskAdmission.fWaits,
+		fTaskAdmission.fTotalWaitTime,
+		fTaskAdmission.fMaximumWaitTime,
+		fTaskAdmission.fPoolEmpty
+	};
+	
+	dict = OSDictionary::withCapacity ( kTaskAdmissionDictionaryEntryCount );
+	require_nonzero ( dict, ErrorExit );
+	
+	for ( UInt32 index = 0; index < kTaskAdmissionDictionaryEntryCount; index++ )
+	{
+		
+		number = OSNumber::withNumber ( values[index], 64 );
+		if ( number != NULL )
+		{
+			
+			dict->setObject ( keys[index], number );
+			number->release ( );
+			number = NULL;
+			
+		}
+		
+	}
+	
+	setProperty ( kIOTaskAdmissionStatisticsKey, dict );
+	dict->release ( );
+	dict = NULL;
+	
+	
+ErrorExit:
+	
+	
+	return;
+	
 }
 
 
 //-----------------------------------------------------------------------------
-//	GetHBADataSize - Retrieves the HBA Data size for this device.	   [PUBLIC]
+//	GetStatistics - Retrieves the I/O statistics for this Target.	   [PUBLIC]
 //-----------------------------------------------------------------------------
 
-UInt32
-IOSCSIParallelInterfaceDevice::GetHBADataSize ( void )
+SCSIParallelStatistics *
+IOSCSIParallelInterfaceDevice::GetStatistics ( void )
 {
-	return fHBADataSize;
+	return fStatistics;
 }
 
 
 //-----------------------------------------------------------------------------
-//	IsFeatureNegotiationNecessary - 	Checks if a feature negotiation is
-//										necessary.					   [PUBLIC]
+//	AllocateStatistics - Allocates a zeroed set of I/O statistics.	   [PUBLIC]
 //-----------------------------------------------------------------------------
 
-bool
-IOSCSIParallelInterfaceDevice::IsFeatureNegotiationNecessary (
-							SCSIParallelFeature			feature )
+SCSIParallelStatistics *
+IOSCSIParallelInterfaceDevice::AllocateStatistics ( void )
 {
-	// Verify that the requested feature is one that is known to
-	// the device object.
-	if ( feature >= kSCSIParallelFeature_TotalFeatureCount )
+	
+	SCSIParallelStatistics *	statistics = NULL;
+	
+	// Align the stripes to cache lines.
+	statistics = ( SCSIParallelStatistics * ) IOMallocAligned (
+						sizeof ( SCSIParallelStatistics ),
+						sizeof ( SCSIParallelStatisticsStripe ) );
+	
+	if ( statistics != NULL )
 	{
-		return false;
+		bzero ( statistics, sizeof ( SCSIParallelStatistics ) );
 	}
 	
-	return ( fITNexusSupportsFeature[feature] &&
-			 ( fFeatureIsNegotiated[feature] == false ) );
+	return statistics;
 	
 }
 
 
 //-----------------------------------------------------------------------------
-//	FindTaskForAddress - 	Find the outstanding task for the Task Address of
-//							this Target and the specified Lun and Tag.
+//	FreeStatistics - Frees a set of I/O statistics.					   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceDevice::FreeStatistics (
+								SCSIParallelStatistics * statistics )
+{
+	IOFreeAligned ( statistics, sizeof ( SCSIParallelStatistics ) );
+}
+
+
+//-----------------------------------------------------------------------------
+//	AddStatistic - Adds to one of the counters in the current thread's
+//				   stripe.											   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceDevice::AddStatistic (
+								SCSIParallelStatistics *	statistics,
+								UInt32						counter,
+								UInt64						value )
+{
+	
+	uintptr_t	thread	= ( uintptr_t ) current_thread ( );
+	UInt32		stripe	= 0;
+	
+	// Hash the thread pointer, as the processor number is not part of the
+	// KPIs the family links against. Threads sharing a stripe are fine,
+	// since the stripe is updated atomically.
+	stripe = ( ( thread >> 8 ) ^ ( thread >> 12 ) ) & kSCSIParallelStatisticsStripeMask;
+	
+	if ( statistics != NULL )
+	{
+		OSAddAtomic64 ( value, &statistics->fStripe[stripe].fCounter[counter] );
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	CreateStatisticsDictionary - Sums the stripes of a set of I/O statistics.
+//																	   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+OSDictionary *
+IOSCSIParallelInterfaceDevice::CreateStatisticsDictionary (
+								SCSIParallelStatistics * statistics )
+{
+	
+	OSDictionary *	dict		= NULL;
+	OSNumber *		number		= NULL;
+	SInt64			queueDepth	= 0;
+	SInt64			values[kSCSIParallelStatisticCount];
+	
+	require_nonzero ( statistics, ErrorExit );
+	
+	bzero ( values, sizeof ( values ) );
+	
+	// The stripes are read without any lock, so the sums may be off by the
+	// tasks in flight while they are read.
+	for ( UInt32 stripe = 0; stripe < kSCSIParallelStatisticsStripeCount; stripe++ )
+	{
+		
+		for ( UInt32 counter = 0; counter < kSCSIParallelStatisticCount; counter++ )
+		{
+			values[counter] += statistics->fStripe[stripe].fCounter[counter];
+		}
+		
+	}
+	
+	queueDepth = values[kSCSIParallelStatistic_TasksSubmitted] -
+				 values[kSCSIParallelStatistic_TasksCompleted];
+	
+	if ( queueDepth < 0 )
+	{
+		queueDepth = 0;
+	}
+	
+	dict = OSDictionary::withCapacity ( kStatisticsDictionaryEntryCount );
+	require_nonzero ( dict, ErrorExit );
+	
+	for ( UInt32 counter = 0; counter < kSCSIParallelStatisticCount; counter++ )
+	{
+		
+		number = OSNumber::withNumber ( values[counter], 64 );
+		if ( number != NULL )
+		{
+			
+			dict->setObject ( sStatisticsKeys[counter], number );
+			number->release ( );
+			number = NULL;
+			
+		}
+		
+	}
+	
+	number = OSNumber::withNumber ( queueDepth, 64 );
+	if ( number != NULL )
+	{
+		
+		dict->setObject ( kIOStatisticsQueueDepthKey, number );
+		number->release ( );
+		number = NULL;
+		
+	}
+	
+	
+ErrorExit:
+	
+	
+	return dict;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	UpdateStatistics - Publishes the I/O statistics.				  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceDevice::UpdateStatistics ( void )
+{
+	
+	OSDictionary *	dict = NULL;
+	
+	dict = CreateStatisticsDictionary ( fStatistics );
+	require_nonzero_quiet ( dict, ErrorExit );
+	
+	setProperty ( kIOStatisticsKey, dict );
+	dict->release ( );
+	dict = NULL;
+	
+	
+ErrorExit:
+	
+	
+	return;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	RecordTaskLatency - Adds the stages of a completed task to the latency
+//						breakdown.									  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceDevice::RecordTaskLatency ( SCSIParallelTaskIdentifier parallelTask )
+{
+	
+	SCSIParallelTask *	task	= ( SCSIParallelTask * ) parallelTask;
+	UInt64 *			time	= task->fStageTime;
+	UInt64				end		= 0;
+	
+	task->MarkStage ( kSCSIParallelTaskStage_Completed, mach_absolute_time ( ) );
+	
+	// Only a task taken from the pool for a client's request waited for it.
+	if ( time[kSCSIParallelTaskStage_Acquired] != 0 )
+	{
+		
+		RecordStageLatency ( kSCSIParallelLatency_PoolWait, 0, time[kSCSIParallelTaskStage_Acquired] );
+		RecordStageLatency ( kSCSIParallelLatency_Setup,
+							 time[kSCSIParallelTaskStage_Acquired],
+							 time[kSCSIParallelTaskStage_Executed] );
+		
+	}
+	
+	// Without an interrupt filter, the HBA stage runs until the completion.
+	end = time[kSCSIParallelTaskStage_Interrupted];
+	if ( end == 0 )
+	{
+		end = time[kSCSIParallelTaskStage_HBACompleted];
+	}
+	
+	else
+	{
+		
+		RecordStageLatency ( kSCSIParallelLatency_Interrupt,
+							 time[kSCSIParallelTaskStage_Interrupted],
+							 time[kSCSIParallelTaskStage_HBACompleted] );
+		
+	}
+	
+	RecordStageLatency ( kSCSIParallelLatency_HBA, time[kSCSIParallelTaskStage_Executed], end );
+	RecordStageLatency ( kSCSIParallelLatency_Completion,
+						 time[kSCSIParallelTaskStage_HBACompleted],
+						 time[kSCSIParallelTaskStage_Completed] );
+	RecordStageLatency ( kSCSIParallelLatency_Total, 0, time[kSCSIParallelTaskStage_Completed] );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	RecordStageLatency - Counts the time between two stage offsets in one
+//						 of the latency histograms.					  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceDevice::RecordStageLatency ( UInt32 histogram, UInt64 start, UInt64 end )
+{
+	
+	UInt64	elapsed	= 0;
+	UInt32	bucket	= 0;
+	
+	// The stage was not reached.
+	require_quiet ( ( end != 0 ), Exit );
+	require_quiet ( ( end >= start ), Exit );
+	
+	absolutetime_to_nanoseconds ( end - start, &elapsed );
+	elapsed /= kMicrosecondScale;
+	
+	// Bucket n counts the times shorter than 2^n microseconds.
+	while ( ( bucket < ( kSCSIParallelLatencyBucketCount - 1 ) ) &&
+			( elapsed >= ( 1ULL << bucket ) ) )
+	{
+		bucket++;
+	}
+	
+	fLatency[histogram][bucket]++;
+	
+	
+Exit:
+	
+	
+	return;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	UpdateLatencyStatistics - Publishes the task latency breakdown.
+//																	  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceDevice::UpdateLatencyStatistics ( void )
+{
+	
+	OSDictionary *	dict		= NULL;
+	OSArray *		array		= NULL;
+	OSNumber *		number		= NULL;
+	
+	const char *	keys[kSCSIParallelLatencyCount] =
+	{
+		kIOTaskStagePoolWaitKey,
+		kIOTaskStageSetupKey,
+		kIOTaskStageHBAKey,
+		kIOTaskStageInterruptKey,
+		kIOTaskStageCompletionKey,
+		kIOTaskStageTotalKey
+	};
+	
+	dict = OSDictionary::withCapacity ( kSCSIParallelLatencyCount );
+	require_nonzero ( dict, ErrorExit );
+	
+	for ( UInt32 histogram = 0; histogram < kSCSIParallelLatencyCount; histogram++ )
+	{
+		
+		array = OSArray::withCapacity ( kSCSIParallelLatencyBucketCount );
+		require_nonzero ( array, ReleaseDictionary );
+		
+		for ( UInt32 bucket = 0; bucket < kSCSIParallelLatencyBucketCount; bucket++ )
+		{
+			
+			number = OSNumber::withNumber ( fLatency[histogram][bucket], 64 );
+			if ( number != NULL )
+			{
+				
+				array->setObject ( number );
+				number->release ( );
+				number = NULL;
+				
+			}
+			
+		}
+		
+		dict->setObject ( keys[histogram], array );
+		array->release ( );
+		array = NULL;
+		
+	}
+	
+	setProperty ( kIOTaskStageLatencyKey, dict );
+	
+	
+ReleaseDictionary:
+	
+	
+	dict->release ( );
+	dict = NULL;
+	
+	
+ErrorExit:
+	
+	
+	return;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	GetTargetIdentifier - Retrieves the SCSITargetIdentifier for this device.
+//																	   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+SCSITargetIdentifier
+IOSCSIParallelInterfaceDevice::GetTargetIdentifier ( void )
+{
+	return fTargetIdentifier;
+}
+
+
+//-----------------------------------------------------------------------------
+//	GetHBADataPointer - Retrieves the pointer to the HBA Data for this device.
+//																	   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+void *
+IOSCSIParallelInterfaceDevice::GetHBADataPointer ( void )
+{
+	return fHBAData;
+}
+
+
+//-----------------------------------------------------------------------------
+//	GetHBADataSize - Retrieves the HBA Data size for this device.	   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+UInt32
+IOSCSIParallelInterfaceDevice::GetHBADataSize ( void )
+{
+	return fHBADataSize;
+}
+
+
+//-----------------------------------------------------------------------------
+//	IsFeatureNegotiationNecessary - 	Checks if a feature negotiation is
+//										necessary.					   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+bool
+IOSCSIParallelInterfaceDevice::IsFeatureNegotiationNecessary (
+							SCSIParallelFeature			feature )
+{
+	// Verify that the requested feature is one that is known to
+	// the device object.
+	if ( feature >= kSCSIParallelFeature_TotalFeatureCount )
+	{
+		return false;
+	}
+	
+	return ( fITNexusSupportsFeature[feature] &&
+			 ( fFeatureIsNegotiated[feature] == false ) );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	RegisterDataBuffer - Registers a data buffer with the controller.  [PUBLIC]
+//-----------------------------------------------------------------------------
+
+IOReturn
+IOSCSIParallelInterfaceDevice::RegisterDataBuffer (
+							IOMemoryDescriptor *		buffer )
+{
+	return fController->RegisterDataBuffer ( buffer );
+}
+
+
+//-----------------------------------------------------------------------------
+//	UnregisterDataBuffer - 	Unregisters a data buffer from the
+//							controller.							   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+IOReturn
+IOSCSIParallelInterfaceDevice::UnregisterDataBuffer (
+							IOMemoryDescriptor *		buffer )
+{
+	return fController->UnregisterDataBuffer ( buffer );
+}
+
+
+//-----------------------------------------------------------------------------
+//	FindTaskForAddress - 	Find the outstanding task for the Task Address of
+//							this Target and the specified Lun and Tag.
 //																	   [PUBLIC]
 //-----------------------------------------------------------------------------
 
@@ -983,29 +1771,324 @@ IOSCSIParallelInterfaceDevice::FindTaskForControllerIdentifier (
 
 
 //-----------------------------------------------------------------------------
-//	SetTargetProperty - Sets a target property. 					   [PUBLIC]
+//	FindTaskForNexus - 	Find the first outstanding task of this Target which
+//						belongs to the specified nexus and which the
+//						controller does not have.					   [PUBLIC]
 //-----------------------------------------------------------------------------
 
-bool	
-IOSCSIParallelInterfaceDevice::SetTargetProperty ( 
-									const char * 		key,
-									OSObject *			value )
+SCSIParallelTaskIdentifier
+IOSCSIParallelInterfaceDevice::FindTaskForNexus (
+							SCSILogicalUnitNumber		theL,
+							SCSITaggedTaskIdentifier	theQ,
+							SCSIParallelTaskNexus		theNexus )
 {
 	
-	bool			result			= false;
-	OSDictionary *	protocolDict	= NULL;
-	OSDictionary *	copyDict		= NULL;
+	SCSIParallelTask *	task 		= NULL;
+	bool				found		= false;
 	
-	require_nonzero ( key, ErrorExit );
+	// Grab the queue lock.
+	IOSimpleLockLock ( fQueueLock );
+	
+	// A task waiting to be resent has been handed back by the controller.
+	// Pull it off the resend list so that it is never reissued.
+	queue_iterate ( &fResendTaskList, task, SCSIParallelTask *, fResendTaskChain )
+	{
+		
+		if ( IsTaskInNexus ( task, theL, theQ, theNexus ) == true )
+		{
+			
+			UnlinkResendTask ( task );
+			found = true;
+			break;
+			
+		}
+		
+	}
+	
+	if ( found == false )
+	{
+		
+		// Otherwise, look for a task the controller released, or one it is
+		// holding and never sent, unless the HBA already completed it. The
+		// HBA still has every other task, and will complete it itself.
+		queue_iterate ( &fOutstandingTaskList, task, SCSIParallelTask *, fCommandChain )
+		{
+			
+			if ( ( ( task->fState == kSCSIParallelTaskState_Released ) ||
+				   ( ( task->fHeld == true ) && ( task->fState == kSCSIParallelTaskState_Family ) ) ) &&
+				 ( IsTaskInNexus ( task, theL, theQ, theNexus ) == true ) )
+			{
+				
+				found = true;
+				break;
+				
+			}
+			
+		}
+		
+	}
+	
+	IOSimpleLockUnlock ( fQueueLock );
+	
+	if ( found == false )
+	{
+		task = NULL;
+	}
+	
+	return task;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	BeginRecovery - Starts timeout recovery for a task.				   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceDevice::BeginRecovery (
+							SCSIParallelTaskIdentifier	parallelTask )
+{
+	
+	fRecoveryTask		= parallelTask;
+	fRecoveryStep		= 0;
+	fRecoveryStartTime	= mach_absolute_time ( );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	EndRecovery - Ends timeout recovery. Returns its duration in ms.   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+UInt64
+IOSCSIParallelInterfaceDevice::EndRecovery ( void )
+{
+	
+	UInt64	elapsed = 0;
+	
+	absolutetime_to_nanoseconds ( mach_absolute_time ( ) - fRecoveryStartTime, &elapsed );
+	
+	fRecoveryTask		= NULL;
+	fRecoveryStep		= 0;
+	fRecoveryStartTime	= 0;
+	
+	return ( elapsed / kMillisecondScale );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	GetRecoveryTask - Gets the task being recovered.				   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+SCSIParallelTaskIdentifier
+IOSCSIParallelInterfaceDevice::GetRecoveryTask ( void )
+{
+	return fRecoveryTask;
+}
+
+
+//-----------------------------------------------------------------------------
+//	GetRecoveryStep - Gets the current recovery step.				   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+UInt8
+IOSCSIParallelInterfaceDevice::GetRecoveryStep ( void )
+{
+	return fRecoveryStep;
+}
+
+
+//-----------------------------------------------------------------------------
+//	SetRecoveryStep - Sets the current recovery step.				   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceDevice::SetRecoveryStep ( UInt8 step )
+{
+	fRecoveryStep = step;
+}
+
+
+//-----------------------------------------------------------------------------
+//	GetTaskAdmission - Gets the task admission state.				   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+SCSIParallelTaskAdmission *
+IOSCSIParallelInterfaceDevice::GetTaskAdmission ( void )
+{
+	return &fTaskAdmission;
+}
+
+
+//-----------------------------------------------------------------------------
+//	SetTargetProperty - Sets a target property. 					   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+bool	
+IOSCSIParallelInterfaceDevice::SetTargetProperty ( 
+									const char * 		key,
+									OSObject *			value )
+{
+	
+	bool	result = false;
+	
+	require_nonzero ( key, ErrorExit );
 	require_nonzero ( value, ErrorExit );
 	
-	copyDict = OSDynamicCast ( OSDictionary, copyProperty ( kIOPropertyProtocolCharacteristicsKey ) );
-	require_nonzero ( copyDict, ErrorExit );
+	result = BeginTargetPropertyTransaction ( );
+	require ( result, ErrorExit );
+	
+	result = SetTargetPropertyInDictionary ( fPropertyTransaction, key, value );
+	
+	CommitTargetPropertyTransaction ( );
+	
+	
+ErrorExit:
+	
+	
+	return result;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	RemoveTargetProperty - Removes a property for this object. 		   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+void	
+IOSCSIParallelInterfaceDevice::RemoveTargetProperty ( const char * key )
+{
+	
+	bool	result = false;
 	
-	protocolDict = ( OSDictionary * ) copyDict->copyCollection ( );
-	copyDict->release ( );
+	require_nonzero ( key, ErrorExit );
+	
+	result = BeginTargetPropertyTransaction ( );
+	require ( result, ErrorExit );
+	
+	if ( fPropertyTransaction->getObject ( key ) != NULL )
+	{
+		
+		fPropertyTransaction->removeObject ( key );
+		
+	}
+	
+	CommitTargetPropertyTransaction ( );
+	
+	
+ErrorExit:
+	
+	
+	return;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	BeginTargetPropertyTransaction - 	Starts a property transaction. 
+//																	   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+bool
+IOSCSIParallelInterfaceDevice::BeginTargetPropertyTransaction ( void )
+{
+	
+	bool			result		= false;
+	OSDictionary *	copyDict	= NULL;
+	thread_t		thread		= current_thread ( );
+	
+	IOLockLock ( fPropertyTransactionLock );
+	
+	// Wait for another thread's transaction to be committed, so that our
+	// changes are not published with it.
+	while ( ( fPropertyTransactionDepth != 0 ) && ( fPropertyTransactionOwner != thread ) )
+	{
+		IOLockSleep ( fPropertyTransactionLock, &fPropertyTransactionDepth, THREAD_UNINT );
+	}
+	
+	// Only the outermost transaction takes a copy of the dictionary.
+	if ( fPropertyTransactionDepth == 0 )
+	{
+		
+		copyDict = OSDynamicCast ( OSDictionary, copyProperty ( kIOPropertyProtocolCharacteristicsKey ) );
+		require_nonzero ( copyDict, ErrorExit );
+		
+		fPropertyTransaction = ( OSDictionary * ) copyDict->copyCollection ( );
+		copyDict->release ( );
+		
+		require_nonzero ( fPropertyTransaction, ErrorExit );
+		
+		fPropertyTransactionOwner = thread;
+		
+	}
+	
+	fPropertyTransactionDepth++;
+	result = true;
+	
+	
+ErrorExit:
+	
+	
+	IOLockUnlock ( fPropertyTransactionLock );
+	
+	return result;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	CommitTargetPropertyTransaction - 	Ends a property transaction,
+//										publishing the changes if it is the
+//										outermost one.				   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceDevice::CommitTargetPropertyTransaction ( void )
+{
+	
+	IOLockLock ( fPropertyTransactionLock );
+	
+	require_nonzero ( fPropertyTransactionDepth, ErrorExit );
+	require ( ( fPropertyTransactionOwner == current_thread ( ) ), ErrorExit );
+	
+	fPropertyTransactionDepth--;
+	if ( fPropertyTransactionDepth == 0 )
+	{
+		
+		setProperty ( kIOPropertyProtocolCharacteristicsKey, fPropertyTransaction );
+		fPropertyTransaction->release ( );
+		fPropertyTransaction = NULL;
+		fPropertyTransactionOwner = NULL;
+		
+		// Let any thread waiting to start a transaction go.
+		IOLockWakeup ( fPropertyTransactionLock, &fPropertyTransactionDepth, false );
+		
+	}
 	
-	require_nonzero ( protocolDict, ErrorExit );
+	
+ErrorExit:
+	
+	
+	IOLockUnlock ( fPropertyTransactionLock );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	SetTargetPropertyInDictionary - Validates a target property and sets it
+//									in the given protocol characteristics
+//									dictionary.						  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+bool
+IOSCSIParallelInterfaceDevice::SetTargetPropertyInDictionary (
+									OSDictionary *		protocolDict,
+									const char * 		key,
+									OSObject *			value )
+{
+	
+	bool	result = false;
 	
 	if ( strcmp ( key, kIOPropertyFibreChannelPortWorldWideNameKey ) == 0 )
 	{
@@ -1078,10 +2161,6 @@ IOSCSIParallelInterfaceDevice::SetTargetProperty (
 		result = protocolDict->setObject ( key, value );
 		
 	}
-		
-	setProperty ( kIOPropertyProtocolCharacteristicsKey, protocolDict );
-	protocolDict->release ( );
-	protocolDict = NULL;
 	
 	
 ErrorExit:
@@ -1092,47 +2171,6 @@ ErrorExit:
 }
 
 
-//-----------------------------------------------------------------------------
-//	RemoveTargetProperty - Removes a property for this object. 		   [PUBLIC]
-//-----------------------------------------------------------------------------
-
-void	
-IOSCSIParallelInterfaceDevice::RemoveTargetProperty ( const char * key )
-{
-	
-	OSDictionary *	protocolDict	= NULL;
-	OSDictionary *	copyDict		= NULL;
-	
-	require_nonzero ( key, ErrorExit );
-	
-	copyDict = OSDynamicCast ( OSDictionary, copyProperty ( kIOPropertyProtocolCharacteristicsKey ) );
-	require_nonzero ( copyDict, ErrorExit );
-	
-	protocolDict = ( OSDictionary * ) copyDict->copyCollection ( );
-	copyDict->release ( );
-	
-	require_nonzero ( protocolDict, ErrorExit );
-	
-	if ( protocolDict->getObject ( key ) != NULL )
-	{
-		
-		protocolDict->removeObject ( key );
-		
-	}
-	
-	setProperty ( kIOPropertyProtocolCharacteristicsKey, protocolDict );
-	protocolDict->release ( );
-	protocolDict = NULL;
-	
-	
-ErrorExit:
-	
-	
-	return;
-	
-}
-
-
 #if 0
 #pragma mark -
 #pragma mark SCSI Protocol Services Member Routines
@@ -1151,23 +2189,80 @@ IOSCSIParallelInterfaceDevice::SendSCSICommand (
 							SCSITaskStatus *			taskStatus )
 {
 	
-	SCSIParallelTaskIdentifier		parallelTask	= NULL;
-	IOMemoryDescriptor *			buffer			= NULL;
-	IOReturn						status			= kIOReturnBadArgument;
-	IOWorkLoop *					workLoop		= NULL;
-	bool							block			= true;
-	
-	// Set the defaults to an error state.		
-	*taskStatus			= kSCSITaskStatus_No_Status;
-	*serviceResponse	= kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
+	// The tasks for a Target which is reachable through several controllers
+	// are sent by its multipath device, which picks the path. Those sent
+	// here are the path's own.
+	return DispatchSCSICommand ( request, serviceResponse, taskStatus );
 	
-	if ( isInactive ( ) == true )
-	{
+}
+
+
+//-----------------------------------------------------------------------------
+//	DispatchSCSICommand - Sends a command to the controller of this path.
+//																	  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+bool
+IOSCSIParallelInterfaceDevice::DispatchSCSICommand (
+							SCSITaskIdentifier			request,
+							SCSIServiceResponse * 		serviceResponse,
+							SCSITaskStatus *			taskStatus )
+{
+	
+	SCSIParallelTaskIdentifier		parallelTask	= NULL;
+	SCSIParallelSplit *				split			= NULL;
+	IOMemoryDescriptor *			buffer			= NULL;
+	IOReturn						status			= kIOReturnBadArgument;
+	IOWorkLoop *					workLoop		= NULL;
+	UInt64							arrivalTime		= 0;
+	bool							block			= true;
+	bool							urgent			= false;
+	bool							reserved		= false;
+	bool							barrier			= false;
+	
+	// Set the defaults to an error state.		
+	*taskStatus			= kSCSITaskStatus_No_Status;
+	*serviceResponse	= kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
+	
+	if ( isInactive ( ) == true )
+	{
 		
 		return false;
 		
 	}
 	
+	// HEAD OF QUEUE and ACA tasks are urgent and go ahead of everything
+	// else. An outstanding ORDERED task is a barrier, whether it has been
+	// sent or waits on the resend list. No other task may overtake it, which
+	// could happen if it were resent, so report that we are busy and let the
+	// task be retried once the ORDERED task has completed. The ORDERED tasks
+	// of a Target reachable through several controllers are counted by its
+	// path group, so that a task can't overtake one on another path.
+	urgent = IsUrgentTaskAttribute ( ( ( SCSITask * ) request )->GetTaskAttribute ( ) );
+	if ( urgent == false )
+	{
+		
+		if ( fPathGroup != NULL )
+		{
+			barrier = fPathGroup->IsOrderedTaskOutstanding ( );
+		}
+		
+		else
+		{
+			
+			IOSimpleLockLock ( fQueueLock );
+			barrier = ( fOrderedTaskCount != 0 );
+			IOSimpleLockUnlock ( fQueueLock );
+			
+		}
+		
+		if ( barrier == true )
+		{
+			return false;
+		}
+		
+	}
+	
 	// Check if there is an SCSIParallelTask available to allow the request
 	// to be sent to the device. If we don't block on the client thread, we
 	// risk the chance of never being able to send an I/O to the controller for
@@ -1186,7 +2281,19 @@ IOSCSIParallelInterfaceDevice::SendSCSICommand (
 		
 	}
 	
-	parallelTask = GetSCSIParallelTask ( block );
+	// The task may come from the workloop of any path to the Target.
+	if ( ( fPathGroup != NULL ) && ( fPathGroup->IsOnWorkLoopThread ( ) == true ) )
+	{
+		block = false;
+	}
+	
+	// Recovery traffic may use the controller's reserved tasks, as urgent
+	// tasks do, but is not given a task ahead of other waiting requests.
+	reserved = ( urgent == true ) || IsRecoveryRequest ( request );
+	
+	arrivalTime = mach_absolute_time ( );
+	
+	parallelTask = GetSCSIParallelTask ( block, urgent, reserved );
 	if ( parallelTask == NULL )
 	{
 		
@@ -1196,12 +2303,32 @@ IOSCSIParallelInterfaceDevice::SendSCSICommand (
 		
 	}
 	
+	( ( SCSIParallelTask * ) parallelTask )->fStageStartTime = arrivalTime;
+	( ( SCSIParallelTask * ) parallelTask )->MarkStage ( kSCSIParallelTaskStage_Acquired, mach_absolute_time ( ) );
+	
 	SetTargetIdentifier ( parallelTask, fTargetIdentifier );
 	SetDevice ( parallelTask, this );
     
 	// Do the 2-way association, so that we can reference the SCSITask from
 	// SCSIParallelTask and vice-versa.
 	SetSCSITaskIdentifier ( parallelTask, request );
+	
+	// A task which transfers data needs a DMA command as well. If there is
+	// none, the request is not executed and waits for a task to complete,
+	// as when there is no task.
+	if ( GetDataTransferDirection ( parallelTask ) != kSCSIDataTransfer_NoDataTransfer )
+	{
+		
+		if ( fController->AttachTaskDMACommand ( parallelTask, block ) == false )
+		{
+			
+			FreeSCSIParallelTask ( parallelTask );
+			return false;
+			
+		}
+		
+	}
+	
 	SetProtocolLayerReference ( request, parallelTask );
 	
 	// Set the Parallel SCSI transfer features.	
@@ -1221,6 +2348,19 @@ IOSCSIParallelInterfaceDevice::SendSCSICommand (
 		
 	}
 	
+	// A READ or WRITE which is larger than the HBA can transfer is sent
+	// in pieces rather than failed.
+	split = CreateSplit ( request, parallelTask );
+	if ( split != NULL )
+	{
+		
+		DispatchSplitSCSICommand ( split, parallelTask, urgent );
+		*serviceResponse = kSCSIServiceResponse_Request_In_Process;
+		
+		return true;
+		
+	}
+	
 	// Add the task to the outstanding task list.
 	AddToOutstandingTaskList ( parallelTask );
 	
@@ -1240,7 +2380,7 @@ IOSCSIParallelInterfaceDevice::SendSCSICommand (
 			// Release the SCSI Parallel Task object
 			FreeSCSIParallelTask ( parallelTask );
 			
-			CommandCompleted ( request, *serviceResponse, *taskStatus );
+			CompleteClientRequest ( request, *serviceResponse, *taskStatus );
 			
 			return true;
 			
@@ -1248,191 +2388,1316 @@ IOSCSIParallelInterfaceDevice::SendSCSICommand (
 		
 	}
 	
-	*serviceResponse = ExecuteParallelTask ( parallelTask );
-	if ( *serviceResponse != kSCSIServiceResponse_Request_In_Process )
+	if ( fPathGroup != NULL )
+	{
+		
+		( ( SCSIParallelTask * ) parallelTask )->fPathStartTime = mach_absolute_time ( );
+		fPathGroup->BeginPathTask ( this );
+		
+	}
+	
+	// The trace state is only looked at under the lock while a capture
+	// is running.
+	if ( fTraceRecords != NULL )
+	{
+		TraceTaskSubmission ( parallelTask );
+	}
+	
+	*serviceResponse = ExecuteParallelTask ( parallelTask );
+	if ( *serviceResponse != kSCSIServiceResponse_Request_In_Process )
+	{
+		
+		// The task has already completed
+		RemoveFromOutstandingTaskList ( parallelTask );
+		EndPathTask ( parallelTask );
+		TraceTaskCompletion ( parallelTask, *serviceResponse, kSCSITaskStatus_No_Status );
+		
+		// Release the SCSI Parallel Task object
+		FreeSCSIParallelTask ( parallelTask );
+		
+		// Since we are completing the command IOSCSIProtocolServices
+		// should not process the command any more
+		*serviceResponse = kSCSIServiceResponse_Request_In_Process;
+		
+		if ( isInactive ( ) == true )
+		{
+			
+			*taskStatus = kSCSITaskStatus_DeviceNotPresent;
+			
+		}
+		
+		CompleteClientRequest ( request, kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE, *taskStatus );
+		
+	}
+	
+	return true;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	CompleteSCSITask - Completes a command from the controller.		   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceDevice::CompleteSCSITask ( 	
+							SCSIParallelTaskIdentifier 	completedTask,
+							SCSIServiceResponse 		serviceResponse,
+							SCSITaskStatus 				completionStatus )
+{
+
+	SCSITaskIdentifier	clientRequest	= NULL;
+	SCSIParallelTask *	task			= ( SCSIParallelTask * ) completedTask;
+	UInt8				retryCount		= task->fTaskRetryCount;
+	bool				piece			= false;
+	
+	if ( completedTask == NULL )
+	{
+		
+		// The driver was asked to complete an invalid task,
+		// there is nothing it can do so just return.
+		return;
+		
+	}
+	
+	// Check if the device rejected the task because its queue is full.
+	if ( ( serviceResponse == kSCSIServiceResponse_TASK_COMPLETE ) &&
+		 ( completionStatus == kSCSITaskStatus_TASK_SET_FULL ) &&
+		 ( fAllowResends == true ) &&
+		 ( retryCount < kMaxTaskRetryCount ) )
+	{
+		
+		// The task was not executed because the device reported
+		// a TASK_SET_FULL, place it on the resend queue and wait for 
+		// a task to complete with a status other than TASK_SET_FULL.
+		AddToResendTaskList ( completedTask );
+		
+		// Done for now.
+		return;
+		
+	} 
+	
+	// Make sure that the task is removed from the outstanding task list
+	// so that the driver no longer sees this task as outstanding.
+	RemoveFromOutstandingTaskList ( completedTask );
+	EndPathTask ( completedTask );
+	TraceTaskCompletion ( completedTask, serviceResponse, completionStatus );
+			
+	// Retrieve the original SCSI Task.
+	clientRequest = GetSCSITaskIdentifier ( completedTask );
+	if ( clientRequest == NULL )
+	{
+		panic ( "IOSCSIParallelInterfaceDevice::CompleteSCSITask: clientRequest is NULL, completedTask = %p\n", completedTask );
+	}
+	
+	// Set the appropriate fields in the SCSI Task. A piece of a split task
+	// adds its count to the split instead.
+	piece = ( task->fSplit != NULL );
+	if ( piece == false )
+	{
+		IOSCSIProtocolServices::SetRealizedDataTransferCount ( clientRequest, GetRealizedDataTransferCount ( completedTask ) );
+	}
+	
+	// Copy the data out of the bounce buffer, if the task had one.
+	fController->CompleteTaskDMABuffer ( completedTask );
+	
+	// Store any negotiations that were done.
+	for ( UInt32 index = 0; index < kSCSIParallelFeature_TotalFeatureCount; index++ )
+	{
+		
+		// Set each one to false.
+		if ( IsFeatureNegotiationNecessary ( ( SCSIParallelFeature ) index ) == true )
+		{
+			
+			if ( GetSCSIParallelFeatureNegotiationResult ( completedTask, ( SCSIParallelFeature ) index ) ==
+				kSCSIParallelFeature_NegotitiationSuccess )
+			{
+				fFeatureIsNegotiated[index] = true;
+			}
+			
+		}
+		
+	}
+	
+	RecordTaskLatency ( completedTask );
+	
+	// Release the SCSI Parallel Task object. A piece of a split task is
+	// handed to the split, which may send the next piece with it and
+	// completes the client's task once all of the pieces are done.
+	if ( piece == true )
+	{
+		FinishSplitPiece ( completedTask, serviceResponse, completionStatus );
+	}
+	
+	else
+	{
+		FreeSCSIParallelTask ( completedTask );
+	}
+
+	IOSimpleLockLock ( fQueueLock );
+
+	// If there are requests on the resend queue, send them first.
+	// Currently only the element at the head of the queue will be sent.
+	// If the desire is to allow all elements to be sent, the break
+	// statement can be removed.
+	while ( !queue_empty ( &fResendTaskList ) )
+	{
+		
+		SCSIParallelTaskIdentifier 	parallelTask;
+		SCSIParallelTask *		task = NULL;
+
+		task = DequeueResendTask ( );
+		
+		parallelTask = ( SCSIParallelTaskIdentifier ) task;
+
+		IOSimpleLockUnlock ( fQueueLock );
+
+		
+		if ( ExecuteParallelTask ( parallelTask ) != kSCSIServiceResponse_Request_In_Process )
+		{
+			
+			SCSITaskIdentifier		nextRequest	= NULL;
+			
+			// The task has already completed
+			RemoveFromOutstandingTaskList ( parallelTask );
+			EndPathTask ( parallelTask );
+			TraceTaskCompletion ( parallelTask, kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE, kSCSITaskStatus_No_Status );
+			
+			if ( task->fSplit != NULL )
+			{
+				FinishSplitPiece ( parallelTask, kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE, kSCSITaskStatus_No_Status );
+			}
+			
+			else
+			{
+				
+				nextRequest = GetSCSITaskIdentifier ( parallelTask );
+				
+				// Release the SCSI Parallel Task object
+				FreeSCSIParallelTask ( parallelTask );
+				
+				CompleteClientRequest ( nextRequest, kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE, kSCSITaskStatus_No_Status );
+				
+			}
+			
+
+			IOSimpleLockLock ( fQueueLock );
+
+			// Since this command has already completed, start the next
+			// one on the queue.
+			continue;
+			
+		} 
+
+		else 
+		{
+		
+			IOSimpleLockLock ( fQueueLock );
+
+			// A command was successfully sent, wait for it to complete
+			// before sending the next one.
+			break;
+
+		}
+		
+	}
+
+	IOSimpleLockUnlock ( fQueueLock );
+	
+	// The split completes the client's task of a piece.
+	if ( piece == true )
+	{
+		return;
+	}
+
+	// If the IO completed with TASK_SET_FULL but has exhausted its max retries,
+	// complete it with taskStatus BUSY. The upper layer will retry it again.
+	if ( ( serviceResponse == kSCSIServiceResponse_TASK_COMPLETE ) &&
+		 ( completionStatus == kSCSITaskStatus_TASK_SET_FULL ) &&
+		 ( retryCount >= kMaxTaskRetryCount ) )
+	{
+		
+		CompleteClientRequest ( clientRequest, kSCSIServiceResponse_TASK_COMPLETE, kSCSITaskStatus_BUSY );
+		
+	}
+	
+	// A task which could not be delivered because the port of this path is
+	// down is sent again over another path, so that the client does not see
+	// the failure.
+	else if ( ( serviceResponse == kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE ) &&
+			  ( fPathGroup != NULL ) &&
+			  ( fPathGroup->IsPathOnline ( this ) == false ) &&
+			  ( DispatchSCSICommandOnOtherPath ( clientRequest ) == true ) )
+	{
+		// The task now belongs to the other path.
+	}
+	
+	else
+	{
+		
+		// Inform the client that the task has been executed.
+		CompleteClientRequest ( clientRequest, serviceResponse, completionStatus );
+		
+	}
+	
+}
+
+
+#if 0
+#pragma mark -
+#pragma mark Split Task Member Routines
+#pragma mark -
+#endif
+
+
+//-----------------------------------------------------------------------------
+//	CreateSplit - 	Creates the split of a client's READ or WRITE which is
+//					larger than the HBA can transfer in one task. Returns
+//					NULL if the task doesn't need to be, or can't be, split.
+//																	  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+SCSIParallelSplit *
+IOSCSIParallelInterfaceDevice::CreateSplit (
+							SCSITaskIdentifier			request,
+							SCSIParallelTaskIdentifier	parallelTask )
+{
+	
+	SCSITask *			clientTask		= ( SCSITask * ) request;
+	SCSIParallelTask *	task			= ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelSplit *	split			= NULL;
+	UInt64				length			= 0;
+	UInt64				maxTransfer		= 0;
+	UInt64				blockSize		= 0;
+	UInt64				blockCount		= 0;
+	UInt64				lba				= 0;
+	SCSICommandDescriptorBlock	cdb;
+	
+	// Nearly every task fits and leaves here.
+	length		= clientTask->GetRequestedDataTransferCount ( );
+	maxTransfer	= task->GetMaximumTransferSize ( );
+	require_quiet ( ( length > maxTransfer ), ErrorExit );
+	require_nonzero_quiet ( clientTask->GetDataBuffer ( ), ErrorExit );
+	
+	// Only a READ or WRITE can be split, as the blocks of a piece can be
+	// put in its CDB. The transfer must be a whole number of blocks which
+	// the HBA can transfer at least one of.
+	clientTask->GetCommandDescriptorBlock ( &cdb );
+	require_quiet ( GetReadWriteBlocks ( cdb,
+										 clientTask->GetCommandDescriptorBlockSize ( ),
+										 &lba,
+										 &blockCount ), ErrorExit );
+	require_quiet ( ( blockCount != 0 ), ErrorExit );
+	
+	blockSize = length / blockCount;
+	require_quiet ( ( ( blockSize * blockCount ) == length ), ErrorExit );
+	require_quiet ( ( blockSize <= maxTransfer ), ErrorExit );
+	
+	split = ( SCSIParallelSplit * ) IOMalloc ( sizeof ( SCSIParallelSplit ) );
+	require_nonzero ( split, ErrorExit );
+	
+	bzero ( split, sizeof ( SCSIParallelSplit ) );
+	bcopy ( cdb, split->fCDB, sizeof ( SCSICommandDescriptorBlock ) );
+	
+	split->fRequest				= request;
+	split->fBlockSize			= blockSize;
+	split->fLogicalBlockAddress	= lba;
+	split->fLength				= length;
+	split->fPieceSize			= ( maxTransfer / blockSize ) * blockSize;
+	split->fOutstanding			= 1;
+	split->fRealizedCount		= length;
+	split->fFailedOffset		= length;
+	split->fServiceResponse		= kSCSIServiceResponse_TASK_COMPLETE;
+	split->fTaskStatus			= kSCSITaskStatus_GOOD;
+	
+	
+ErrorExit:
+	
+	
+	return split;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	DispatchSplitSCSICommand - 	Sends the first pieces of a split task. The
+//								rest are sent as pieces complete.	  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceDevice::DispatchSplitSCSICommand (
+							SCSIParallelSplit *			split,
+							SCSIParallelTaskIdentifier	parallelTask,
+							bool						urgent )
+{
+	
+	SCSIParallelTaskIdentifier	task			= parallelTask;
+	SCSIServiceResponse			serviceResponse	= kSCSIServiceResponse_Request_In_Process;
+	UInt32						window			= kMaxSplitPieceCount;
+	UInt32						count			= 0;
+	bool						armed			= false;
+	bool						last			= false;
+	
+	// The pieces of a SIMPLE task are sent side by side. Any other task is
+	// ordered against the tasks around it, so its pieces are sent one at a
+	// time.
+	if ( GetTaskAttribute ( parallelTask ) != kSCSITask_SIMPLE )
+	{
+		window = 1;
+	}
+	
+	while ( task != NULL )
+	{
+		
+		IOSimpleLockLock ( fQueueLock );
+		armed = ArmSplitPiece ( split, ( SCSIParallelTask * ) task );
+		IOSimpleLockUnlock ( fQueueLock );
+		
+		if ( armed == false )
+		{
+			
+			// Nothing left to send, or a piece already failed.
+			FreeSCSIParallelTask ( task );
+			break;
+			
+		}
+		
+		serviceResponse = SendSplitPiece ( task );
+		if ( serviceResponse != kSCSIServiceResponse_Request_In_Process )
+		{
+			
+			FinishSplitPiece ( task,
+							   kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE,
+							   ( isInactive ( ) == true ) ? kSCSITaskStatus_DeviceNotPresent : kSCSITaskStatus_No_Status );
+			
+		}
+		
+		count++;
+		if ( count >= window )
+		{
+			break;
+		}
+		
+		// Further pieces only use tasks which are free now. The pieces that
+		// don't get a task of their own are sent when a piece completes.
+		task = GetSCSIParallelTask ( false, urgent, urgent );
+		if ( task != NULL )
+		{
+			
+			if ( fController->AttachTaskDMACommand ( task, false ) == false )
+			{
+				
+				FreeSCSIParallelTask ( task );
+				break;
+				
+			}
+			
+			SetTargetIdentifier ( task, fTargetIdentifier );
+			SetDevice ( task, this );
+			SetSCSITaskIdentifier ( task, split->fRequest );
+			
+		}
+		
+	}
+	
+	// Drop the hold on the split taken when it was created.
+	IOSimpleLockLock ( fQueueLock );
+	split->fOutstanding--;
+	last = ( split->fOutstanding == 0 );
+	IOSimpleLockUnlock ( fQueueLock );
+	
+	if ( last == true )
+	{
+		CompleteSplit ( split );
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	ArmSplitPiece - Sets up a task to send the next piece of a split task.
+//					Returns false if there is nothing left to send or a piece
+//					failed. Called with fQueueLock held.			  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+bool
+IOSCSIParallelInterfaceDevice::ArmSplitPiece (
+							SCSIParallelSplit *			split,
+							SCSIParallelTask *			task )
+{
+	
+	UInt64	length = 0;
+	
+	if ( ( split->fServiceResponse != kSCSIServiceResponse_TASK_COMPLETE ) ||
+		 ( split->fTaskStatus != kSCSITaskStatus_GOOD ) ||
+		 ( split->fNextOffset >= split->fLength ) )
+	{
+		return false;
+	}
+	
+	length = split->fLength - split->fNextOffset;
+	if ( length > split->fPieceSize )
+	{
+		length = split->fPieceSize;
+	}
+	
+	task->fSplit		= split;
+	task->fSplitOffset	= split->fNextOffset;
+	task->fSplitLength	= length;
+	
+	bcopy ( split->fCDB, task->fSplitCDB, sizeof ( SCSICommandDescriptorBlock ) );
+	SetReadWriteBlocks ( task->fSplitCDB,
+						 split->fLogicalBlockAddress + ( split->fNextOffset / split->fBlockSize ),
+						 length / split->fBlockSize );
+	
+	split->fNextOffset += length;
+	split->fOutstanding++;
+	
+	return true;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	SendSplitPiece - Sends a piece of a split task to the controller. If the
+//					 piece could not be sent, it is taken off the lists and
+//					 the response is returned.						  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+SCSIServiceResponse
+IOSCSIParallelInterfaceDevice::SendSplitPiece (
+							SCSIParallelTaskIdentifier	parallelTask )
+{
+	
+	SCSIParallelTask *		task			= ( SCSIParallelTask * ) parallelTask;
+	SCSIServiceResponse		serviceResponse	= kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
+	IOReturn				status			= kIOReturnSuccess;
+	
+	AddToOutstandingTaskList ( parallelTask );
+	
+	// A task which sent an earlier piece may still have its buffer set.
+	task->fDMACommand->clearMemoryDescriptor ( false );
+	
+	status = SetDMABuffer ( parallelTask, task->GetClientDataBuffer ( ) );
+	if ( status != kIOReturnSuccess )
+	{
+		
+		ERROR_LOG ( ( "SetDMABuffer failed, status = 0x%08x\n", status ) );
+		RemoveFromOutstandingTaskList ( parallelTask );
+		
+		return serviceResponse;
+		
+	}
+	
+	if ( fPathGroup != NULL )
+	{
+		
+		task->fPathStartTime = mach_absolute_time ( );
+		fPathGroup->BeginPathTask ( this );
+		
+	}
+	
+	if ( fTraceRecords != NULL )
+	{
+		TraceTaskSubmission ( parallelTask );
+	}
+	
+	serviceResponse = ExecuteParallelTask ( parallelTask );
+	if ( serviceResponse != kSCSIServiceResponse_Request_In_Process )
+	{
+		
+		RemoveFromOutstandingTaskList ( parallelTask );
+		EndPathTask ( parallelTask );
+		TraceTaskCompletion ( parallelTask, serviceResponse, kSCSITaskStatus_No_Status );
+		
+	}
+	
+	return serviceResponse;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	FinishSplitPiece - 	Adds a finished piece to its split. The task sends
+//						the next piece if there is one, otherwise it is
+//						freed, and the client's task is completed once the
+//						last piece is done.							  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceDevice::FinishSplitPiece (
+							SCSIParallelTaskIdentifier	parallelTask,
+							SCSIServiceResponse			serviceResponse,
+							SCSITaskStatus				taskStatus )
+{
+	
+	SCSIParallelTask *		task		= ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelSplit *		split		= task->fSplit;
+	UInt64					realized	= 0;
+	bool					failed		= false;
+	bool					armed		= false;
+	bool					last		= false;
+	
+	// A piece which still got TASK SET FULL after its retries is reported
+	// as BUSY, as an unsplit task would be.
+	if ( ( serviceResponse == kSCSIServiceResponse_TASK_COMPLETE ) &&
+		 ( taskStatus == kSCSITaskStatus_TASK_SET_FULL ) )
+	{
+		taskStatus = kSCSITaskStatus_BUSY;
+	}
+	
+	while ( true )
+	{
+		
+		failed = ( ( serviceResponse != kSCSIServiceResponse_TASK_COMPLETE ) ||
+				   ( taskStatus != kSCSITaskStatus_GOOD ) );
+		
+		realized = task->GetRealizedDataTransferCount ( );
+		if ( ( failed == true ) && ( serviceResponse != kSCSIServiceResponse_TASK_COMPLETE ) )
+		{
+			realized = 0;
+		}
+		
+		if ( realized > task->fSplitLength )
+		{
+			realized = task->fSplitLength;
+		}
+		
+		IOSimpleLockLock ( fQueueLock );
+		
+		// The client only learns how many bytes were transferred, not which,
+		// so report the bytes up to the first piece which failed or came up
+		// short, whatever the pieces after it did.
+		if ( ( ( failed == true ) || ( realized < task->fSplitLength ) ) &&
+			 ( ( task->fSplitOffset + realized ) < split->fRealizedCount ) )
+		{
+			split->fRealizedCount = task->fSplitOffset + realized;
+		}
+		
+		// The pieces share the client's task, so its sense data is that of
+		// the piece which completed last. Keep a copy of the sense data of
+		// the first piece which failed.
+		if ( ( failed == true ) && ( task->fSplitOffset < split->fFailedOffset ) )
+		{
+			
+			split->fFailedOffset	= task->fSplitOffset;
+			split->fServiceResponse	= serviceResponse;
+			split->fTaskStatus		= taskStatus;
+			split->fSenseDataSize	= 0;
+			
+			if ( ( taskStatus == kSCSITaskStatus_CHECK_CONDITION ) &&
+				 ( task->GetAutoSenseData ( &split->fSenseData, sizeof ( SCSI_Sense_Data ) ) == true ) )
+			{
+				split->fSenseDataSize = sizeof ( SCSI_Sense_Data );
+			}
+			
+		}
+		
+		armed = ArmSplitPiece ( split, task );
+		split->fOutstanding--;
+		last = ( split->fOutstanding == 0 );
+		
+		IOSimpleLockUnlock ( fQueueLock );
+		
+		if ( armed == false )
+		{
+			break;
+		}
+		
+		// Send the next piece with this task.
+		task->SetRealizedDataTransferCount ( 0 );
+		task->fTaskRetryCount = 0;
+		
+		serviceResponse = SendSplitPiece ( parallelTask );
+		if ( serviceResponse == kSCSIServiceResponse_Request_In_Process )
+		{
+			return;
+		}
+		
+		serviceResponse	= kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
+		taskStatus		= kSCSITaskStatus_No_Status;
+		
+	}
+	
+	task->fSplit = NULL;
+	FreeSCSIParallelTask ( parallelTask );
+	
+	if ( last == true )
+	{
+		CompleteSplit ( split );
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	CompleteSplit - Completes the client's task of a split once all of its
+//					pieces are done, and frees the split.			  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceDevice::CompleteSplit ( SCSIParallelSplit * split )
+{
+	
+	SCSITaskIdentifier		request			= split->fRequest;
+	SCSIServiceResponse		serviceResponse	= split->fServiceResponse;
+	SCSITaskStatus			taskStatus		= split->fTaskStatus;
+	
+	IOSCSIProtocolServices::SetRealizedDataTransferCount ( request, split->fRealizedCount );
+	
+	// Put back the sense data of the first piece which failed, in case a
+	// later piece overwrote it.
+	if ( split->fSenseDataSize != 0 )
+	{
+		( ( SCSITask * ) request )->SetAutoSenseData ( &split->fSenseData, split->fSenseDataSize );
+	}
+	
+	IOFree ( split, sizeof ( SCSIParallelSplit ) );
+	split = NULL;
+	
+	// As with an unsplit task, a task which could not be delivered because
+	// the port of this path is down is sent again over another path. It is
+	// split again there if need be.
+	if ( ( serviceResponse == kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE ) &&
+		 ( fPathGroup != NULL ) &&
+		 ( fPathGroup->IsPathOnline ( this ) == false ) &&
+		 ( DispatchSCSICommandOnOtherPath ( request ) == true ) )
+	{
+		return;
+	}
+	
+	CompleteClientRequest ( request, serviceResponse, taskStatus );
+	
+}
+
+
+#if 0
+#pragma mark -
+#pragma mark Multipathing Member Routines
+#pragma mark -
+#endif
+
+
+//-----------------------------------------------------------------------------
+//	JoinPathGroup - Identifies the Target and adds this path to the group of
+//					paths to it, then presents the Target. Runs on a thread
+//					of its own, started by start.					  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceDevice::JoinPathGroup ( void )
+{
+	
+	SCSIParallelPathGroup *			group			= NULL;
+	SCSIParallelMultipathDevice *	multipathDevice	= NULL;
+	OSData *						identifier		= NULL;
+	OSString *						policy			= NULL;
+	thread_t						thread			= NULL;
+	bool							stopped			= false;
+	
+	// A Target which does not identify its logical unit can't be matched
+	// with other paths, so it is only presented over this one.
+	identifier = CopyLogicalUnitIdentifier ( );
+	if ( identifier != NULL )
+	{
+		
+		setProperty ( kIOMultipathIdentifierKey, identifier );
+		
+		policy = OSDynamicCast ( OSString, fController->getProperty ( kIOMultipathPolicyKey ) );
+		
+		group = SCSIParallelPathGroup::AddPath ( identifier, this, policy );
+		identifier->release ( );
+		identifier = NULL;
+		
+	}
+	
+	// The path may have been stopped while the Target was identified, in
+	// which case it is not presented.
+	IOSimpleLockLock ( fQueueLock );
+	
+	stopped = fStopped;
+	if ( stopped == false )
+	{
+		fPathGroup = group;
+	}
+	
+	IOSimpleLockUnlock ( fQueueLock );
+	
+	if ( stopped == true )
+	{
+		
+		if ( group != NULL )
+		{
+			
+			group->RemovePath ( this );
+			group->release ( );
+			group = NULL;
+			
+		}
+		
+	}
+	
+	else if ( group == NULL )
+	{
+		
+		// The device and this driver have been succesfully configured
+		// and are ready to provide their services, call CreateSCSITargetDevice().
+		CreateSCSITargetDevice ( );
+		
+	}
+	
+	else
+	{
+		
+		// The Target is presented by the multipath device of the group, the
+		// first path starts it. A path which could not be attached to it
+		// leaves the group, as it would never be selected.
+		multipathDevice = group->CopyMultipathDevice ( );
+		if ( ( multipathDevice == NULL ) || ( multipathDevice->AttachPath ( this ) == false ) )
+		{
+			
+			ERROR_LOG ( ( "JoinPathGroup: could not attach the path\n" ) );
+			group->RemovePath ( this );
+			
+		}
+		
+		if ( multipathDevice != NULL )
+		{
+			
+			multipathDevice->release ( );
+			multipathDevice = NULL;
+			
+		}
+		
+		// Put the path in the IORegistry so that it can be found.
+		registerService ( );
+		
+	}
+	
+	// Release our retain held while starting thread.
+	release ( );
+	
+	// Terminate the thread.
+	thread = current_thread ( );
+	thread_deallocate ( thread );
+	thread_terminate ( thread );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	CopyLogicalUnitIdentifier - Reads the Device Identification VPD page of
+//								LUN 0 and returns the designator of its
+//								logical unit, or NULL.				  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+OSData *
+IOSCSIParallelInterfaceDevice::CopyLogicalUnitIdentifier ( void )
+{
+	
+	IOBufferMemoryDescriptor *	buffer		= NULL;
+	SCSITask *					request		= NULL;
+	SCSIParallelDeviceCommand	command		= { NULL, false };
+	OSData *					identifier	= NULL;
+	UInt8 *						page		= NULL;
+	UInt32						length		= 0;
+	UInt32						offset		= 0;
+	UInt32						best		= 0;
+	UInt8						rank		= 0;
+	UInt8						bestRank	= 0;
+	bool						result		= false;
+	
+	// The command completes on the workloop, so it can't be waited for
+	// from there.
+	require_quiet ( ( getWorkLoop ( )->onThread ( ) == false ), ErrorExit );
+	
+	buffer = IOBufferMemoryDescriptor::withCapacity ( kDeviceIdentificationPageSize, kIODirectionIn );
+	require_nonzero ( buffer, ErrorExit );
+	
+	command.fLock = IOLockAlloc ( );
+	require_nonzero ( command.fLock, RELEASE_BUFFER );
+	
+	request = OSTypeAlloc ( SCSITask );
+	require_nonzero ( request, FREE_LOCK );
+	
+	result = request->init ( );
+	require ( result, RELEASE_REQUEST );
+	
+	request->ResetForNewTask ( );
+	request->SetTaskOwner ( this );
+	request->SetCommandDescriptorBlock ( kSCSICmd_INQUIRY,
+										 0x01,
+										 kINQUIRY_Page83_PageCode,
+										 0x00,
+										 kDeviceIdentificationPageSize,
+										 0x00 );
+	request->SetDataTransferDirection ( kSCSIDataTransfer_FromTargetToInitiator );
+	request->SetDataBuffer ( buffer );
+	request->SetRequestedDataTransferCount ( kDeviceIdentificationPageSize );
+	request->SetTimeoutDuration ( kDeviceIdentificationTimeout );
+	request->SetTaskCompletionCallback ( &IOSCSIParallelInterfaceDevice::DeviceCommandCompletion );
+	request->SetApplicationLayerReference ( &command );
+	
+	ExecuteCommand ( request );
+	
+	// Wait for the completion, which may already have happened.
+	IOLockLock ( command.fLock );
+	
+	while ( command.fDone == false )
+	{
+		IOLockSleep ( command.fLock, &command.fDone, THREAD_UNINT );
+	}
+	
+	IOLockUnlock ( command.fLock );
+	
+	require_quiet ( ( request->GetServiceResponse ( ) == kSCSIServiceResponse_TASK_COMPLETE ), RELEASE_REQUEST );
+	require_quiet ( ( request->GetTaskStatus ( ) == kSCSITaskStatus_GOOD ), RELEASE_REQUEST );
+	
+	page	= ( UInt8 * ) buffer->getBytesNoCopy ( );
+	length	= request->GetRealizedDataTransferCount ( );
+	require_quiet ( ( length >= 4 ), RELEASE_REQUEST );
+	
+	// The page header is four bytes and gives the length of the designation
+	// descriptors which follow it.
+	length = min ( length, 4 + ( ( page[2] << 8 ) | page[3] ) );
+	
+	// Use the logical unit designator which is most likely to be unique:
+	// an NAA name, then an EUI-64, then a T10 vendor ID.
+	for ( offset = 4; ( offset + 4 ) <= length; offset += 4 + page[offset + 3] )
+	{
+		
+		if ( ( offset + 4 + page[offset + 3] ) > length )
+		{
+			break;
+		}
+		
+		if ( ( page[offset + 1] & kINQUIRY_Page83_AssociationMask ) != kINQUIRY_Page83_AssociationDevice )
+		{
+			continue;
+		}
+		
+		switch ( page[offset + 1] & kINQUIRY_Page83_IdentifierTypeMask )
+		{
+			
+			case kINQUIRY_Page83_IdentifierTypeFCNameIdentifier:
+				rank = 3;
+				break;
+			
+			case kINQUIRY_Page83_IdentifierTypeIEEE_EUI64:
+				rank = 2;
+				break;
+			
+			case kINQUIRY_Page83_IdentifierTypeVendorID:
+				rank = 1;
+				break;
+			
+			default:
+				rank = 0;
+				break;
+			
+		}
+		
+		if ( rank > bestRank )
+		{
+			
+			bestRank	= rank;
+			best		= offset;
+			
+		}
+		
+	}
+	
+	require_quiet ( ( bestRank != 0 ), RELEASE_REQUEST );
+	
+	// Keep the designator type with the designator so that designators of
+	// different types never match.
+	identifier = OSData::withCapacity ( 1 + page[best + 3] );
+	require_nonzero ( identifier, RELEASE_REQUEST );
+	
+	identifier->appendBytes ( &page[best + 1], 1 );
+	identifier->appendBytes ( &page[best + 4], page[best + 3] );
+	
+	
+RELEASE_REQUEST:
+	
+	
+	request->release ( );
+	request = NULL;
+	
+	
+FREE_LOCK:
+	
+	
+	IOLockFree ( command.fLock );
+	command.fLock = NULL;
+	
+	
+RELEASE_BUFFER:
+	
+	
+	buffer->release ( );
+	buffer = NULL;
+	
+	
+ErrorExit:
+	
+	
+	return identifier;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	DeviceCommandCompletion - Wakes up the thread waiting for a command the
+//							  device sent on its own.		  [STATIC][PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceDevice::DeviceCommandCompletion ( SCSITaskIdentifier request )
+{
+	
+	SCSIParallelDeviceCommand *	command = NULL;
+	
+	command = ( SCSIParallelDeviceCommand * ) ( ( SCSITask * ) request )->GetApplicationLayerReference ( );
+	
+	IOLockLock ( command->fLock );
+	command->fDone = true;
+	IOLockWakeup ( command->fLock, &command->fDone, true );
+	IOLockUnlock ( command->fLock );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	DispatchSCSICommandOnOtherPath - Sends a command which failed on this
+//									 path over another one. Returns false if
+//									 no other path could take it.	  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+bool
+IOSCSIParallelInterfaceDevice::DispatchSCSICommandOnOtherPath (
+							SCSITaskIdentifier			request )
+{
+	
+	IOSCSIParallelInterfaceDevice *	path			= NULL;
+	SCSIServiceResponse				serviceResponse	= kSCSIServiceResponse_Request_In_Process;
+	SCSITaskStatus					taskStatus		= kSCSITaskStatus_No_Status;
+	bool							result			= false;
+	
+	path = fPathGroup->SelectPath ( );
+	require_nonzero_quiet ( path, ErrorExit );
+	
+	// This path is down, so the group should not pick it. Check anyway
+	// rather than send the task back where it failed.
+	if ( path != this )
+	{
+		result = path->DispatchSCSICommand ( request, &serviceResponse, &taskStatus );
+	}
+	
+	path->release ( );
+	path = NULL;
+	
+	
+ErrorExit:
+	
+	
+	return result;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	EndPathTask - Lets the path group know that a task sent over this path
+//				  is done.											  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceDevice::EndPathTask ( SCSIParallelTaskIdentifier parallelTask )
+{
+	
+	UInt64	elapsed = 0;
+	
+	if ( fPathGroup != NULL )
 	{
 		
-		// The task has already completed
-		RemoveFromOutstandingTaskList ( parallelTask );
-		
-		// Release the SCSI Parallel Task object
-		FreeSCSIParallelTask ( parallelTask );
-		
-		// Since we are completing the command IOSCSIProtocolServices
-		// should not process the command any more
-		*serviceResponse = kSCSIServiceResponse_Request_In_Process;
-		
-		if ( isInactive ( ) == true )
-		{
-			
-			*taskStatus = kSCSITaskStatus_DeviceNotPresent;
-			
-		}
+		absolutetime_to_nanoseconds (
+			mach_absolute_time ( ) - ( ( SCSIParallelTask * ) parallelTask )->fPathStartTime,
+			&elapsed );
 		
-		CommandCompleted ( request, kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE, *taskStatus );
+		fPathGroup->EndPathTask ( this, elapsed );
 		
 	}
 	
-	return true;
-	
 }
 
 
 //-----------------------------------------------------------------------------
-//	CompleteSCSITask - Completes a command from the controller.		   [PUBLIC]
+//	CompleteClientRequest - Completes a client's task through the multipath
+//							device of the Target, if it has one, as that
+//							is where the client sent it.			  [PRIVATE]
 //-----------------------------------------------------------------------------
 
 void
-IOSCSIParallelInterfaceDevice::CompleteSCSITask ( 	
-							SCSIParallelTaskIdentifier 	completedTask,
-							SCSIServiceResponse 		serviceResponse,
-							SCSITaskStatus 				completionStatus )
+IOSCSIParallelInterfaceDevice::CompleteClientRequest (
+							SCSITaskIdentifier			request,
+							SCSIServiceResponse			serviceResponse,
+							SCSITaskStatus				taskStatus )
 {
-
-	SCSITaskIdentifier	clientRequest	= NULL;
-	SCSIParallelTask *	task			= ( SCSIParallelTask * ) completedTask;
-	UInt8				retryCount		= task->fTaskRetryCount;
 	
-	if ( completedTask == NULL )
+	if ( fMultipathDevice != NULL )
 	{
-		
-		// The driver was asked to complete an invalid task,
-		// there is nothing it can do so just return.
-		return;
-		
+		fMultipathDevice->CompleteClientRequest ( request, serviceResponse, taskStatus );
 	}
 	
-	// Check if the device rejected the task because its queue is full.
-	if ( ( serviceResponse == kSCSIServiceResponse_TASK_COMPLETE ) &&
-		 ( completionStatus == kSCSITaskStatus_TASK_SET_FULL ) &&
-		 ( fAllowResends == true ) &&
-		 ( retryCount < kMaxTaskRetryCount ) )
+	else
 	{
-		
-		// The task was not executed because the device reported
-		// a TASK_SET_FULL, place it on the resend queue and wait for 
-		// a task to complete with a status other than TASK_SET_FULL.
-		AddToResendTaskList ( completedTask );
-		
-		// Done for now.
-		return;
-		
-	} 
+		CommandCompleted ( request, serviceResponse, taskStatus );
+	}
 	
-	// Make sure that the task is removed from the outstanding task list
-	// so that the driver no longer sees this task as outstanding.
-	RemoveFromOutstandingTaskList ( completedTask );
-			
-	// Retrieve the original SCSI Task.
-	clientRequest = GetSCSITaskIdentifier ( completedTask );
-	if ( clientRequest == NULL )
+}
+
+
+#if 0
+#pragma mark -
+#pragma mark Command Trace Member Routines
+#pragma mark -
+#endif
+
+
+//-----------------------------------------------------------------------------
+//	StartCommandTrace - Starts a new command trace capture, dropping any
+//						previous one.								  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+bool
+IOSCSIParallelInterfaceDevice::StartCommandTrace ( UInt32 recordCount )
+{
+	
+	SCSIParallelTraceRecord *	records		= NULL;
+	SCSIParallelTraceRecord *	oldRecords	= NULL;
+	UInt32						oldCapacity	= 0;
+	
+	records = ( SCSIParallelTraceRecord * ) IOMalloc ( recordCount * sizeof ( SCSIParallelTraceRecord ) );
+	require_nonzero ( records, ErrorExit );
+	bzero ( records, recordCount * sizeof ( SCSIParallelTraceRecord ) );
+	
+	removeProperty ( kIOCommandTraceDataKey );
+	
+	IOSimpleLockLock ( fQueueLock );
+	
+	oldRecords		= fTraceRecords;
+	oldCapacity		= fTraceCapacity;
+	
+	fTraceRecords		= records;
+	fTraceCapacity		= recordCount;
+	fTraceNext			= 0;
+	fTraceDropped		= 0;
+	fTraceStartTime		= mach_absolute_time ( );
+	
+	// Tasks still outstanding from an earlier capture are not recorded
+	// in this one.
+	fTraceGeneration++;
+	
+	IOSimpleLockUnlock ( fQueueLock );
+	
+	if ( oldRecords != NULL )
 	{
-		panic ( "IOSCSIParallelInterfaceDevice::CompleteSCSITask: clientRequest is NULL, completedTask = %p\n", completedTask );
+		IOFree ( oldRecords, oldCapacity * sizeof ( SCSIParallelTraceRecord ) );
 	}
 	
-	// Set the appropriate fields in the SCSI Task.
-	IOSCSIProtocolServices::SetRealizedDataTransferCount ( clientRequest, GetRealizedDataTransferCount ( completedTask ) );
+	return true;
 	
-	// Store any negotiations that were done.
-	for ( UInt32 index = 0; index < kSCSIParallelFeature_TotalFeatureCount; index++ )
+	
+ErrorExit:
+	
+	
+	return false;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	StopCommandTrace - Stops the command trace capture and publishes the
+//					   trace under kIOCommandTraceDataKey.			  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceDevice::StopCommandTrace ( void )
+{
+	
+	SCSIParallelTraceRecord *	records		= NULL;
+	UInt32						capacity	= 0;
+	UInt32						count		= 0;
+	UInt32						dropped		= 0;
+	UInt64						startTime	= 0;
+	OSData *					data		= NULL;
+	SCSIParallelTraceHeader		header;
+	
+	IOSimpleLockLock ( fQueueLock );
+	
+	records		= fTraceRecords;
+	capacity	= fTraceCapacity;
+	count		= min ( fTraceNext, fTraceCapacity );
+	dropped		= fTraceDropped;
+	startTime	= fTraceStartTime;
+	
+	fTraceRecords	= NULL;
+	fTraceCapacity	= 0;
+	
+	IOSimpleLockUnlock ( fQueueLock );
+	
+	require_nonzero_quiet ( records, ErrorExit );
+	
+	bzero ( &header, sizeof ( header ) );
+	header.fSignature			= kSCSIParallelTraceSignature;
+	header.fVersion				= kSCSIParallelTraceVersion;
+	header.fRecordSize			= sizeof ( SCSIParallelTraceRecord );
+	header.fTargetIdentifier	= fTargetIdentifier;
+	header.fRecordCount			= count;
+	header.fDroppedCount		= dropped;
+	
+	// The records hold absolute times while the capture runs. Turn them
+	// into nanoseconds since the start of the capture.
+	for ( UInt32 index = 0; index < count; index++ )
 	{
 		
-		// Set each one to false.
-		if ( IsFeatureNegotiationNecessary ( ( SCSIParallelFeature ) index ) == true )
+		absolutetime_to_nanoseconds ( records[index].fSubmitTime - startTime, &records[index].fSubmitTime );
+		
+		if ( ( records[index].fFlags & kSCSIParallelTraceFlag_Outstanding ) == 0 )
 		{
-			
-			if ( GetSCSIParallelFeatureNegotiationResult ( completedTask, ( SCSIParallelFeature ) index ) ==
-				kSCSIParallelFeature_NegotitiationSuccess )
-			{
-				fFeatureIsNegotiated[index] = true;
-			}
-			
+			absolutetime_to_nanoseconds ( records[index].fCompletionTime - startTime, &records[index].fCompletionTime );
 		}
 		
 	}
 	
-	// Release the SCSI Parallel Task object.
-	FreeSCSIParallelTask ( completedTask );
-
-	IOSimpleLockLock ( fQueueLock );
-
-	// If there are requests on the resend queue, send them first.
-	// Currently only the element at the head of the queue will be sent.
-	// If the desire is to allow all elements to be sent, the break
-	// statement can be removed.
-	while ( !queue_empty ( &fResendTaskList ) )
-	{
-		
-		SCSIParallelTaskIdentifier 	parallelTask;
-		SCSIParallelTask *		task = NULL;
-
-		parallelTask = ( SCSIParallelTaskIdentifier ) queue_first ( &fResendTaskList );
-		
-		task = ( SCSIParallelTask * ) parallelTask ;
+	data = OSData::withCapacity ( sizeof ( header ) + ( count * sizeof ( SCSIParallelTraceRecord ) ) );
+	require_nonzero ( data, DATA_ALLOC_FAILURE );
+	
+	data->appendBytes ( &header, sizeof ( header ) );
+	data->appendBytes ( records, count * sizeof ( SCSIParallelTraceRecord ) );
+	
+	setProperty ( kIOCommandTraceDataKey, data );
+	data->release ( );
+	data = NULL;
+	
+	
+DATA_ALLOC_FAILURE:
+	
+	
+	IOFree ( records, capacity * sizeof ( SCSIParallelTraceRecord ) );
+	records = NULL;
+	
+	
+ErrorExit:
+	
+	
+	return;
+	
+}
 
-		queue_remove ( &fResendTaskList, task, SCSIParallelTask *, fResendTaskChain );
 
-		IOSimpleLockUnlock ( fQueueLock );
+//-----------------------------------------------------------------------------
+//	TraceTaskSubmission - Records a task sent to the controller.	  [PRIVATE]
+//-----------------------------------------------------------------------------
 
+void
+IOSCSIParallelInterfaceDevice::TraceTaskSubmission (
+							SCSIParallelTaskIdentifier	parallelTask )
+{
+	
+	SCSIParallelTask *				task = ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelTraceRecord			record;
+	SCSICommandDescriptorBlock		cdb;
+	
+	// Fill in the record before taking the lock.
+	bzero ( &record, sizeof ( record ) );
+	GetCommandDescriptorBlock ( parallelTask, &cdb );
+	bcopy ( cdb, record.fCDB, sizeof ( record.fCDB ) );
+	
+	record.fLogicalUnit				= GetLogicalUnitNumber ( parallelTask );
+	record.fRequestedTransferCount	= GetRequestedDataTransferCount ( parallelTask );
+	record.fCDBSize					= GetCommandDescriptorBlockSize ( parallelTask );
+	record.fTaskAttribute			= GetTaskAttribute ( parallelTask );
+	record.fDataTransferDirection	= GetDataTransferDirection ( parallelTask );
+	record.fServiceResponse			= kSCSIServiceResponse_Request_In_Process;
+	record.fTaskStatus				= kSCSITaskStatus_No_Status;
+	record.fFlags					= kSCSIParallelTraceFlag_Outstanding;
+	
+	task->fTraceRecord = kSCSIParallelTraceNoRecord;
+	
+	IOSimpleLockLock ( fQueueLock );
+	
+	if ( fTraceRecords != NULL )
+	{
 		
-		if ( ExecuteParallelTask ( parallelTask ) != kSCSIServiceResponse_Request_In_Process )
+		if ( fTraceNext < fTraceCapacity )
 		{
 			
-			SCSITaskIdentifier		nextRequest	= NULL;
-			
-			// The task has already completed
-			RemoveFromOutstandingTaskList ( parallelTask );
-			
-			nextRequest = GetSCSITaskIdentifier ( parallelTask );
-			
-			// Release the SCSI Parallel Task object
-			FreeSCSIParallelTask ( parallelTask );
+			record.fSubmitTime = mach_absolute_time ( );
+			fTraceRecords[fTraceNext] = record;
 			
-			CommandCompleted ( nextRequest, kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE, kSCSITaskStatus_No_Status );
+			task->fTraceRecord		= fTraceNext;
+			task->fTraceGeneration	= fTraceGeneration;
 			
-
-			IOSimpleLockLock ( fQueueLock );
-
-			// Since this command has already completed, start the next
-			// one on the queue.
-			continue;
+			fTraceNext++;
 			
-		} 
-
-		else 
-		{
+		}
 		
-			IOSimpleLockLock ( fQueueLock );
-
-			// A command was successfully sent, wait for it to complete
-			// before sending the next one.
-			break;
-
+		else
+		{
+			fTraceDropped++;
 		}
 		
 	}
-
+	
 	IOSimpleLockUnlock ( fQueueLock );
+	
+}
 
-	// If the IO completed with TASK_SET_FULL but has exhausted its max retries,
-	// complete it with taskStatus BUSY. The upper layer will retry it again.
-	if ( ( serviceResponse == kSCSIServiceResponse_TASK_COMPLETE ) &&
-		 ( completionStatus == kSCSITaskStatus_TASK_SET_FULL ) &&
-		 ( retryCount >= kMaxTaskRetryCount ) )
+
+//-----------------------------------------------------------------------------
+//	TraceTaskCompletion - Records the completion of a traced task.	  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceDevice::TraceTaskCompletion (
+							SCSIParallelTaskIdentifier	parallelTask,
+							SCSIServiceResponse			serviceResponse,
+							SCSITaskStatus				taskStatus )
+{
+	
+	SCSIParallelTask *			task	= ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelTraceRecord *	record	= NULL;
+	
+	if ( task->fTraceRecord == kSCSIParallelTraceNoRecord )
 	{
-		
-		CommandCompleted ( clientRequest, kSCSIServiceResponse_TASK_COMPLETE, kSCSITaskStatus_BUSY );
-		
+		return;
 	}
 	
-	else
+	IOSimpleLockLock ( fQueueLock );
+	
+	// The capture may have been stopped or restarted since the task was
+	// sent.
+	if ( ( fTraceRecords != NULL ) &&
+		 ( task->fTraceGeneration == fTraceGeneration ) &&
+		 ( task->fTraceRecord < fTraceNext ) )
 	{
 		
-		// Inform the client that the task has been executed.
-		CommandCompleted ( clientRequest, serviceResponse, completionStatus );
+		record = &fTraceRecords[task->fTraceRecord];
+		
+		record->fCompletionTime			= mach_absolute_time ( );
+		record->fRealizedTransferCount	= GetRealizedDataTransferCount ( parallelTask );
+		record->fServiceResponse		= serviceResponse;
+		record->fTaskStatus				= taskStatus;
+		record->fRetryCount				= task->fTaskRetryCount;
+		record->fFlags				   &= ~kSCSIParallelTraceFlag_Outstanding;
 		
 	}
 	
+	IOSimpleLockUnlock ( fQueueLock );
+	
+	task->fTraceRecord = kSCSIParallelTraceNoRecord;
+	
 }
 
 
@@ -1501,7 +3766,11 @@ IOSCSIParallelInterfaceDevice::IsProtocolServiceSupported (
 
 		case kSCSIProtocolFeature_MultiPathing:
 		{
-			isSupported = fMultiPathSupport;
+			
+			// The paths to a Target which has a path group are already
+			// presented as one by its multipath device.
+			isSupported = ( fMultiPathSupport == true ) && ( fPathGroup == NULL );
+			
 		}
 		break;
 		
@@ -1591,7 +3860,21 @@ IOSCSIParallelInterfaceDevice::HandleAbortTask (
 							UInt8 						theLogicalUnit, 
 							SCSITaggedTaskIdentifier 	theTag )
 {
-	return fController->AbortTaskRequest ( fTargetIdentifier, theLogicalUnit, theTag );
+	
+	SCSIServiceResponse		serviceResponse = kSCSIServiceResponse_Request_In_Process;
+	
+	serviceResponse = fController->AbortTaskRequest ( fTargetIdentifier, theLogicalUnit, theTag );
+	
+	// If the controller performed the function immediately, reclaim the
+	// affected tasks now. Otherwise the controller will call the matching
+	// completion routine once the function has been performed.
+	if ( serviceResponse == kSCSIServiceResponse_FUNCTION_COMPLETE )
+	{
+		fController->ReclaimTasksForNexus ( fTargetIdentifier, theLogicalUnit, theTag, kSCSIParallelTaskNexus_I_T_L_Q );
+	}
+	
+	return serviceResponse;
+	
 }
 
 
@@ -1604,7 +3887,21 @@ SCSIServiceResponse
 IOSCSIParallelInterfaceDevice::HandleAbortTaskSet ( 
 							UInt8 						theLogicalUnit )
 {
-	return fController->AbortTaskSetRequest ( fTargetIdentifier, theLogicalUnit );
+	
+	SCSIServiceResponse		serviceResponse = kSCSIServiceResponse_Request_In_Process;
+	
+	serviceResponse = fController->AbortTaskSetRequest ( fTargetIdentifier, theLogicalUnit );
+	
+	// If the controller performed the function immediately, reclaim the
+	// affected tasks now. Otherwise the controller will call the matching
+	// completion routine once the function has been performed.
+	if ( serviceResponse == kSCSIServiceResponse_FUNCTION_COMPLETE )
+	{
+		fController->ReclaimTasksForNexus ( fTargetIdentifier, theLogicalUnit, 0, kSCSIParallelTaskNexus_I_T_L );
+	}
+	
+	return serviceResponse;
+	
 }
 
 
@@ -1629,7 +3926,21 @@ SCSIServiceResponse
 IOSCSIParallelInterfaceDevice::HandleClearTaskSet ( 
 							UInt8						theLogicalUnit )
 {
-	return fController->ClearTaskSetRequest ( fTargetIdentifier, theLogicalUnit );
+	
+	SCSIServiceResponse		serviceResponse = kSCSIServiceResponse_Request_In_Process;
+	
+	serviceResponse = fController->ClearTaskSetRequest ( fTargetIdentifier, theLogicalUnit );
+	
+	// If the controller performed the function immediately, reclaim the
+	// affected tasks now. Otherwise the controller will call the matching
+	// completion routine once the function has been performed.
+	if ( serviceResponse == kSCSIServiceResponse_FUNCTION_COMPLETE )
+	{
+		fController->ReclaimTasksForNexus ( fTargetIdentifier, theLogicalUnit, 0, kSCSIParallelTaskNexus_I_T_L );
+	}
+	
+	return serviceResponse;
+	
 }
 
 
@@ -1641,7 +3952,21 @@ SCSIServiceResponse
 IOSCSIParallelInterfaceDevice::HandleLogicalUnitReset (
 							UInt8 						theLogicalUnit )
 {
-	return fController->LogicalUnitResetRequest ( fTargetIdentifier, theLogicalUnit );
+	
+	SCSIServiceResponse		serviceResponse = kSCSIServiceResponse_Request_In_Process;
+	
+	serviceResponse = fController->LogicalUnitResetRequest ( fTargetIdentifier, theLogicalUnit );
+	
+	// If the controller performed the function immediately, reclaim the
+	// affected tasks now. Otherwise the controller will call the matching
+	// completion routine once the function has been performed.
+	if ( serviceResponse == kSCSIServiceResponse_FUNCTION_COMPLETE )
+	{
+		fController->ReclaimTasksForNexus ( fTargetIdentifier, theLogicalUnit, 0, kSCSIParallelTaskNexus_I_T_L );
+	}
+	
+	return serviceResponse;
+	
 }
 
 
@@ -1652,7 +3977,21 @@ IOSCSIParallelInterfaceDevice::HandleLogicalUnitReset (
 SCSIServiceResponse
 IOSCSIParallelInterfaceDevice::HandleTargetReset ( void )
 {
-	return fController->TargetResetRequest ( fTargetIdentifier );
+	
+	SCSIServiceResponse		serviceResponse = kSCSIServiceResponse_Request_In_Process;
+	
+	serviceResponse = fController->TargetResetRequest ( fTargetIdentifier );
+	
+	// If the controller performed the function immediately, reclaim the
+	// affected tasks now. Otherwise the controller will call the matching
+	// completion routine once the function has been performed.
+	if ( serviceResponse == kSCSIServiceResponse_FUNCTION_COMPLETE )
+	{
+		fController->ReclaimTasksForNexus ( fTargetIdentifier, 0, 0, kSCSIParallelTaskNexus_I_T );
+	}
+	
+	return serviceResponse;
+	
 }
 
 
@@ -1681,9 +4020,11 @@ IOSCSIParallelInterfaceDevice::ExecuteParallelTask (
 //-----------------------------------------------------------------------------
 
 SCSIParallelTaskIdentifier
-IOSCSIParallelInterfaceDevice::GetSCSIParallelTask ( bool blockForCommand )
+IOSCSIParallelInterfaceDevice::GetSCSIParallelTask ( bool blockForCommand,
+													 bool urgent,
+													 bool reserved )
 {
-	return fController->GetSCSIParallelTask ( blockForCommand );
+	return fController->GetSCSIParallelTaskForTarget ( this, blockForCommand, urgent, reserved );
 }
 
 
@@ -1742,8 +4083,18 @@ IOSCSIParallelInterfaceDevice::AddToOutstandingTaskList (
 	
 	queue_enter ( &fOutstandingTaskList, task, SCSIParallelTask *, fCommandChain );
 	
+	if ( ( task->GetTaskAttribute ( ) == kSCSITask_ORDERED ) && ( fPathGroup == NULL ) )
+	{
+		fOrderedTaskCount++;
+	}
+	
 	IOSimpleLockUnlock ( fQueueLock );
 	
+	if ( ( task->GetTaskAttribute ( ) == kSCSITask_ORDERED ) && ( fPathGroup != NULL ) )
+	{
+		fPathGroup->BeginOrderedTask ( );
+	}
+	
 	return true;
 	
 }
@@ -1759,7 +4110,8 @@ IOSCSIParallelInterfaceDevice::RemoveFromOutstandingTaskList (
 							SCSIParallelTaskIdentifier 	parallelTask )
 {
 	
-	SCSIParallelTask *	task = ( SCSIParallelTask * ) parallelTask;
+	SCSIParallelTask *	task	= ( SCSIParallelTask * ) parallelTask;
+	bool				ordered	= false;
 	
 	require_nonzero ( ( task->fCommandChain.next ), Exit );
 	require_nonzero ( ( task->fCommandChain.prev ), Exit );
@@ -1770,12 +4122,33 @@ IOSCSIParallelInterfaceDevice::RemoveFromOutstandingTaskList (
 	
 	queue_remove ( &fOutstandingTaskList, task, SCSIParallelTask *, fCommandChain );
 	
+	if ( task->GetTaskAttribute ( ) == kSCSITask_ORDERED )
+	{
+		
+		if ( fPathGroup == NULL )
+		{
+			fOrderedTaskCount--;
+		}
+		
+		else
+		{
+			ordered = true;
+		}
+		
+	}
+	
 	
 ExitLocked:
 	
 	
 	IOSimpleLockUnlock ( fQueueLock );
 	
+	// The group's lock is not taken with fQueueLock held.
+	if ( ordered == true )
+	{
+		fPathGroup->EndOrderedTask ( );
+	}
+	
 	
 Exit:
 	
@@ -1807,7 +4180,7 @@ IOSCSIParallelInterfaceDevice::AddToResendTaskList (
 	
 	task->fTaskRetryCount++;
 	
-	queue_enter ( &fResendTaskList, task, SCSIParallelTask *, fResendTaskChain );
+	EnqueueResendTask ( task );
 	
 	// Some targets return TASK SET FULL even if they have no other pending
 	// IOs from the I-T nexus. In this case we don't want that IO to sit
@@ -1876,11 +4249,9 @@ IOSCSIParallelInterfaceDevice::SendFromResendTaskList ( void )
 	while ( !queue_empty ( &fResendTaskList ) )
 	{
 		
-		parallelTask = ( SCSIParallelTaskIdentifier ) queue_first ( &fResendTaskList );
+		task = DequeueResendTask ( );
 		
-		task = ( SCSIParallelTask * ) parallelTask;
-		
-		queue_remove ( &fResendTaskList, task, SCSIParallelTask *, fResendTaskChain );
+		parallelTask = ( SCSIParallelTaskIdentifier ) task;
 		
 		IOSimpleLockUnlock ( fQueueLock );
 		
@@ -1907,14 +4278,26 @@ IOSCSIParallelInterfaceDevice::SendFromResendTaskList ( void )
 			
 		// The task has already completed
 		RemoveFromOutstandingTaskList ( parallelTask );
+		EndPathTask ( parallelTask );
+		TraceTaskCompletion ( parallelTask, kSCSIServiceResponse_TASK_COMPLETE, kSCSITaskStatus_BUSY );
+		
+		// Return taskStatus BUSY so that upper layer will retry the IO.
+		if ( task->fSplit != NULL )
+		{
+			FinishSplitPiece ( parallelTask, kSCSIServiceResponse_TASK_COMPLETE, kSCSITaskStatus_BUSY );
+		}
+		
+		else
+		{
 			
-		nextRequest = GetSCSITaskIdentifier ( parallelTask );
+			nextRequest = GetSCSITaskIdentifier ( parallelTask );
 			
-		// Release the SCSI Parallel Task object
-		FreeSCSIParallelTask ( parallelTask );
-
-		// Return taskStatus BUSY so that upper layer will retry the IO.
-		CommandCompleted ( nextRequest, kSCSIServiceResponse_TASK_COMPLETE, kSCSITaskStatus_BUSY );
+			// Release the SCSI Parallel Task object
+			FreeSCSIParallelTask ( parallelTask );
+			
+			CompleteClientRequest ( nextRequest, kSCSIServiceResponse_TASK_COMPLETE, kSCSITaskStatus_BUSY );
+			
+		}
 			
 		IOSimpleLockLock ( fQueueLock );
 			
@@ -1939,6 +4322,174 @@ IOSCSIParallelInterfaceDevice::SendFromResendTaskList ( void )
 }
 
 
+//-----------------------------------------------------------------------------
+//	EnqueueResendTask - Adds a task to the resend task list in priority
+//						order. Called with fQueueLock held.			  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceDevice::EnqueueResendTask ( SCSIParallelTask * task )
+{
+	
+	SCSIParallelTask *	next		= NULL;
+	SCSITaskAttribute	attribute	= task->GetTaskAttribute ( );
+	
+	if ( IsUrgentTaskAttribute ( attribute ) == true )
+	{
+		
+		// Urgent tasks go ahead of all other tasks, but behind the urgent
+		// tasks which are already waiting.
+		queue_iterate ( &fResendTaskList, next, SCSIParallelTask *, fResendTaskChain )
+		{
+			
+			if ( IsUrgentTaskAttribute ( next->GetTaskAttribute ( ) ) == false )
+			{
+				
+				queue_insert_before ( &fResendTaskList, task, next, SCSIParallelTask *, fResendTaskChain );
+				return;
+				
+			}
+			
+		}
+		
+	}
+	
+	queue_enter ( &fResendTaskList, task, SCSIParallelTask *, fResendTaskChain );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	DequeueResendTask - Removes the next task to be resent from the resend
+//						task list. Called with fQueueLock held and the list
+//						not empty.									  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+SCSIParallelTask *
+IOSCSIParallelInterfaceDevice::DequeueResendTask ( void )
+{
+	
+	SCSIParallelTask *	task	= NULL;
+	SCSIParallelTask *	next	= NULL;
+	bool				urgent	= false;
+	
+	task	= ( SCSIParallelTask * ) queue_first ( &fResendTaskList );
+	urgent	= IsUrgentTaskAttribute ( task->GetTaskAttribute ( ) );
+	
+	// Urgent tasks are at the head of the list. Once enough of them have been
+	// resent in a row, resend the oldest other task so that it isn't starved.
+	if ( ( urgent == true ) && ( fUrgentResendStreak >= kSCSIParallelMaxUrgentTaskStreak ) )
+	{
+		
+		queue_iterate ( &fResendTaskList, next, SCSIParallelTask *, fResendTaskChain )
+		{
+			
+			if ( IsUrgentTaskAttribute ( next->GetTaskAttribute ( ) ) == false )
+			{
+				
+				task	= next;
+				urgent	= false;
+				break;
+				
+			}
+			
+		}
+		
+	}
+	
+	if ( urgent == true )
+	{
+		fUrgentResendStreak++;
+	}
+	
+	else
+	{
+		fUrgentResendStreak = 0;
+	}
+	
+	UnlinkResendTask ( task );
+	
+	return task;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	UnlinkResendTask - 	Removes a task from the resend task list. Called
+//						with fQueueLock held.						  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelInterfaceDevice::UnlinkResendTask ( SCSIParallelTask * task )
+{
+	
+	queue_remove ( &fResendTaskList, task, SCSIParallelTask *, fResendTaskChain );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	IsTaskInNexus - Determines if a task belongs to a nexus of this Target.
+//																	  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+bool
+IOSCSIParallelInterfaceDevice::IsTaskInNexus (
+							SCSIParallelTask *			task,
+							SCSILogicalUnitNumber		theL,
+							SCSITaggedTaskIdentifier	theQ,
+							SCSIParallelTaskNexus		theNexus )
+{
+	
+	// Every task of this Target belongs to an I_T nexus.
+	if ( theNexus == kSCSIParallelTaskNexus_I_T )
+	{
+		return true;
+	}
+	
+	if ( GetLogicalUnitNumber ( task ) != theL )
+	{
+		return false;
+	}
+	
+	return ( ( theNexus == kSCSIParallelTaskNexus_I_T_L ) ||
+			 ( GetTaggedTaskIdentifier ( task ) == theQ ) );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	IsUrgentTaskAttribute - Determines if tasks with the attribute go ahead of
+//							other tasks.							  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+bool
+IOSCSIParallelInterfaceDevice::IsUrgentTaskAttribute ( SCSITaskAttribute attribute )
+{
+	return ( ( attribute == kSCSITask_HEAD_OF_QUEUE ) || ( attribute == kSCSITask_ACA ) );
+}
+
+
+//-----------------------------------------------------------------------------
+//	IsRecoveryRequest - Determines if a request is part of error recovery.
+//																	  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+bool
+IOSCSIParallelInterfaceDevice::IsRecoveryRequest ( SCSITaskIdentifier request )
+{
+	
+	SCSICommandDescriptorBlock	cdb;
+	
+	// Sense is collected with REQUEST SENSE, and a Target is checked with
+	// TEST UNIT READY after a reset. Neither is sent often otherwise.
+	( ( SCSITask * ) request )->GetCommandDescriptorBlock ( &cdb );
+	
+	return ( ( cdb[0] == kSCSICmd_REQUEST_SENSE ) || ( cdb[0] == kSCSICmd_TEST_UNIT_READY ) );
+	
+}
+
+
 //-----------------------------------------------------------------------------
 //	RemoveFromOutstandingTaskList - 	Removes a task from the resend task
 //										(TASK_SET_FULL) list.		[PROTECTED]
@@ -1958,7 +4509,7 @@ IOSCSIParallelInterfaceDevice::RemoveFromResendTaskList (
 	
 	require ( ( queue_empty ( &fResendTaskList ) == false ), ExitLocked );
 	
-	queue_remove ( &fResendTaskList, task, SCSIParallelTask *, fResendTaskChain );
+	UnlinkResendTask ( task );
 	
 	
 ExitLocked:
@@ -2088,7 +4639,9 @@ IOSCSIParallelInterfaceDevice::GetTargetIdentifier (
 
 
 //-----------------------------------------------------------------------------
-//	SetDMABuffer - Sets the DMA buffer in the task.					[PROTECTED]
+//	SetDMABuffer - Sets the DMA buffer in the task. The controller stages
+//				   the data through a bounce buffer if the HBA can't reach
+//				   the client's buffer.								[PROTECTED]
 //-----------------------------------------------------------------------------
 
 IOReturn
@@ -2104,7 +4657,7 @@ IOSCSIParallelInterfaceDevice::SetDMABuffer (
 		return NULL;
 	}
 	
-	return task->SetBuffer ( buffer );
+	return fController->SetTaskDMABuffer ( task, buffer );
 	
 }
 
@@ -2565,3 +5118,159 @@ IOSCSIParallelInterfaceDevice::GetHBADataDescriptor (
 	return task->GetHBADataDescriptor ( );
 	
 }
+
+
+#if 0
+#pragma mark -
+#pragma mark Static Routines
+#pragma mark -
+#endif
+
+
+//-----------------------------------------------------------------------------
+//	GetReadWriteBlocks - 	Gets the first block and the block count of a
+//							READ or WRITE CDB. Returns false for any other
+//							command.								   [STATIC]
+//-----------------------------------------------------------------------------
+
+static bool
+GetReadWriteBlocks ( UInt8 *	cdb,
+					 UInt8		cdbSize,
+					 UInt64 *	logicalBlockAddress,
+					 UInt64 *	blockCount )
+{
+	
+	bool	result = true;
+	
+	switch ( cdb[0] )
+	{
+		
+		case kSCSICmd_READ_6:
+		case kSCSICmd_WRITE_6:
+		{
+			
+			require_quiet ( ( cdbSize == kSCSICDBSize_6Byte ), ErrorExit );
+			*logicalBlockAddress	= ( ( cdb[1] & 0x1F ) << 16 ) | ( cdb[2] << 8 ) | cdb[3];
+			*blockCount				= ( cdb[4] == 0 ) ? 256 : cdb[4];
+			
+		}
+		break;
+		
+		case kSCSICmd_READ_10:
+		case kSCSICmd_WRITE_10:
+		{
+			
+			require_quiet ( ( cdbSize == kSCSICDBSize_10Byte ), ErrorExit );
+			*logicalBlockAddress	= OSReadBigInt32 ( cdb, 2 );
+			*blockCount				= OSReadBigInt16 ( cdb, 7 );
+			
+		}
+		break;
+		
+		case kSCSICmd_READ_12:
+		case kSCSICmd_WRITE_12:
+		{
+			
+			require_quiet ( ( cdbSize == kSCSICDBSize_12Byte ), ErrorExit );
+			*logicalBlockAddress	= OSReadBigInt32 ( cdb, 2 );
+			*blockCount				= OSReadBigInt32 ( cdb, 6 );
+			
+		}
+		break;
+		
+		case kSCSICmd_READ_16:
+		case kSCSICmd_WRITE_16:
+		{
+			
+			require_quiet ( ( cdbSize == kSCSICDBSize_16Byte ), ErrorExit );
+			*logicalBlockAddress	= OSReadBigInt64 ( cdb, 2 );
+			*blockCount				= OSReadBigInt32 ( cdb, 10 );
+			
+		}
+		break;
+		
+		default:
+		{
+			result = false;
+		}
+		break;
+		
+	}
+	
+	return result;
+	
+	
+ErrorExit:
+	
+	
+	return false;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	SetReadWriteBlocks - 	Sets the first block and the block count of a
+//							READ or WRITE CDB. The values must fit the CDB,
+//							which they do for a piece of the original.
+//																	   [STATIC]
+//-----------------------------------------------------------------------------
+
+static void
+SetReadWriteBlocks ( UInt8 *	cdb,
+					 UInt64		logicalBlockAddress,
+					 UInt64		blockCount )
+{
+	
+	switch ( cdb[0] )
+	{
+		
+		case kSCSICmd_READ_6:
+		case kSCSICmd_WRITE_6:
+		{
+			
+			cdb[1] = ( cdb[1] & 0xE0 ) | ( ( logicalBlockAddress >> 16 ) & 0x1F );
+			cdb[2] = ( logicalBlockAddress >> 8 ) & 0xFF;
+			cdb[3] = logicalBlockAddress & 0xFF;
+			
+			// A count of 0 means 256 blocks.
+			cdb[4] = blockCount & 0xFF;
+			
+		}
+		break;
+		
+		case kSCSICmd_READ_10:
+		case kSCSICmd_WRITE_10:
+		{
+			
+			OSWriteBigInt32 ( cdb, 2, logicalBlockAddress );
+			OSWriteBigInt16 ( cdb, 7, blockCount );
+			
+		}
+		break;
+		
+		case kSCSICmd_READ_12:
+		case kSCSICmd_WRITE_12:
+		{
+			
+			OSWriteBigInt32 ( cdb, 2, logicalBlockAddress );
+			OSWriteBigInt32 ( cdb, 6, blockCount );
+			
+		}
+		break;
+		
+		case kSCSICmd_READ_16:
+		case kSCSICmd_WRITE_16:
+		{
+			
+			OSWriteBigInt64 ( cdb, 2, logicalBlockAddress );
+			OSWriteBigInt32 ( cdb, 10, blockCount );
+			
+		}
+		break;
+		
+		default:
+			break;
+		
+	}
+	
+}
@@ -44,17 +44,157 @@
 // SCSI Parallel Family Headers
 #include "IOSCSIParallelInterfaceController.h"
 #include "SCSIParallelTask.h"
+#include "SCSIParallelPathGroup.h"
+#include "SCSIParallelTrace.h"
+
+
+//-----------------------------------------------------------------------------
+//	Structures
+//-----------------------------------------------------------------------------
+
+// Task admission state for a Target. This is owned by the device, but is only
+// changed by the controller with its workloop gate held.
+typedef struct SCSIParallelTaskAdmission
+{
+	
+	// The reservation, cap and weight (see kIOTaskAdmissionKey).
+	UInt32		fReservation;
+	UInt32		fCap;
+	UInt32		fWeight;
+	
+	// The number of tasks charged to the Target, the number of threads
+	// waiting for one, and whether a request was last turned away.
+	UInt32		fOutstanding;
+	UInt32		fWaiters;
+	bool		fDeferred;
+	
+	// Whether the Target has the controller open, and whether its
+	// reservation is set aside. A closed Target keeps its reservation until
+	// the tasks charged to it have drained.
+	bool		fOpen;
+	bool		fReserved;
+	
+	// Statistics. Wait times are in microseconds. fPoolEmpty counts the
+	// deferrals that found no free task in the pool.
+	UInt32		fMaximumOutstanding;
+	UInt64		fDeferrals;
+	UInt64		fWaits;
+	UInt64		fTotalWaitTime;
+	UInt64		fMaximumWaitTime;
+	UInt64		fPoolEmpty;
+	
+} SCSIParallelTaskAdmission;
+
+// A client's READ or WRITE which is larger than the HBA can transfer in one
+// task. It is sent as pieces, each a task of its own with a CDB for its part
+// of the blocks, and the client's task is completed once all of the pieces
+// are done. Protected by the device's fQueueLock.
+typedef struct SCSIParallelSplit
+{
+	
+	SCSITaskIdentifier			fRequest;
+	
+	// The CDB of the client's task, the block size and the first block.
+	SCSICommandDescriptorBlock	fCDB;
+	UInt64						fBlockSize;
+	UInt64						fLogicalBlockAddress;
+	
+	// The bytes to transfer, the most a piece may transfer, and the offset
+	// of the next piece to send.
+	UInt64						fLength;
+	UInt64						fPieceSize;
+	UInt64						fNextOffset;
+	
+	// The pieces which have been sent but are not done, plus one while
+	// the pieces are being sent.
+	UInt32						fOutstanding;
+	
+	// The bytes transferred before the first piece which failed or came up
+	// short, and the result and sense data of the first piece which failed.
+	// Pieces complete in any order, so the first piece is the one at the
+	// lowest offset. No more pieces are sent after a failure.
+	UInt64						fRealizedCount;
+	UInt64						fFailedOffset;
+	SCSIServiceResponse			fServiceResponse;
+	SCSITaskStatus				fTaskStatus;
+	SCSI_Sense_Data				fSenseData;
+	UInt8						fSenseDataSize;
+	
+} SCSIParallelSplit;
+
+// The I/O counters kept for a controller and for each Target (see
+// kIOStatisticsKey).
+enum
+{
+	kSCSIParallelStatistic_TasksSubmitted	= 0,
+	kSCSIParallelStatistic_TasksCompleted	= 1,
+	kSCSIParallelStatistic_BytesRead		= 2,
+	kSCSIParallelStatistic_BytesWritten		= 3,
+	kSCSIParallelStatistic_Errors			= 4,
+	kSCSIParallelStatistic_Timeouts			= 5,
+	kSCSIParallelStatistic_Resends			= 6,
+	kSCSIParallelStatistic_DMAMappings		= 7,
+	kSCSIParallelStatistic_DMAMappingTime	= 8,
+	kSCSIParallelStatisticCount				= 9
+};
+
+enum
+{
+	kSCSIParallelStatisticsStripeCount		= 16,
+	kSCSIParallelStatisticsStripeMask		= 0x0F
+};
+
+// The counters are kept in stripes aligned to cache lines, and a thread
+// updates the stripe picked by hashing its thread pointer. This is not a
+// per-CPU counter: two threads may hash to the same stripe, and a thread
+// keeps its stripe when it moves to another processor, so updates are
+// atomic. Striping only makes it unlikely that the threads submitting and
+// completing tasks write to the same cache line. The stripes are only
+// summed when the statistics are read.
+typedef struct SCSIParallelStatisticsStripe
+{
+	volatile SInt64		fCounter[kSCSIParallelStatisticCount];
+} __attribute__ ( ( aligned ( 64 ) ) ) SCSIParallelStatisticsStripe;
+
+typedef struct SCSIParallelStatistics
+{
+	SCSIParallelStatisticsStripe	fStripe[kSCSIParallelStatisticsStripeCount];
+} SCSIParallelStatistics;
+
+// The histograms of the task latency breakdown kept for each Target (see
+// kIOTaskStageLatencyKey), and the number of buckets in each.
+enum
+{
+	kSCSIParallelLatency_PoolWait		= 0,
+	kSCSIParallelLatency_Setup			= 1,
+	kSCSIParallelLatency_HBA			= 2,
+	kSCSIParallelLatency_Interrupt		= 3,
+	kSCSIParallelLatency_Completion		= 4,
+	kSCSIParallelLatency_Total			= 5,
+	kSCSIParallelLatencyCount			= 6
+};
+
+enum
+{
+	kSCSIParallelLatencyBucketCount		= 24
+};
 
 
 //-----------------------------------------------------------------------------
 //	Class Declarations
 //-----------------------------------------------------------------------------
 
+class SCSIParallelMultipathDevice;
+
 class IOSCSIParallelInterfaceDevice: public IOSCSIProtocolServices
 {
 	
 	OSDeclareDefaultStructors ( IOSCSIParallelInterfaceDevice )
 	
+	// The multipath device of a Target sends the tasks and task management
+	// functions of its clients over the paths to it.
+	friend class SCSIParallelMultipathDevice;
+	
 #if 0	
 #pragma mark -
 #pragma mark Client API
@@ -118,6 +258,25 @@ public:
 	
 	SCSIParallelTaskIdentifier	FindTaskForControllerIdentifier ( 
 									UInt64						theIdentifier );
+	
+	/*!
+		@function FindTaskForNexus
+		@abstract Method to retrieve an outstanding SCSIParallelTaskIdentifier for a nexus.
+		@discussion	Find the first outstanding task of this Target which belongs to the
+		specified nexus and which the controller does not have: a task waiting on the
+		resend list, which is removed from that list so it will not be reissued to the
+		controller, a task the HBA released with ReleaseParallelTask, or a task the
+		controller holds while services are suspended. Must be called with the gate
+		held.
+		@param theL the LUN. Ignored for an I_T nexus.
+		@param theQ the tagged task identifier. Ignored for an I_T or I_T_L nexus.
+		@param theNexus the SCSIParallelTaskNexus to match against.
+		@result returns A valid SCSIParallelTaskIdentifier or NULL.
+	*/
+	SCSIParallelTaskIdentifier	FindTaskForNexus ( 
+									SCSILogicalUnitNumber		theL,
+									SCSITaggedTaskIdentifier	theQ,
+									SCSIParallelTaskNexus		theNexus );
 							
 	bool	SetInitialTargetProperties ( OSDictionary * properties );
 	
@@ -127,8 +286,43 @@ public:
 	
 	void	RemoveTargetProperty ( const char * key );
 	
+	// Property transactions. Between the begin and the commit, calls to
+	// SetTargetProperty and RemoveTargetProperty change a private copy of the
+	// protocol characteristics dictionary, which is published once by the
+	// outermost commit. Transactions may be nested and belong to the thread
+	// which began them. Other threads wait for the outermost commit before
+	// starting their own.
+	bool	BeginTargetPropertyTransaction ( void );
+	void	CommitTargetPropertyTransaction ( void );
+	
 	bool	IsFeatureNegotiationNecessary ( SCSIParallelFeature	feature );
 	
+	/*!
+		@function RegisterDataBuffer
+		@abstract Method to register a data buffer which the client uses for
+		many tasks.
+		@discussion	The buffer is prepared and mapped for DMA once, and stays so
+		until it is unregistered. A task whose data buffer is a registered
+		buffer reuses that mapping instead of the HBA mapping the buffer for
+		every task. The buffer must be reachable by the HBA. Registrations
+		are per controller, so a buffer registered with one Target may be
+		used with any Target of the same controller.
+		@param buffer The data buffer.
+		@result returns kIOReturnSuccess if the buffer was registered.
+	*/
+	IOReturn	RegisterDataBuffer ( IOMemoryDescriptor * buffer );
+	
+	/*!
+		@function UnregisterDataBuffer
+		@abstract Method to unregister a data buffer registered with
+		RegisterDataBuffer().
+		@discussion	Tasks already using the buffer keep its mapping until they
+		complete.
+		@param buffer The data buffer.
+		@result returns kIOReturnSuccess if the buffer was unregistered.
+	*/
+	IOReturn	UnregisterDataBuffer ( IOMemoryDescriptor * buffer );
+	
 	/*
 	 * Member routines for services available only to controller.
 	 */
@@ -164,6 +358,106 @@ public:
 									SCSIServiceResponse 		serviceResponse,
 									SCSITaskStatus 				taskStatus );
 	
+	/*!
+		@function BeginRecovery
+		@abstract Method called when timeout recovery begins for a task.
+		@discussion	Method called by the controller when a task of this Target has
+		timed out and the timeout recovery ladder is started for it. Only one task
+		per Target is recovered at a time.
+		@param parallelTask A valid SCSIParallelTaskIdentifier.
+	*/
+	void	BeginRecovery ( SCSIParallelTaskIdentifier parallelTask );
+	
+	/*!
+		@function EndRecovery
+		@abstract Method called when timeout recovery ends.
+		@discussion	Method called by the controller when the task being recovered
+		has completed, or the recovery ladder has been exhausted.
+		@result returns the duration of the recovery in milliseconds.
+	*/
+	UInt64	EndRecovery ( void );
+	
+	/*!
+		@function GetRecoveryTask
+		@abstract Method to retrieve the task being recovered.
+		@discussion	Method to retrieve the task for which timeout recovery is in
+		progress.
+		@result returns A valid SCSIParallelTaskIdentifier or NULL if no recovery
+		is in progress.
+	*/
+	SCSIParallelTaskIdentifier	GetRecoveryTask ( void );
+	
+	/*!
+		@function GetRecoveryStep
+		@abstract Method to retrieve the current timeout recovery step.
+		@discussion	Method to retrieve the last step of the timeout recovery ladder
+		which was issued for the task being recovered.
+		@result returns the recovery step.
+	*/
+	UInt8	GetRecoveryStep ( void );
+	
+	/*!
+		@function SetRecoveryStep
+		@abstract Method to set the current timeout recovery step.
+		@discussion	Method to set the current timeout recovery step.
+		@param step The recovery step being issued.
+	*/
+	void	SetRecoveryStep ( UInt8 step );
+	
+	/*!
+		@function GetTaskAdmission
+		@abstract Method to retrieve the task admission state.
+		@discussion	Method used by the controller to charge and uncharge SCSI
+		Parallel Tasks to this Target.
+		@result returns a pointer to the SCSIParallelTaskAdmission for this Target.
+	*/
+	SCSIParallelTaskAdmission *	GetTaskAdmission ( void );
+	
+	/*!
+		@function GetStatistics
+		@abstract Method to retrieve the I/O statistics.
+		@discussion	Method used by the controller to count the tasks submitted to
+		and completed by this Target.
+		@result returns a pointer to the SCSIParallelStatistics for this Target,
+		or NULL if they could not be allocated.
+	*/
+	SCSIParallelStatistics *	GetStatistics ( void );
+	
+	/*!
+		@function AllocateStatistics
+		@abstract Allocates a zeroed set of I/O statistics.
+		@result returns a pointer to the SCSIParallelStatistics or NULL.
+	*/
+	static SCSIParallelStatistics *	AllocateStatistics ( void );
+	
+	/*!
+		@function FreeStatistics
+		@abstract Frees a set of I/O statistics allocated by AllocateStatistics().
+		@param statistics A pointer to the SCSIParallelStatistics.
+	*/
+	static void		FreeStatistics ( SCSIParallelStatistics * statistics );
+	
+	/*!
+		@function AddStatistic
+		@abstract Adds to one of the counters in the current thread's stripe.
+		@param statistics A pointer to the SCSIParallelStatistics, or NULL.
+		@param counter The counter, e.g. kSCSIParallelStatistic_TasksSubmitted.
+		@param value The amount to add.
+	*/
+	static void		AddStatistic ( SCSIParallelStatistics *	statistics,
+								   UInt32					counter,
+								   UInt64					value );
+	
+	/*!
+		@function CreateStatisticsDictionary
+		@abstract Sums the stripes of a set of I/O statistics.
+		@param statistics A pointer to the SCSIParallelStatistics.
+		@result returns a dictionary suitable for publishing under
+		kIOStatisticsKey, or NULL. The caller must release it.
+	*/
+	static OSDictionary *	CreateStatisticsDictionary (
+								SCSIParallelStatistics * statistics );
+	
 	
 	/*
 	 * Member routines for services available only to SCSI Parallel Family.
@@ -265,11 +559,17 @@ protected:
 		@param blockForCommand If true, the thread calling this method will
 		block until a command becomes available. If false, it will not block
 		and could possibly return NULL.
+		@param urgent If true, the request is urgent (HEAD OF QUEUE or ACA) and
+		is given a task ahead of other requests waiting for one.
+		@param reserved If true, the request may use the controller's reserved
+		tasks (see kIOTaskReserveKey).
 		@result returns If blockForCommand is true, this call is guaranteed
 		to return a valid SCSIParallelTaskIdentifier. If blockForCommand is
 		false, it may return a valid SCSIParallelTaskIdentifier or NULL.
 	*/
-	SCSIParallelTaskIdentifier 	GetSCSIParallelTask ( bool blockForCommand );
+	SCSIParallelTaskIdentifier 	GetSCSIParallelTask ( bool blockForCommand,
+													  bool urgent = false,
+													  bool reserved = false );
 	
 	/*!
 		@function FreeSCSIParallelTask
@@ -646,6 +946,8 @@ public:
 	
 	IOReturn	message ( UInt32 clientMsg, IOService * forProvider, void * forArg = 0 );
 	IOReturn	requestProbe ( IOOptionBits options );
+	IOReturn	setProperties ( OSObject * properties );
+	bool		serializeProperties ( OSSerialize * s ) const;
 	
 	/*
 	 * IOSCSIProtocolServices support member routines.
@@ -705,6 +1007,56 @@ private:
 	
 	IOSCSIParallelInterfaceController *	fController;
 	
+	// Timeout recovery state. The task being recovered, the last step of the
+	// recovery ladder issued for it, and the time the recovery began.
+	SCSIParallelTaskIdentifier			fRecoveryTask;
+	UInt8								fRecoveryStep;
+	UInt64								fRecoveryStartTime;
+	
+	// Task admission state for the controller's pool of SCSI Parallel Tasks.
+	SCSIParallelTaskAdmission			fTaskAdmission;
+	
+	// The I/O statistics for this Target.
+	SCSIParallelStatistics *			fStatistics;
+	
+	// The task latency breakdown. Tasks are completed on the controller's
+	// workloop, so the histograms are only updated there.
+	UInt64								fLatency[kSCSIParallelLatencyCount][kSCSIParallelLatencyBucketCount];
+	
+	// The number of outstanding ORDERED tasks, which hold back new tasks
+	// other than urgent ones, and the number of urgent tasks resent in a
+	// row ahead of other tasks. Protected by fQueueLock. The ORDERED tasks
+	// of a path are counted by its path group instead.
+	UInt32								fOrderedTaskCount;
+	UInt32								fUrgentResendStreak;
+	
+	// The copy of the protocol characteristics dictionary being changed by
+	// the open property transaction, how deeply it is nested and the thread
+	// which owns it. The depth and the owner are protected by
+	// fPropertyTransactionLock, the copy is only used by the owner.
+	OSDictionary *						fPropertyTransaction;
+	UInt32								fPropertyTransactionDepth;
+	thread_t							fPropertyTransactionOwner;
+	IOLock *							fPropertyTransactionLock;
+	
+	// The group of paths to this Target when it can be reached through more
+	// than one controller, or NULL, and the device which presents the Target
+	// over the group. fPathGroup is set under fQueueLock once the Target has
+	// been identified, unless the path was stopped first (see fStopped).
+	SCSIParallelPathGroup *				fPathGroup;
+	SCSIParallelMultipathDevice *		fMultipathDevice;
+	bool								fStopped;
+	
+	// The command trace being captured, or NULL if there is no capture
+	// (see kIOCommandTraceKey). The trace state is protected by fQueueLock.
+	// While the capture runs, the times in the records are absolute times.
+	SCSIParallelTraceRecord *			fTraceRecords;
+	UInt32								fTraceCapacity;
+	UInt32								fTraceNext;
+	UInt32								fTraceDropped;
+	UInt32								fTraceGeneration;
+	UInt64								fTraceStartTime;
+	
 	// Member variables to maintain the previous and next element in the 
 	// Parallel device list.
 	IOSCSIParallelInterfaceDevice *		fPreviousParallelDevice;
@@ -715,6 +1067,84 @@ private:
 	// tagged command queueing, etc.
 	void 		DetermineParallelFeatures ( UInt8 * inqData );
 	
+	// Member routine to validate and set a property in the protocol
+	// characteristics dictionary of a property transaction.
+	bool		SetTargetPropertyInDictionary (
+					OSDictionary *	protocolDict,
+					const char * 	key,
+					OSObject *		value );
+	
+	// Member routines to keep the resend list in priority order. These are
+	// called with fQueueLock held.
+	void				EnqueueResendTask ( SCSIParallelTask * task );
+	SCSIParallelTask *	DequeueResendTask ( void );
+	void				UnlinkResendTask ( SCSIParallelTask * task );
+	bool				IsTaskInNexus ( SCSIParallelTask *			task,
+										SCSILogicalUnitNumber		theL,
+										SCSITaggedTaskIdentifier	theQ,
+										SCSIParallelTaskNexus		theNexus );
+	
+	static bool	IsUrgentTaskAttribute ( SCSITaskAttribute attribute );
+	static bool	IsRecoveryRequest ( SCSITaskIdentifier request );
+	
+	// Member routines to set up and publish the task admission state.
+	void		InitializeTaskAdmission ( OSDictionary * properties );
+	void		UpdateTaskAdmissionStatistics ( void );
+	
+	// Member routine to publish the I/O statistics.
+	void		UpdateStatistics ( void );
+	
+	// Member routines to keep and publish the task latency breakdown.
+	void		RecordTaskLatency ( SCSIParallelTaskIdentifier parallelTask );
+	void		RecordStageLatency ( UInt32 histogram, UInt64 start, UInt64 end );
+	void		UpdateLatencyStatistics ( void );
+	
+	// Member routines for multipathing. A task is dispatched on the path the
+	// multipath device picks, and is completed back through it. The Target
+	// is identified and the path joins its group on a thread of its own.
+	void		JoinPathGroup ( void );
+	OSData *	CopyLogicalUnitIdentifier ( void );
+	static void	DeviceCommandCompletion ( SCSITaskIdentifier request );
+	
+	bool		DispatchSCSICommand (
+					SCSITaskIdentifier			request,
+					SCSIServiceResponse * 		serviceResponse,
+					SCSITaskStatus *			taskStatus );
+	bool		DispatchSCSICommandOnOtherPath ( SCSITaskIdentifier request );
+	void		EndPathTask ( SCSIParallelTaskIdentifier parallelTask );
+	void		CompleteClientRequest (
+					SCSITaskIdentifier			request,
+					SCSIServiceResponse			serviceResponse,
+					SCSITaskStatus				taskStatus );
+	
+	// Member routines to send a READ or WRITE which is too large for the
+	// HBA as pieces, and to finish the pieces.
+	SCSIParallelSplit *	CreateSplit (
+							SCSITaskIdentifier			request,
+							SCSIParallelTaskIdentifier	parallelTask );
+	void		DispatchSplitSCSICommand (
+					SCSIParallelSplit *			split,
+					SCSIParallelTaskIdentifier	parallelTask,
+					bool						urgent );
+	bool		ArmSplitPiece (
+					SCSIParallelSplit *			split,
+					SCSIParallelTask *			task );
+	SCSIServiceResponse	SendSplitPiece ( SCSIParallelTaskIdentifier parallelTask );
+	void		FinishSplitPiece (
+					SCSIParallelTaskIdentifier	parallelTask,
+					SCSIServiceResponse			serviceResponse,
+					SCSITaskStatus				taskStatus );
+	void		CompleteSplit ( SCSIParallelSplit * split );
+	
+	// Member routines for command trace capture.
+	bool		StartCommandTrace ( UInt32 recordCount );
+	void		StopCommandTrace ( void );
+	void		TraceTaskSubmission ( SCSIParallelTaskIdentifier parallelTask );
+	void		TraceTaskCompletion (
+					SCSIParallelTaskIdentifier	parallelTask,
+					SCSIServiceResponse			serviceResponse,
+					SCSITaskStatus				taskStatus );
+	
 };
 
 
@@ -0,0 +1,847 @@
+/*
+ * Copyright (c) 2002-2008 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+
+//-----------------------------------------------------------------------------
+//	Includes
+//-----------------------------------------------------------------------------
+
+#include <IOKit/IOTypes.h>
+#include <libkern/OSAtomic.h>
+
+// IOKit storage includes
+#include <IOKit/storage/IOStorageProtocolCharacteristics.h>
+
+// SCSI Architecture Model Family includes
+#include <IOKit/scsi/SCSICmds_INQUIRY_Definitions.h>
+
+// SCSI Parallel Family includes
+#include "SCSIParallelMultipathDevice.h"
+#include "IOSCSIParallelInterfaceDevice.h"
+
+
+//-----------------------------------------------------------------------------
+//	Macros
+//-----------------------------------------------------------------------------
+
+#define DEBUG 												0
+#define DEBUG_ASSERT_COMPONENT_NAME_STRING					"SPI MULTIPATH"
+
+#if DEBUG
+#define SCSI_PARALLEL_MULTIPATH_DEBUGGING_LEVEL				0
+#endif
+
+
+#include "IOSCSIParallelFamilyDebugging.h"
+
+
+#if ( SCSI_PARALLEL_MULTIPATH_DEBUGGING_LEVEL >= 1 )
+#define PANIC_NOW(x)		panic x
+#else
+#define PANIC_NOW(x)
+#endif
+
+#if ( SCSI_PARALLEL_MULTIPATH_DEBUGGING_LEVEL >= 2 )
+#define ERROR_LOG(x)		IOLog x
+#else
+#define ERROR_LOG(x)		SCSI_PARALLEL_TRACE ( kSCSIParallelTraceCategory_Device, x )
+#endif
+
+#if ( SCSI_PARALLEL_MULTIPATH_DEBUGGING_LEVEL >= 3 )
+#define STATUS_LOG(x)		IOLog x
+#else
+#define STATUS_LOG(x)		SCSI_PARALLEL_TRACE ( kSCSIParallelTraceCategory_Device | kSCSIParallelTraceStatus, x )
+#endif
+
+
+#define super IOSCSIProtocolServices
+OSDefineMetaClassAndStructors ( SCSIParallelMultipathDevice, IOSCSIProtocolServices );
+
+
+//-----------------------------------------------------------------------------
+//	Constants
+//-----------------------------------------------------------------------------
+
+#define kIOMultipathIdentifierKey	"Multipath Identifier"
+
+// The task management functions, for SendTaskManagementFunction.
+enum
+{
+	kSCSIParallelMultipathFunction_AbortTask			= 0,
+	kSCSIParallelMultipathFunction_AbortTaskSet			= 1,
+	kSCSIParallelMultipathFunction_ClearACA				= 2,
+	kSCSIParallelMultipathFunction_ClearTaskSet			= 3,
+	kSCSIParallelMultipathFunction_LogicalUnitReset		= 4,
+	kSCSIParallelMultipathFunction_TargetReset			= 5
+};
+
+
+//-----------------------------------------------------------------------------
+//	Globals
+//-----------------------------------------------------------------------------
+
+// The same power states as the paths have.
+static IOPMPowerState sPowerStates[kSCSIProtocolLayerNumDefaultStates] =
+{
+	{ 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 },
+	{ 1, (IOPMDeviceUsable | IOPMMaxPerformance), IOPMPowerOn, IOPMPowerOn, 0, 0, 0, 0, 0, 0, 0, 0 }
+};
+
+
+#if 0
+#pragma mark -
+#pragma mark IOKit Member Routines
+#pragma mark -
+#endif
+
+
+//-----------------------------------------------------------------------------
+//	Create - Creates the multipath device for a path group.	   [STATIC][PUBLIC]
+//-----------------------------------------------------------------------------
+
+SCSIParallelMultipathDevice *
+SCSIParallelMultipathDevice::Create ( SCSIParallelPathGroup * group )
+{
+	
+	SCSIParallelMultipathDevice *	device = NULL;
+	
+	device = OSTypeAlloc ( SCSIParallelMultipathDevice );
+	require_nonzero ( device, ErrorExit );
+	
+	require ( device->InitWithPathGroup ( group ), ReleaseDevice );
+	
+	return device;
+	
+	
+ReleaseDevice:
+	
+	
+	device->release ( );
+	device = NULL;
+	
+	
+ErrorExit:
+	
+	
+	return device;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	AttachPath - Makes the multipath device a client of a path. The first
+//				 path starts it, later paths are told the INQUIRY data of
+//				 the Target.										   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+bool
+SCSIParallelMultipathDevice::AttachPath ( IOSCSIParallelInterfaceDevice * path )
+{
+	
+	bool	result = false;
+	
+	IOLockLock ( fLock );
+	
+	require ( ( isInactive ( ) == false ), UNLOCK_EXIT );
+	require ( ( path->isInactive ( ) == false ), UNLOCK_EXIT );
+	
+	// The path must know where to complete tasks before it is selected.
+	retain ( );
+	path->fMultipathDevice = this;
+	
+	result = attach ( path );
+	require ( result, UNLOCK_EXIT );
+	
+	fPathGroup->SetPathOnline ( path, true );
+	
+	if ( fStarted == false )
+	{
+		
+		fStarted = start ( path );
+		if ( fStarted == false )
+		{
+			
+			fPathGroup->SetPathOnline ( path, false );
+			detach ( path );
+			result = false;
+			
+		}
+		
+	}
+	
+	else if ( fInquiryDataLength != 0 )
+	{
+		path->DetermineParallelFeatures ( fInquiryData );
+	}
+	
+	
+UNLOCK_EXIT:
+	
+	
+	IOLockUnlock ( fLock );
+	
+	return result;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	start															   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+bool
+SCSIParallelMultipathDevice::start ( IOService * provider )
+{
+	
+	IOSCSIParallelInterfaceDevice *	path	= NULL;
+	OSObject *						value	= NULL;
+	bool							result	= false;
+	
+	path = OSDynamicCast ( IOSCSIParallelInterfaceDevice, provider );
+	require_nonzero ( path, ErrorExit );
+	
+	result = super::start ( provider );
+	require ( result, ErrorExit );
+	
+	InitializePowerManagement ( provider );
+	
+	// The paths reach the Target over the same kind of interconnect, so
+	// the first one describes it for all of them.
+	value = path->getProperty ( kIOPropertyProtocolCharacteristicsKey );
+	if ( value != NULL )
+	{
+		setProperty ( kIOPropertyProtocolCharacteristicsKey, value );
+	}
+	
+	value = path->getProperty ( kIOMultipathIdentifierKey );
+	if ( value != NULL )
+	{
+		setProperty ( kIOMultipathIdentifierKey, value );
+	}
+	
+	CreateSCSITargetDevice ( );
+	
+	
+ErrorExit:
+	
+	
+	return result;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	stop - Called for each path which goes away. The multipath device only
+//		   stops with its last path.								   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+void
+SCSIParallelMultipathDevice::stop ( IOService * provider )
+{
+	
+	if ( isInactive ( ) == true )
+	{
+		super::stop ( provider );
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	free															   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+void
+SCSIParallelMultipathDevice::free ( void )
+{
+	
+	if ( fPathGroup != NULL )
+	{
+		
+		fPathGroup->release ( );
+		fPathGroup = NULL;
+		
+	}
+	
+	if ( fLock != NULL )
+	{
+		
+		IOLockFree ( fLock );
+		fLock = NULL;
+		
+	}
+	
+	super::free ( );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	willTerminate - Stops sending tasks over a path which is going away.
+//																	   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+bool
+SCSIParallelMultipathDevice::willTerminate (
+							IOService *		provider,
+							IOOptionBits	options )
+{
+	
+	IOSCSIParallelInterfaceDevice *	path = NULL;
+	
+	path = OSDynamicCast ( IOSCSIParallelInterfaceDevice, provider );
+	if ( path != NULL )
+	{
+		fPathGroup->SetPathOnline ( path, false );
+	}
+	
+	// The last path is going away, and the multipath device with it.
+	if ( isInactive ( ) == true )
+	{
+		SendNotification_DeviceRemoved ( );
+	}
+	
+	return super::willTerminate ( provider, options );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	message - Passes the notifications of the paths on to the clients.
+//																	   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+IOReturn
+SCSIParallelMultipathDevice::message (
+							UInt32			type,
+							IOService *		provider,
+							void *			argument )
+{
+	
+	IOReturn	result	= kIOReturnSuccess;
+	bool		online	= false;
+	
+	switch ( type )
+	{
+		
+		case kSCSIProtocolNotification_VerifyDeviceState:
+		{
+			SendNotification_VerifyDeviceState ( );
+		}
+		break;
+		
+		case kSCSIPort_NotificationStatusChange:
+		{
+			
+			// The Target is only offline once it can't be reached over any
+			// path, and the clients only hear when that changes.
+			online = fPathGroup->IsAnyPathOnline ( );
+			if ( online != fOnline )
+			{
+				
+				fOnline = online;
+				messageClients ( kSCSIPort_NotificationStatusChange,
+								 ( void * ) ( uintptr_t ) ( online ? kSCSIPort_StatusOnline : kSCSIPort_StatusOffline ) );
+				
+			}
+			
+		}
+		break;
+		
+		default:
+		{
+			result = super::message ( type, provider, argument );
+		}
+		break;
+		
+	}
+	
+	return result;
+	
+}
+
+
+#if 0
+#pragma mark -
+#pragma mark SCSI Protocol Services Member Routines
+#pragma mark -
+#endif
+
+
+//-----------------------------------------------------------------------------
+//	IsProtocolServiceSupported - Asks the primary path. The paths are not
+//								 offered to the SCSI Architecture Model
+//								 family as paths of its own.		   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+bool
+SCSIParallelMultipathDevice::IsProtocolServiceSupported (
+							SCSIProtocolFeature			feature,
+							void *						serviceValue )
+{
+	
+	IOSCSIParallelInterfaceDevice *	path		= NULL;
+	bool							isSupported	= false;
+	
+	require ( ( isInactive ( ) == false ), ErrorExit );
+	require_quiet ( ( feature != kSCSIProtocolFeature_MultiPathing ), ErrorExit );
+	
+	path = fPathGroup->GetPrimaryPath ( );
+	require_nonzero ( path, ErrorExit );
+	
+	isSupported = path->IsProtocolServiceSupported ( feature, serviceValue );
+	
+	path->release ( );
+	path = NULL;
+	
+	
+ErrorExit:
+	
+	
+	return isSupported;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	HandleProtocolServiceFeature - Passes a feature on to every path.  [PUBLIC]
+//-----------------------------------------------------------------------------
+
+bool
+SCSIParallelMultipathDevice::HandleProtocolServiceFeature (
+							SCSIProtocolFeature			feature,
+							void *						serviceValue )
+{
+	
+	IOSCSIParallelInterfaceDevice *	paths[kSCSIParallelMaximumPathCount];
+	UInt32							count		= 0;
+	UInt32							length		= 0;
+	bool							wasHandled	= false;
+	
+	if ( feature == kSCSIProtocolFeature_SubmitDefaultInquiryData )
+	{
+		
+		// Keep the INQUIRY data for the paths which join later. The target
+		// device submits it from start, with fLock held, so the length is
+		// set once the data is in place rather than taking the lock.
+		length = ( ( SCSICmd_INQUIRY_StandardData * ) serviceValue )->ADDITIONAL_LENGTH + 5;
+		bcopy ( serviceValue, fInquiryData, length );
+		OSMemoryBarrier ( );
+		fInquiryDataLength = length;
+		
+		wasHandled = true;
+		
+		// Put us in the IORegistry so we can be found by utilities like
+		// System Profiler easily.
+		registerService ( );
+		
+	}
+	
+	count = fPathGroup->CopyPaths ( paths, kSCSIParallelMaximumPathCount );
+	
+	for ( UInt32 index = 0; index < count; index++ )
+	{
+		
+		// The paths are already in the IORegistry.
+		if ( feature == kSCSIProtocolFeature_SubmitDefaultInquiryData )
+		{
+			paths[index]->DetermineParallelFeatures ( ( UInt8 * ) serviceValue );
+		}
+		
+		else if ( paths[index]->HandleProtocolServiceFeature ( feature, serviceValue ) == true )
+		{
+			wasHandled = true;
+		}
+		
+		paths[index]->release ( );
+		
+	}
+	
+	return wasHandled;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	SendSCSICommand - Sends a command over the path the group picks.   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+bool
+SCSIParallelMultipathDevice::SendSCSICommand (
+							SCSITaskIdentifier			request,
+							SCSIServiceResponse *		serviceResponse,
+							SCSITaskStatus *			taskStatus )
+{
+	
+	IOSCSIParallelInterfaceDevice *	path	= NULL;
+	bool							result	= false;
+	
+	*taskStatus			= kSCSITaskStatus_No_Status;
+	*serviceResponse	= kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
+	
+	if ( isInactive ( ) == true )
+	{
+		return false;
+	}
+	
+	path = fPathGroup->SelectPath ( );
+	if ( path == NULL )
+	{
+		
+		// No path is up. Fail the task rather than hold it, as there may be
+		// no task outstanding whose completion would send it again.
+		*serviceResponse = kSCSIServiceResponse_Request_In_Process;
+		CommandCompleted ( request, kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE, *taskStatus );
+		
+		return true;
+		
+	}
+	
+	result = path->DispatchSCSICommand ( request, serviceResponse, taskStatus );
+	path->release ( );
+	
+	return result;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	CompleteClientRequest - Completes a task which was sent over a path.
+//																	   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+void
+SCSIParallelMultipathDevice::CompleteClientRequest (
+							SCSITaskIdentifier			request,
+							SCSIServiceResponse			serviceResponse,
+							SCSITaskStatus				taskStatus )
+{
+	CommandCompleted ( request, serviceResponse, taskStatus );
+}
+
+
+//-----------------------------------------------------------------------------
+//	AbortSCSICommand - Not used.	   		   			     [OBSOLETE][PUBLIC]
+//-----------------------------------------------------------------------------
+
+SCSIServiceResponse
+SCSIParallelMultipathDevice::AbortSCSICommand (
+							SCSITaskIdentifier			request )
+{
+	return kSCSIServiceResponse_FUNCTION_REJECTED;
+}
+
+
+#if 0
+#pragma mark -
+#pragma mark SCSI Task Management Functions
+#pragma mark -
+#endif
+
+
+//-----------------------------------------------------------------------------
+//	HandleAbortTask													[PROTECTED]
+//-----------------------------------------------------------------------------
+
+SCSIServiceResponse
+SCSIParallelMultipathDevice::HandleAbortTask (
+							UInt8						theLogicalUnit,
+							SCSITaggedTaskIdentifier	theTag )
+{
+	return SendTaskManagementFunction ( kSCSIParallelMultipathFunction_AbortTask, theLogicalUnit, theTag );
+}
+
+
+//-----------------------------------------------------------------------------
+//	HandleAbortTaskSet												[PROTECTED]
+//-----------------------------------------------------------------------------
+
+SCSIServiceResponse
+SCSIParallelMultipathDevice::HandleAbortTaskSet (
+							UInt8						theLogicalUnit )
+{
+	return SendTaskManagementFunction ( kSCSIParallelMultipathFunction_AbortTaskSet, theLogicalUnit, 0 );
+}
+
+
+//-----------------------------------------------------------------------------
+//	HandleClearACA													[PROTECTED]
+//-----------------------------------------------------------------------------
+
+SCSIServiceResponse
+SCSIParallelMultipathDevice::HandleClearACA (
+							UInt8						theLogicalUnit )
+{
+	return SendTaskManagementFunction ( kSCSIParallelMultipathFunction_ClearACA, theLogicalUnit, 0 );
+}
+
+
+//-----------------------------------------------------------------------------
+//	HandleClearTaskSet												[PROTECTED]
+//-----------------------------------------------------------------------------
+
+SCSIServiceResponse
+SCSIParallelMultipathDevice::HandleClearTaskSet (
+							UInt8						theLogicalUnit )
+{
+	return SendTaskManagementFunction ( kSCSIParallelMultipathFunction_ClearTaskSet, theLogicalUnit, 0 );
+}
+
+
+//-----------------------------------------------------------------------------
+//	HandleLogicalUnitReset											[PROTECTED]
+//-----------------------------------------------------------------------------
+
+SCSIServiceResponse
+SCSIParallelMultipathDevice::HandleLogicalUnitReset (
+							UInt8						theLogicalUnit )
+{
+	return SendTaskManagementFunction ( kSCSIParallelMultipathFunction_LogicalUnitReset, theLogicalUnit, 0 );
+}
+
+
+//-----------------------------------------------------------------------------
+//	HandleTargetReset												[PROTECTED]
+//-----------------------------------------------------------------------------
+
+SCSIServiceResponse
+SCSIParallelMultipathDevice::HandleTargetReset ( void )
+{
+	return SendTaskManagementFunction ( kSCSIParallelMultipathFunction_TargetReset, 0, 0 );
+}
+
+
+#if 0
+#pragma mark -
+#pragma mark Protected Methods
+#pragma mark -
+#endif
+
+
+//-----------------------------------------------------------------------------
+//	InitWithPathGroup												[PROTECTED]
+//-----------------------------------------------------------------------------
+
+bool
+SCSIParallelMultipathDevice::InitWithPathGroup ( SCSIParallelPathGroup * group )
+{
+	
+	bool	result = false;
+	
+	result = super::init ( );
+	require ( result, ErrorExit );
+	
+	fLock = IOLockAlloc ( );
+	require_nonzero_action ( fLock, ErrorExit, result = false );
+	
+	group->retain ( );
+	fPathGroup = group;
+	
+	fStarted			= false;
+	fOnline				= true;
+	fInquiryDataLength	= 0;
+	
+	
+ErrorExit:
+	
+	
+	return result;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	InitializePowerManagement - Registers the driver with its policy maker,
+//								as the paths do.					[PROTECTED]
+//-----------------------------------------------------------------------------
+
+void
+SCSIParallelMultipathDevice::InitializePowerManagement ( IOService * provider )
+{
+	
+	PMinit ( );
+	
+	temporaryPowerClampOn ( );
+	
+	provider->joinPMtree ( this );
+	
+	makeUsable ( );
+	
+	fPowerManagementInitialized = true;
+	
+	registerPowerDriver ( this, sPowerStates, kSCSIProtocolLayerNumDefaultStates );
+	
+	changePowerStateTo ( kSCSIProtocolLayerPowerStateOn );
+	
+	fCurrentPowerState = kSCSIProtocolLayerPowerStateOn;
+	fProposedPowerState = kSCSIProtocolLayerPowerStateOn;
+	
+}
+
+
+#if 0
+#pragma mark -
+#pragma mark Private Methods
+#pragma mark -
+#endif
+
+
+//-----------------------------------------------------------------------------
+//	SendTaskManagementFunction - Sends a task management function over the
+//								 paths. A function for a nexus of tasks goes
+//								 over every path and only completes if it
+//								 completed on all of them. A reset goes
+//								 over one path, and the tasks it cleared on
+//								 the other paths are reclaimed there.
+//																	  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+SCSIServiceResponse
+SCSIParallelMultipathDevice::SendTaskManagementFunction (
+							UInt32						function,
+							UInt8						theLogicalUnit,
+							SCSITaggedTaskIdentifier	theTag )
+{
+	
+	IOSCSIParallelInterfaceDevice *	paths[kSCSIParallelMaximumPathCount];
+	IOSCSIParallelInterfaceDevice *	path			= NULL;
+	SCSIServiceResponse				serviceResponse	= kSCSIServiceResponse_FUNCTION_REJECTED;
+	SCSIServiceResponse				pathResponse	= kSCSIServiceResponse_FUNCTION_REJECTED;
+	UInt32							count			= 0;
+	
+	if ( ( function == kSCSIParallelMultipathFunction_LogicalUnitReset ) ||
+		 ( function == kSCSIParallelMultipathFunction_TargetReset ) )
+	{
+		
+		path = fPathGroup->SelectPath ( );
+		require_nonzero ( path, ErrorExit );
+		
+		if ( function == kSCSIParallelMultipathFunction_LogicalUnitReset )
+		{
+			serviceResponse = path->HandleLogicalUnitReset ( theLogicalUnit );
+		}
+		
+		else
+		{
+			serviceResponse = path->HandleTargetReset ( );
+		}
+		
+		require_quiet ( ( serviceResponse == kSCSIServiceResponse_FUNCTION_COMPLETE ), ReleasePath );
+		
+	}
+	
+	count = fPathGroup->CopyPaths ( paths, kSCSIParallelMaximumPathCount );
+	
+	for ( UInt32 index = 0; index < count; index++ )
+	{
+		
+		switch ( function )
+		{
+			
+			case kSCSIParallelMultipathFunction_AbortTask:
+				pathResponse = paths[index]->HandleAbortTask ( theLogicalUnit, theTag );
+				break;
+			
+			case kSCSIParallelMultipathFunction_AbortTaskSet:
+				pathResponse = paths[index]->HandleAbortTaskSet ( theLogicalUnit );
+				break;
+			
+			case kSCSIParallelMultipathFunction_ClearACA:
+				pathResponse = paths[index]->HandleClearACA ( theLogicalUnit );
+				break;
+			
+			case kSCSIParallelMultipathFunction_ClearTaskSet:
+				pathResponse = paths[index]->HandleClearTaskSet ( theLogicalUnit );
+				break;
+			
+			case kSCSIParallelMultipathFunction_LogicalUnitReset:
+			{
+				
+				if ( paths[index] != path )
+				{
+					
+					paths[index]->fController->ReclaimTasksForNexus (
+						paths[index]->fTargetIdentifier,
+						theLogicalUnit,
+						0,
+						kSCSIParallelTaskNexus_I_T_L );
+					
+				}
+				
+				pathResponse = kSCSIServiceResponse_FUNCTION_COMPLETE;
+				
+			}
+			break;
+			
+			case kSCSIParallelMultipathFunction_TargetReset:
+			default:
+			{
+				
+				if ( paths[index] != path )
+				{
+					
+					paths[index]->fController->ReclaimTasksForNexus (
+						paths[index]->fTargetIdentifier,
+						0,
+						0,
+						kSCSIParallelTaskNexus_I_T );
+					
+				}
+				
+				pathResponse = kSCSIServiceResponse_FUNCTION_COMPLETE;
+				
+			}
+			break;
+			
+		}
+		
+		// Report the first path on which the function did not complete.
+		if ( ( index == 0 ) || ( serviceResponse == kSCSIServiceResponse_FUNCTION_COMPLETE ) )
+		{
+			serviceResponse = pathResponse;
+		}
+		
+		paths[index]->release ( );
+		
+	}
+	
+	
+ReleasePath:
+	
+	
+	if ( path != NULL )
+	{
+		
+		path->release ( );
+		path = NULL;
+		
+	}
+	
+	
+ErrorExit:
+	
+	
+	return serviceResponse;
+	
+}
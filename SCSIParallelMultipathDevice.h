@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2002-2008 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#ifndef __IOKIT_SCSI_PARALLEL_MULTIPATH_DEVICE_H__
+#define __IOKIT_SCSI_PARALLEL_MULTIPATH_DEVICE_H__
+
+
+/* A SCSI Parallel Multipath Device presents a Target which is reachable
+ * through more than one controller. It is a client of every path in the
+ * Target's SCSIParallelPathGroup and the provider of the Target's SCSI
+ * target device, so the Target stays presented for as long as any path to
+ * it is left. Each task is handed to the path chosen by the group, and is
+ * completed back through the multipath device.
+ */
+
+
+//-----------------------------------------------------------------------------
+//	Includes
+//-----------------------------------------------------------------------------
+
+// General IOKit includes
+#include <IOKit/IOLocks.h>
+
+// SCSI Architecture Model Family includes
+#include <IOKit/scsi/IOSCSIProtocolServices.h>
+
+// SCSI Parallel Family includes
+#include "SCSIParallelPathGroup.h"
+
+
+//-----------------------------------------------------------------------------
+//	Constants
+//-----------------------------------------------------------------------------
+
+// The largest standard INQUIRY data, as ADDITIONAL LENGTH can be 255.
+#define kSCSIParallelMultipathInquiryDataSize		( 255 + 5 )
+
+
+//-----------------------------------------------------------------------------
+//	Class Declarations
+//-----------------------------------------------------------------------------
+
+class IOSCSIParallelInterfaceDevice;
+
+class SCSIParallelMultipathDevice : public IOSCSIProtocolServices
+{
+	
+	OSDeclareDefaultStructors ( SCSIParallelMultipathDevice )
+	
+public:
+	
+	static SCSIParallelMultipathDevice *	Create ( SCSIParallelPathGroup * group );
+	
+	// Called by a path once it is in the group. The first path starts the
+	// multipath device.
+	bool	AttachPath ( IOSCSIParallelInterfaceDevice * path );
+	
+	// Called by a path to complete a task the multipath device sent over it.
+	void	CompleteClientRequest (
+				SCSITaskIdentifier			request,
+				SCSIServiceResponse			serviceResponse,
+				SCSITaskStatus				taskStatus );
+	
+	/*
+	 * IOService support member routines.
+	 */
+	bool		start ( IOService * provider );
+	void		stop ( IOService * provider );
+	void		free ( void );
+	bool		willTerminate ( IOService * provider, IOOptionBits options );
+	IOReturn	message ( UInt32 type, IOService * provider, void * argument = 0 );
+	
+	/*
+	 * IOSCSIProtocolServices support member routines.
+	 */
+	bool	IsProtocolServiceSupported (
+				SCSIProtocolFeature			feature,
+				void *						serviceValue );
+	
+	bool	HandleProtocolServiceFeature (
+				SCSIProtocolFeature			feature,
+				void *						serviceValue );
+	
+	bool	SendSCSICommand (
+				SCSITaskIdentifier			request,
+				SCSIServiceResponse *		serviceResponse,
+				SCSITaskStatus *			taskStatus );
+	
+	SCSIServiceResponse	AbortSCSICommand ( SCSITaskIdentifier request );
+	
+	
+protected:
+	
+	bool	InitWithPathGroup ( SCSIParallelPathGroup * group );
+	void	InitializePowerManagement ( IOService * provider );
+	
+	// The functions for a nexus of tasks are sent over every path, as its
+	// tasks may be on any of them. The resets are sent over one path.
+	SCSIServiceResponse		HandleAbortTask (
+								UInt8						theLogicalUnit,
+								SCSITaggedTaskIdentifier	theTag );
+	
+	SCSIServiceResponse		HandleAbortTaskSet (
+								UInt8						theLogicalUnit );
+	
+	SCSIServiceResponse		HandleClearACA (
+								UInt8						theLogicalUnit );
+	
+	SCSIServiceResponse		HandleClearTaskSet (
+								UInt8						theLogicalUnit );
+	
+	SCSIServiceResponse		HandleLogicalUnitReset (
+								UInt8						theLogicalUnit );
+	
+	SCSIServiceResponse		HandleTargetReset ( void );
+	
+	
+private:
+	
+	SCSIParallelPathGroup *		fPathGroup;
+	
+	// Held while a path is attached, so that only the first path starts
+	// the multipath device.
+	IOLock *					fLock;
+	bool						fStarted;
+	
+	// Whether any path was online when the clients were last told.
+	bool						fOnline;
+	
+	// The INQUIRY data the target device submitted, for the paths which
+	// join after it did. The length is zero until the data is in place.
+	UInt8						fInquiryData[kSCSIParallelMultipathInquiryDataSize];
+	UInt32						fInquiryDataLength;
+	
+	SCSIServiceResponse		SendTaskManagementFunction (
+								UInt32						function,
+								UInt8						theLogicalUnit,
+								SCSITaggedTaskIdentifier	theTag );
+	
+};
+
+
+#endif	/* __IOKIT_SCSI_PARALLEL_MULTIPATH_DEVICE_H__ */
@@ -0,0 +1,908 @@
+/*
+ * Copyright (c) 2002-2008 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+
+//-----------------------------------------------------------------------------
+//	Includes
+//-----------------------------------------------------------------------------
+
+#include <IOKit/IOTypes.h>
+#include <libkern/OSAtomic.h>
+
+#include "SCSIParallelPathGroup.h"
+#include "SCSIParallelMultipathDevice.h"
+#include "IOSCSIParallelInterfaceDevice.h"
+
+
+//-----------------------------------------------------------------------------
+//	Macros
+//-----------------------------------------------------------------------------
+
+#define DEBUG 												0
+#define DEBUG_ASSERT_COMPONENT_NAME_STRING					"SPI PATH GROUP"
+
+#if DEBUG
+#define SCSI_PARALLEL_PATH_GROUP_DEBUGGING_LEVEL			0
+#endif
+
+
+#include "IOSCSIParallelFamilyDebugging.h"
+
+
+#if ( SCSI_PARALLEL_PATH_GROUP_DEBUGGING_LEVEL >= 1 )
+#define PANIC_NOW(x)		panic x
+#else
+#define PANIC_NOW(x)
+#endif
+
+#if ( SCSI_PARALLEL_PATH_GROUP_DEBUGGING_LEVEL >= 2 )
+#define ERROR_LOG(x)		IOLog x
+#else
+#define ERROR_LOG(x)		SCSI_PARALLEL_TRACE ( kSCSIParallelTraceCategory_Device, x )
+#endif
+
+#if ( SCSI_PARALLEL_PATH_GROUP_DEBUGGING_LEVEL >= 3 )
+#define STATUS_LOG(x)		IOLog x
+#else
+#define STATUS_LOG(x)		SCSI_PARALLEL_TRACE ( kSCSIParallelTraceCategory_Device | kSCSIParallelTraceStatus, x )
+#endif
+
+
+#define super OSObject
+OSDefineMetaClassAndStructors ( SCSIParallelPathGroup, OSObject );
+
+
+//-----------------------------------------------------------------------------
+//	Constants
+//-----------------------------------------------------------------------------
+
+// The weight of a new sample in the moving average of a path's latency is
+// one in 2^kLatencyAverageShift.
+#define kLatencyAverageShift		3
+
+
+//-----------------------------------------------------------------------------
+//	Globals
+//-----------------------------------------------------------------------------
+
+SCSIParallelPathGroup *		SCSIParallelPathGroup::sPathGroups			= NULL;
+IOLock *					SCSIParallelPathGroup::sPathGroupListLock	= NULL;
+
+
+#if 0
+#pragma mark -
+#pragma mark Public Methods
+#pragma mark -
+#endif
+
+
+//-----------------------------------------------------------------------------
+//	InitializePathGroups - Allocates the lock for the list of path groups.
+//						   Called when the kext is loaded.	   [STATIC][PUBLIC]
+//-----------------------------------------------------------------------------
+
+bool
+SCSIParallelPathGroup::InitializePathGroups ( void )
+{
+	
+	sPathGroupListLock = IOLockAlloc ( );
+	
+	return ( sPathGroupListLock != NULL );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	TerminatePathGroups - Frees the lock for the list of path groups.
+//						  Called when the kext is unloaded, by which time
+//						  every group is gone.				   [STATIC][PUBLIC]
+//-----------------------------------------------------------------------------
+
+void
+SCSIParallelPathGroup::TerminatePathGroups ( void )
+{
+	
+	if ( sPathGroupListLock != NULL )
+	{
+		
+		IOLockFree ( sPathGroupListLock );
+		sPathGroupListLock = NULL;
+		
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	AddPath - Adds a device to the group for its identifier. The group is
+//			  created if this is the first path to the Target. The path is
+//			  not selected until it is marked online. Returns the retained
+//			  group, or NULL on failure.					   [STATIC][PUBLIC]
+//-----------------------------------------------------------------------------
+
+SCSIParallelPathGroup *
+SCSIParallelPathGroup::AddPath (
+							OSData *						identifier,
+							IOSCSIParallelInterfaceDevice *	device,
+							OSString *						policy )
+{
+	
+	SCSIParallelPathGroup *	group		= NULL;
+	SCSIParallelPath *		path		= NULL;
+	IOWorkLoop *			workLoop	= NULL;
+	bool					result		= false;
+	
+	require_nonzero ( sPathGroupListLock, ErrorExit );
+	require_nonzero ( identifier, ErrorExit );
+	require_nonzero ( device, ErrorExit );
+	
+	workLoop = device->getWorkLoop ( );
+	
+	IOLockLock ( sPathGroupListLock );
+	
+	// Look for a group which already reaches this Target.
+	for ( group = sPathGroups; group != NULL; group = group->fNextPathGroup )
+	{
+		
+		if ( group->fIdentifier->isEqualTo ( identifier ) == true )
+		{
+			
+			group->retain ( );
+			break;
+			
+		}
+		
+	}
+	
+	if ( group == NULL )
+	{
+		
+		group = OSTypeAlloc ( SCSIParallelPathGroup );
+		require_nonzero ( group, UNLOCK_EXIT );
+		
+		result = group->InitWithIdentifier ( identifier, policy );
+		require ( result, RELEASE_GROUP );
+		
+		group->fNextPathGroup = sPathGroups;
+		sPathGroups = group;
+		
+	}
+	
+	IOSimpleLockLock ( group->fLock );
+	
+	// Take the first free slot.
+	path = group->FindPath ( NULL );
+	if ( path != NULL )
+	{
+		
+		path->fDevice		= device;
+		path->fWorkLoop		= workLoop;
+		path->fOnline		= false;
+		path->fOutstanding	= 0;
+		path->fLatency		= 0;
+		
+		if ( group->fPrimaryPath == NULL )
+		{
+			group->fPrimaryPath = device;
+		}
+		
+		group->fPathCount++;
+		
+	}
+	
+	IOSimpleLockUnlock ( group->fLock );
+	
+	IOLockUnlock ( sPathGroupListLock );
+	
+	if ( path == NULL )
+	{
+		
+		ERROR_LOG ( ( "SCSIParallelPathGroup::AddPath: too many paths\n" ) );
+		
+		group->release ( );
+		group = NULL;
+		
+	}
+	
+	return group;
+	
+	
+RELEASE_GROUP:
+	
+	
+	group->release ( );
+	group = NULL;
+	
+	
+UNLOCK_EXIT:
+	
+	
+	IOLockUnlock ( sPathGroupListLock );
+	
+	
+ErrorExit:
+	
+	
+	return NULL;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	RemovePath - Removes a device from the group. If the device was the
+//				 primary path, another path becomes primary. The multipath
+//				 device keeps presenting the Target over the remaining
+//				 paths.												   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+void
+SCSIParallelPathGroup::RemovePath ( IOSCSIParallelInterfaceDevice * device )
+{
+	
+	SCSIParallelMultipathDevice *	multipathDevice	= NULL;
+	SCSIParallelPathGroup **		link			= NULL;
+	SCSIParallelPath *				path			= NULL;
+	bool							empty			= false;
+	
+	IOLockLock ( sPathGroupListLock );
+	IOSimpleLockLock ( fLock );
+	
+	path = FindPath ( device );
+	if ( path != NULL )
+	{
+		
+		path->fDevice	= NULL;
+		path->fWorkLoop	= NULL;
+		path->fOnline	= false;
+		fPathCount--;
+		
+		if ( fPrimaryPath == device )
+		{
+			
+			fPrimaryPath = NULL;
+			
+			// Promote the first remaining path.
+			for ( UInt32 index = 0; index < kSCSIParallelMaximumPathCount; index++ )
+			{
+				
+				if ( fPaths[index].fDevice != NULL )
+				{
+					
+					fPrimaryPath = fPaths[index].fDevice;
+					break;
+					
+				}
+				
+			}
+			
+		}
+		
+	}
+	
+	empty = ( fPathCount == 0 );
+	
+	IOSimpleLockUnlock ( fLock );
+	
+	// The last path is gone, take the group off the list so that the
+	// Target starts a new group if it comes back. The multipath device is
+	// terminated with the last path, and lets go of the group when it is
+	// freed.
+	if ( empty == true )
+	{
+		
+		multipathDevice = fMultipathDevice;
+		fMultipathDevice = NULL;
+		
+		for ( link = &sPathGroups; *link != NULL; link = &( *link )->fNextPathGroup )
+		{
+			
+			if ( *link == this )
+			{
+				
+				*link = fNextPathGroup;
+				fNextPathGroup = NULL;
+				break;
+				
+			}
+			
+		}
+		
+	}
+	
+	IOLockUnlock ( sPathGroupListLock );
+	
+	if ( multipathDevice != NULL )
+	{
+		multipathDevice->release ( );
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	CopyMultipathDevice - Returns the retained device which presents the
+//						  Target, creating it for the first path. Returns
+//						  NULL on failure.							   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+SCSIParallelMultipathDevice *
+SCSIParallelPathGroup::CopyMultipathDevice ( void )
+{
+	
+	SCSIParallelMultipathDevice *	multipathDevice	= NULL;
+	SCSIParallelMultipathDevice *	stale			= NULL;
+	
+	IOLockLock ( sPathGroupListLock );
+	
+	// A device whose last path went away is being terminated, even if a
+	// new path joined the group before the old one was removed from it.
+	if ( ( fMultipathDevice != NULL ) && ( fMultipathDevice->isInactive ( ) == true ) )
+	{
+		
+		stale = fMultipathDevice;
+		fMultipathDevice = NULL;
+		
+	}
+	
+	if ( fMultipathDevice == NULL )
+	{
+		fMultipathDevice = SCSIParallelMultipathDevice::Create ( this );
+	}
+	
+	multipathDevice = fMultipathDevice;
+	if ( multipathDevice != NULL )
+	{
+		multipathDevice->retain ( );
+	}
+	
+	IOLockUnlock ( sPathGroupListLock );
+	
+	if ( stale != NULL )
+	{
+		stale->release ( );
+	}
+	
+	return multipathDevice;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	GetPrimaryPath - Returns the retained primary path, or NULL.	   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+IOSCSIParallelInterfaceDevice *
+SCSIParallelPathGroup::GetPrimaryPath ( void )
+{
+	
+	IOSCSIParallelInterfaceDevice *	device = NULL;
+	
+	IOSimpleLockLock ( fLock );
+	
+	device = fPrimaryPath;
+	if ( device != NULL )
+	{
+		device->retain ( );
+	}
+	
+	IOSimpleLockUnlock ( fLock );
+	
+	return device;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	SelectPath - Returns the retained path the next task should be sent
+//				 over, or NULL if no path is online.				   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+IOSCSIParallelInterfaceDevice *
+SCSIParallelPathGroup::SelectPath ( void )
+{
+	
+	IOSCSIParallelInterfaceDevice *	device		= NULL;
+	SCSIParallelPath *				path		= NULL;
+	SCSIParallelPath *				best		= NULL;
+	UInt64							cost		= 0;
+	UInt64							bestCost	= 0;
+	UInt32							slot		= 0;
+	UInt32							bestSlot	= 0;
+	
+	IOSimpleLockLock ( fLock );
+	
+	// Start the search after the path chosen last time so that paths
+	// which cost the same take turns.
+	for ( UInt32 index = 0; index < kSCSIParallelMaximumPathCount; index++ )
+	{
+		
+		slot = ( fNextPath + index ) % kSCSIParallelMaximumPathCount;
+		path = &fPaths[slot];
+		
+		if ( ( path->fDevice == NULL ) || ( path->fOnline == false ) )
+		{
+			continue;
+		}
+		
+		switch ( fPolicy )
+		{
+			
+			case kSCSIParallelPathPolicy_LeastQueueDepth:
+			{
+				cost = path->fOutstanding;
+			}
+			break;
+			
+			case kSCSIParallelPathPolicy_LeastLatency:
+			{
+				
+				// A path with tasks queued on it will take longer to get to
+				// a new one. A path which has not completed a task yet has
+				// no latency and is tried first.
+				cost = path->fLatency * ( path->fOutstanding + 1 );
+				
+			}
+			break;
+			
+			case kSCSIParallelPathPolicy_RoundRobin:
+			default:
+			{
+				cost = 0;
+			}
+			break;
+			
+		}
+		
+		if ( ( best == NULL ) || ( cost < bestCost ) )
+		{
+			
+			best		= path;
+			bestCost	= cost;
+			bestSlot	= slot;
+			
+		}
+		
+		if ( fPolicy == kSCSIParallelPathPolicy_RoundRobin )
+		{
+			break;
+		}
+		
+	}
+	
+	if ( best != NULL )
+	{
+		
+		device = best->fDevice;
+		device->retain ( );
+		
+		fNextPath = ( bestSlot + 1 ) % kSCSIParallelMaximumPathCount;
+		
+	}
+	
+	IOSimpleLockUnlock ( fLock );
+	
+	return device;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	CopyPaths - Fills in the retained paths of the group, up to count of
+//				them. Returns the number of paths.					   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+UInt32
+SCSIParallelPathGroup::CopyPaths (
+							IOSCSIParallelInterfaceDevice **	paths,
+							UInt32								count )
+{
+	
+	UInt32	found = 0;
+	
+	IOSimpleLockLock ( fLock );
+	
+	for ( UInt32 index = 0; ( index < kSCSIParallelMaximumPathCount ) && ( found < count ); index++ )
+	{
+		
+		if ( fPaths[index].fDevice != NULL )
+		{
+			
+			paths[found] = fPaths[index].fDevice;
+			paths[found]->retain ( );
+			found++;
+			
+		}
+		
+	}
+	
+	IOSimpleLockUnlock ( fLock );
+	
+	return found;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	IsPathOnline - Returns whether the port of a path is up.		   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+bool
+SCSIParallelPathGroup::IsPathOnline ( IOSCSIParallelInterfaceDevice * device )
+{
+	
+	SCSIParallelPath *	path	= NULL;
+	bool				result	= false;
+	
+	IOSimpleLockLock ( fLock );
+	
+	path = FindPath ( device );
+	if ( path != NULL )
+	{
+		result = path->fOnline;
+	}
+	
+	IOSimpleLockUnlock ( fLock );
+	
+	return result;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	IsAnyPathOnline - Returns whether the port of any path is up.	   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+bool
+SCSIParallelPathGroup::IsAnyPathOnline ( void )
+{
+	
+	bool	result = false;
+	
+	IOSimpleLockLock ( fLock );
+	
+	for ( UInt32 index = 0; index < kSCSIParallelMaximumPathCount; index++ )
+	{
+		
+		if ( ( fPaths[index].fDevice != NULL ) && ( fPaths[index].fOnline == true ) )
+		{
+			
+			result = true;
+			break;
+			
+		}
+		
+	}
+	
+	IOSimpleLockUnlock ( fLock );
+	
+	return result;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	SetPathOnline - Marks the port of a path up or down. Paths which are
+//					down are not selected.							   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+void
+SCSIParallelPathGroup::SetPathOnline (
+							IOSCSIParallelInterfaceDevice *	device,
+							bool							online )
+{
+	
+	SCSIParallelPath *	path = NULL;
+	
+	IOSimpleLockLock ( fLock );
+	
+	path = FindPath ( device );
+	if ( path != NULL )
+	{
+		
+		path->fOnline = online;
+		
+		// The latency of a path which was down says nothing about how it
+		// will do now.
+		if ( online == true )
+		{
+			path->fLatency = 0;
+		}
+		
+	}
+	
+	IOSimpleLockUnlock ( fLock );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	IsOnWorkLoopThread - Returns whether the caller is running on the
+//						 workloop of any of the paths.				   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+bool
+SCSIParallelPathGroup::IsOnWorkLoopThread ( void )
+{
+	
+	bool	result = false;
+	
+	IOSimpleLockLock ( fLock );
+	
+	for ( UInt32 index = 0; index < kSCSIParallelMaximumPathCount; index++ )
+	{
+		
+		if ( ( fPaths[index].fWorkLoop != NULL ) &&
+			 ( fPaths[index].fWorkLoop->onThread ( ) == true ) )
+		{
+			
+			result = true;
+			break;
+			
+		}
+		
+	}
+	
+	IOSimpleLockUnlock ( fLock );
+	
+	return result;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	BeginPathTask - Counts a task sent over a path.					   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+void
+SCSIParallelPathGroup::BeginPathTask ( IOSCSIParallelInterfaceDevice * device )
+{
+	
+	SCSIParallelPath *	path = NULL;
+	
+	IOSimpleLockLock ( fLock );
+	
+	path = FindPath ( device );
+	if ( path != NULL )
+	{
+		OSIncrementAtomic ( &path->fOutstanding );
+	}
+	
+	IOSimpleLockUnlock ( fLock );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	EndPathTask - Counts a task completed on a path, and folds the time it
+//				  took, in nanoseconds, into the path's latency.	   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+void
+SCSIParallelPathGroup::EndPathTask (
+							IOSCSIParallelInterfaceDevice *	device,
+							UInt64							latency )
+{
+	
+	SCSIParallelPath *	path	= NULL;
+	SInt64				average	= 0;
+	
+	IOSimpleLockLock ( fLock );
+	
+	path = FindPath ( device );
+	if ( path != NULL )
+	{
+		
+		if ( path->fOutstanding > 0 )
+		{
+			OSDecrementAtomic ( &path->fOutstanding );
+		}
+		
+		average = path->fLatency;
+		if ( average == 0 )
+		{
+			average = latency;
+		}
+		
+		else
+		{
+			average += ( ( SInt64 ) latency - average ) >> kLatencyAverageShift;
+		}
+		
+		path->fLatency = average;
+		
+	}
+	
+	IOSimpleLockUnlock ( fLock );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	BeginOrderedTask - Counts an ORDERED task sent over any path.	   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+void
+SCSIParallelPathGroup::BeginOrderedTask ( void )
+{
+	
+	IOSimpleLockLock ( fLock );
+	fOrderedTaskCount++;
+	IOSimpleLockUnlock ( fLock );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	EndOrderedTask - Counts an ORDERED task which is done.			   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+void
+SCSIParallelPathGroup::EndOrderedTask ( void )
+{
+	
+	IOSimpleLockLock ( fLock );
+	
+	if ( fOrderedTaskCount > 0 )
+	{
+		fOrderedTaskCount--;
+	}
+	
+	IOSimpleLockUnlock ( fLock );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	IsOrderedTaskOutstanding - Returns whether an ORDERED task is outstanding
+//							   on any of the paths.					   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+bool
+SCSIParallelPathGroup::IsOrderedTaskOutstanding ( void )
+{
+	
+	bool	result = false;
+	
+	IOSimpleLockLock ( fLock );
+	result = ( fOrderedTaskCount != 0 );
+	IOSimpleLockUnlock ( fLock );
+	
+	return result;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	free - Releases the resources of the group.						   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+void
+SCSIParallelPathGroup::free ( void )
+{
+	
+	if ( fIdentifier != NULL )
+	{
+		
+		fIdentifier->release ( );
+		fIdentifier = NULL;
+		
+	}
+	
+	if ( fLock != NULL )
+	{
+		
+		IOSimpleLockFree ( fLock );
+		fLock = NULL;
+		
+	}
+	
+	super::free ( );
+	
+}
+
+
+#if 0
+#pragma mark -
+#pragma mark Protected Methods
+#pragma mark -
+#endif
+
+
+//-----------------------------------------------------------------------------
+//	InitWithIdentifier - Initializes an empty group.				[PROTECTED]
+//-----------------------------------------------------------------------------
+
+bool
+SCSIParallelPathGroup::InitWithIdentifier (
+							OSData *	identifier,
+							OSString *	policy )
+{
+	
+	bool	result = false;
+	
+	result = super::init ( );
+	require ( result, ErrorExit );
+	
+	fLock = IOSimpleLockAlloc ( );
+	require_nonzero_action ( fLock, ErrorExit, result = false );
+	
+	identifier->retain ( );
+	fIdentifier = identifier;
+	
+	fOrderedTaskCount	= 0;
+	fMultipathDevice	= NULL;
+	
+	fPolicy = kSCSIParallelPathPolicy_RoundRobin;
+	
+	if ( policy != NULL )
+	{
+		
+		if ( policy->isEqualTo ( kIOMultipathPolicyLeastQueueDepthKey ) == true )
+		{
+			fPolicy = kSCSIParallelPathPolicy_LeastQueueDepth;
+		}
+		
+		else if ( policy->isEqualTo ( kIOMultipathPolicyLeastLatencyKey ) == true )
+		{
+			fPolicy = kSCSIParallelPathPolicy_LeastLatency;
+		}
+		
+	}
+	
+	
+ErrorExit:
+	
+	
+	return result;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	FindPath - Returns the slot of a device, or a free slot if the device
+//			   is NULL.												[PROTECTED]
+//-----------------------------------------------------------------------------
+
+SCSIParallelPath *
+SCSIParallelPathGroup::FindPath ( IOSCSIParallelInterfaceDevice * device )
+{
+	
+	SCSIParallelPath *	path = NULL;
+	
+	for ( UInt32 index = 0; index < kSCSIParallelMaximumPathCount; index++ )
+	{
+		
+		if ( fPaths[index].fDevice == device )
+		{
+			
+			path = &fPaths[index];
+			break;
+			
+		}
+		
+	}
+	
+	return path;
+	
+}
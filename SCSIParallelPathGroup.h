@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2002-2008 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#ifndef __IOKIT_SCSI_PARALLEL_PATH_GROUP_H__
+#define __IOKIT_SCSI_PARALLEL_PATH_GROUP_H__
+
+
+/* A SCSI Parallel Path Group collects the IOSCSIParallelInterfaceDevice
+ * objects which reach the same Target through different controllers. The
+ * Targets are matched by the logical unit designator that LUN 0 reports in
+ * its Device Identification VPD page (83h).
+ *
+ * The Target is presented by the group's SCSIParallelMultipathDevice, which
+ * is a client of every path, and hands each task to the path chosen by the
+ * group's policy. Paths whose port is down are skipped. An outstanding
+ * ORDERED task holds back the tasks of every path in the group. The first
+ * path to a Target is its primary path, which answers for the group when
+ * the features of the paths are asked about.
+ */
+
+
+//-----------------------------------------------------------------------------
+//	Includes
+//-----------------------------------------------------------------------------
+
+// Libkern includes
+#include <libkern/c++/OSData.h>
+#include <libkern/c++/OSObject.h>
+#include <libkern/c++/OSString.h>
+
+// General IOKit includes
+#include <IOKit/IOLocks.h>
+#include <IOKit/IOWorkLoop.h>
+
+
+//-----------------------------------------------------------------------------
+//	Constants
+//-----------------------------------------------------------------------------
+
+// The path selection policies (see kIOMultipathPolicyKey).
+enum
+{
+	kSCSIParallelPathPolicy_RoundRobin			= 0,
+	kSCSIParallelPathPolicy_LeastQueueDepth		= 1,
+	kSCSIParallelPathPolicy_LeastLatency		= 2
+};
+
+#define kSCSIParallelMaximumPathCount		8
+
+
+//-----------------------------------------------------------------------------
+//	Structures
+//-----------------------------------------------------------------------------
+
+class IOSCSIParallelInterfaceDevice;
+class SCSIParallelMultipathDevice;
+
+typedef struct SCSIParallelPath
+{
+	
+	// The device for this path, or NULL if the slot is free.
+	IOSCSIParallelInterfaceDevice *	fDevice;
+	IOWorkLoop *					fWorkLoop;
+	
+	// Whether the port of the path's controller is up.
+	bool							fOnline;
+	
+	// The number of tasks outstanding on the path, and a moving average
+	// of their completion time in nanoseconds.
+	volatile SInt32					fOutstanding;
+	volatile UInt64					fLatency;
+	
+} SCSIParallelPath;
+
+
+//-----------------------------------------------------------------------------
+//	Class Declarations
+//-----------------------------------------------------------------------------
+
+class SCSIParallelPathGroup : public OSObject
+{
+	
+	OSDeclareDefaultStructors ( SCSIParallelPathGroup )
+	
+public:
+	
+	static SCSIParallelPathGroup *	AddPath (
+										OSData *						identifier,
+										IOSCSIParallelInterfaceDevice *	device,
+										OSString *						policy );
+	
+	void	RemovePath ( IOSCSIParallelInterfaceDevice * device );
+	
+	SCSIParallelMultipathDevice *	CopyMultipathDevice ( void );
+	
+	IOSCSIParallelInterfaceDevice *	GetPrimaryPath ( void );
+	IOSCSIParallelInterfaceDevice *	SelectPath ( void );
+	UInt32							CopyPaths (
+										IOSCSIParallelInterfaceDevice **	paths,
+										UInt32								count );
+	
+	bool	IsPathOnline ( IOSCSIParallelInterfaceDevice * device );
+	bool	IsAnyPathOnline ( void );
+	void	SetPathOnline ( IOSCSIParallelInterfaceDevice * device, bool online );
+	bool	IsOnWorkLoopThread ( void );
+	
+	void	BeginPathTask ( IOSCSIParallelInterfaceDevice * device );
+	void	EndPathTask ( IOSCSIParallelInterfaceDevice * device, UInt64 latency );
+	
+	void	BeginOrderedTask ( void );
+	void	EndOrderedTask ( void );
+	bool	IsOrderedTaskOutstanding ( void );
+	
+	// Called when the kext is loaded and unloaded.
+	static bool		InitializePathGroups ( void );
+	static void		TerminatePathGroups ( void );
+	
+	void	free ( void );
+	
+	
+protected:
+	
+	bool				InitWithIdentifier ( OSData * identifier, OSString * policy );
+	SCSIParallelPath *	FindPath ( IOSCSIParallelInterfaceDevice * device );
+	
+	
+private:
+	
+	// The list of all path groups, and the lock for it.
+	static SCSIParallelPathGroup *	sPathGroups;
+	static IOLock *					sPathGroupListLock;
+	SCSIParallelPathGroup *			fNextPathGroup;
+	
+	OSData *						fIdentifier;
+	UInt32							fPolicy;
+	
+	// The device which presents the Target, or NULL until the first path
+	// asks for it. Protected by sPathGroupListLock.
+	SCSIParallelMultipathDevice *	fMultipathDevice;
+	
+	// The paths, and the counters in each path, are protected by fLock.
+	IOSimpleLock *					fLock;
+	IOSCSIParallelInterfaceDevice *	fPrimaryPath;
+	UInt32							fPathCount;
+	UInt32							fNextPath;
+	SCSIParallelPath				fPaths[kSCSIParallelMaximumPathCount];
+	
+	// The number of ORDERED tasks outstanding on any of the paths. They
+	// hold back new tasks on all of the paths, not only on their own.
+	// Protected by fLock.
+	UInt32							fOrderedTaskCount;
+	
+};
+
+
+#endif	/* __IOKIT_SCSI_PARALLEL_PATH_GROUP_H__ */
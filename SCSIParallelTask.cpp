@@ -63,18 +63,18 @@
 #if ( SCSI_PARALLEL_TASK_DEBUGGING_LEVEL >= 2 )
 #define ERROR_LOG(x)		kprintf x
 #else
-#define ERROR_LOG(x)
+#define ERROR_LOG(x)		SCSI_PARALLEL_TRACE ( kSCSIParallelTraceCategory_Task, x )
 #endif
 
 #if ( SCSI_PARALLEL_TASK_DEBUGGING_LEVEL >= 3 )
 #define STATUS_LOG(x)		kprintf x
 #else
-#define STATUS_LOG(x)
+#define STATUS_LOG(x)		SCSI_PARALLEL_TRACE ( kSCSIParallelTraceCategory_Task | kSCSIParallelTraceStatus, x )
 #endif
 
 
-#define super IODMACommand
-OSDefineMetaClassAndStructors ( SCSIParallelTask, IODMACommand );
+#define super IOCommand
+OSDefineMetaClassAndStructors ( SCSIParallelTask, IOCommand );
 
 
 #if 0
@@ -133,6 +133,8 @@ SCSIParallelTask::InitWithSize (
 	IOBufferMemoryDescriptor *	buffer			= NULL;
 	IOReturn					status			= kIOReturnSuccess;
 	
+	require ( super::init ( ), ErrorExit );
+	
 	fCommandChain.next = NULL;
 	fCommandChain.prev = NULL;
 	
@@ -142,6 +144,45 @@ SCSIParallelTask::InitWithSize (
 	fTimeoutChain.next 	= NULL;
 	fTimeoutChain.prev	= NULL;
 	
+	fAdmissionTarget = NULL;
+	
+	fState = kSCSIParallelTaskState_Family;
+	
+	fDeferredCompletionNext = NULL;
+	fBatchedSubmissionNext = NULL;
+	
+	fPathStartTime = 0;
+	
+	fHoldingDeadline	= 0;
+	fHeld				= false;
+	
+	fTraceRecord		= kSCSIParallelTraceNoRecord;
+	fTraceGeneration	= 0;
+	
+	// The controller gives the task a DMA command of its own, and makes
+	// that the identifier, unless the DMA commands are pooled.
+	fDMACommand	= NULL;
+	fIdentifier	= this;
+	
+	fBounceBuffer = NULL;
+	
+	fSplit			= NULL;
+	fSplitOffset	= 0;
+	fSplitLength	= 0;
+	
+	// Set the feature arrays to their default values. ResetForNewTask only
+	// resets them again once a negotiation has been requested.
+	fSCSIParallelFeatureRequestCount		= 0;
+	fSCSIParallelFeatureRequestResultCount	= 0;
+	
+	for ( int loop = 0; loop < kSCSIParallelFeature_TotalFeatureCount; loop++ )
+	{
+		
+		fSCSIParallelFeatureRequest[loop]	= kSCSIParallelFeature_NoNegotiation;
+		fSCSIParallelFeatureResult[loop]	= kSCSIParallelFeature_NegotitiationUnchanged;
+		
+	}
+	
 	fHBADataSize = sizeOfHBAData;
 	
 	buffer = IOBufferMemoryDescriptor::inTaskWithPhysicalMask (
@@ -202,6 +243,15 @@ SCSIParallelTask::free ( void )
 		
 	}
 	
+	// The task's own DMA command goes with it.
+	if ( ( fIdentifier != NULL ) && ( fIdentifier != this ) )
+	{
+		
+		fIdentifier->release ( );
+		fIdentifier = NULL;
+		
+	}
+	
 	super::free ( );
 	
 }
@@ -221,16 +271,30 @@ SCSIParallelTask::ResetForNewTask ( void )
 	fRealizedTransferCount		= 0;
 	fControllerTaskIdentifier	= 0;
 	fTaskRetryCount				= 0;
+	fState						= kSCSIParallelTaskState_Family;
+	fSplit						= NULL;
+	fStageStartTime				= 0;
 	
-	fSCSIParallelFeatureRequestCount		= 0;
-	fSCSIParallelFeatureRequestResultCount	= 0;
+	bzero ( fStageTime, sizeof ( fStageTime ) );
 	
-	// Set the feature arrays to their default values
-	for ( int loop = 0; loop < kSCSIParallelFeature_TotalFeatureCount; loop++ )
+	// The feature arrays only differ from their default values if a
+	// negotiation was requested or reported, which is rare. Leave their
+	// cache lines alone otherwise.
+	if ( ( fSCSIParallelFeatureRequestCount != 0 ) ||
+		 ( fSCSIParallelFeatureRequestResultCount != 0 ) )
 	{
 		
-		fSCSIParallelFeatureRequest[loop]	= kSCSIParallelFeature_NoNegotiation;
-		fSCSIParallelFeatureResult[loop]	= kSCSIParallelFeature_NegotitiationUnchanged;
+		fSCSIParallelFeatureRequestCount		= 0;
+		fSCSIParallelFeatureRequestResultCount	= 0;
+		
+		// Set the feature arrays to their default values
+		for ( int loop = 0; loop < kSCSIParallelFeature_TotalFeatureCount; loop++ )
+		{
+			
+			fSCSIParallelFeatureRequest[loop]	= kSCSIParallelFeature_NoNegotiation;
+			fSCSIParallelFeatureResult[loop]	= kSCSIParallelFeature_NegotitiationUnchanged;
+			
+		}
 		
 	}
 	
@@ -370,7 +434,17 @@ bool
 SCSIParallelTask::GetCommandDescriptorBlock ( 
 					SCSICommandDescriptorBlock *	cdbData )
 {
+	
+	if ( fSplit != NULL )
+	{
+		
+		bcopy ( fSplitCDB, cdbData, sizeof ( SCSICommandDescriptorBlock ) );
+		return true;
+		
+	}
+	
 	return ( ( SCSITask * ) fSCSITask )->GetCommandDescriptorBlock ( cdbData );
+	
 }
 
 
@@ -392,7 +466,12 @@ SCSIParallelTask::GetDataTransferDirection ( void )
 UInt64
 SCSIParallelTask::GetRequestedDataTransferCount ( void )
 {
+	
+	if ( fSplit != NULL )
+		return fSplitLength;
+	
 	return ( ( SCSITask * ) fSCSITask )->GetRequestedDataTransferCount ( );
+	
 }
 
 
@@ -438,13 +517,19 @@ SCSIParallelTask::GetRealizedDataTransferCount ( void )
 
 
 //-----------------------------------------------------------------------------
-//	GetDataBuffer - Gets the data buffer associated with this task.    [PUBLIC]
+//	GetDataBuffer - Gets the data buffer associated with this task. This is
+//					the bounce buffer if the task has one.			   [PUBLIC]
 //-----------------------------------------------------------------------------
 
 IOMemoryDescriptor *
 SCSIParallelTask::GetDataBuffer ( void )
 {
-	return ( ( SCSITask * ) fSCSITask )->GetDataBuffer ( );
+	
+	if ( fBounceBuffer != NULL )
+		return fBounceBuffer;
+	
+	return GetClientDataBuffer ( );
+	
 }
 
 
@@ -456,7 +541,43 @@ SCSIParallelTask::GetDataBuffer ( void )
 UInt64
 SCSIParallelTask::GetDataBufferOffset ( void )
 {
+	
+	// The data always starts at the beginning of a bounce buffer.
+	if ( fBounceBuffer != NULL )
+		return 0;
+	
+	return GetClientDataBufferOffset ( );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	GetClientDataBuffer - 	Gets the data buffer of the client's SCSI Task.
+//																	   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+IOMemoryDescriptor *
+SCSIParallelTask::GetClientDataBuffer ( void )
+{
+	return ( ( SCSITask * ) fSCSITask )->GetDataBuffer ( );
+}
+
+
+//-----------------------------------------------------------------------------
+//	GetClientDataBufferOffset - Gets the data buffer offset of the client's
+//								SCSI Task.							   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+UInt64
+SCSIParallelTask::GetClientDataBufferOffset ( void )
+{
+	
+	// A piece of a split task transfers part of the client's buffer.
+	if ( fSplit != NULL )
+		return ( ( SCSITask * ) fSCSITask )->GetDataBufferOffset ( ) + fSplitOffset;
+	
 	return ( ( SCSITask * ) fSCSITask )->GetDataBufferOffset ( );
+	
 }
 
 
@@ -526,7 +647,7 @@ SCSIParallelTask::SetSCSIParallelFeatureNegotiation (
 	if ( requestedFeature >= kSCSIParallelFeature_TotalFeatureCount )
 	{
 		
-		ERROR_LOG ( ( "Unknown feature request: %ld\n", ( int ) requestedFeature ) );
+		ERROR_LOG ( ( "Unknown feature request: %d\n", ( int ) requestedFeature ) );
 		
 		// The object does not know of this feature, so it will
 		// ignore this request.
@@ -562,7 +683,7 @@ SCSIParallelTask::GetSCSIParallelFeatureNegotiation (
 	if ( requestedFeature >= kSCSIParallelFeature_TotalFeatureCount )
 	{
 		
-		ERROR_LOG ( ( "Unknown feature request: %ld\n", ( int ) requestedFeature ) );
+		ERROR_LOG ( ( "Unknown feature request: %d\n", ( int ) requestedFeature ) );
 		
 		// The object does not know of this feature, so it will
 		// return that negotation is not requested.
@@ -604,7 +725,7 @@ SCSIParallelTask::SetSCSIParallelFeatureNegotiationResult (
 	if ( requestedFeature >= kSCSIParallelFeature_TotalFeatureCount )
 	{
 		
-		ERROR_LOG ( ( "Unknown feature request: %ld\n", ( int ) requestedFeature ) );
+		ERROR_LOG ( ( "Unknown feature request: %d\n", ( int ) requestedFeature ) );
 		
 		// The object does not know of this feature, so it will
 		// ignore this request.
@@ -638,7 +759,7 @@ SCSIParallelTask::GetSCSIParallelFeatureNegotiationResult (
 	if ( requestedFeature >= kSCSIParallelFeature_TotalFeatureCount )
 	{
 		
-		ERROR_LOG ( ( "Unknown feature request: %ld\n", ( int ) requestedFeature ) );
+		ERROR_LOG ( ( "Unknown feature request: %d\n", ( int ) requestedFeature ) );
 		
 		// The object does not know of this feature, so it will
 		// return that negotation is unchanged.
@@ -741,6 +862,264 @@ SCSIParallelTask::SetTimeoutDeadline ( AbsoluteTime time )
 }
 
 
+#if 0
+#pragma mark -
+#pragma mark SCSIParallelDMACommand
+#pragma mark -
+#endif
+
+
+#undef super
+#define super IODMACommand
+OSDefineMetaClassAndStructors ( SCSIParallelDMACommand, IODMACommand );
+
+
+//-----------------------------------------------------------------------------
+//	Create - 	Creates a SCSIParallelDMACommand. The controller initializes
+//				it with the DMA specification of the HBA.	   [STATIC][PUBLIC]
+//-----------------------------------------------------------------------------
+
+SCSIParallelDMACommand *
+SCSIParallelDMACommand::Create ( void )
+{
+	
+	SCSIParallelDMACommand *	newCommand = NULL;
+	
+	newCommand = OSTypeAlloc ( SCSIParallelDMACommand );
+	require_nonzero ( newCommand, ErrorExit );
+	
+	newCommand->fDMAMappings			= 0;
+	newCommand->fDMAMappingTime			= 0;
+	newCommand->fRegisteredBuffer		= NULL;
+	newCommand->fRegisteredOffset		= 0;
+	newCommand->fRegisteredLength		= 0;
+	newCommand->fRegisteredPrepareCount	= 0;
+	newCommand->fTask					= NULL;
+	
+	
+ErrorExit:
+	
+	
+	return newCommand;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	prepare - Prepares the command for DMA, timing the mapping.		   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+IOReturn
+SCSIParallelDMACommand::prepare ( UInt64	offset,
+								  UInt64	length,
+								  bool		flushCache,
+								  bool		synchronize )
+{
+	
+	IOReturn	status		= kIOReturnSuccess;
+	UInt64		startTime	= 0;
+	
+	// A registered buffer is already mapped. Only note the part of it the
+	// HBA wants, as IODMACommand would.
+	if ( fRegisteredBuffer != NULL )
+	{
+		
+		if ( length == 0 )
+		{
+			length = fRegisteredBuffer->fBuffer->getLength ( ) - offset;
+		}
+		
+		if ( fRegisteredPrepareCount != 0 )
+		{
+			
+			if ( ( offset != fRegisteredOffset ) || ( length != fRegisteredLength ) )
+			{
+				return kIOReturnNotReady;
+			}
+			
+		}
+		
+		else
+		{
+			
+			if ( ( offset + length ) > fRegisteredBuffer->fBuffer->getLength ( ) )
+			{
+				return kIOReturnBadArgument;
+			}
+			
+			fRegisteredOffset = offset;
+			fRegisteredLength = length;
+			
+		}
+		
+		fRegisteredPrepareCount++;
+		
+		return kIOReturnSuccess;
+		
+	}
+	
+	startTime = mach_absolute_time ( );
+	
+	status = super::prepare ( offset, length, flushCache, synchronize );
+	
+	// The controller adds these to its statistics when the task completes.
+	fDMAMappingTime += mach_absolute_time ( ) - startTime;
+	fDMAMappings++;
+	
+	return status;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	complete - Completes the DMA of the command.					   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+IOReturn
+SCSIParallelDMACommand::complete ( bool	invalidateCache,
+								   bool	synchronize )
+{
+	
+	if ( fRegisteredBuffer != NULL )
+	{
+		
+		if ( fRegisteredPrepareCount == 0 )
+		{
+			return kIOReturnNotReady;
+		}
+		
+		// The mapping belongs to the registered buffer and is kept.
+		fRegisteredPrepareCount--;
+		
+		return kIOReturnSuccess;
+		
+	}
+	
+	return super::complete ( invalidateCache, synchronize );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	synchronize - Synchronizes the DMA buffer of the command.		   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+IOReturn
+SCSIParallelDMACommand::synchronize ( IOOptionBits options )
+{
+	
+	// A registered buffer can be reached by the HBA, so there is never a
+	// copy to synchronize.
+	if ( fRegisteredBuffer != NULL )
+	{
+		return ( fRegisteredPrepareCount != 0 ) ? kIOReturnSuccess : kIOReturnNotReady;
+	}
+	
+	return super::synchronize ( options );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	genIOVMSegments - Generates the DMA segments of the command. The
+//					  segments of a registered buffer are taken from the
+//					  ones it generated when it was registered.		   [PUBLIC]
+//-----------------------------------------------------------------------------
+
+IOReturn
+SCSIParallelDMACommand::genIOVMSegments ( UInt64 *	offsetP,
+										  void *	segmentsP,
+										  UInt32 *	numSegmentsP )
+{
+	
+	SCSIParallelRegisteredSegment *	segments	= NULL;
+	Segment64						segment;
+	UInt64							position	= 0;
+	UInt64							end			= 0;
+	UInt32							low			= 0;
+	UInt32							high		= 0;
+	UInt32							index		= 0;
+	UInt32							count		= 0;
+	
+	if ( fRegisteredBuffer == NULL )
+	{
+		return super::genIOVMSegments ( offsetP, segmentsP, numSegmentsP );
+	}
+	
+	if ( fRegisteredPrepareCount == 0 )
+	{
+		return kIOReturnNotReady;
+	}
+	
+	if ( ( offsetP == NULL ) || ( segmentsP == NULL ) || ( numSegmentsP == NULL ) )
+	{
+		return kIOReturnBadArgument;
+	}
+	
+	// The offset is from the start of the prepared part.
+	if ( *offsetP >= fRegisteredLength )
+	{
+		return kIOReturnOverrun;
+	}
+	
+	segments	= fRegisteredBuffer->fSegments;
+	position	= fRegisteredOffset + *offsetP;
+	end			= fRegisteredOffset + fRegisteredLength;
+	
+	// Find the segment the offset is in.
+	low		= 0;
+	high	= fRegisteredBuffer->fSegmentCount;
+	while ( ( high - low ) > 1 )
+	{
+		
+		index = ( low + high ) / 2;
+		if ( segments[index].fOffset <= position )
+		{
+			low = index;
+		}
+		
+		else
+		{
+			high = index;
+		}
+		
+	}
+	
+	index = low;
+	
+	while ( ( count < *numSegmentsP ) &&
+			( position < end ) &&
+			( index < fRegisteredBuffer->fSegmentCount ) )
+	{
+		
+		segment.fIOVMAddr	= segments[index].fAddress + ( position - segments[index].fOffset );
+		segment.fLength		= segments[index].fLength - ( position - segments[index].fOffset );
+		
+		if ( segment.fLength > ( end - position ) )
+		{
+			segment.fLength = end - position;
+		}
+		
+		// Output the segment in the HBA's format.
+		if ( ( *fOutSeg ) ( this, segment, segmentsP, count ) == false )
+		{
+			break;
+		}
+		
+		position += segment.fLength;
+		count++;
+		index++;
+		
+	}
+	
+	*offsetP		= position - fRegisteredOffset;
+	*numSegmentsP	= count;
+	
+	return kIOReturnSuccess;
+	
+}
+
+
 #if 0
 #pragma mark -
 #pragma mark Static Debugging Assertion Method
@@ -33,6 +33,7 @@
 #ifndef __SCSI_PARALLEL_TASK_H__
 #define __SCSI_PARALLEL_TASK_H__
 
+#include <IOKit/IOCommand.h>
 #include <IOKit/IODMACommand.h>
 #include <IOKit/scsi/spi/IOSCSIParallelInterfaceController.h>
 #include <IOKit/scsi/SCSITask.h>
@@ -40,23 +41,232 @@
 #include <IOKit/scsi/SCSITaskDefinition.h>
 
 
+//-----------------------------------------------------------------------------
+//	Constants
+//-----------------------------------------------------------------------------
+
+#define kSCSIParallelTraceNoRecord		0xFFFFFFFF
+
+// The number of urgent (HEAD OF QUEUE or ACA) tasks let in ahead of other
+// waiting tasks in a row before one of the other tasks gets a turn. Used for
+// the controller's task pool as well as for the resend list of a Target.
+#define kSCSIParallelMaxUrgentTaskStreak	8
+
+// The stages a task goes through, for the latency breakdown of its Target
+// (see kIOTaskStageLatencyKey).
+enum
+{
+	kSCSIParallelTaskStage_Acquired		= 0,	// taken from the pool
+	kSCSIParallelTaskStage_Executed		= 1,	// handed to the controller
+	kSCSIParallelTaskStage_Interrupted	= 2,	// the HBA's interrupt filter ran
+	kSCSIParallelTaskStage_HBACompleted	= 3,	// CompleteParallelTask called
+	kSCSIParallelTaskStage_Completed	= 4,	// handed back to the client
+	kSCSIParallelTaskStageCount			= 5
+};
+
+// Who has a task which is outstanding for its Target. A task is only
+// reclaimed after a Task Management function if the HBA does not have it
+// (see IOSCSIParallelInterfaceController::ReclaimTasksForNexus), and it
+// does not time out once the HBA completed it outside of the gate.
+enum
+{
+	kSCSIParallelTaskState_Family		= 0,	// not handed to the HBA, or handed back
+	kSCSIParallelTaskState_HBA			= 1,	// handed to the HBA
+	kSCSIParallelTaskState_Released		= 2,	// released by the HBA without a completion
+	kSCSIParallelTaskState_Deferred		= 3		// completed, completion not yet finished
+};
+
+
+//-----------------------------------------------------------------------------
+//	Forward declarations
+//-----------------------------------------------------------------------------
+
+class IOBufferMemoryDescriptor;
+class SCSIParallelTask;
+struct SCSIParallelSplit;
+
+
+//-----------------------------------------------------------------------------
+//	Structures
+//-----------------------------------------------------------------------------
+
+// A segment of a registered buffer, at an offset in the buffer.
+typedef struct SCSIParallelRegisteredSegment
+{
+	UInt64		fOffset;
+	UInt64		fAddress;
+	UInt64		fLength;
+} SCSIParallelRegisteredSegment;
+
+// A data buffer registered with the controller by a client which sends
+// many tasks with it (see IOSCSIParallelInterfaceDevice::RegisterDataBuffer).
+// It stays prepared for DMA while it is registered, and its segments are
+// generated once, so a task using it needs no mapping of its own. It is
+// freed when it has been unregistered and no task is using it.
+typedef struct SCSIParallelRegisteredBuffer
+{
+	IOMemoryDescriptor *				fBuffer;
+	IODMACommand *						fCommand;
+	SCSIParallelRegisteredSegment *		fSegments;
+	UInt32								fSegmentCount;
+	UInt32								fSegmentCapacity;
+	UInt32								fReferenceCount;
+} SCSIParallelRegisteredBuffer;
+
+
 //-----------------------------------------------------------------------------
 //	Class Declarations
 //-----------------------------------------------------------------------------
 
-class SCSIParallelTask: public IODMACommand
+// The DMA command of a task. By default every task has one of its own, which
+// is also what the HBA is given as the task's identifier, as HBAs which use
+// the task as an IODMACommand expect. If the HBA sets kIODMACommandPoolSizeKey,
+// the controller keeps these in a pool of their own instead, and a task is
+// only given one when its data has to be mapped (see GetDMACommand).
+class SCSIParallelDMACommand: public IODMACommand
+{
+	
+	OSDeclareDefaultStructors ( SCSIParallelDMACommand )
+	
+public:
+	
+	static SCSIParallelDMACommand *	Create ( void );
+	
+	inline IOReturn SetBuffer ( IOMemoryDescriptor * buffer )
+	{
+		return setMemoryDescriptor ( buffer, false );
+	}
+	
+	// The largest transfer the DMA specification of the command allows.
+	inline UInt64 GetMaximumTransferSize ( void )
+	{
+		return fMaxTransferSize;
+	}
+	
+	// Whether the DMA specification of the command shapes its segments
+	// the same way as the given one.
+	inline bool HasSegmentSpecification ( UInt32	numAddressBits,
+										  UInt64	maxSegmentSize,
+										  UInt32	alignment )
+	{
+		return ( ( fNumAddressBits == numAddressBits ) &&
+				 ( fMaxSegmentSize == maxSegmentSize ) &&
+				 ( fAlignMask == ( alignment - 1 ) ) );
+	}
+	
+	// Counts and times the mappings made by the HBA (see kIOStatisticsKey).
+	// A command for a registered buffer takes its segments from the buffer
+	// instead of mapping its own.
+	IOReturn	prepare ( UInt64	offset		= 0,
+						  UInt64	length		= 0,
+						  bool		flushCache	= true,
+						  bool		synchronize	= true );
+	IOReturn	complete ( bool		invalidateCache	= true,
+						   bool		synchronize		= true );
+	IOReturn	synchronize ( IOOptionBits options );
+	IOReturn	genIOVMSegments ( UInt64 *	offset,
+								  void *	segments,
+								  UInt32 *	numSegments );
+	
+	// The number of times the command was mapped for DMA, and the absolute
+	// time spent doing so, since the controller last counted them.
+	UInt32						fDMAMappings;
+	UInt64						fDMAMappingTime;
+	
+	// The registered buffer the data is in, or NULL, and the part of it
+	// the HBA prepared.
+	SCSIParallelRegisteredBuffer *	fRegisteredBuffer;
+	UInt64						fRegisteredOffset;
+	UInt64						fRegisteredLength;
+	UInt32						fRegisteredPrepareCount;
+	
+	// The task the command belongs to, if it is the task's own command, or
+	// NULL if it is from the pool.
+	SCSIParallelTask *			fTask;
+	
+};
+
+
+class SCSIParallelTask: public IOCommand
 {
 	
 	OSDeclareDefaultStructors ( SCSIParallelTask )
 	
 public:
 	
-	queue_chain_t		fResendTaskChain;
-	queue_chain_t		fTimeoutChain;
+	// The member variables are laid out by how often they are used. The
+	// state touched on every submission and completion is packed into four
+	// cache lines, three public ones here and a private one below, so that
+	// it is not spread across the object.
+	// Everything else, such as the feature negotiation state, comes after.
+	
+	// The link on the controller's timeout list. This starts the first
+	// cache line of per-I/O state, the lists the task is on.
+	queue_chain_t				fTimeoutChain __attribute__ ( ( aligned ( 64 ) ) );
+	
+	// The Target this task is charged to by the controller's task
+	// admission, or NULL if it is not charged to any Target.
+	IOSCSIParallelInterfaceDevice *	fAdmissionTarget;
+	
+	// The link and results for a completion that was made outside of the
+	// workloop gate and is waiting to be finished on the workloop.
+	SCSIParallelTask *			fDeferredCompletionNext;
+	SCSITaskStatus				fDeferredTaskStatus;
+	SCSIServiceResponse			fDeferredServiceResponse;
+	
+	// The link for a task waiting to be handed to the HBA in a batch, or
+	// on the holding queue while the controller is suspended.
+	SCSIParallelTask *			fBatchedSubmissionNext;
+	
+	// The client's task this task is a piece of, if it was split because it
+	// is larger than the HBA can transfer, or NULL.
+	SCSIParallelSplit *			fSplit;
+	
+	// The DMA command of the task: its own, or one from the pool while the
+	// task transfers data, or NULL.
+	SCSIParallelDMACommand *	fDMACommand;
 	
 	// Counter to keep track of the number of times the IO completes
-	// with TASK SET FULL status.
-	UInt8						fTaskRetryCount;
+	// with TASK SET FULL status. This starts the second cache line, the
+	// task's state and its timing.
+	UInt8						fTaskRetryCount __attribute__ ( ( aligned ( 64 ) ) );
+	
+	// Who has the task (see kSCSIParallelTaskState_HBA). It is only changed
+	// by the controller, and to kSCSIParallelTaskState_Released only with
+	// the gate held. kSCSIParallelTaskState_Deferred is set without the gate
+	// before the task is published on the deferred completion list.
+	UInt8						fState;
+	
+	// The record of the task in its Target's command trace, and the
+	// capture it belongs to. The record is kSCSIParallelTraceNoRecord if
+	// the task is not being traced.
+	UInt32						fTraceRecord;
+	UInt32						fTraceGeneration;
+	
+	// The time the client's request arrived at the Target, and the times
+	// the task reached each stage after that as offsets from it in absolute
+	// time units. A stage which was not reached is zero.
+	UInt64						fStageStartTime;
+	UInt64						fStageTime[kSCSIParallelTaskStageCount];
+	
+	// The controller's bounce buffer the data is staged through, or NULL
+	// if the HBA transfers to the client's buffer. This starts the third
+	// cache line, how the task's data is sent.
+	IOBufferMemoryDescriptor *	fBounceBuffer __attribute__ ( ( aligned ( 64 ) ) );
+	
+	// The time the task was sent over a path of a multipathed Target.
+	UInt64						fPathStartTime;
+	
+	// The CDB of a piece of a split task, and the part of the client's data
+	// buffer it transfers. These replace those of the client's task while
+	// fSplit is set.
+	SCSICommandDescriptorBlock	fSplitCDB;
+	UInt64						fSplitOffset;
+	UInt64						fSplitLength;
+	
+	// What the HBA is given for the task: the task's own DMA command, or
+	// the task itself if the DMA commands are pooled.
+	SCSIParallelTaskIdentifier	fIdentifier;
 	
 	static SCSIParallelTask *	Create ( UInt32 sizeOfHBAData, UInt64 alignmentMask ); 
 	
@@ -92,6 +302,8 @@ public:
 	
 	IOMemoryDescriptor *	GetDataBuffer ( void );
 	UInt64					GetDataBufferOffset ( void );
+	IOMemoryDescriptor *	GetClientDataBuffer ( void );
+	UInt64					GetClientDataBufferOffset ( void );
 	UInt32					GetTimeoutDuration ( void );
 	bool					SetAutoSenseData ( SCSI_Sense_Data * senseData, UInt8 senseDataSize );
 	bool					GetAutoSenseData ( SCSI_Sense_Data * receivingBuffer, UInt8 senseDataSize );
@@ -119,15 +331,59 @@ public:
 	AbsoluteTime	GetTimeoutDeadline ( void );
 	void			SetTimeoutDeadline ( AbsoluteTime time );
 	
-	inline IOReturn SetBuffer ( IOMemoryDescriptor * buffer )
+	// The task an identifier given to the HBA stands for. The family's own
+	// code may pass the task itself.
+	static inline SCSIParallelTask * FromIdentifier ( SCSIParallelTaskIdentifier identifier )
 	{
-		return setMemoryDescriptor ( buffer, false );
-	}	
+		
+		if ( ( identifier != NULL ) &&
+			 ( identifier->getMetaClass ( ) == SCSIParallelDMACommand::metaClass ) )
+		{
+			return ( ( SCSIParallelDMACommand * ) identifier )->fTask;
+		}
+		
+		return ( SCSIParallelTask * ) identifier;
+		
+	}
+	
+	// The largest transfer the DMA command of the task allows, or 0 if the
+	// task has none.
+	inline UInt64 GetMaximumTransferSize ( void )
+	{
+		return ( fDMACommand != NULL ) ? fDMACommand->GetMaximumTransferSize ( ) : 0;
+	}
 	
 private:
 	
-	SCSITargetIdentifier				fTargetID;
+	// This is the SCSI Task that is to be executed on behalf of the Application
+	// Layer client that controls the Target. This starts the fourth cache
+	// line of per-I/O state.
+	SCSITaskIdentifier			fSCSITask __attribute__ ( ( aligned ( 64 ) ) );
+	
 	IOSCSIParallelInterfaceDevice *		fDevice;
+	SCSITargetIdentifier				fTargetID;
+	
+	// This is the space of the HBA data as requested on when the task object
+	// was created.
+	void *						fHBAData;
+	
+	// Local storage for data that needs to be copied back to the client's SCSI Task
+	UInt64						fRealizedTransferCount;
+	
+	// Member variables to maintain the next element in the 
+	// timeout list and the timeout deadline.
+	AbsoluteTime				fTimeoutDeadline;
+	
+	// This is a value that can be used by a controller to uniquely identify a given
+	// task.
+	UInt64						fControllerTaskIdentifier;
+	
+	// This is the size of the HBA data.
+	UInt32						fHBADataSize;
+	
+	// ---- The per-I/O state ends here. ----
+	
+	IOMemoryDescriptor *		fHBADataDescriptor;
 	
 	// --> Wide, Sync and other parallel specific fields.
 	// The member variables to indicate if wide transfers should be
@@ -146,28 +402,29 @@ private:
 
 	UInt64						fSCSIParallelFeatureRequestCount;
 	UInt64						fSCSIParallelFeatureRequestResultCount;
-		
-	// This is the SCSI Task that is to be executed on behalf of the Application
-	// Layer client that controls the Target.
-	SCSITaskIdentifier			fSCSITask;
 	
-	// This is a value that can be used by a controller to uniquely identify a given
-	// task.
-	UInt64						fControllerTaskIdentifier;
+public:
 	
-	// This is the size and space of the HBA data as requested on
-	// when the task object was created.
-	UInt32						fHBADataSize;
-	void *						fHBAData;
-	IOMemoryDescriptor *		fHBADataDescriptor;
+	// The link on the Target's resend list. This is only used when a task
+	// completes with TASK SET FULL status.
+	queue_chain_t				fResendTaskChain;
 	
-	// Local storage for data that needs to be copied back to the client's SCSI Task
-	UInt64						fRealizedTransferCount;
+	// The time a task on the controller's holding queue fails if it has
+	// not been sent by then, and whether it is on the queue. Both are only
+	// used with the gate held.
+	UInt64						fHoldingDeadline;
+	bool						fHeld;
+	
+	// Marks a stage as reached at the given time.
+	inline void MarkStage ( UInt32 stage, UInt64 time )
+	{
+		
+		UInt64	offset = time - fStageStartTime;
+		
+		fStageTime[stage] = ( offset == 0 ) ? 1 : offset;
+		
+	}
 	
-	// Member variables to maintain the next element in the 
-	// timeout list and the timeout deadline.
-	AbsoluteTime				fTimeoutDeadline;
-			
 };
 
 
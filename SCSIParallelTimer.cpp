@@ -54,13 +54,13 @@
 #if ( SCSI_PARALLEL_TIMER_DEBUGGING_LEVEL >= 2 )
 #define ERROR_LOG(x)		IOLog x
 #else
-#define ERROR_LOG(x)
+#define ERROR_LOG(x)		SCSI_PARALLEL_TRACE ( kSCSIParallelTraceCategory_Timer, x )
 #endif
 
 #if ( SCSI_PARALLEL_TIMER_DEBUGGING_LEVEL >= 3 )
 #define STATUS_LOG(x)		IOLog x
 #else
-#define STATUS_LOG(x)
+#define STATUS_LOG(x)		SCSI_PARALLEL_TRACE ( kSCSIParallelTraceCategory_Timer | kSCSIParallelTraceStatus, x )
 #endif
 
 
@@ -118,6 +118,7 @@ SCSIParallelTimer::Init ( OSObject * owner, Action action )
 {
 	
 	queue_init ( &fListHead );
+	queue_init ( &fPendingListHead );
 	return super::init ( owner, action );
 	
 }
@@ -180,8 +181,22 @@ void
 SCSIParallelTimer::EndTimeoutContext ( void )
 {
 	
+	SCSIParallelTask *	task = NULL;
+	
 	closeGate ( );
+	
 	fHandlingTimeout = false;
+	
+	// Now that the timeout list is no longer being walked, insert the tasks
+	// which were given a new timeout while the expired tasks were handled.
+	while ( queue_empty ( &fPendingListHead ) == false )
+	{
+		
+		queue_remove_first ( &fPendingListHead, task, SCSIParallelTask *, fTimeoutChain );
+		InsertTask ( task );
+		
+	}
+	
 	openGate ( );
 	
 }
@@ -258,6 +273,11 @@ SCSIParallelTimer::GetExpiredTask ( void )
 			
 			queue_remove_first ( &fListHead, expiredTask, SCSIParallelTask *, fTimeoutChain );
 			
+			// The task is off the list, so RemoveTask() must not unlink it
+			// again when it is completed later.
+			expiredTask->fTimeoutChain.next = NULL;
+			expiredTask->fTimeoutChain.prev = NULL;
+			
 		}
 		
 	}
@@ -308,6 +328,42 @@ SCSIParallelTimer::SetTimeout ( SCSIParallelTaskIdentifier	taskIdentifier,
 	clock_interval_to_deadline ( inTimeoutMS, kMillisecondScale, &deadline );
 	task->SetTimeoutDeadline ( deadline );
 	
+	// While the expired tasks are being handled, the timeout list is being
+	// walked by GetExpiredTask(). Park the task until the walk is over (see
+	// EndTimeoutContext).
+	if ( fHandlingTimeout == true )
+	{
+		queue_enter ( &fPendingListHead, task, SCSIParallelTask *, fTimeoutChain );
+	}
+	
+	else
+	{
+		InsertTask ( task );
+	}
+	
+	openGate ( );
+	status = kIOReturnSuccess;
+	
+	
+ErrorExit:
+	
+	
+	return status;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	InsertTask - Inserts a task in the timeout list, which is kept sorted by
+//				 deadline.											  [PRIVATE]
+//-----------------------------------------------------------------------------
+
+void
+SCSIParallelTimer::InsertTask ( SCSIParallelTask * task )
+{
+	
+	AbsoluteTime	deadline = GetDeadline ( task );
+	
 	// 1) Check if we have a list head. If not, put this
 	// element at the beginning.
 	// 2) Check if the task has a shorter timeout than the list head
@@ -365,15 +421,6 @@ SCSIParallelTimer::SetTimeout ( SCSIParallelTaskIdentifier	taskIdentifier,
 		
 	}
 	
-	openGate ( );
-	status = kIOReturnSuccess;
-	
-	
-ErrorExit:
-	
-	
-	return status;
-	
 }
 
 
@@ -396,6 +443,27 @@ SCSIParallelTimer::RemoveTask ( SCSIParallelTaskIdentifier parallelRequest )
 	
 	closeGate ( );
 	
+	if ( fHandlingTimeout == true )
+	{
+		
+		SCSIParallelTask *	pendingTask = NULL;
+		
+		// The task may be waiting to be put back on the timeout list.
+		queue_iterate ( &fPendingListHead, pendingTask, SCSIParallelTask *, fTimeoutChain )
+		{
+			
+			if ( pendingTask == task )
+			{
+				
+				queue_remove ( &fPendingListHead, task, SCSIParallelTask *, fTimeoutChain );
+				goto ExitGate;
+				
+			}
+			
+		}
+		
+	}
+	
 	require ( ( queue_empty ( &fListHead ) == false ), ExitGate );
 	
 	if ( task == ( SCSIParallelTask * ) queue_first ( &fListHead ) )
@@ -415,6 +483,10 @@ SCSIParallelTimer::RemoveTask ( SCSIParallelTaskIdentifier parallelRequest )
 ExitGate:
 	
 	
+	// The task is on neither list now.
+	task->fTimeoutChain.next = NULL;
+	task->fTimeoutChain.prev = NULL;
+	
 	openGate ( );
 	
 	
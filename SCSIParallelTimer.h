@@ -86,7 +86,10 @@ protected:
 	
 private:
 	
+	void					InsertTask ( SCSIParallelTask * task );
+	
 	queue_head_t			fListHead;
+	queue_head_t			fPendingListHead;
 	bool					fHandlingTimeout;
 	
 };
@@ -0,0 +1,317 @@
+/*
+ * Copyright (c) 2002-2008 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+//-----------------------------------------------------------------------------
+//	Includes
+//-----------------------------------------------------------------------------
+
+// General IOKit includes
+#include <IOKit/IOLib.h>
+#include <IOKit/IOLocks.h>
+
+// Libkern includes
+#include <libkern/libkern.h>
+#include <libkern/OSAtomic.h>
+
+// Kernel includes
+#include <kern/clock.h>
+#include <kern/thread_call.h>
+#include <pexpert/pexpert.h>
+#include <stdarg.h>
+
+// SCSI Parallel Family includes
+#include "SCSIParallelTrace.h"
+
+
+//-----------------------------------------------------------------------------
+//	Macros
+//-----------------------------------------------------------------------------
+
+#define DEBUG 												0
+#define DEBUG_ASSERT_COMPONENT_NAME_STRING					"SPI TRACE"
+
+#include "IOSCSIParallelFamilyDebugging.h"
+
+
+#if 0
+#pragma mark -
+#pragma mark Tracepoints
+#pragma mark -
+#endif
+
+
+// The trace ring. A writer claims a record by bumping sTraceHead and publishes
+// it by storing its sequence number (one more than its position, so zero means
+// unpublished) once the text is in place, so no lock is taken on the I/O path.
+// The drain copies published records out in order and counts the records the
+// writers lapped before it got to them as dropped.
+enum
+{
+	kSCSIParallelTraceRingSize		= 512,
+	kSCSIParallelTraceTextSize		= 116,
+	kSCSIParallelTraceDrainDelayMS	= 10
+};
+
+typedef struct SCSIParallelTraceEntry
+{
+	volatile UInt32		fSequence;
+	UInt64				fTimeStamp;
+	char				fText[kSCSIParallelTraceTextSize];
+} SCSIParallelTraceEntry;
+
+volatile UInt32					gSCSIParallelTraceCategories	= 0;
+
+static SCSIParallelTraceEntry	sTraceRing[kSCSIParallelTraceRingSize];
+static volatile UInt32			sTraceHead						= 0;
+static UInt32					sTraceTail						= 0;
+static volatile UInt32			sTraceDrainPending				= 0;
+static volatile UInt32			sTraceInitialized				= 0;
+static IOLock *					sTraceDrainLock					= NULL;
+static thread_call_t			sTraceDrainCall					= NULL;
+
+static void
+IOSCSIParallelFamilyTraceDrain ( thread_call_param_t	param0,
+								 thread_call_param_t	param1 );
+
+
+//-----------------------------------------------------------------------------
+//	IOSCSIParallelFamilyTraceInitialize - 	Sets up the trace ring drain and
+//											picks up the categories from
+//											the spi_trace boot-arg.
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelFamilyTraceInitialize ( void )
+{
+	
+	UInt32	categories = 0;
+	
+	require_quiet ( OSCompareAndSwap ( 0, 1, &sTraceInitialized ), Exit );
+	
+	sTraceDrainLock = IOLockAlloc ( );
+	require_nonzero ( sTraceDrainLock, Exit );
+	
+	sTraceDrainCall = thread_call_allocate ( IOSCSIParallelFamilyTraceDrain, NULL );
+	require_nonzero ( sTraceDrainCall, Exit );
+	
+	if ( PE_parse_boot_argn ( "spi_trace", &categories, sizeof ( categories ) ) )
+	{
+		IOSCSIParallelFamilySetTraceCategories ( categories );
+	}
+	
+	
+Exit:
+	
+	
+	return;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	IOSCSIParallelFamilyTraceTerminate - 	Disables tracing and tears down the
+//											trace ring drain. Called when the
+//											kext is unloaded.
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelFamilyTraceTerminate ( void )
+{
+	
+	gSCSIParallelTraceCategories = 0;
+	
+	// Wait for a drain which is scheduled or running to finish before the
+	// code it runs goes away.
+	if ( sTraceDrainCall != NULL )
+	{
+		
+		thread_call_cancel_wait ( sTraceDrainCall );
+		thread_call_free ( sTraceDrainCall );
+		sTraceDrainCall = NULL;
+		
+	}
+	
+	if ( sTraceDrainLock != NULL )
+	{
+		
+		IOLockFree ( sTraceDrainLock );
+		sTraceDrainLock = NULL;
+		
+	}
+	
+	sTraceDrainPending	= 0;
+	sTraceInitialized	= 0;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	IOSCSIParallelFamilySetTraceCategories - Enables the tracepoints of the
+//											 given categories and disables
+//											 the others.
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelFamilySetTraceCategories ( UInt32 categories )
+{
+	
+	// Nothing may be traced until there is a drain for it.
+	require_nonzero ( sTraceDrainCall, Exit );
+	
+	gSCSIParallelTraceCategories = categories & ( kSCSIParallelTraceCategoryMask | kSCSIParallelTraceStatus );
+	
+	
+Exit:
+	
+	
+	return;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	IOSCSIParallelFamilyTrace - Records a tracepoint in the trace ring.
+//-----------------------------------------------------------------------------
+
+void
+IOSCSIParallelFamilyTrace ( const char * format, ... )
+{
+	
+	SCSIParallelTraceEntry *	entry		= NULL;
+	UInt32						sequence	= 0;
+	UInt64						deadline	= 0;
+	va_list						arguments;
+	
+	sequence	= ( UInt32 ) OSIncrementAtomic ( ( volatile SInt32 * ) &sTraceHead );
+	entry		= &sTraceRing[sequence % kSCSIParallelTraceRingSize];
+	
+	// Unpublish the record while it is rewritten so that the drain does not
+	// copy out half of it.
+	entry->fSequence = 0;
+	OSMemoryBarrier ( );
+	
+	entry->fTimeStamp = mach_absolute_time ( );
+	
+	va_start ( arguments, format );
+	vsnprintf ( entry->fText, sizeof ( entry->fText ), format, arguments );
+	va_end ( arguments );
+	
+	OSMemoryBarrier ( );
+	entry->fSequence = sequence + 1;
+	
+	// Only the first record since the last drain schedules the next one.
+	if ( OSCompareAndSwap ( 0, 1, &sTraceDrainPending ) == true )
+	{
+		
+		clock_interval_to_deadline ( kSCSIParallelTraceDrainDelayMS, kMillisecondScale, &deadline );
+		thread_call_enter_delayed ( sTraceDrainCall, deadline );
+		
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	IOSCSIParallelFamilyTraceDrain - Writes the published records in the
+//									 trace ring to the system log.	   [STATIC]
+//-----------------------------------------------------------------------------
+
+static void
+IOSCSIParallelFamilyTraceDrain ( thread_call_param_t	param0,
+								 thread_call_param_t	param1 )
+{
+	
+	SCSIParallelTraceEntry *	entry		= NULL;
+	UInt32						head		= 0;
+	UInt32						sequence	= 0;
+	UInt32						dropped		= 0;
+	UInt64						timeStamp	= 0;
+	UInt64						time		= 0;
+	char						text[kSCSIParallelTraceTextSize];
+	
+	IOLockLock ( sTraceDrainLock );
+	
+	// Records published from now on schedule another drain.
+	sTraceDrainPending = 0;
+	OSMemoryBarrier ( );
+	
+	head = sTraceHead;
+	
+	if ( ( head - sTraceTail ) > kSCSIParallelTraceRingSize )
+	{
+		
+		dropped		= head - sTraceTail - kSCSIParallelTraceRingSize;
+		sTraceTail	= head - kSCSIParallelTraceRingSize;
+		
+	}
+	
+	while ( sTraceTail != head )
+	{
+		
+		entry		= &sTraceRing[sTraceTail % kSCSIParallelTraceRingSize];
+		sequence	= entry->fSequence;
+		
+		// A record still being written is left for the drain its writer
+		// schedules once it is published.
+		if ( ( sequence == 0 ) || ( ( SInt32 ) ( sequence - ( sTraceTail + 1 ) ) < 0 ) )
+		{
+			break;
+		}
+		
+		OSMemoryBarrier ( );
+		timeStamp = entry->fTimeStamp;
+		bcopy ( entry->fText, text, sizeof ( text ) );
+		OSMemoryBarrier ( );
+		
+		// The writers lapped this record, possibly while it was copied.
+		if ( ( sequence != ( sTraceTail + 1 ) ) || ( entry->fSequence != sequence ) )
+		{
+			
+			dropped++;
+			sTraceTail++;
+			continue;
+			
+		}
+		
+		text[sizeof ( text ) - 1] = 0;
+		absolutetime_to_nanoseconds ( timeStamp, &time );
+		
+		IOLog ( "SPI [%llu.%06llu] %s%s",
+				time / kSecondScale,
+				( time % kSecondScale ) / kMicrosecondScale,
+				text,
+				( ( text[0] != 0 ) && ( text[strlen ( text ) - 1] == '\n' ) ) ? "" : "\n" );
+		
+		sTraceTail++;
+		
+	}
+	
+	if ( dropped != 0 )
+	{
+		IOLog ( "SPI: %u trace records dropped\n", ( unsigned int ) dropped );
+	}
+	
+	IOLockUnlock ( sTraceDrainLock );
+	
+}
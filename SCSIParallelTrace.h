@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2002-2008 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#ifndef __SCSI_PARALLEL_TRACE_H__
+#define __SCSI_PARALLEL_TRACE_H__
+
+
+/* The format of a command trace captured by an IOSCSIParallelInterfaceDevice
+ * (see kIOCommandTraceKey). A trace is a SCSIParallelTraceHeader followed by
+ * fRecordCount SCSIParallelTraceRecords, one for each task sent to the Target
+ * in the order they were sent. All fields are in host byte order.
+ *
+ * This header is shared with user space tools, so it only uses the standard
+ * integer types. The tracepoints the family's modules log to, which are
+ * implemented in SCSIParallelTrace.cpp, are only declared for the kernel.
+ */
+
+
+//-----------------------------------------------------------------------------
+//	Includes
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+
+#if KERNEL
+#include <IOKit/IOTypes.h>
+#endif
+
+
+//-----------------------------------------------------------------------------
+//	Constants
+//-----------------------------------------------------------------------------
+
+#define kSCSIParallelTraceSignature			0x53505452	/* 'SPTR' */
+#define kSCSIParallelTraceVersion			1
+
+// The number of records captured when capture is turned on with a boolean,
+// and the most that may be asked for.
+#define kSCSIParallelTraceDefaultRecordCount	4096
+#define kSCSIParallelTraceMaximumRecordCount	65536
+
+// The record flags.
+enum
+{
+	// The task was still outstanding when the capture was stopped, so
+	// there is no completion time or status.
+	kSCSIParallelTraceFlag_Outstanding	= 0x01
+};
+
+
+//-----------------------------------------------------------------------------
+//	Structures
+//-----------------------------------------------------------------------------
+
+#pragma pack(push, 1)
+
+typedef struct SCSIParallelTraceHeader
+{
+	uint32_t	fSignature;
+	uint16_t	fVersion;
+	uint16_t	fRecordSize;
+	uint64_t	fTargetIdentifier;
+
+	// The number of records that follow, and the number of tasks which
+	// were not recorded because the capture was full.
+	uint32_t	fRecordCount;
+	uint32_t	fDroppedCount;
+} SCSIParallelTraceHeader;
+
+typedef struct SCSIParallelTraceRecord
+{
+	// The times the task was sent to the controller and completed, in
+	// nanoseconds since the capture was started.
+	uint64_t	fSubmitTime;
+	uint64_t	fCompletionTime;
+
+	uint64_t	fLogicalUnit;
+	uint64_t	fRequestedTransferCount;
+	uint64_t	fRealizedTransferCount;
+	uint8_t		fCDB[16];
+	uint8_t		fCDBSize;
+	uint8_t		fTaskAttribute;
+	uint8_t		fDataTransferDirection;
+
+	// The completion, and the number of times the task was resent because
+	// the Target reported TASK SET FULL.
+	uint8_t		fServiceResponse;
+	uint8_t		fTaskStatus;
+	uint8_t		fRetryCount;
+
+	uint8_t		fFlags;
+	uint8_t		fReserved;
+} SCSIParallelTraceRecord;
+
+#pragma pack(pop)
+
+
+//-----------------------------------------------------------------------------
+//	Tracepoints
+//-----------------------------------------------------------------------------
+
+#if KERNEL
+
+/* Tracepoints. Each module traces under its own category: ERROR_LOG records
+ * when the category is enabled, STATUS_LOG only when kSCSIParallelTraceStatus
+ * is enabled as well. The categories are enabled at run time with the
+ * spi_trace boot-arg or the kIOTraceCategoriesKey property of any controller.
+ * A disabled tracepoint costs a load and a branch predicted not taken. The
+ * records are formatted into a lock-free ring and written to the system log
+ * later from a thread call, never from the I/O path.
+ */
+enum
+{
+	kSCSIParallelTraceCategory_Controller	= 0x00000001,
+	kSCSIParallelTraceCategory_Device		= 0x00000002,
+	kSCSIParallelTraceCategory_Task			= 0x00000004,
+	kSCSIParallelTraceCategory_Timer		= 0x00000008,
+	kSCSIParallelTraceCategory_WorkLoop		= 0x00000010,
+	kSCSIParallelTraceCategoryMask			= 0x0000001F,
+	kSCSIParallelTraceStatus				= 0x80000000
+};
+
+extern volatile UInt32	gSCSIParallelTraceCategories;
+
+void
+IOSCSIParallelFamilyTraceInitialize ( void );
+
+void
+IOSCSIParallelFamilyTraceTerminate ( void );
+
+void
+IOSCSIParallelFamilySetTraceCategories ( UInt32 categories );
+
+void
+IOSCSIParallelFamilyTrace ( const char * format, ... ) __printflike ( 1, 2 );
+
+#define SCSI_PARALLEL_TRACE( categories, x ) \
+	do \
+	{ \
+		if ( __builtin_expect ( ( gSCSIParallelTraceCategories & ( categories ) ) == ( categories ), 0 ) ) \
+			IOSCSIParallelFamilyTrace x; \
+	} while ( 0 )
+
+#endif	/* KERNEL */
+
+
+#endif	/* __SCSI_PARALLEL_TRACE_H__ */
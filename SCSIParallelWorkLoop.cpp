@@ -54,13 +54,13 @@
 #if ( SCSI_PARALLEL_WORKLOOP_DEBUGGING_LEVEL >= 2 )
 #define ERROR_LOG(x)		IOLog x
 #else
-#define ERROR_LOG(x)
+#define ERROR_LOG(x)		SCSI_PARALLEL_TRACE ( kSCSIParallelTraceCategory_WorkLoop, x )
 #endif
 
 #if ( SCSI_PARALLEL_WORKLOOP_DEBUGGING_LEVEL >= 3 )
 #define STATUS_LOG(x)		IOLog x
 #else
-#define STATUS_LOG(x)
+#define STATUS_LOG(x)		SCSI_PARALLEL_TRACE ( kSCSIParallelTraceCategory_WorkLoop | kSCSIParallelTraceStatus, x )
 #endif
 
 
@@ -46,10 +46,12 @@ LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN ADVISED OF THE POSSIBILITY OF SUC
 
 #include <libkern/c++/OSArray.h>
 #include <libkern/c++/OSData.h>
+#include <libkern/c++/OSNumber.h>
 #include <libkern/c++/OSString.h>
 #include <IOKit/IOTypes.h>
 #include <IOKit/IOMessage.h>
 #include <IOKit/IOMemoryDescriptor.h>
+#include <IOKit/IOSubMemoryDescriptor.h>
 #include <IOKit/storage/IOStorageDeviceCharacteristics.h>
 #include <IOKit/storage/IOStorageProtocolCharacteristics.h>
 #include <IOKit/scsi/spi/IOSCSIParallelInterfaceController.h>
@@ -65,6 +67,7 @@ LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN ADVISED OF THE POSSIBILITY OF SUC
 typedef struct AdapterTargetStruct
 {
 	AppleSCSITargetEmulator *	emulator;
+	bool						stalled;
 } AdapterTargetStruct;
 
 
@@ -106,6 +109,10 @@ OSDefineMetaClassAndStructors ( AppleSCSIEmulatorAdapter, IOSCSIParallelInterfac
 
 #define kMaxTargetID	256
 
+// The number of this adapter's port. Each port is a separate personality,
+// and Targets are shared by all the ports.
+#define kEmulatorPortKey	"Emulator Port"
+
 
 //-----------------------------------------------------------------------------
 //	ReportHBAConstraints
@@ -182,6 +189,7 @@ AppleSCSIEmulatorAdapter::InitializeTargetForID ( SCSITargetIdentifier targetID
 			
 			targetStruct = ( AdapterTargetStruct * ) GetHBATargetDataPointer ( targetID );
 			targetStruct->emulator = emulator;
+			targetStruct->stalled = false;
 			found = true;
 			
 		}
@@ -203,9 +211,12 @@ AppleSCSIEmulatorAdapter::AbortTaskRequest (
 							SCSILogicalUnitNumber		theL,
 							SCSITaggedTaskIdentifier	theQ )
 {
-	// Returning general failure for AbortTaskRequest as this isn't yet supported by our HBA
-
-	return kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
+	
+	// Release the command if the Target never answered it. A command which
+	// has been answered is still completed.
+	ReleaseStalledTasks ( theT, theL, theQ, kSCSIParallelTaskNexus_I_T_L_Q );
+	return kSCSIServiceResponse_FUNCTION_COMPLETE;
+	
 }
 
 
@@ -218,9 +229,10 @@ AppleSCSIEmulatorAdapter::AbortTaskSetRequest (
 							SCSITargetIdentifier 		theT,
 							SCSILogicalUnitNumber		theL )
 {
-	// Returning general failure for AbortTaskSetRequest as this isn't yet supported by our HBA
-
-	return kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
+	
+	ReleaseStalledTasks ( theT, theL, 0, kSCSIParallelTaskNexus_I_T_L );
+	return kSCSIServiceResponse_FUNCTION_COMPLETE;
+	
 }
 
 
@@ -248,9 +260,10 @@ AppleSCSIEmulatorAdapter::ClearTaskSetRequest (
 							SCSITargetIdentifier 		theT,
 							SCSILogicalUnitNumber		theL )
 {
-	// Returning general failure for ClearTaskSetRequest as this isn't yet supported by our HBA
-
-	return kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
+	
+	ReleaseStalledTasks ( theT, theL, 0, kSCSIParallelTaskNexus_I_T_L );
+	return kSCSIServiceResponse_FUNCTION_COMPLETE;
+	
 }
 
 
@@ -263,9 +276,10 @@ AppleSCSIEmulatorAdapter::LogicalUnitResetRequest (
 							SCSITargetIdentifier 		theT,
 							SCSILogicalUnitNumber		theL )
 {
-	// Returning general failure for LogicalUnitResetRequest as this isn't yet supported by our HBA
-
-	return kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
+	
+	ReleaseStalledTasks ( theT, theL, 0, kSCSIParallelTaskNexus_I_T_L );
+	return kSCSIServiceResponse_FUNCTION_COMPLETE;
+	
 }
 
 
@@ -277,9 +291,24 @@ SCSIServiceResponse
 AppleSCSIEmulatorAdapter::TargetResetRequest (
 							SCSITargetIdentifier		theT )
 {
-	// Returning general failure for TargetResetRequest as this isn't yet supported by our HBA
-
-	return kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
+	
+	AdapterTargetStruct *	targetStruct = NULL;
+	
+	ReleaseStalledTasks ( theT, 0, 0, kSCSIParallelTaskNexus_I_T );
+	
+	// The Target answers again once it has been reset.
+	targetStruct = ( AdapterTargetStruct * ) GetHBATargetDataPointer ( theT );
+	if ( targetStruct != NULL )
+	{
+		
+		IOSimpleLockLock ( fStallLock );
+		targetStruct->stalled = false;
+		IOSimpleLockUnlock ( fStallLock );
+		
+	}
+	
+	return kSCSIServiceResponse_FUNCTION_COMPLETE;
+	
 }
 
 
@@ -402,6 +431,11 @@ AppleSCSIEmulatorAdapter::SetControllerProperties ( void )
 	OSData *	data	= NULL;
 	UInt8		wwn[8];
 	UInt8		addressID[3];
+	char		description[16];
+	bool		transaction	= false;
+	
+	// Publish all of the properties at once.
+	transaction = BeginHBAPropertyTransaction ( );
 	
 	string = OSString::withCString ( "Apple" );
 	if ( string != NULL )
@@ -433,7 +467,9 @@ AppleSCSIEmulatorAdapter::SetControllerProperties ( void )
 		
 	}
 	
-	string = OSString::withCString ( "Port 0" );
+	snprintf ( description, sizeof ( description ), "Port %u", ( unsigned int ) fPort );
+	
+	string = OSString::withCString ( description );
 	if ( string != NULL )
 	{
 		
@@ -470,7 +506,7 @@ AppleSCSIEmulatorAdapter::SetControllerProperties ( void )
 	wwn[4] = 0x50;
 	wwn[5] = 0x60;
 	wwn[6] = 0xBB;
-	wwn[7] = 0xA0;
+	wwn[7] = 0xA0 + fPort;
 	
 	data = OSData::withBytes ( wwn, sizeof ( wwn ) );
 	if ( data != NULL )
@@ -503,7 +539,7 @@ AppleSCSIEmulatorAdapter::SetControllerProperties ( void )
 	
 	addressID[0] = 0;
 	addressID[1] = 0;
-	addressID[2] = 1;
+	addressID[2] = 1 + fPort;
 	
 	data = OSData::withBytes ( addressID, sizeof ( addressID ) );
 	if ( data != NULL )
@@ -515,6 +551,11 @@ AppleSCSIEmulatorAdapter::SetControllerProperties ( void )
 		
 	}
 	
+	if ( transaction == true )
+	{
+		CommitHBAPropertyTransaction ( );
+	}
+	
 }
 
 
@@ -528,8 +569,23 @@ AppleSCSIEmulatorAdapter::InitializeController ( void )
 	
 	IOReturn	status 	= kIOReturnSuccess;
 	
+	OSNumber *	port	= NULL;
+	
 	STATUS_LOG ( ( "+AppleSCSIEmulatorAdapter::InitializeController\n" ) );
 	
+	port = OSDynamicCast ( OSNumber, getProperty ( kEmulatorPortKey ) );
+	if ( port != NULL )
+	{
+		fPort = port->unsigned32BitValue ( );
+	}
+	
+	fPortOnline = true;
+	
+	queue_init ( &fStalledTasks );
+	
+	fStallLock = IOSimpleLockAlloc ( );
+	require_nonzero ( fStallLock, ErrorExit );
+	
 	SetControllerProperties ( );
 	
 	// We don't have any real hardware to initialize in this example code since
@@ -543,7 +599,7 @@ AppleSCSIEmulatorAdapter::InitializeController ( void )
 			this,
 			&AppleSCSIEmulatorAdapter::TaskComplete ) );
 	
-	require_nonzero ( fEventSource, ErrorExit );
+	require_nonzero ( fEventSource, FreeStallLock );
 	
 	status = GetWorkLoop ( )->addEventSource ( fEventSource );
 	require_success ( status, ReleaseEventSource );
@@ -569,6 +625,13 @@ ReleaseEventSource:
 	fEventSource = NULL;
 	
 	
+FreeStallLock:
+	
+	
+	IOSimpleLockFree ( fStallLock );
+	fStallLock = NULL;
+	
+	
 ErrorExit:
 	
 	
@@ -609,6 +672,14 @@ AppleSCSIEmulatorAdapter::TerminateController ( void )
 		
 	}
 	
+	if ( fStallLock != NULL )
+	{
+		
+		IOSimpleLockFree ( fStallLock );
+		fStallLock = NULL;
+		
+	}
+	
 	STATUS_LOG ( ( "-AppleSCSIEmulatorAdapter::TerminateController\n" ) );
 	
 }
@@ -638,9 +709,39 @@ void
 AppleSCSIEmulatorAdapter::StopController ( void )
 {
 	
+	queue_head_t				stalledTasks;
+	queue_head_t				completionQueue;
+	SCSIEmulatorRequestBlock *	srb = NULL;
+	
 	// We've been requested to stop providing HBA services.  Cleanup and shut down
 	STATUS_LOG ( ( "AppleSCSIEmulatorAdapter::StopController\n" ) );
 	
+	queue_init ( &stalledTasks );
+	queue_init ( &completionQueue );
+	
+	// Fail the commands stalled Targets never answered.
+	IOSimpleLockLock ( fStallLock );
+	
+	while ( !queue_empty ( &fStalledTasks ) )
+	{
+		
+		queue_remove_first ( &fStalledTasks, srb, SCSIEmulatorRequestBlock *, fQueueChain );
+		queue_enter ( &stalledTasks, srb, SCSIEmulatorRequestBlock *, fQueueChain );
+		
+	}
+	
+	IOSimpleLockUnlock ( fStallLock );
+	
+	while ( !queue_empty ( &stalledTasks ) )
+	{
+		
+		queue_remove_first ( &stalledTasks, srb, SCSIEmulatorRequestBlock *, fQueueChain );
+		CompleteTaskOnWorkloopThread ( srb->fParallelRequest, false, kSCSITaskStatus_No_Status, 0, NULL, 0, &completionQueue );
+		
+	}
+	
+	fEventSource->AddItemsToQueue ( &completionQueue );
+	
 }
 
 
@@ -689,7 +790,53 @@ SCSIServiceResponse
 AppleSCSIEmulatorAdapter::ProcessParallelTask ( SCSIParallelTaskIdentifier parallelRequest )
 {
 	
-	SCSIServiceResponse 			ret 				= kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
+	RunParallelTask ( parallelRequest, NULL );
+	return kSCSIServiceResponse_Request_In_Process;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	ProcessParallelTasks
+//-----------------------------------------------------------------------------
+
+void
+AppleSCSIEmulatorAdapter::ProcessParallelTasks (
+							SCSIParallelTaskIdentifier	parallelRequests[],
+							SCSIServiceResponse			serviceResponses[],
+							UInt32						count )
+{
+	
+	queue_head_t	completionQueue;
+	UInt32			index = 0;
+	
+	queue_init ( &completionQueue );
+	
+	// Run all the commands, then hand all the completions to the
+	// event source at once so the workloop is only signalled once.
+	for ( index = 0; index < count; index++ )
+	{
+		
+		RunParallelTask ( parallelRequests[index], &completionQueue );
+		serviceResponses[index] = kSCSIServiceResponse_Request_In_Process;
+		
+	}
+	
+	fEventSource->AddItemsToQueue ( &completionQueue );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	RunParallelTask
+//-----------------------------------------------------------------------------
+
+void
+AppleSCSIEmulatorAdapter::RunParallelTask (
+							SCSIParallelTaskIdentifier	parallelRequest,
+							queue_head_t *				completionQueue )
+{
+	
 	UInt8							transferDir			= GetDataTransferDirection ( parallelRequest );
 	IOMemoryDescriptor *			transferMemDesc		= GetDataBuffer ( parallelRequest );
 	UInt8							cdbLength			= GetCommandDescriptorBlockSize ( parallelRequest );
@@ -707,6 +854,21 @@ AppleSCSIEmulatorAdapter::ProcessParallelTask ( SCSIParallelTaskIdentifier paral
 	GetLogicalUnitBytes ( parallelRequest, &logicalUnitBytes );
 #endif /* USE_LUN_BYTES */
 	
+	// Nothing gets through while the port is down.
+	if ( fPortOnline == false )
+	{
+		
+		CompleteTaskOnWorkloopThread ( parallelRequest, false, kSCSITaskStatus_No_Status, 0, NULL, 0, completionQueue );
+		return;
+		
+	}
+	
+	// A stalled Target does not answer.
+	if ( StallParallelTask ( parallelRequest ) == true )
+	{
+		return;
+	}
+	
 	targetID = GetTargetIdentifier ( parallelRequest );
 	targetStruct = ( AdapterTargetStruct * ) GetHBATargetDataPointer ( targetID );
 	
@@ -724,10 +886,7 @@ AppleSCSIEmulatorAdapter::ProcessParallelTask ( SCSIParallelTaskIdentifier paral
 	targetStruct->emulator->SendCommand ( cdbData, cdbLength, transferMemDesc, &dataLen, logicalUnitNumber, &scsiStatus, &senseDataBuffer, &senseLength );
 #endif
 	
-	CompleteTaskOnWorkloopThread ( parallelRequest, true, scsiStatus, dataLen, &senseDataBuffer, senseLength );
-	
-	ret = kSCSIServiceResponse_Request_In_Process;
-	return ret;
+	CompleteTaskOnWorkloopThread ( parallelRequest, true, scsiStatus, dataLen, &senseDataBuffer, senseLength, completionQueue );
 	
 }
 
@@ -743,7 +902,8 @@ AppleSCSIEmulatorAdapter::CompleteTaskOnWorkloopThread (
 	SCSITaskStatus					scsiStatus,
 	UInt64							actuallyTransferred,
 	SCSI_Sense_Data *				senseBuffer,
-	UInt8							senseLength )
+	UInt8							senseLength,
+	queue_head_t *					completionQueue )
 {
 	
 	UInt8						transferDir				= GetDataTransferDirection ( parallelRequest );
@@ -828,7 +988,16 @@ AppleSCSIEmulatorAdapter::CompleteTaskOnWorkloopThread (
 	queue_init ( &srb->fQueueChain );
 	srb->fParallelRequest = parallelRequest;
 	srb->fTaskStatus = scsiStatus;
-	fEventSource->AddItemToQueue ( srb );
+	
+	if ( completionQueue != NULL )
+	{
+		queue_enter ( completionQueue, srb, SCSIEmulatorRequestBlock *, fQueueChain );
+	}
+	
+	else
+	{
+		fEventSource->AddItemToQueue ( srb );
+	}
 	
 }
 
@@ -852,6 +1021,116 @@ AppleSCSIEmulatorAdapter::TaskComplete (
 }
 
 
+//-----------------------------------------------------------------------------
+//	StallParallelTask
+//-----------------------------------------------------------------------------
+
+bool
+AppleSCSIEmulatorAdapter::StallParallelTask (
+							SCSIParallelTaskIdentifier	parallelRequest )
+{
+	
+	SCSIEmulatorRequestBlock *	srb				= ( SCSIEmulatorRequestBlock * ) GetHBADataPointer ( parallelRequest );
+	AdapterTargetStruct *		targetStruct	= NULL;
+	bool						stalled			= false;
+	
+	targetStruct = ( AdapterTargetStruct * ) GetHBATargetDataPointer ( GetTargetIdentifier ( parallelRequest ) );
+	
+	// Keep the command until the Target is unstalled, or a Task Management
+	// function releases it. The lock keeps SetTargetStalled from missing it.
+	IOSimpleLockLock ( fStallLock );
+	
+	if ( ( targetStruct != NULL ) && ( targetStruct->stalled == true ) )
+	{
+		
+		srb->fParallelRequest = parallelRequest;
+		queue_enter ( &fStalledTasks, srb, SCSIEmulatorRequestBlock *, fQueueChain );
+		stalled = true;
+		
+	}
+	
+	IOSimpleLockUnlock ( fStallLock );
+	
+	return stalled;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	TakeStalledTasks - Called with fStallLock held.
+//-----------------------------------------------------------------------------
+
+void
+AppleSCSIEmulatorAdapter::TakeStalledTasks (
+							SCSITargetIdentifier 		theT,
+							SCSILogicalUnitNumber		theL,
+							SCSITaggedTaskIdentifier	theQ,
+							SCSIParallelTaskNexus		theNexus,
+							queue_head_t *				tasks )
+{
+	
+	SCSIEmulatorRequestBlock *	srb		= NULL;
+	SCSIEmulatorRequestBlock *	next	= NULL;
+	
+	srb = ( SCSIEmulatorRequestBlock * ) queue_first ( &fStalledTasks );
+	while ( !queue_end ( &fStalledTasks, ( queue_entry_t ) srb ) )
+	{
+		
+		next = ( SCSIEmulatorRequestBlock * ) queue_next ( &srb->fQueueChain );
+		
+		if ( ( GetTargetIdentifier ( srb->fParallelRequest ) == theT ) &&
+			 ( ( theNexus == kSCSIParallelTaskNexus_I_T ) ||
+			   ( ( GetLogicalUnitNumber ( srb->fParallelRequest ) == theL ) &&
+				 ( ( theNexus == kSCSIParallelTaskNexus_I_T_L ) ||
+				   ( GetTaggedTaskIdentifier ( srb->fParallelRequest ) == theQ ) ) ) ) )
+		{
+			
+			queue_remove ( &fStalledTasks, srb, SCSIEmulatorRequestBlock *, fQueueChain );
+			queue_enter ( tasks, srb, SCSIEmulatorRequestBlock *, fQueueChain );
+			
+		}
+		
+		srb = next;
+		
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	ReleaseStalledTasks
+//-----------------------------------------------------------------------------
+
+void
+AppleSCSIEmulatorAdapter::ReleaseStalledTasks (
+							SCSITargetIdentifier 		theT,
+							SCSILogicalUnitNumber		theL,
+							SCSITaggedTaskIdentifier	theQ,
+							SCSIParallelTaskNexus		theNexus )
+{
+	
+	queue_head_t				tasks;
+	SCSIEmulatorRequestBlock *	srb = NULL;
+	
+	queue_init ( &tasks );
+	
+	IOSimpleLockLock ( fStallLock );
+	TakeStalledTasks ( theT, theL, theQ, theNexus, &tasks );
+	IOSimpleLockUnlock ( fStallLock );
+	
+	// The commands were never answered, so they are not completed. The
+	// family reclaims them once the Task Management function completes.
+	while ( !queue_empty ( &tasks ) )
+	{
+		
+		queue_remove_first ( &tasks, srb, SCSIEmulatorRequestBlock *, fQueueChain );
+		ReleaseParallelTask ( srb->fParallelRequest );
+		
+	}
+	
+}
+
+
 //-----------------------------------------------------------------------------
 //	CreateLUN
 //-----------------------------------------------------------------------------
@@ -984,52 +1263,12 @@ AppleSCSIEmulatorAdapter::CreateLUN (
 	if ( targetStruct == NULL )
 	{
 		
-		OSDictionary *	dict = NULL;
-		
-		// Yes. Make sure to add it to the list of target emulators.
-		fTargetEmulators->setObject ( target );
-		
-		dict = OSDictionary::withCapacity ( 3 );
-		if ( dict != NULL )
-		{
-			
-			OSData *	data		= NULL;
-			UInt8		nodeWWN[]	= { 0x60, 0x00, 0x00, 0x00, 0x12, 0x34, 0x56, 0x78 };
-			UInt8		portWWN[]	= { 0x50, 0x00, 0x00, 0x00, 0x12, 0x34, 0x56, 0x78 };
-			
-			nodeWWN[1] = ( targetParameters->targetID >> 16 ) & 0xFF;
-			nodeWWN[2] = ( targetParameters->targetID >>  8 ) & 0xFF;
-			nodeWWN[3] = ( targetParameters->targetID >>  0 ) & 0xFF;
-			
-			data = OSData::withBytes ( nodeWWN, sizeof ( nodeWWN ) );
-			if ( data != NULL )
-			{
-				dict->setObject ( kIOPropertyFibreChannelNodeWorldWideNameKey, data );
-				data->release ( );
-				data = NULL;
-				
-			}
-			
-			data = OSData::withBytes ( portWWN, sizeof ( portWWN ) );
-			if ( data != NULL )
-			{
-				dict->setObject ( kIOPropertyFibreChannelPortWorldWideNameKey, data );
-				data->release ( );
-				data = NULL;
-				
-			}
-			
-		}
-		
-		// Last thing to do is allocate the target device.
-		result = CreateTargetForID ( targetParameters->targetID, dict );
+		// Yes. Attach it to all the ports.
+		result = ShareTargetEmulator ( target );
 		
 		target->release ( );
 		target = NULL;
 		
-		dict->release ( );
-		dict = NULL;
-		
 	}
 	
 	if ( result == true )
@@ -1087,31 +1326,44 @@ AppleSCSIEmulatorAdapter::DestroyTarget (
 	SCSITargetIdentifier targetID )
 {
 	
-	int							index		= 0;
-	int							count		= 0;
-	AppleSCSITargetEmulator *	emulator	= NULL;
+	OSIterator *				iterator		= NULL;
+	AppleSCSIEmulatorAdapter *	peer			= NULL;
+	AdapterTargetStruct *		targetStruct	= NULL;
+	AdapterTargetStruct *		peerStruct		= NULL;
 	
 	ERROR_LOG ( ( "AppleSCSIEmulatorAdapter::DestroyTarget, targetID = %qd\n", targetID ) );
 	
-	DestroyTargetForID ( targetID );
+	targetStruct = ( AdapterTargetStruct * ) GetHBATargetDataPointer ( targetID );
+	require_nonzero ( targetStruct, ErrorExit );
 	
-	// Release the emulator.
-	count = fTargetEmulators->getCount ( );
-	for ( index = 0; index < count; index++ )
+	// Remove the Target from the other ports which share its emulator.
+	iterator = getMatchingServices ( serviceMatching ( "AppleSCSIEmulatorAdapter" ) );
+	if ( iterator != NULL )
 	{
 		
-		emulator = OSDynamicCast ( AppleSCSITargetEmulator, fTargetEmulators->getObject ( index ) );
-		
-		if ( emulator->GetTargetID ( ) == targetID )
+		while ( ( peer = OSDynamicCast ( AppleSCSIEmulatorAdapter, iterator->getNextObject ( ) ) ) != NULL )
 		{
 			
-			fTargetEmulators->removeObject ( index );
-			break;
+			if ( peer == this )
+			{
+				continue;
+			}
+			
+			peerStruct = ( AdapterTargetStruct * ) peer->GetHBATargetDataPointer ( targetID );
+			if ( ( peerStruct != NULL ) && ( peerStruct->emulator == targetStruct->emulator ) )
+			{
+				peer->DetachTargetEmulator ( targetID );
+			}
 			
 		}
 		
+		iterator->release ( );
+		iterator = NULL;
+		
 	}
 	
+	DetachTargetEmulator ( targetID );
+	
 	return kIOReturnSuccess;
 	
 	
@@ -1123,6 +1375,579 @@ ErrorExit:
 }
 
 
+//-----------------------------------------------------------------------------
+//	SetPortStatus
+//-----------------------------------------------------------------------------
+
+IOReturn
+AppleSCSIEmulatorAdapter::SetPortStatus (
+	SCSIPortStatus newStatus )
+{
+	
+	ERROR_LOG ( ( "AppleSCSIEmulatorAdapter::SetPortStatus, port = %u, newStatus = %u\n", ( unsigned int ) fPort, newStatus ) );
+	
+	require ( ( newStatus <= kSCSIPort_StatusFailure ), ErrorExit );
+	
+	fPortOnline = ( newStatus == kSCSIPort_StatusOnline );
+	NotifyClientsOfPortStatusChange ( newStatus );
+	
+	return kIOReturnSuccess;
+	
+	
+ErrorExit:
+	
+	
+	return kIOReturnBadArgument;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	SetTargetStalled
+//-----------------------------------------------------------------------------
+
+IOReturn
+AppleSCSIEmulatorAdapter::SetTargetStalled (
+	SCSITargetIdentifier	targetID,
+	bool					stalled )
+{
+	
+	AdapterTargetStruct *		targetStruct	= NULL;
+	SCSIEmulatorRequestBlock *	srb				= NULL;
+	queue_head_t				stalledTasks;
+	queue_head_t				completionQueue;
+	
+	ERROR_LOG ( ( "AppleSCSIEmulatorAdapter::SetTargetStalled, targetID = %qd, stalled = %d\n", targetID, stalled ) );
+	
+	targetStruct = ( AdapterTargetStruct * ) GetHBATargetDataPointer ( targetID );
+	require_nonzero ( targetStruct, ErrorExit );
+	
+	queue_init ( &stalledTasks );
+	queue_init ( &completionQueue );
+	
+	// While a Target is stalled, it does not answer any command. That lets
+	// the commands time out, so the family's recovery and the Task
+	// Management functions can be exercised.
+	IOSimpleLockLock ( fStallLock );
+	
+	targetStruct->stalled = stalled;
+	if ( stalled == false )
+	{
+		TakeStalledTasks ( targetID, 0, 0, kSCSIParallelTaskNexus_I_T, &stalledTasks );
+	}
+	
+	IOSimpleLockUnlock ( fStallLock );
+	
+	// The Target answers the commands it was holding now.
+	while ( !queue_empty ( &stalledTasks ) )
+	{
+		
+		queue_remove_first ( &stalledTasks, srb, SCSIEmulatorRequestBlock *, fQueueChain );
+		RunParallelTask ( srb->fParallelRequest, &completionQueue );
+		
+	}
+	
+	fEventSource->AddItemsToQueue ( &completionQueue );
+	
+	return kIOReturnSuccess;
+	
+	
+ErrorExit:
+	
+	
+	return kIOReturnBadArgument;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	SetSuspended
+//-----------------------------------------------------------------------------
+
+IOReturn
+AppleSCSIEmulatorAdapter::SetSuspended ( bool suspended )
+{
+	
+	ERROR_LOG ( ( "AppleSCSIEmulatorAdapter::SetSuspended, port = %u, suspended = %d\n", ( unsigned int ) fPort, suspended ) );
+	
+	// While services are suspended, the family holds the commands sent to
+	// the port instead of failing them, as it would for an HBA whose
+	// firmware is being reset. Resuming sends the held commands in the
+	// order they were submitted. Those which found the holding queue full
+	// or were held past its timeout have failed in the meantime.
+	if ( suspended == true )
+	{
+		SuspendServices ( );
+	}
+	
+	else
+	{
+		ResumeServices ( );
+	}
+	
+	return kIOReturnSuccess;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	ApplyTopology
+//-----------------------------------------------------------------------------
+
+IOReturn
+AppleSCSIEmulatorAdapter::ApplyTopology (
+	EmulatorTopologyParamsStruct *	params,
+	task_t							task )
+{
+	
+	IOReturn						status			= kIOReturnBadArgument;
+	IOReturn						entryStatus		= kIOReturnSuccess;
+	IOMemoryDescriptor *			entryBuffer		= NULL;
+	IOMemoryDescriptor *			templateBuffer	= NULL;
+	EmulatorTopologyEntryStruct *	entries			= NULL;
+	OSArray *						created			= NULL;
+	OSArray *						changed			= NULL;
+	UInt32							entriesSize		= 0;
+	UInt32							index			= 0;
+	
+	ERROR_LOG ( ( "AppleSCSIEmulatorAdapter::ApplyTopology, entryCount = %u\n", ( unsigned int ) params->entryCount ) );
+	
+	require ( ( params->entryCount > 0 ), ErrorExit );
+	require ( ( params->entryCount <= kMaxTopologyEntryCount ), ErrorExit );
+	require ( ( params->inquiryDataOffset <= params->templateDataLength ), ErrorExit );
+	require ( ( params->inquiryDataLength <= params->templateDataLength - params->inquiryDataOffset ), ErrorExit );
+	require ( ( params->inquiryPage00DataOffset <= params->templateDataLength ), ErrorExit );
+	require ( ( params->inquiryPage00DataLength <= params->templateDataLength - params->inquiryPage00DataOffset ), ErrorExit );
+	
+	// Copy in the entries.
+	entriesSize = params->entryCount * sizeof ( EmulatorTopologyEntryStruct );
+	entries = ( EmulatorTopologyEntryStruct * ) IOMalloc ( entriesSize );
+	require_nonzero_action ( entries, ErrorExit, status = kIOReturnNoMemory );
+	
+	entryBuffer = IOMemoryDescriptor::withAddressRange ( params->entries, entriesSize, kIODirectionOut, task );
+	require_nonzero_action ( entryBuffer, FreeEntries, status = kIOReturnNoMemory );
+	
+	status = entryBuffer->prepare ( );
+	require_success ( status, ReleaseEntryBuffer );
+	
+	entryBuffer->readBytes ( 0, entries, entriesSize );
+	entryBuffer->complete ( );
+	
+	// Map the template buffer once, for all the new LUNs.
+	templateBuffer = IOMemoryDescriptor::withAddressRange ( params->templateData, params->templateDataLength, kIODirectionOut, task );
+	require_nonzero_action ( templateBuffer, ReleaseEntryBuffer, status = kIOReturnNoMemory );
+	
+	status = templateBuffer->prepare ( );
+	require_success ( status, ReleaseTemplateBuffer );
+	
+	created = OSArray::withCapacity ( 16 );
+	require_nonzero_action ( created, CompleteTemplateBuffer, status = kIOReturnNoMemory );
+	
+	changed = OSArray::withCapacity ( 16 );
+	require_nonzero_action ( changed, ReleaseCreated, status = kIOReturnNoMemory );
+	
+	// Apply all the entries, and report the first failure.
+	for ( index = 0; index < params->entryCount; index++ )
+	{
+		
+		entryStatus = ApplyTopologyEntry ( &entries[index], params, templateBuffer, created, changed );
+		if ( ( entryStatus != kIOReturnSuccess ) && ( status == kIOReturnSuccess ) )
+		{
+			status = entryStatus;
+		}
+		
+	}
+	
+	// The new Targets have all their LUNs now, so attach them.
+	for ( index = 0; index < created->getCount ( ); index++ )
+	{
+		
+		if ( ShareTargetEmulator ( ( AppleSCSITargetEmulator * ) created->getObject ( index ) ) == false )
+		{
+			status = kIOReturnError;
+		}
+		
+	}
+	
+	// Let each Target report its inventory change once.
+	for ( index = 0; index < changed->getCount ( ); index++ )
+	{
+		( ( AppleSCSITargetEmulator * ) changed->getObject ( index ) )->EndInventoryChange ( );
+	}
+	
+	changed->release ( );
+	changed = NULL;
+	
+	
+ReleaseCreated:
+	
+	
+	created->release ( );
+	created = NULL;
+	
+	
+CompleteTemplateBuffer:
+	
+	
+	templateBuffer->complete ( );
+	
+	
+ReleaseTemplateBuffer:
+	
+	
+	templateBuffer->release ( );
+	templateBuffer = NULL;
+	
+	
+ReleaseEntryBuffer:
+	
+	
+	entryBuffer->release ( );
+	entryBuffer = NULL;
+	
+	
+FreeEntries:
+	
+	
+	IOFree ( entries, entriesSize );
+	entries = NULL;
+	
+	
+ErrorExit:
+	
+	
+	return status;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	ApplyTopologyEntry
+//-----------------------------------------------------------------------------
+
+IOReturn
+AppleSCSIEmulatorAdapter::ApplyTopologyEntry (
+	EmulatorTopologyEntryStruct *	entry,
+	EmulatorTopologyParamsStruct *	params,
+	IOMemoryDescriptor *			templateBuffer,
+	OSArray *						created,
+	OSArray *						changed )
+{
+	
+	IOReturn					status					= kIOReturnBadArgument;
+	AppleSCSITargetEmulator *	target					= NULL;
+	AdapterTargetStruct *		targetStruct			= NULL;
+	IOMemoryDescriptor *		inquiryBuffer			= NULL;
+	IOMemoryDescriptor *		inquiryPage00Buffer		= NULL;
+	IOMemoryDescriptor *		inquiryPage80Buffer		= NULL;
+	IOMemoryDescriptor *		inquiryPage83Buffer		= NULL;
+	UInt32						index					= 0;
+	bool						result					= false;
+	
+	require ( ( entry->targetID != kInitiatorID ), ErrorExit );
+	require ( ( entry->targetID < kMaxTargetID ), ErrorExit );
+	
+	// Find the Target, which may have been created earlier in this batch.
+	for ( index = 0; index < created->getCount ( ); index++ )
+	{
+		
+		if ( ( ( AppleSCSITargetEmulator * ) created->getObject ( index ) )->GetTargetID ( ) == entry->targetID )
+		{
+			
+			target = ( AppleSCSITargetEmulator * ) created->getObject ( index );
+			break;
+			
+		}
+		
+	}
+	
+	if ( target == NULL )
+	{
+		
+		targetStruct = ( AdapterTargetStruct * ) GetHBATargetDataPointer ( entry->targetID );
+		if ( targetStruct != NULL )
+		{
+			target = targetStruct->emulator;
+		}
+		
+	}
+	
+	if ( entry->operation == kEmulatorTopologyDestroyTarget )
+	{
+		
+		// A Target which isn't attached yet is simply dropped.
+		if ( ( target != NULL ) && ( targetStruct == NULL ) )
+		{
+			
+			created->removeObject ( index );
+			status = kIOReturnSuccess;
+			
+		}
+		
+		else
+		{
+			status = DestroyTarget ( entry->targetID );
+		}
+		
+		goto ErrorExit;
+		
+	}
+	
+	if ( target == NULL )
+	{
+		
+		// Only a new LUN can create the Target.
+		require ( ( entry->operation == kEmulatorTopologyCreateLUN ), ErrorExit );
+		
+		target = AppleSCSITargetEmulator::Create ( entry->targetID );
+		require_nonzero_action ( target, ErrorExit, status = kIOReturnNoResources );
+		
+		created->setObject ( target );
+		target->release ( );
+		
+	}
+	
+	// Hold the Target's inventory change notification until the whole batch
+	// is done.
+	if ( changed->getNextIndexOfObject ( target, 0 ) == ( unsigned int ) -1 )
+	{
+		
+		target->BeginInventoryChange ( );
+		changed->setObject ( target );
+		
+	}
+	
+	if ( entry->operation == kEmulatorTopologyDestroyLUN )
+	{
+		
+		target->RemoveLogicalUnit ( entry->logicalUnit );
+		status = kIOReturnSuccess;
+		goto ErrorExit;
+		
+	}
+	
+	require ( ( entry->operation == kEmulatorTopologyCreateLUN ), ErrorExit );
+	require ( ( entry->inquiryPage80Offset <= params->templateDataLength ), ErrorExit );
+	require ( ( params->inquiryPage80DataLength <= params->templateDataLength - entry->inquiryPage80Offset ), ErrorExit );
+	require ( ( entry->inquiryPage83Offset <= params->templateDataLength ), ErrorExit );
+	require ( ( params->inquiryPage83DataLength <= params->templateDataLength - entry->inquiryPage83Offset ), ErrorExit );
+	
+	// The LUN copies the data, so it can point straight into the template.
+	inquiryBuffer = IOSubMemoryDescriptor::withSubRange (
+		templateBuffer,
+		params->inquiryDataOffset,
+		params->inquiryDataLength,
+		kIODirectionOut );
+	
+	inquiryPage00Buffer = IOSubMemoryDescriptor::withSubRange (
+		templateBuffer,
+		params->inquiryPage00DataOffset,
+		params->inquiryPage00DataLength,
+		kIODirectionOut );
+	
+	inquiryPage80Buffer = IOSubMemoryDescriptor::withSubRange (
+		templateBuffer,
+		entry->inquiryPage80Offset,
+		params->inquiryPage80DataLength,
+		kIODirectionOut );
+	
+	inquiryPage83Buffer = IOSubMemoryDescriptor::withSubRange (
+		templateBuffer,
+		entry->inquiryPage83Offset,
+		params->inquiryPage83DataLength,
+		kIODirectionOut );
+	
+	if ( ( inquiryBuffer != NULL ) && ( inquiryPage00Buffer != NULL ) &&
+		 ( inquiryPage80Buffer != NULL ) && ( inquiryPage83Buffer != NULL ) )
+	{
+		
+		result = target->AddLogicalUnit (
+			entry->logicalUnit,
+			entry->capacity,
+			inquiryBuffer,
+			inquiryPage00Buffer,
+			inquiryPage80Buffer,
+			inquiryPage83Buffer );
+		
+	}
+	
+	status = ( result == true ) ? kIOReturnSuccess : kIOReturnError;
+	
+	if ( inquiryBuffer != NULL )
+	{
+		inquiryBuffer->release ( );
+	}
+	
+	if ( inquiryPage00Buffer != NULL )
+	{
+		inquiryPage00Buffer->release ( );
+	}
+	
+	if ( inquiryPage80Buffer != NULL )
+	{
+		inquiryPage80Buffer->release ( );
+	}
+	
+	if ( inquiryPage83Buffer != NULL )
+	{
+		inquiryPage83Buffer->release ( );
+	}
+	
+	
+ErrorExit:
+	
+	
+	return status;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	ShareTargetEmulator
+//-----------------------------------------------------------------------------
+
+bool
+AppleSCSIEmulatorAdapter::ShareTargetEmulator (
+	AppleSCSITargetEmulator * target )
+{
+	
+	OSIterator *				iterator	= NULL;
+	AppleSCSIEmulatorAdapter *	peer		= NULL;
+	bool						result		= false;
+	
+	// Attach the Target to this port, and to every other port which doesn't
+	// have a Target with this ID yet, so that it can be reached over all
+	// of them.
+	result = AttachTargetEmulator ( target );
+	require ( result, ErrorExit );
+	
+	iterator = getMatchingServices ( serviceMatching ( "AppleSCSIEmulatorAdapter" ) );
+	require_nonzero ( iterator, ErrorExit );
+	
+	while ( ( peer = OSDynamicCast ( AppleSCSIEmulatorAdapter, iterator->getNextObject ( ) ) ) != NULL )
+	{
+		
+		if ( ( peer != this ) && ( peer->GetHBATargetDataPointer ( target->GetTargetID ( ) ) == NULL ) )
+		{
+			peer->AttachTargetEmulator ( target );
+		}
+		
+	}
+	
+	iterator->release ( );
+	iterator = NULL;
+	
+	
+ErrorExit:
+	
+	
+	return result;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	AttachTargetEmulator
+//-----------------------------------------------------------------------------
+
+bool
+AppleSCSIEmulatorAdapter::AttachTargetEmulator (
+	AppleSCSITargetEmulator * target )
+{
+	
+	OSDictionary *			dict		= NULL;
+	SCSITargetIdentifier	targetID	= target->GetTargetID ( );
+	bool					result		= false;
+	
+	// Make sure to add it to the list of target emulators.
+	fTargetEmulators->setObject ( target );
+	
+	dict = OSDictionary::withCapacity ( 3 );
+	if ( dict != NULL )
+	{
+		
+		OSData *	data		= NULL;
+		UInt8		nodeWWN[]	= { 0x60, 0x00, 0x00, 0x00, 0x12, 0x34, 0x56, 0x78 };
+		UInt8		portWWN[]	= { 0x50, 0x00, 0x00, 0x00, 0x12, 0x34, 0x56, 0x78 };
+		
+		nodeWWN[1] = ( targetID >> 16 ) & 0xFF;
+		nodeWWN[2] = ( targetID >>  8 ) & 0xFF;
+		nodeWWN[3] = ( targetID >>  0 ) & 0xFF;
+		
+		// Each port reaches the Target through a port of its own.
+		portWWN[7] += fPort;
+		
+		data = OSData::withBytes ( nodeWWN, sizeof ( nodeWWN ) );
+		if ( data != NULL )
+		{
+			dict->setObject ( kIOPropertyFibreChannelNodeWorldWideNameKey, data );
+			data->release ( );
+			data = NULL;
+			
+		}
+		
+		data = OSData::withBytes ( portWWN, sizeof ( portWWN ) );
+		if ( data != NULL )
+		{
+			dict->setObject ( kIOPropertyFibreChannelPortWorldWideNameKey, data );
+			data->release ( );
+			data = NULL;
+			
+		}
+		
+	}
+	
+	// Last thing to do is allocate the target device.
+	result = CreateTargetForID ( targetID, dict );
+	
+	if ( dict != NULL )
+	{
+		
+		dict->release ( );
+		dict = NULL;
+		
+	}
+	
+	return result;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	DetachTargetEmulator
+//-----------------------------------------------------------------------------
+
+void
+AppleSCSIEmulatorAdapter::DetachTargetEmulator (
+	SCSITargetIdentifier targetID )
+{
+	
+	int							index		= 0;
+	int							count		= 0;
+	AppleSCSITargetEmulator *	emulator	= NULL;
+	
+	DestroyTargetForID ( targetID );
+	
+	// Release the emulator.
+	count = fTargetEmulators->getCount ( );
+	for ( index = 0; index < count; index++ )
+	{
+		
+		emulator = OSDynamicCast ( AppleSCSITargetEmulator, fTargetEmulators->getObject ( index ) );
+		
+		if ( emulator->GetTargetID ( ) == targetID )
+		{
+			
+			fTargetEmulators->removeObject ( index );
+			break;
+			
+		}
+		
+	}
+	
+}
+
+
 //-----------------------------------------------------------------------------
 //	AppleSCSIEmulatorDebugAssert
 //-----------------------------------------------------------------------------
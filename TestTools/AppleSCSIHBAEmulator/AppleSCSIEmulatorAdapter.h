@@ -56,6 +56,7 @@ LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN ADVISED OF THE POSSIBILITY OF SUC
 
 // Forward declarations
 class AppleSCSIEmulatorEventSource;
+class AppleSCSITargetEmulator;
 
 
 //-----------------------------------------------------------------------------
@@ -105,6 +106,10 @@ public:
 	IOReturn	CreateLUN ( EmulatorTargetParamsStruct * targetParameters, task_t task );
 	IOReturn	DestroyLUN ( SCSITargetIdentifier targetID, SCSILogicalUnitNumber logicalUnit );
 	IOReturn	DestroyTarget ( SCSITargetIdentifier targetID );
+	IOReturn	SetPortStatus ( SCSIPortStatus newStatus );
+	IOReturn	SetTargetStalled ( SCSITargetIdentifier targetID, bool stalled );
+	IOReturn	SetSuspended ( bool suspended );
+	IOReturn	ApplyTopology ( EmulatorTopologyParamsStruct * params, task_t task );
 	
 	
 protected:
@@ -119,7 +124,8 @@ protected:
 							SCSITaskStatus					scsiStatus,
 							UInt64							actuallyTransferred,
 							SCSI_Sense_Data *				senseBuffer,
-							UInt8							senseLength );
+							UInt8							senseLength,
+							queue_head_t *					completionQueue = NULL );
 	
 	SCSIInitiatorIdentifier	ReportInitiatorIdentifier ( void );
 	
@@ -148,6 +154,11 @@ protected:
 	SCSIServiceResponse ProcessParallelTask (
 							SCSIParallelTaskIdentifier parallelRequest );
 	
+	void ProcessParallelTasks (
+							SCSIParallelTaskIdentifier	parallelRequests[],
+							SCSIServiceResponse			serviceResponses[],
+							UInt32						count );
+	
 	IOInterruptEventSource * CreateDeviceInterrupt ( 
 											IOInterruptEventSource::Action			action,
 											IOFilterInterruptEventSource::Filter	filter,
@@ -155,9 +166,48 @@ protected:
 	
 private:
 	
+	bool ShareTargetEmulator ( AppleSCSITargetEmulator * target );
+	bool AttachTargetEmulator ( AppleSCSITargetEmulator * target );
+	void DetachTargetEmulator ( SCSITargetIdentifier targetID );
+	
+	IOReturn ApplyTopologyEntry (
+							EmulatorTopologyEntryStruct *	entry,
+							EmulatorTopologyParamsStruct *	params,
+							IOMemoryDescriptor *			templateBuffer,
+							OSArray *						created,
+							OSArray *						changed );
+	
+	void RunParallelTask (
+							SCSIParallelTaskIdentifier	parallelRequest,
+							queue_head_t *				completionQueue );
+	
+	bool StallParallelTask (
+							SCSIParallelTaskIdentifier	parallelRequest );
+	
+	void TakeStalledTasks (
+							SCSITargetIdentifier 		theT,
+							SCSILogicalUnitNumber		theL,
+							SCSITaggedTaskIdentifier	theQ,
+							SCSIParallelTaskNexus		theNexus,
+							queue_head_t *				tasks );
+	
+	void ReleaseStalledTasks (
+							SCSITargetIdentifier 		theT,
+							SCSILogicalUnitNumber		theL,
+							SCSITaggedTaskIdentifier	theQ,
+							SCSIParallelTaskNexus		theNexus );
+	
 	AppleSCSIEmulatorEventSource *	fEventSource;
 	OSArray *						fTargetEmulators;
 	
+	// The port number of this adapter, and whether the port is up.
+	UInt32							fPort;
+	bool							fPortOnline;
+	
+	// The commands of stalled Targets, which have not been answered.
+	IOSimpleLock *					fStallLock;
+	queue_head_t					fStalledTasks;
+	
 };
 
 
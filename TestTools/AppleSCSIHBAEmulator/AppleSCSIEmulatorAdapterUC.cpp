@@ -307,6 +307,57 @@ AppleSCSIEmulatorAdapterUserClient::externalMethod (
 		
 	}
 	
+	else if ( selector == kUserClientApplyTopology )
+	{
+		
+		require ( ( args->structureInputSize == sizeof ( EmulatorTopologyParamsStruct ) ), ErrorExit );
+		require ( ( args->structureOutputSize == 0 ), ErrorExit );
+		
+		STATUS_LOG ( ( "args->structureInputSize = %u\n", args->structureInputSize ) );
+		
+		status = ( ( AppleSCSIEmulatorAdapter * ) fProvider )->ApplyTopology ( ( EmulatorTopologyParamsStruct * ) args->structureInput, fTask );
+		
+	}
+	
+	else if ( selector == kUserClientSetPortStatus )
+	{
+		
+		require ( ( args->scalarInputCount == 1 ), ErrorExit );
+		require ( ( args->scalarOutputCount == 0 ), ErrorExit );
+		
+		STATUS_LOG ( ( "args->scalarInputCount = %u\n", args->scalarInputCount ) );
+		STATUS_LOG ( ( "args->scalarInput[0] = %qd\n", args->scalarInput[0] ) );
+		
+		status = ( ( AppleSCSIEmulatorAdapter * ) fProvider )->SetPortStatus ( ( SCSIPortStatus ) args->scalarInput[0] );
+		
+	}
+	
+	else if ( selector == kUserClientSetTargetStalled )
+	{
+		
+		require ( ( args->scalarInputCount == 2 ), ErrorExit );
+		require ( ( args->scalarOutputCount == 0 ), ErrorExit );
+		
+		STATUS_LOG ( ( "args->scalarInputCount = %u\n", args->scalarInputCount ) );
+		STATUS_LOG ( ( "args->scalarInput[0] = %qd, args->scalarInput[1] = %qd\n", args->scalarInput[0], args->scalarInput[1] ) );
+		
+		status = ( ( AppleSCSIEmulatorAdapter * ) fProvider )->SetTargetStalled ( args->scalarInput[0], ( args->scalarInput[1] != 0 ) );
+		
+	}
+	
+	else if ( selector == kUserClientSetSuspended )
+	{
+		
+		require ( ( args->scalarInputCount == 1 ), ErrorExit );
+		require ( ( args->scalarOutputCount == 0 ), ErrorExit );
+		
+		STATUS_LOG ( ( "args->scalarInputCount = %u\n", args->scalarInputCount ) );
+		STATUS_LOG ( ( "args->scalarInput[0] = %qd\n", args->scalarInput[0] ) );
+		
+		status = ( ( AppleSCSIEmulatorAdapter * ) fProvider )->SetSuspended ( ( args->scalarInput[0] != 0 ) );
+		
+	}
+	
 	
 ErrorExit:
 	
@@ -60,15 +60,28 @@ LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN ADVISED OF THE POSSIBILITY OF SUC
 #define kSCSIEmulatorAdapterUserClientAccessMask	0x1000
 #define kSCSIEmulatorAdapterUserClientConnection	15
 #define kInitiatorID								15
+#define kMaxTopologyEntryCount						( 256 * 16384 )
 
 enum
 {
 	kUserClientCreateLUN		= 0,
 	kUserClientDestroyLUN		= 1,
 	kUserClientDestroyTarget	= 2,
+	kUserClientSetPortStatus	= 3,
+	kUserClientApplyTopology	= 4,
+	kUserClientSetTargetStalled	= 5,
+	kUserClientSetSuspended		= 6,
 	kUserClientMethodCount
 };
 
+// The operations of a topology entry.
+enum
+{
+	kEmulatorTopologyCreateLUN		= 0,
+	kEmulatorTopologyDestroyLUN		= 1,
+	kEmulatorTopologyDestroyTarget	= 2
+};
+
 
 //-----------------------------------------------------------------------------
 //	Structures
@@ -95,6 +108,34 @@ typedef struct EmulatorTargetParamsStruct
 	EmulatorLUNParamsStruct	lun;
 } EmulatorTargetParamsStruct;
 
+// One operation of a topology change. The VPD pages 80h and 83h of a
+// new LUN are at the given offsets in the template buffer.
+typedef struct EmulatorTopologyEntryStruct
+{
+	UInt32					operation;
+	SCSITargetIdentifier	targetID;
+	SCSILogicalUnitNumber	logicalUnit;
+	UInt64					capacity;
+	UInt32					inquiryPage80Offset;
+	UInt32					inquiryPage83Offset;
+} EmulatorTopologyEntryStruct;
+
+// A batch of topology entries. The standard INQUIRY data and VPD page 00h
+// in the template buffer are shared by all the new LUNs.
+typedef struct EmulatorTopologyParamsStruct
+{
+	mach_vm_address_t		entries;
+	UInt32					entryCount;
+	mach_vm_address_t		templateData;
+	UInt32					templateDataLength;
+	UInt32					inquiryDataOffset;
+	UInt32					inquiryDataLength;
+	UInt32					inquiryPage00DataOffset;
+	UInt32					inquiryPage00DataLength;
+	UInt32					inquiryPage80DataLength;
+	UInt32					inquiryPage83DataLength;
+} EmulatorTopologyParamsStruct;
+
 #pragma options align=reset
 
 
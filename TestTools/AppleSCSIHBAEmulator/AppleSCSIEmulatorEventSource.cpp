@@ -138,6 +138,40 @@ AppleSCSIEmulatorEventSource::AddItemToQueue ( SCSIEmulatorRequestBlock * srb )
 }
 
 
+//-----------------------------------------------------------------------------
+//	AddItemsToQueue
+//-----------------------------------------------------------------------------
+
+void
+AppleSCSIEmulatorEventSource::AddItemsToQueue ( queue_head_t * items )
+{
+	
+	SCSIEmulatorRequestBlock *	srb = NULL;
+	
+	if ( queue_empty ( items ) )
+		return;
+	
+	// Take the lock to protect the queue.
+	IOSimpleLockLock ( fLock );
+	
+	// Move all the items to the queue.
+	while ( !queue_empty ( items ) )
+	{
+		
+		queue_remove_first ( items, srb, SCSIEmulatorRequestBlock *, fQueueChain );
+		queue_enter ( &fResponderQueue, srb, SCSIEmulatorRequestBlock *, fQueueChain );
+		
+	}
+	
+	// Drop the lock.
+	IOSimpleLockUnlock ( fLock );
+	
+	// Wakeup the thread once for all of them.
+	signalWorkAvailable ( );
+	
+}
+
+
 //-----------------------------------------------------------------------------
 //	RemoveItemFromQueue
 //-----------------------------------------------------------------------------
@@ -84,6 +84,7 @@ public:
 	
 	bool						Init ( OSObject * owner, Action action );
 	void						AddItemToQueue ( SCSIEmulatorRequestBlock * srb );
+	void						AddItemsToQueue ( queue_head_t * items );
 	SCSIEmulatorRequestBlock *	RemoveItemFromQueue ( void );
 	
 protected:
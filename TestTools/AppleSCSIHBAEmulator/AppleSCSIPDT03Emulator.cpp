@@ -188,10 +188,41 @@ AppleSCSIPDT03Emulator::SendCommand (
 			
 			COMMAND_LOG ( ( "SCSI Command: INQUIRY\n" ) );
 			
-			if ( cdb[1] == 1 )
+			if ( ( cdb[1] == 1 ) && ( cdb[2] == kINQUIRY_Page83_PageCode ) )
+			{
+				
+				UInt8	page[16] = { 0 };
+				
+				COMMAND_LOG ( ( "INQUIRY VPD page 83h requested\n" ) );
+				
+				// Report a single NAA name for the logical unit, made from
+				// the Target ID.
+				page[0]		= kINQUIRY_PERIPHERAL_TYPE_ProcessorSPCDevice;
+				page[1]		= kINQUIRY_Page83_PageCode;
+				page[3]		= sizeof ( page ) - 4;
+				page[4]		= kINQUIRY_Page83_CodeSetBinaryData;
+				page[5]		= kINQUIRY_Page83_AssociationDevice | kINQUIRY_Page83_IdentifierTypeFCNameIdentifier;
+				page[7]		= 8;
+				page[8]		= 0x60;
+				page[9]		= 0x00;
+				page[10]	= 0xA0;
+				page[11]	= 0x40;
+				page[12]	= ( fTargetID >> 24 ) & 0xFF;
+				page[13]	= ( fTargetID >> 16 ) & 0xFF;
+				page[14]	= ( fTargetID >>  8 ) & 0xFF;
+				page[15]	= ( fTargetID >>  0 ) & 0xFF;
+				
+				*dataLen = min ( sizeof ( page ), *dataLen );
+				dataDesc->writeBytes ( 0, page, *dataLen );
+				
+				*scsiStatus = kSCSITaskStatus_GOOD;
+				
+			}
+			
+			else if ( cdb[1] == 1 )
 			{
 								
-				COMMAND_LOG ( ( "INQUIRY VPD requested, PDT03 doesn't support it\n" ) );
+				COMMAND_LOG ( ( "INQUIRY VPD requested, PDT03 doesn't support other pages\n" ) );
 				
 				*scsiStatus = kSCSITaskStatus_CHECK_CONDITION;
 				
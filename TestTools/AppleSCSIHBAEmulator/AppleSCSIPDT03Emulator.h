@@ -72,6 +72,10 @@ public:
 	
 	inline SCSILogicalUnitNumber GetLogicalUnitNumber ( void ) { return 0; }
 	
+	// The Target ID is used to build the logical unit's name, so that all
+	// the ports which share a Target report the same name.
+	inline void SetTargetID ( SCSITargetIdentifier targetID ) { fTargetID = targetID; }
+	
 	int SendCommand ( UInt8 *				cdb,
 					  UInt8					cbdLen,
 					  IOMemoryDescriptor * 	dataDesc,
@@ -83,6 +87,10 @@ public:
 	static SCSI_Sense_Data		sInvalidCommandSenseData;
 	static SCSI_Sense_Data		sInvalidCDBFieldSenseData;
 	
+private:
+	
+	SCSITargetIdentifier	fTargetID;
+	
 };
 
 
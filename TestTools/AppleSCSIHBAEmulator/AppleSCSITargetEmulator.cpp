@@ -108,6 +108,11 @@ CompareLUNs (
 	const OSMetaClassBase * obj2,
 	void * ref );
 
+static void
+GetLUNEntry (
+	AppleSCSILogicalUnitEmulator *		LUN,
+	SCSICmd_REPORT_LUNS_LUN_ENTRY *		entry );
+
 
 //-----------------------------------------------------------------------------
 //	Globals
@@ -242,6 +247,7 @@ AppleSCSITargetEmulator::Init (
 	require_nonzero ( emulator, ReleaseSet );
 	
 	emulator->SetLogicalUnitNumber ( 0 );
+	emulator->SetTargetID ( targetID );
 	fLUNs->setObject ( emulator );
 	emulator->release ( );
 	
@@ -257,6 +263,11 @@ AppleSCSITargetEmulator::Init (
 	fLUNReportBuffer->LUN_LIST_LENGTH = OSSwapHostToBigInt32 ( sizeof ( SCSICmd_REPORT_LUNS_LUN_ENTRY ) );
 	fLUNReportBuffer->LUN[0].FIRST_LEVEL_ADDRESSING = OSSwapHostToBigInt16 ( 0 );
 	
+	fLUNReport = NULL;
+	
+	fInventoryChangeDepth	= 0;
+	fInventoryChangePending	= false;
+	
 	return true;
 	
 	
@@ -300,6 +311,14 @@ AppleSCSITargetEmulator::free ( void )
 		
 	}
 	
+	if ( fLUNReport != NULL )
+	{
+		
+		fLUNReport->release ( );
+		fLUNReport = NULL;
+		
+	}
+	
 	if ( fLUNReportBuffer != NULL )
 	{
 		
@@ -385,6 +404,10 @@ AppleSCSITargetEmulator::AddLogicalUnit (
 		if ( buffer != NULL )
 		{
 			
+			// Carry the list over, the entries are kept in place from now on.
+			bcopy ( fLUNReportBuffer, buffer, fLUNDataAvailable );
+			bzero ( ( UInt8 * ) buffer + fLUNDataAvailable, bufferSize - fLUNDataAvailable );
+			
 			// Free the old buffer.
 			IOFree ( fLUNReportBuffer, fLUNReportBufferSize );
 			
@@ -415,11 +438,9 @@ AppleSCSITargetEmulator::AddLogicalUnit (
 		
 	}
 	
-	// Add this LUN emulator to the set.
+	// Add this LUN emulator to the set, and its entry to the list.
 	fLUNs->setObject ( emulator );
-	
-	// Rebuild the list.
-	RebuildListOfLUNs ( );
+	InsertLUNEntry ( emulator );
 	
 	if ( fState & kTargetStateChangeActiveWaitMask )
 	{
@@ -488,6 +509,8 @@ AppleSCSITargetEmulator::RemoveLogicalUnit (
 		if ( LUN->GetLogicalUnitNumber ( ) == logicalUnitNumber )
 		{
 			
+			// Remove the entry first, the set holds the last reference.
+			RemoveLUNEntry ( LUN );
 			fLUNs->removeObject ( LUN );
 			break;
 			
@@ -495,82 +518,247 @@ AppleSCSITargetEmulator::RemoveLogicalUnit (
 		
 	}
 	
-	// Rebuild the list.
-	RebuildListOfLUNs ( );
-	
 	IOLockUnlock ( fLock );
 	
 }
 
 
 //-----------------------------------------------------------------------------
-//	RebuildListOfLUNs
+//	InsertLUNEntry
 //-----------------------------------------------------------------------------
-// MUST BE CALLED WITH fLock HELD.
+// MUST BE CALLED WITH fLock HELD. The buffer must have room for the entry.
 
 void
-AppleSCSITargetEmulator::RebuildListOfLUNs ( void )
+AppleSCSITargetEmulator::InsertLUNEntry (
+	AppleSCSILogicalUnitEmulator *	LUN )
 {
 	
-	UInt32	index		= 0;
-	UInt32	count 		= 0;
-	UInt32	bufferSize 	= 0;
-
-	STATUS_LOG ( ( "AppleSCSITargetEmulator::RebuildListOfLUNs\n" ) );
+	SCSICmd_REPORT_LUNS_LUN_ENTRY	entry	= { 0 };
+	UInt32							index	= 0;
+	UInt32							count	= 0;
+	bool							found	= false;
 	
-	// Get the count of emulators (including this new one).
-	count = fLUNs->getCount ( );
+	GetLUNEntry ( LUN, &entry );
 	
-	// Set the bufferSize.
-	bufferSize = count * sizeof ( SCSICmd_REPORT_LUNS_LUN_ENTRY );
+	// The entries are kept sorted, so only the ones after the new entry
+	// have to move.
+	index = FindLUNEntry ( &entry, &found );
+	require_quiet ( ( found == false ), ErrorExit );
 	
-	// Zero the buffer.
-	bzero ( fLUNReportBuffer, fLUNReportBufferSize );
+	count = ( fLUNDataAvailable - kREPORT_LUNS_HeaderSize ) / sizeof ( SCSICmd_REPORT_LUNS_LUN_ENTRY );
 	
-	// Repopulate the buffer with correct LUN data.	
-	fLUNReportBuffer->LUN_LIST_LENGTH = OSSwapHostToBigInt32 ( bufferSize );
+	memmove ( &fLUNReportBuffer->LUN[index + 1],
+			  &fLUNReportBuffer->LUN[index],
+			  ( count - index ) * sizeof ( SCSICmd_REPORT_LUNS_LUN_ENTRY ) );
+	
+	fLUNReportBuffer->LUN[index] = entry;
+	
+	fLUNDataAvailable += sizeof ( SCSICmd_REPORT_LUNS_LUN_ENTRY );
+	fLUNReportBuffer->LUN_LIST_LENGTH = OSSwapHostToBigInt32 ( fLUNDataAvailable - kREPORT_LUNS_HeaderSize );
+	
+	
+ErrorExit:
+	
+	
+	if ( fLUNReport != NULL )
+	{
+		
+		fLUNReport->release ( );
+		fLUNReport = NULL;
+		
+	}
+	
+	if ( fInventoryChangeDepth == 0 )
+	{
+		fLUNInventoryChanged = true;
+	}
+	
+	else
+	{
+		fInventoryChangePending = true;
+	}
+	
+}
 
-#if USE_LUN_BYTES
 
-	// Repopulate the buffer with correct LUN inventory.
-	for ( index = 0; index < count; index++ )
+//-----------------------------------------------------------------------------
+//	RemoveLUNEntry
+//-----------------------------------------------------------------------------
+// MUST BE CALLED WITH fLock HELD.
+
+void
+AppleSCSITargetEmulator::RemoveLUNEntry (
+	AppleSCSILogicalUnitEmulator *	LUN )
+{
+	
+	SCSICmd_REPORT_LUNS_LUN_ENTRY	entry	= { 0 };
+	UInt32							index	= 0;
+	UInt32							count	= 0;
+	bool							found	= false;
+	
+	GetLUNEntry ( LUN, &entry );
+	
+	index = FindLUNEntry ( &entry, &found );
+	require_quiet ( found, ErrorExit );
+	
+	count = ( fLUNDataAvailable - kREPORT_LUNS_HeaderSize ) / sizeof ( SCSICmd_REPORT_LUNS_LUN_ENTRY );
+	
+	memmove ( &fLUNReportBuffer->LUN[index],
+			  &fLUNReportBuffer->LUN[index + 1],
+			  ( count - index - 1 ) * sizeof ( SCSICmd_REPORT_LUNS_LUN_ENTRY ) );
+	
+	fLUNDataAvailable -= sizeof ( SCSICmd_REPORT_LUNS_LUN_ENTRY );
+	fLUNReportBuffer->LUN_LIST_LENGTH = OSSwapHostToBigInt32 ( fLUNDataAvailable - kREPORT_LUNS_HeaderSize );
+	
+	bzero ( ( UInt8 * ) fLUNReportBuffer + fLUNDataAvailable, sizeof ( SCSICmd_REPORT_LUNS_LUN_ENTRY ) );
+	
+	
+ErrorExit:
+	
+	
+	if ( fLUNReport != NULL )
 	{
 		
-		SCSILogicalUnitBytes			logicalUnitBytes	= { 0 };
-		AppleSCSILogicalUnitEmulator *	LUN					= NULL;
+		fLUNReport->release ( );
+		fLUNReport = NULL;
 		
-		LUN = ( AppleSCSILogicalUnitEmulator * ) fLUNs->getObject ( index );
-		LUN->GetLogicalUnitBytes ( &logicalUnitBytes );
-		
-		bcopy ( logicalUnitBytes, &fLUNReportBuffer->LUN[index], sizeof ( SCSILogicalUnitBytes ) );
+	}
+	
+	if ( fInventoryChangeDepth == 0 )
+	{
+		fLUNInventoryChanged = true;
+	}
+	
+	else
+	{
+		fInventoryChangePending = true;
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	BeginInventoryChange
+//-----------------------------------------------------------------------------
+
+void
+AppleSCSITargetEmulator::BeginInventoryChange ( void )
+{
+	
+	IOLockLock ( fLock );
+	fInventoryChangeDepth++;
+	IOLockUnlock ( fLock );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	EndInventoryChange
+//-----------------------------------------------------------------------------
+
+void
+AppleSCSITargetEmulator::EndInventoryChange ( void )
+{
+	
+	IOLockLock ( fLock );
+	
+	fInventoryChangeDepth--;
+	
+	if ( ( fInventoryChangeDepth == 0 ) && ( fInventoryChangePending == true ) )
+	{
 		
-		STATUS_LOG ( ( "logicalUnitBytes = 0x%02x 0x%02x, Data = 0x%04x\n",
-						logicalUnitBytes[0], logicalUnitBytes[1],
-						fLUNReportBuffer->LUN[index].FIRST_LEVEL_ADDRESSING ) );
+		fInventoryChangePending	= false;
+		fLUNInventoryChanged	= true;
 		
 	}
+	
+	IOLockUnlock ( fLock );
+	
+}
 
-#else
+
+//-----------------------------------------------------------------------------
+//	FindLUNEntry
+//-----------------------------------------------------------------------------
+// MUST BE CALLED WITH fLock HELD. Returns the index of the entry, or the
+// index at which it would be inserted if it isn't in the list.
+
+UInt32
+AppleSCSITargetEmulator::FindLUNEntry (
+	SCSICmd_REPORT_LUNS_LUN_ENTRY *	entry,
+	bool *							found )
+{
 	
-	// Repopulate the buffer with correct LUN inventory.
-	for ( index = 0; index < count; index++ )
+	UInt32	low		= 0;
+	UInt32	high	= 0;
+	UInt32	middle	= 0;
+	int		result	= 0;
+	
+	high = ( fLUNDataAvailable - kREPORT_LUNS_HeaderSize ) / sizeof ( SCSICmd_REPORT_LUNS_LUN_ENTRY );
+	
+	*found = false;
+	
+	// The entries are in the byte order of their LUN addresses.
+	while ( low < high )
 	{
 		
-		SCSILogicalUnitNumber			logicalUnit	= 0;
-		AppleSCSILogicalUnitEmulator *	LUN			= NULL;
+		middle = low + ( ( high - low ) >> 1 );
+		result = memcmp ( &fLUNReportBuffer->LUN[middle], entry, sizeof ( SCSICmd_REPORT_LUNS_LUN_ENTRY ) );
 		
-		LUN = ( AppleSCSILogicalUnitEmulator * ) fLUNs->getObject ( index );
-		logicalUnit = LUN->GetLogicalUnitNumber ( );
+		if ( result == 0 )
+		{
+			
+			*found = true;
+			return middle;
+			
+		}
 		
-		fLUNReportBuffer->LUN[index].FIRST_LEVEL_ADDRESSING = OSSwapHostToBigInt16 ( logicalUnit );
+		if ( result < 0 )
+		{
+			low = middle + 1;
+		}
+		
+		else
+		{
+			high = middle;
+		}
 		
 	}
+	
+	return low;
+	
+}
 
-#endif	/* USE_LUN_BYTES */
+
+//-----------------------------------------------------------------------------
+//	CopyLUNReport
+//-----------------------------------------------------------------------------
+// Returns the current REPORT LUNS data, retained, or NULL.
+
+OSData *
+AppleSCSITargetEmulator::CopyLUNReport ( void )
+{
 	
-	fLUNDataAvailable = bufferSize + kREPORT_LUNS_HeaderSize;
+	OSData *	report = NULL;
 	
-	fLUNInventoryChanged = true;
+	IOLockLock ( fLock );
+	
+	// Make a new snapshot only when the inventory changed since the last
+	// one. Commands which already hold the old one keep using it.
+	if ( fLUNReport == NULL )
+	{
+		fLUNReport = OSData::withBytes ( fLUNReportBuffer, fLUNDataAvailable );
+	}
+	
+	report = fLUNReport;
+	if ( report != NULL )
+	{
+		report->retain ( );
+	}
+	
+	IOLockUnlock ( fLock );
+	
+	return report;
 	
 }
 
@@ -631,11 +819,14 @@ AppleSCSITargetEmulator::SendCommand (
 			
 			COMMAND_LOG ( ( "REPORT_LUNS requested = %qd\n", *dataLen ) );
 			
-			if ( fLUNReportBuffer != NULL )
+			OSData *	report = CopyLUNReport ( );
+			
+			if ( report != NULL )
 			{
 				
-				*dataLen = min ( fLUNDataAvailable, *dataLen );
-				dataDesc->writeBytes ( 0, fLUNReportBuffer, *dataLen );
+				*dataLen = min ( report->getLength ( ), *dataLen );
+				dataDesc->writeBytes ( 0, report->getBytesNoCopy ( ), *dataLen );
+				report->release ( );
 				
 				COMMAND_LOG ( ( "REPORT_LUNS realized = %qd\n", *dataLen ) );
 				
@@ -807,11 +998,14 @@ AppleSCSITargetEmulator::SendCommand (
 			
 			COMMAND_LOG ( ( "REPORT_LUNS requested = %qd\n", *dataLen ) );
 			
-			if ( fLUNReportBuffer != NULL )
+			OSData *	report = CopyLUNReport ( );
+			
+			if ( report != NULL )
 			{
 				
-				*dataLen = min ( fLUNDataAvailable, *dataLen );
-				dataDesc->writeBytes ( 0, fLUNReportBuffer, *dataLen );
+				*dataLen = min ( report->getLength ( ), *dataLen );
+				dataDesc->writeBytes ( 0, report->getBytesNoCopy ( ), *dataLen );
+				report->release ( );
 				
 				COMMAND_LOG ( ( "REPORT_LUNS realized = %qd\n", *dataLen ) );
 				
@@ -925,6 +1119,34 @@ AppleSCSITargetEmulator::SendCommand (
 #endif /* USE_LUN_BYTES */
 
 
+//-----------------------------------------------------------------------------
+//	GetLUNEntry
+//-----------------------------------------------------------------------------
+
+static void
+GetLUNEntry (
+	AppleSCSILogicalUnitEmulator *		LUN,
+	SCSICmd_REPORT_LUNS_LUN_ENTRY *		entry )
+{
+	
+	bzero ( entry, sizeof ( SCSICmd_REPORT_LUNS_LUN_ENTRY ) );
+	
+#if USE_LUN_BYTES
+	
+	SCSILogicalUnitBytes	logicalUnitBytes = { 0 };
+	
+	LUN->GetLogicalUnitBytes ( &logicalUnitBytes );
+	bcopy ( logicalUnitBytes, entry, sizeof ( SCSILogicalUnitBytes ) );
+	
+#else
+	
+	entry->FIRST_LEVEL_ADDRESSING = OSSwapHostToBigInt16 ( LUN->GetLogicalUnitNumber ( ) );
+	
+#endif	/* USE_LUN_BYTES */
+	
+}
+
+
 //-----------------------------------------------------------------------------
 //	CompareLUNs
 //-----------------------------------------------------------------------------
@@ -51,11 +51,15 @@ LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN ADVISED OF THE POSSIBILITY OF SUC
 #include <IOKit/IOMemoryDescriptor.h>
 #include <IOKit/scsi/SCSITask.h>
 #include <libkern/c++/OSArray.h>
+#include <libkern/c++/OSData.h>
 #include <IOKit/IOLocks.h>
 #include <IOKit/scsi/SCSICmds_REQUEST_SENSE_Defs.h>
 #include <IOKit/scsi/SCSICmds_REPORT_LUNS_Definitions.h>
 #include "AppleSCSIEmulatorDefines.h"
 
+// Forward declarations
+class AppleSCSILogicalUnitEmulator;
+
 
 //-----------------------------------------------------------------------------
 //	Constants
@@ -97,7 +101,14 @@ public:
 		IOMemoryDescriptor * 	inquiryPage83Buffer );
 
 	void	RemoveLogicalUnit ( SCSILogicalUnitNumber logicalUnitNumber );
-	void	RebuildListOfLUNs ( void );
+	
+	void	InsertLUNEntry ( AppleSCSILogicalUnitEmulator * LUN );
+	void	RemoveLUNEntry ( AppleSCSILogicalUnitEmulator * LUN );
+	UInt32	FindLUNEntry ( SCSICmd_REPORT_LUNS_LUN_ENTRY * entry, bool * found );
+	OSData *	CopyLUNReport ( void );
+	
+	void	BeginInventoryChange ( void );
+	void	EndInventoryChange ( void );
 	
 	void	free ( void );
 	
@@ -133,11 +144,21 @@ public:
 	SCSICmd_REPORT_LUNS_Header *	fLUNReportBuffer;
 	UInt32							fLUNReportBufferSize;
 	UInt32							fLUNDataAvailable;
+	
+	// The REPORT LUNS data as of the last inventory change. It is never
+	// modified, a change drops it and the next REPORT LUNS makes a new one.
+	OSData *						fLUNReport;
+	
 	OSOrderedSet *					fLUNs;
 	IOLock *						fLock;
 	UInt32							fState;
 	bool							fLUNInventoryChanged;
 	
+	// Changes made between BeginInventoryChange and EndInventoryChange are
+	// reported with a single UNIT ATTENTION.
+	UInt32							fInventoryChangeDepth;
+	bool							fInventoryChangePending;
+	
 };
 
 
@@ -2,6 +2,8 @@
 //	Includes
 //-----------------------------------------------------------------------------
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <getopt.h>
@@ -13,6 +15,7 @@
 #include <IOKit/storage/IOStorageProtocolCharacteristics.h>
 #include <CoreFoundation/CoreFoundation.h>
 #include <IOKit/scsi/SCSITask.h>
+#include <IOKit/scsi/SCSIPort.h>
 #include <IOKit/scsi/SCSICmds_REPORT_LUNS_Definitions.h>
 #include <IOKit/scsi/SCSICommandOperationCodes.h>
 #include <IOKit/scsi/SCSICmds_INQUIRY_Definitions.h>
@@ -91,6 +94,7 @@ DebugAssert ( const char *	componentNameString,
 #define kIOSCSIParallelInterfaceDeviceString	"IOSCSIParallelInterfaceDevice"
 #define kIOSCSITargetDeviceString				"IOSCSITargetDevice"
 #define kIOSCSIHierarchicalLogicalUnitString	"IOSCSIHierarchicalLogicalUnit"
+#define kEmulatorPortKey						"Emulator Port"
 
 //-----------------------------------------------------------------------------
 //	Structures
@@ -143,6 +147,9 @@ typedef struct EmulatorSCSIInquiryPage83
 //	Globals
 //-----------------------------------------------------------------------------
 
+// The port of the emulator to use (see --port).
+static int gPort = 0;
+
 SCSICmd_INQUIRY_StandardData gInquiryData =
 {
 	kINQUIRY_PERIPHERAL_TYPE_DirectAccessSBCDevice,	// PERIPHERAL_DEVICE_TYPE
@@ -247,6 +254,35 @@ static void
 DestroyTarget (
 	SCSITargetIdentifier 	targetID );
 
+static void
+SetPortStatus (
+	SCSIPortStatus			status );
+
+static void
+SetTargetStalled (
+	SCSITargetIdentifier	targetID,
+	boolean_t				stalled );
+
+static void
+SetSuspended (
+	boolean_t				suspended );
+
+static void
+ApplyTopologyFile (
+	const char *			path );
+
+static boolean_t
+ParseByteCount (
+	const char *			string,
+	uint64_t *				byteCount );
+
+static void
+FillLUNPages (
+	SCSILogicalUnitNumber			logicalUnit,
+	boolean_t						unique,
+	EmulatorSCSIInquiryPage80 *		page80,
+	EmulatorSCSIInquiryPage83 *		page83 );
+
 static io_object_t
 GetController ( void );
 
@@ -278,6 +314,10 @@ main ( int argc, const char * argv[] )
 	boolean_t		destroy		= false;
 	boolean_t		inventory	= false;
 	boolean_t		unique		= true;
+	int				portStatus	= -1;
+	int				stall		= -1;
+	int				suspend		= -1;
+	const char *	config		= NULL;
 	int64_t			targetID	= -1;
 	int64_t			lun			= -1;
 	uint64_t		size		= 0;
@@ -293,10 +333,18 @@ main ( int argc, const char * argv[] )
 		{ "destroy",		no_argument,		0, 'd' },
 		{ "help",			no_argument,		0, 'h' },
 		{ "nounique",		no_argument,		0, 'n' },
+		{ "port",			required_argument,	0, 'p' },
+		{ "online",			no_argument,		0, 'o' },
+		{ "offline",		no_argument,		0, 'f' },
+		{ "config",			required_argument,	0, 'g' },
+		{ "stall",			no_argument,		0, 'S' },
+		{ "unstall",		no_argument,		0, 'U' },
+		{ "suspend",		no_argument,		0, 'P' },
+		{ "resume",			no_argument,		0, 'R' },
 		{ 0, 0, 0, 0 }
 	};
 	
-	while ( ( c = getopt_long ( argc, ( char * const * ) argv, "t:l:s:icdhn?", long_options, NULL ) ) != -1 )
+	while ( ( c = getopt_long ( argc, ( char * const * ) argv, "t:l:s:icdhnp:ofg:SUPR?", long_options, NULL ) ) != -1 )
 	{
 		
 		switch ( c )
@@ -333,31 +381,7 @@ main ( int argc, const char * argv[] )
 			case 's':
 			{
 				
-				char *	expr;
-				
-				size = strtoull ( optarg, &expr, 10 );
-				
-				switch ( *expr )
-				{
-					
-					case 'k':
-						size *= 1 << 10;
-						break;
-					
-					case 'm':
-						size *= 1 << 20;
-						break;
-					
-					case 'g':
-						size *= 1 << 30;
-						break;
-					
-					default:
-						break;
-					
-				}
-				
-				if ( size % 512 )
+				if ( ParseByteCount ( optarg, &size ) == false )
 				{
 					PRINT ( ( "Invalid byte count. Must be a multiple of 512 bytes\n" ) );
 					PrintUsage ( );
@@ -418,6 +442,56 @@ main ( int argc, const char * argv[] )
 			}
 			break;
 			
+			case 'p':
+			{
+				
+				gPort = strtoul ( optarg, ( char ** ) NULL, 10 );
+				
+			}
+			break;
+			
+			case 'o':
+			{
+				portStatus = kSCSIPort_StatusOnline;
+			}
+			break;
+			
+			case 'f':
+			{
+				portStatus = kSCSIPort_StatusOffline;
+			}
+			break;
+			
+			case 'g':
+			{
+				config = optarg;
+			}
+			break;
+			
+			case 'S':
+			{
+				stall = true;
+			}
+			break;
+			
+			case 'U':
+			{
+				stall = false;
+			}
+			break;
+			
+			case 'P':
+			{
+				suspend = true;
+			}
+			break;
+			
+			case 'R':
+			{
+				suspend = false;
+			}
+			break;
+			
 			case 'h':
 			default:
 			{
@@ -440,6 +514,46 @@ main ( int argc, const char * argv[] )
 		
 	}
 	
+	if ( config != NULL )
+	{
+		
+		ApplyTopologyFile ( config );
+		exit ( 0 );
+		
+	}
+	
+	if ( portStatus != -1 )
+	{
+		
+		SetPortStatus ( ( SCSIPortStatus ) portStatus );
+		exit ( 0 );
+		
+	}
+	
+	if ( stall != -1 )
+	{
+		
+		if ( targetID == -1 )
+		{
+			
+			PrintUsage ( );
+			exit ( EX_USAGE );
+			
+		}
+		
+		SetTargetStalled ( targetID, stall );
+		exit ( 0 );
+		
+	}
+	
+	if ( suspend != -1 )
+	{
+		
+		SetSuspended ( suspend );
+		exit ( 0 );
+		
+	}
+	
 	if ( create )
 	{
 		
@@ -528,7 +642,6 @@ CreateTargetLUN (
 			size_t							outCount	= 0;
 			EmulatorSCSIInquiryPage80		page80		= gInquiryPage80Data;
 			EmulatorSCSIInquiryPage83		page83		= gInquiryPage83Data;
-			char							serial[32];
 			
 			bzero ( &target, sizeof ( EmulatorTargetParamsStruct ) );
 			bzero ( &lun, sizeof ( EmulatorLUNParamsStruct ) );
@@ -570,48 +683,294 @@ CreateTargetLUN (
 			PRINT ( ( "sizeof ( EmulatorTargetParamsStruct ) = %ld\n", sizeof ( EmulatorTargetParamsStruct ) ) );
 			PRINT ( ( "sizeof ( EmulatorLUNParamsStruct ) = %ld\n", sizeof ( EmulatorLUNParamsStruct ) ) );
 			
-			// Fill in LUN information for page 80.
-			snprintf ( serial, 32, "APPLE Virtual LUN %qd", logicalUnit );
-			bcopy ( serial, ( char * ) &page80.header.PRODUCT_SERIAL_NUMBER, 32 );
+			FillLUNPages ( logicalUnit, unique, &page80, &page83 );
+			
+			IOConnectCallStructMethod (
+				connection,
+				kUserClientCreateLUN,
+				&target,
+				sizeof ( EmulatorTargetParamsStruct ),
+				NULL,
+				&outCount );
+			
+			IOServiceClose ( connection );
+			
+		}
+		
+		IOObjectRelease ( controller );
+		
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		FillLUNPages - Fills in the VPD pages 80h and 83h of a Logical Unit.
+//-----------------------------------------------------------------------------
+
+static void
+FillLUNPages (
+	SCSILogicalUnitNumber			logicalUnit,
+	boolean_t						unique,
+	EmulatorSCSIInquiryPage80 *		page80,
+	EmulatorSCSIInquiryPage83 *		page83 )
+{
+	
+	char	serial[32];
+	
+	// Fill in LUN information for page 80.
+	snprintf ( serial, 32, "APPLE Virtual LUN %qd", logicalUnit );
+	bcopy ( serial, ( char * ) &page80->header.PRODUCT_SERIAL_NUMBER, 32 );
+	
+	if ( unique )
+	{
+		
+		int		fd = -1;
+		char	randomBytes[15];
+		int		amount;
+		
+		// Get some random bytes from /dev/random.
+		fd = open ( "/dev/random", O_RDONLY, 0 );
+		if ( fd == -1 )
+		{
+			
+			PRINT ( ( "Open /dev/random failed\n" ) );
+			exit ( -1 );
+			
+		}
+		
+		amount = read ( fd, randomBytes, sizeof ( randomBytes ) );
+		if ( amount != sizeof ( randomBytes ) )
+		{
+			
+			PRINT ( ( "Reading from /dev/random failed\n" ) );
+			exit ( -1 );
+			
+		}
+		
+		// Make sure that the page 83 data is unique for this LUN.
+		bcopy ( randomBytes, page83->data.descriptor2bytes, sizeof ( page83->data.descriptor2bytes ) );
+		
+		close ( fd );
+		
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		ApplyTopologyFile - Creates and destroys the Targets and Logical
+//		Units listed in a topology file, all in one call. Each line is one of
+//
+//			create <target> <lun> <size> [nounique]
+//			destroy <target> [<lun>]
+//
+//		Blank lines and lines starting with '#' are ignored.
+//-----------------------------------------------------------------------------
+
+static void
+ApplyTopologyFile (
+	const char *			path )
+{
+	
+	FILE *							file			= NULL;
+	EmulatorTopologyEntryStruct *	entries			= NULL;
+	boolean_t *						unique			= NULL;
+	UInt8 *							templateData	= NULL;
+	EmulatorTopologyParamsStruct	params;
+	io_object_t						controller		= IO_OBJECT_NULL;
+	io_connect_t					connection		= IO_OBJECT_NULL;
+	IOReturn						status			= kIOReturnSuccess;
+	UInt32							capacity		= 0;
+	UInt32							count			= 0;
+	UInt32							created			= 0;
+	UInt32							index			= 0;
+	UInt32							offset			= 0;
+	unsigned int					lineNumber		= 0;
+	char							line[256];
+	
+	file = fopen ( path, "r" );
+	if ( file == NULL )
+	{
+		
+		printf ( "Could not open %s\n", path );
+		exit ( EX_NOINPUT );
+		
+	}
+	
+	while ( fgets ( line, sizeof ( line ), file ) != NULL )
+	{
+		
+		char		operation[16]	= { 0 };
+		char		size[32]		= { 0 };
+		char		option[16]		= { 0 };
+		long long	targetID		= -1;
+		long long	lun				= -1;
+		uint64_t	byteCount		= 0;
+		int			fields			= 0;
+		
+		lineNumber++;
+		
+		fields = sscanf ( line, "%15s %lld %lld %31s %15s", operation, &targetID, &lun, size, option );
+		if ( ( fields <= 0 ) || ( operation[0] == '#' ) )
+		{
+			continue;
+		}
+		
+		if ( ( targetID < 0 ) || ( targetID > 255 ) || ( targetID == kInitiatorID ) )
+		{
+			
+			printf ( "%s:%u: Invalid targetID.\n", path, lineNumber );
+			exit ( EX_DATAERR );
 			
-			if ( unique )
+		}
+		
+		if ( count == capacity )
+		{
+			
+			capacity	= ( capacity == 0 ) ? 256 : capacity << 1;
+			entries		= ( EmulatorTopologyEntryStruct * ) realloc ( entries, capacity * sizeof ( EmulatorTopologyEntryStruct ) );
+			unique		= ( boolean_t * ) realloc ( unique, capacity * sizeof ( boolean_t ) );
+			
+			if ( ( entries == NULL ) || ( unique == NULL ) )
 			{
 				
-				int		fd = -1;
-				char	randomBytes[15];
-				int		amount;
-				
-				// Get some random bytes from /dev/random.
-				fd = open ( "/dev/random", O_RDONLY, 0 );
-				if ( fd == -1 )
-				{
-					
-					PRINT ( ( "Open /dev/random failed\n" ) );
-					exit ( -1 );
-					
-				}
-				
-				amount = read ( fd, randomBytes, sizeof ( randomBytes ) );
-				if ( amount != sizeof ( randomBytes ) )
-				{
-					
-					PRINT ( ( "Reading from /dev/random failed\n" ) );
-					exit ( -1 );
-					
-				}
+				printf ( "Out of memory\n" );
+				exit ( EX_OSERR );
 				
-				// Make sure that the page 83 data is unique for this LUN.
-				bcopy ( randomBytes, page83.data.descriptor2bytes, sizeof ( page83.data.descriptor2bytes ) );
+			}
+			
+		}
+		
+		bzero ( &entries[count], sizeof ( EmulatorTopologyEntryStruct ) );
+		entries[count].targetID = targetID;
+		unique[count] = true;
+		
+		if ( ( strcmp ( operation, "create" ) == 0 ) && ( fields >= 4 ) )
+		{
+			
+			if ( ( lun < 1 ) || ( lun > 16383 ) || ( ParseByteCount ( size, &byteCount ) == false ) )
+			{
 				
-				close ( fd );
+				printf ( "%s:%u: Invalid LUN or size.\n", path, lineNumber );
+				exit ( EX_DATAERR );
 				
 			}
 			
-			IOConnectCallStructMethod (
+			entries[count].operation	= kEmulatorTopologyCreateLUN;
+			entries[count].logicalUnit	= lun;
+			entries[count].capacity		= byteCount;
+			unique[count] = ( strcmp ( option, "nounique" ) != 0 );
+			created++;
+			
+		}
+		
+		else if ( ( strcmp ( operation, "destroy" ) == 0 ) && ( fields == 2 ) )
+		{
+			entries[count].operation = kEmulatorTopologyDestroyTarget;
+		}
+		
+		else if ( ( strcmp ( operation, "destroy" ) == 0 ) && ( fields == 3 ) )
+		{
+			
+			entries[count].operation	= kEmulatorTopologyDestroyLUN;
+			entries[count].logicalUnit	= lun;
+			
+		}
+		
+		else
+		{
+			
+			printf ( "%s:%u: Unrecognized line.\n", path, lineNumber );
+			exit ( EX_DATAERR );
+			
+		}
+		
+		count++;
+		
+	}
+	
+	fclose ( file );
+	
+	if ( count == 0 )
+	{
+		return;
+	}
+	
+	// The standard INQUIRY data and page 00h come first, and are shared by
+	// all the new LUNs. Each new LUN's pages 80h and 83h follow.
+	bzero ( &params, sizeof ( params ) );
+	
+	params.inquiryDataOffset		= 0;
+	params.inquiryDataLength		= sizeof ( gInquiryData );
+	params.inquiryPage00DataOffset	= sizeof ( gInquiryData );
+	params.inquiryPage00DataLength	= sizeof ( gInquiryPage00Data );
+	params.inquiryPage80DataLength	= sizeof ( EmulatorSCSIInquiryPage80 );
+	params.inquiryPage83DataLength	= sizeof ( EmulatorSCSIInquiryPage83 );
+	params.templateDataLength		= sizeof ( gInquiryData ) + sizeof ( gInquiryPage00Data ) +
+									  created * ( sizeof ( EmulatorSCSIInquiryPage80 ) + sizeof ( EmulatorSCSIInquiryPage83 ) );
+	
+	templateData = ( UInt8 * ) malloc ( params.templateDataLength );
+	if ( templateData == NULL )
+	{
+		
+		printf ( "Out of memory\n" );
+		exit ( EX_OSERR );
+		
+	}
+	
+	bcopy ( &gInquiryData, templateData + params.inquiryDataOffset, sizeof ( gInquiryData ) );
+	bcopy ( &gInquiryPage00Data, templateData + params.inquiryPage00DataOffset, sizeof ( gInquiryPage00Data ) );
+	
+	offset = params.inquiryPage00DataOffset + params.inquiryPage00DataLength;
+	
+	for ( index = 0; index < count; index++ )
+	{
+		
+		EmulatorSCSIInquiryPage80	page80 = gInquiryPage80Data;
+		EmulatorSCSIInquiryPage83	page83 = gInquiryPage83Data;
+		
+		if ( entries[index].operation != kEmulatorTopologyCreateLUN )
+		{
+			continue;
+		}
+		
+		FillLUNPages ( entries[index].logicalUnit, unique[index], &page80, &page83 );
+		
+		entries[index].inquiryPage80Offset = offset;
+		bcopy ( &page80, templateData + offset, sizeof ( page80 ) );
+		offset += sizeof ( page80 );
+		
+		entries[index].inquiryPage83Offset = offset;
+		bcopy ( &page83, templateData + offset, sizeof ( page83 ) );
+		offset += sizeof ( page83 );
+		
+	}
+	
+	params.entries		= ( mach_vm_address_t ) ( uintptr_t ) entries;
+	params.entryCount	= count;
+	params.templateData	= ( mach_vm_address_t ) ( uintptr_t ) templateData;
+	
+	controller = GetController ( );
+	if ( controller != IO_OBJECT_NULL )
+	{
+		
+		status = IOServiceOpen (
+			controller,
+			mach_task_self ( ),
+			kSCSIEmulatorAdapterUserClientConnection,
+			&connection );
+		
+		if ( status == kIOReturnSuccess )
+		{
+			
+			size_t	outCount = 0;
+			
+			status = IOConnectCallStructMethod (
 				connection,
-				kUserClientCreateLUN,
-				&target,
-				sizeof ( EmulatorTargetParamsStruct ),
+				kUserClientApplyTopology,
+				&params,
+				sizeof ( EmulatorTopologyParamsStruct ),
 				NULL,
 				&outCount );
 			
@@ -619,10 +978,59 @@ CreateTargetLUN (
 			
 		}
 		
+		if ( status != kIOReturnSuccess )
+		{
+			printf ( "Applying %s failed, status = 0x%08x\n", path, status );
+		}
+		
 		IOObjectRelease ( controller );
 		
 	}
 	
+	free ( templateData );
+	free ( unique );
+	free ( entries );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		ParseByteCount - Parses a byte count, with an optional k, m, or g
+//		suffix as with dd. Returns false if it is not a multiple of 512.
+//-----------------------------------------------------------------------------
+
+static boolean_t
+ParseByteCount (
+	const char *			string,
+	uint64_t *				byteCount )
+{
+	
+	char *	expr;
+	
+	*byteCount = strtoull ( string, &expr, 10 );
+	
+	switch ( *expr )
+	{
+		
+		case 'k':
+			*byteCount *= 1 << 10;
+			break;
+		
+		case 'm':
+			*byteCount *= 1 << 20;
+			break;
+		
+		case 'g':
+			*byteCount *= 1 << 30;
+			break;
+		
+		default:
+			break;
+		
+	}
+	
+	return ( ( *byteCount != 0 ) && ( ( *byteCount % 512 ) == 0 ) );
+	
 }
 
 
@@ -735,18 +1143,217 @@ DestroyTarget (
 
 
 //-----------------------------------------------------------------------------
-//		GetController - Gets the controller object.
+//		SetPortStatus - Takes the port up or down.
+//-----------------------------------------------------------------------------
+
+static void
+SetPortStatus (
+	SCSIPortStatus			status )
+{
+	
+	io_object_t		controller = IO_OBJECT_NULL;
+	
+	PRINT ( ( "SetPortStatus, port = %d, status = %d\n", gPort, status ) );
+	
+	controller = GetController ( );
+	if ( controller != IO_OBJECT_NULL )
+	{
+		
+		io_connect_t	connection 	= IO_OBJECT_NULL;
+		IOReturn		result		= kIOReturnSuccess;
+		
+		result = IOServiceOpen (
+			controller,
+			mach_task_self ( ),
+			kSCSIEmulatorAdapterUserClientConnection,
+			&connection );
+		
+		if ( result == kIOReturnSuccess )
+		{
+			
+			uint32_t	outCount = 0;
+			uint64_t	params[1];
+			
+			params[0] = status;
+			
+			IOConnectCallScalarMethod (
+				connection,
+				kUserClientSetPortStatus,
+				( const uint64_t * ) params,
+				1,
+				NULL,
+				&outCount );
+			
+			IOServiceClose ( connection );
+			
+		}
+		
+		IOObjectRelease ( controller );
+		
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		SetTargetStalled - Stops or restarts a target answering commands.
+//-----------------------------------------------------------------------------
+
+static void
+SetTargetStalled (
+	SCSITargetIdentifier	targetID,
+	boolean_t				stalled )
+{
+	
+	io_object_t		controller = IO_OBJECT_NULL;
+	
+	PRINT ( ( "SetTargetStalled, port = %d, targetID = %qd, stalled = %d\n", gPort, targetID, stalled ) );
+	
+	controller = GetController ( );
+	if ( controller != IO_OBJECT_NULL )
+	{
+		
+		io_connect_t	connection 	= IO_OBJECT_NULL;
+		IOReturn		result		= kIOReturnSuccess;
+		
+		result = IOServiceOpen (
+			controller,
+			mach_task_self ( ),
+			kSCSIEmulatorAdapterUserClientConnection,
+			&connection );
+		
+		if ( result == kIOReturnSuccess )
+		{
+			
+			uint32_t	outCount = 0;
+			uint64_t	params[2];
+			
+			params[0] = targetID;
+			params[1] = stalled;
+			
+			IOConnectCallScalarMethod (
+				connection,
+				kUserClientSetTargetStalled,
+				( const uint64_t * ) params,
+				2,
+				NULL,
+				&outCount );
+			
+			IOServiceClose ( connection );
+			
+		}
+		
+		IOObjectRelease ( controller );
+		
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		SetSuspended - Suspends or resumes the services of a port.
+//-----------------------------------------------------------------------------
+
+static void
+SetSuspended (
+	boolean_t				suspended )
+{
+	
+	io_object_t		controller = IO_OBJECT_NULL;
+	
+	PRINT ( ( "SetSuspended, port = %d, suspended = %d\n", gPort, suspended ) );
+	
+	controller = GetController ( );
+	if ( controller != IO_OBJECT_NULL )
+	{
+		
+		io_connect_t	connection 	= IO_OBJECT_NULL;
+		IOReturn		result		= kIOReturnSuccess;
+		
+		result = IOServiceOpen (
+			controller,
+			mach_task_self ( ),
+			kSCSIEmulatorAdapterUserClientConnection,
+			&connection );
+		
+		if ( result == kIOReturnSuccess )
+		{
+			
+			uint32_t	outCount = 0;
+			uint64_t	params[1];
+			
+			params[0] = suspended;
+			
+			IOConnectCallScalarMethod (
+				connection,
+				kUserClientSetSuspended,
+				( const uint64_t * ) params,
+				1,
+				NULL,
+				&outCount );
+			
+			IOServiceClose ( connection );
+			
+		}
+		
+		IOObjectRelease ( controller );
+		
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		GetController - Gets the controller object for the selected port.
 //-----------------------------------------------------------------------------
 
 static io_object_t
 GetController ( void )
 {
 	
-	io_object_t		controller = IO_OBJECT_NULL;
+	io_object_t		controller	= IO_OBJECT_NULL;
+	io_iterator_t	iterator	= IO_OBJECT_NULL;
+	IOReturn		result		= kIOReturnSuccess;
 	
-	controller = IOServiceGetMatchingService (
+	result = IOServiceGetMatchingServices (
 		kIOMasterPortDefault,
-		IOServiceMatching ( kAppleSCSIEmulatorAdapterClassString ) );
+		IOServiceMatching ( kAppleSCSIEmulatorAdapterClassString ),
+		&iterator );
+	
+	if ( result != kIOReturnSuccess )
+	{
+		return IO_OBJECT_NULL;
+	}
+	
+	controller = IOIteratorNext ( iterator );
+	
+	while ( controller != IO_OBJECT_NULL )
+	{
+		
+		CFNumberRef		number	= NULL;
+		int				port	= 0;
+		
+		number = ( CFNumberRef ) IORegistryEntryCreateCFProperty ( controller, CFSTR ( kEmulatorPortKey ), kCFAllocatorDefault, 0 );
+		if ( number != NULL )
+		{
+			
+			CFNumberGetValue ( number, kCFNumberIntType, &port );
+			CFRelease ( number );
+			number = NULL;
+			
+		}
+		
+		if ( port == gPort )
+		{
+			break;
+		}
+		
+		IOObjectRelease ( controller );
+		controller = IOIteratorNext ( iterator );
+		
+	}
+	
+	IOObjectRelease ( iterator );
 	
 	return controller;
 	
@@ -1055,8 +1662,13 @@ static void
 PrintUsage ( void )
 {
 	
-	printf ( "Usage: emulator [--create, -c] [--destroy, -d] [--inventory, -i] [--target, -t] [--lun, -l] [--unique, -u] [--size, -s]\n" );
+	printf ( "Usage: emulator [--create, -c] [--destroy, -d] [--inventory, -i] [--target, -t] [--lun, -l] [--unique, -u] [--size, -s] [--port, -p] [--online, -o] [--offline, -f] [--config, -g] [--stall, -S] [--unstall, -U] [--suspend, -P] [--resume, -R]\n" );
 	printf ( "       --create and --destroy are mutually exclusive\n" );
+	printf ( "       --port selects the emulator port to use, 0 or 1. Targets are created on all the ports.\n" );
+	printf ( "       --online and --offline take the port up or down, to exercise multipath failover.\n" );
+	printf ( "       --stall stops the --target answering commands on the port, so they time out and are recovered with task management functions. --unstall answers them.\n" );
+	printf ( "       --suspend suspends the services of the port. New commands are held by the family, and fail once the holding queue is full or they are held past its timeout. --resume sends the held commands in the order they were submitted. The port's Holding Queue Statistics count the held, expired and refused commands.\n" );
+	printf ( "       --config applies a topology file in one call. Each line is \"create <target> <lun> <size> [nounique]\" or \"destroy <target> [<lun>]\".\n" );
 	printf ( "       --target accepts targetIDs in the rang of [0...14][16...255]. ID 15 is reserved for the initiator.\n" );
 	printf ( "       --lun accepts LUNs in the range of [1...16383] inclusive.\n" );
 	printf ( "       --size can be in bytes, kilobytes, megabytes, or gigabytes, suffix usage similar to dd\n" );
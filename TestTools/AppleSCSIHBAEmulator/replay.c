@@ -0,0 +1,1445 @@
+//-----------------------------------------------------------------------------
+//	Includes
+//-----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sysexits.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+
+#if defined(__APPLE__)
+#include <sys/disk.h>
+#include <mach/mach_time.h>
+#include <IOKit/IOKitLib.h>
+#include <CoreFoundation/CoreFoundation.h>
+#else
+#include <time.h>
+#endif
+
+#include "SCSIParallelTrace.h"
+
+
+//-----------------------------------------------------------------------------
+//	Constants
+//-----------------------------------------------------------------------------
+
+#define kAppleSCSIEmulatorAdapterClassString	"AppleSCSIEmulatorAdapter"
+#define kIOSCSIParallelInterfaceDeviceString	"IOSCSIParallelInterfaceDevice"
+#define kEmulatorPortKey						"Emulator Port"
+#define kIOPropertyIOUnitKey					"IOUnit"
+#define kIOCommandTraceKey						"Command Trace"
+#define kIOCommandTraceDataKey					"Command Trace Data"
+
+#define kMaximumDeviceCount						16
+#define kDefaultThreadCount						32
+#define kMaximumThreadCount						256
+#define kBufferAlignment						4096
+
+// SCSI operation codes which are replayed.
+enum
+{
+	kOpREAD_6				= 0x08,
+	kOpWRITE_6				= 0x0A,
+	kOpREAD_10				= 0x28,
+	kOpWRITE_10				= 0x2A,
+	kOpSYNCHRONIZE_CACHE	= 0x35,
+	kOpREAD_16				= 0x88,
+	kOpWRITE_16				= 0x8A,
+	kOpSYNCHRONIZE_CACHE_16	= 0x91,
+	kOpREAD_12				= 0xA8,
+	kOpWRITE_12				= 0xAA
+};
+
+enum
+{
+	kReplayRead		= 0,
+	kReplayWrite	= 1,
+	kReplaySync		= 2,
+	kReplaySkip		= 3
+};
+
+// The SCSI service response for a completed task (see SCSITask.h).
+#define kServiceResponseTaskComplete			3
+
+
+//-----------------------------------------------------------------------------
+//	Structures
+//-----------------------------------------------------------------------------
+
+typedef struct ReplayDevice
+{
+	bool			anyLUN;
+	uint64_t		logicalUnit;
+	const char *	path;
+	int				fd;
+	uint32_t		blockSize;
+} ReplayDevice;
+
+typedef struct ReplayCommand
+{
+	
+	const SCSIParallelTraceRecord *	record;
+	ReplayDevice *					device;
+	uint32_t						operation;
+	uint64_t						offset;
+	
+	// The results of the replay. Times are in nanoseconds.
+	uint64_t						lateness;
+	uint64_t						latency;
+	bool							failed;
+	
+} ReplayCommand;
+
+
+//-----------------------------------------------------------------------------
+//	Globals
+//-----------------------------------------------------------------------------
+
+static ReplayDevice			gDevices[kMaximumDeviceCount];
+static uint32_t				gDeviceCount	= 0;
+static uint32_t				gBlockSize		= 0;
+static int					gPort			= 0;
+
+static ReplayCommand *		gCommands		= NULL;
+static uint32_t				gCommandCount	= 0;
+static uint64_t				gLargestTransfer = 0;
+
+// The queue of commands handed from the dispatcher to the worker threads.
+static pthread_mutex_t		gQueueLock		= PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		gQueueNotEmpty	= PTHREAD_COND_INITIALIZER;
+static pthread_cond_t		gQueueNotFull	= PTHREAD_COND_INITIALIZER;
+static uint32_t *			gQueue			= NULL;
+static uint32_t				gQueueSize		= 0;
+static uint32_t				gQueueHead		= 0;
+static uint32_t				gQueueCount		= 0;
+static bool					gQueueDone		= false;
+
+#if defined(__APPLE__)
+static mach_timebase_info_data_t	gTimebase;
+#endif
+
+
+//-----------------------------------------------------------------------------
+//		Prototypes
+//-----------------------------------------------------------------------------
+
+static void *
+ReadTrace (
+	const char *			path,
+	SCSIParallelTraceHeader **	header );
+
+static bool
+ParseDevice ( const char * string );
+
+static bool
+OpenDevices ( uint32_t operationMask );
+
+static ReplayDevice *
+FindDevice ( uint64_t logicalUnit );
+
+static uint32_t
+DecodeCommand (
+	const SCSIParallelTraceRecord *	record,
+	uint64_t *						logicalBlock );
+
+static void
+DumpTrace ( const SCSIParallelTraceHeader * header );
+
+static int
+ReplayTrace (
+	const SCSIParallelTraceHeader *	header,
+	double							scale,
+	uint32_t						threadCount,
+	bool							verbose );
+
+static void *
+ReplayThreadMain ( void * context );
+
+static void
+PrintLatencies (
+	const char *			name,
+	uint64_t *				latencies,
+	uint32_t				count );
+
+static uint64_t
+GetNanoseconds ( void );
+
+static void
+SleepUntil ( uint64_t deadline );
+
+#if defined(__APPLE__)
+
+static io_object_t
+GetTargetDevice ( uint64_t targetID );
+
+static int
+StartCapture (
+	uint64_t				targetID,
+	uint32_t				recordCount );
+
+static int
+StopCapture (
+	uint64_t				targetID,
+	const char *			path );
+
+#endif	/* __APPLE__ */
+
+static void
+PrintUsage ( void );
+
+
+//-----------------------------------------------------------------------------
+//		main - Our main entry point
+//-----------------------------------------------------------------------------
+
+int
+main ( int argc, const char * argv[] )
+{
+	
+	SCSIParallelTraceHeader *	header		= NULL;
+	void *						trace		= NULL;
+	const char *				input		= NULL;
+	const char *				output		= NULL;
+	int64_t						targetID	= -1;
+	uint32_t					recordCount	= kSCSIParallelTraceDefaultRecordCount;
+	uint32_t					threadCount	= kDefaultThreadCount;
+	double						scale		= 1.0;
+	bool						start		= false;
+	bool						stop		= false;
+	bool						dump		= false;
+	bool						verbose		= false;
+	int							c			= 0;
+	
+	static struct option long_options [ ] =
+	{
+		{ "target",			required_argument,	0, 't' },
+		{ "port",			required_argument,	0, 'p' },
+		{ "start",			no_argument,		0, 's' },
+		{ "records",		required_argument,	0, 'n' },
+		{ "stop",			no_argument,		0, 'x' },
+		{ "output",			required_argument,	0, 'o' },
+		{ "input",			required_argument,	0, 'i' },
+		{ "device",			required_argument,	0, 'd' },
+		{ "block-size",		required_argument,	0, 'b' },
+		{ "scale",			required_argument,	0, 'S' },
+		{ "threads",		required_argument,	0, 'q' },
+		{ "dump",			no_argument,		0, 'D' },
+		{ "verbose",		no_argument,		0, 'v' },
+		{ "help",			no_argument,		0, 'h' },
+		{ 0, 0, 0, 0 }
+	};
+	
+	while ( ( c = getopt_long ( argc, ( char * const * ) argv, "t:p:sn:xo:i:d:b:S:q:Dvh?", long_options, NULL ) ) != -1 )
+	{
+	
+		switch ( c )
+		{
+	
+			case 't':
+			{
+	
+				targetID = strtoll ( optarg, ( char ** ) NULL, 10 );
+				if ( ( targetID < 0 ) || ( targetID > 255 ) )
+				{
+					fprintf ( stderr, "Invalid targetID.\n" );
+					PrintUsage ( );
+					exit ( EX_USAGE );
+				}
+	
+			}
+			break;
+	
+			case 'p':
+			{
+				gPort = strtoul ( optarg, ( char ** ) NULL, 10 );
+			}
+			break;
+	
+			case 's':
+			{
+				start = true;
+			}
+			break;
+	
+			case 'n':
+			{
+	
+				recordCount = strtoul ( optarg, ( char ** ) NULL, 10 );
+				if ( ( recordCount == 0 ) || ( recordCount > kSCSIParallelTraceMaximumRecordCount ) )
+				{
+					fprintf ( stderr, "Invalid record count, at most %d records can be captured.\n", kSCSIParallelTraceMaximumRecordCount );
+					PrintUsage ( );
+					exit ( EX_USAGE );
+				}
+	
+			}
+			break;
+	
+			case 'x':
+			{
+				stop = true;
+			}
+			break;
+	
+			case 'o':
+			{
+				output = optarg;
+			}
+			break;
+	
+			case 'i':
+			{
+				input = optarg;
+			}
+			break;
+	
+			case 'd':
+			{
+	
+				if ( ParseDevice ( optarg ) == false )
+				{
+					fprintf ( stderr, "Invalid device.\n" );
+					PrintUsage ( );
+					exit ( EX_USAGE );
+				}
+	
+			}
+			break;
+	
+			case 'b':
+			{
+	
+				gBlockSize = strtoul ( optarg, ( char ** ) NULL, 10 );
+				if ( ( gBlockSize == 0 ) || ( ( gBlockSize % 512 ) != 0 ) )
+				{
+					fprintf ( stderr, "Invalid block size. Must be a multiple of 512 bytes\n" );
+					PrintUsage ( );
+					exit ( EX_USAGE );
+				}
+	
+			}
+			break;
+	
+			case 'S':
+			{
+	
+				scale = strtod ( optarg, ( char ** ) NULL );
+				if ( scale < 0 )
+				{
+					fprintf ( stderr, "Invalid scale.\n" );
+					PrintUsage ( );
+					exit ( EX_USAGE );
+				}
+	
+			}
+			break;
+	
+			case 'q':
+			{
+	
+				threadCount = strtoul ( optarg, ( char ** ) NULL, 10 );
+				if ( ( threadCount == 0 ) || ( threadCount > kMaximumThreadCount ) )
+				{
+					fprintf ( stderr, "Invalid thread count.\n" );
+					PrintUsage ( );
+					exit ( EX_USAGE );
+				}
+	
+			}
+			break;
+	
+			case 'D':
+			{
+				dump = true;
+			}
+			break;
+	
+			case 'v':
+			{
+				verbose = true;
+			}
+			break;
+	
+			case 'h':
+			default:
+			{
+	
+				PrintUsage ( );
+				exit ( EX_USAGE );
+	
+			}
+			break;
+	
+		}
+	
+	}
+	
+	#if defined(__APPLE__)
+	mach_timebase_info ( &gTimebase );
+	#endif
+	
+	if ( ( start ) || ( stop ) )
+	{
+	
+		if ( ( targetID == -1 ) || ( ( start ) && ( stop ) ) || ( ( stop ) && ( output == NULL ) ) )
+		{
+	
+			PrintUsage ( );
+			exit ( EX_USAGE );
+	
+		}
+	
+		#if defined(__APPLE__)
+	
+		if ( start )
+			exit ( StartCapture ( targetID, recordCount ) );
+		else
+			exit ( StopCapture ( targetID, output ) );
+	
+		#else
+	
+		fprintf ( stderr, "Capture is only available on Mac OS X.\n" );
+		exit ( EX_UNAVAILABLE );
+	
+		#endif
+	
+	}
+	
+	if ( input == NULL )
+	{
+	
+		PrintUsage ( );
+		exit ( EX_USAGE );
+	
+	}
+	
+	trace = ReadTrace ( input, &header );
+	if ( trace == NULL )
+	{
+		exit ( EX_DATAERR );
+	}
+	
+	if ( dump )
+	{
+	
+		DumpTrace ( header );
+		exit ( 0 );
+	
+	}
+	
+	if ( gDeviceCount == 0 )
+	{
+	
+		PrintUsage ( );
+		exit ( EX_USAGE );
+	
+	}
+	
+	return ReplayTrace ( header, scale, threadCount, verbose );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		ReadTrace - Reads and checks a trace file. Returns the whole file,
+//		the header is at the start of it.
+//-----------------------------------------------------------------------------
+
+static void *
+ReadTrace (
+	const char *				path,
+	SCSIParallelTraceHeader **	header )
+{
+	
+	struct stat		status;
+	void *			buffer	= NULL;
+	ssize_t			amount	= 0;
+	int				fd		= -1;
+	
+	fd = open ( path, O_RDONLY );
+	if ( fd == -1 )
+	{
+		fprintf ( stderr, "%s: %s\n", path, strerror ( errno ) );
+		goto ErrorExit;
+	}
+	
+	if ( fstat ( fd, &status ) != 0 )
+	{
+		fprintf ( stderr, "%s: %s\n", path, strerror ( errno ) );
+		goto ErrorExit;
+	}
+	
+	if ( ( size_t ) status.st_size < sizeof ( SCSIParallelTraceHeader ) )
+	{
+		fprintf ( stderr, "%s: not a command trace.\n", path );
+		goto ErrorExit;
+	}
+	
+	buffer = malloc ( status.st_size );
+	if ( buffer == NULL )
+	{
+		fprintf ( stderr, "Could not allocate the trace.\n" );
+		goto ErrorExit;
+	}
+	
+	amount = read ( fd, buffer, status.st_size );
+	if ( amount != status.st_size )
+	{
+		fprintf ( stderr, "%s: could not read the trace.\n", path );
+		goto ErrorExit;
+	}
+	
+	*header = ( SCSIParallelTraceHeader * ) buffer;
+	
+	if ( ( ( *header )->fSignature != kSCSIParallelTraceSignature ) ||
+		 ( ( *header )->fVersion != kSCSIParallelTraceVersion ) ||
+		 ( ( *header )->fRecordSize != sizeof ( SCSIParallelTraceRecord ) ) )
+	{
+		fprintf ( stderr, "%s: not a command trace, or of an unknown version.\n", path );
+		goto ErrorExit;
+	}
+	
+	if ( ( ( status.st_size - sizeof ( SCSIParallelTraceHeader ) ) / sizeof ( SCSIParallelTraceRecord ) ) < ( *header )->fRecordCount )
+	{
+		fprintf ( stderr, "%s: the trace is truncated.\n", path );
+		goto ErrorExit;
+	}
+	
+	close ( fd );
+	
+	return buffer;
+	
+	
+ErrorExit:
+	
+	
+	if ( buffer != NULL )
+		free ( buffer );
+	
+	if ( fd != -1 )
+		close ( fd );
+	
+	return NULL;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		ParseDevice - Parses a [lun:]path device mapping. A device without
+//		a LUN takes the commands for all the LUNs without a device of their
+//		own.
+//-----------------------------------------------------------------------------
+
+static bool
+ParseDevice ( const char * string )
+{
+	
+	ReplayDevice *	device	= NULL;
+	const char *	colon	= NULL;
+	char *			expr	= NULL;
+	
+	if ( gDeviceCount == kMaximumDeviceCount )
+		return false;
+	
+	device = &gDevices[gDeviceCount];
+	memset ( device, 0, sizeof ( *device ) );
+	
+	device->anyLUN	= true;
+	device->path	= string;
+	device->fd		= -1;
+	
+	colon = strchr ( string, ':' );
+	if ( ( colon != NULL ) && ( colon != string ) )
+	{
+	
+		device->logicalUnit = strtoull ( string, &expr, 10 );
+		if ( expr == colon )
+		{
+	
+			device->anyLUN	= false;
+			device->path	= colon + 1;
+	
+		}
+	
+	}
+	
+	gDeviceCount++;
+	
+	return true;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		OpenDevices - Opens the devices used by the replay.
+//-----------------------------------------------------------------------------
+
+static bool
+OpenDevices ( uint32_t operationMask )
+{
+	
+	uint32_t	index = 0;
+	int			flags = ( operationMask & ( 1 << kReplayWrite ) ) ? O_RDWR : O_RDONLY;
+	
+	for ( index = 0; index < gDeviceCount; index++ )
+	{
+	
+		ReplayDevice *	device = &gDevices[index];
+	
+		#if defined(O_DIRECT)
+		device->fd = open ( device->path, flags | O_DIRECT );
+		if ( ( device->fd == -1 ) && ( errno == EINVAL ) )
+		#endif
+		device->fd = open ( device->path, flags );
+	
+		if ( device->fd == -1 )
+		{
+			fprintf ( stderr, "%s: %s\n", device->path, strerror ( errno ) );
+			return false;
+		}
+	
+		#if defined(F_NOCACHE)
+		fcntl ( device->fd, F_NOCACHE, 1 );
+		#endif
+	
+		device->blockSize = gBlockSize;
+	
+		#if defined(__APPLE__)
+		if ( device->blockSize == 0 )
+			ioctl ( device->fd, DKIOCGETBLOCKSIZE, &device->blockSize );
+		#endif
+	
+		if ( device->blockSize == 0 )
+			device->blockSize = 512;
+	
+	}
+	
+	return true;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		FindDevice - Finds the device for a LUN.
+//-----------------------------------------------------------------------------
+
+static ReplayDevice *
+FindDevice ( uint64_t logicalUnit )
+{
+	
+	ReplayDevice *	fallback	= NULL;
+	uint32_t		index		= 0;
+	
+	for ( index = 0; index < gDeviceCount; index++ )
+	{
+	
+		if ( gDevices[index].anyLUN == true )
+		{
+	
+			if ( fallback == NULL )
+				fallback = &gDevices[index];
+	
+		}
+	
+		else if ( gDevices[index].logicalUnit == logicalUnit )
+		{
+			return &gDevices[index];
+		}
+	
+	}
+	
+	return fallback;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		DecodeCommand - Works out what to replay for a recorded command.
+//-----------------------------------------------------------------------------
+
+static uint32_t
+DecodeCommand (
+	const SCSIParallelTraceRecord *	record,
+	uint64_t *						logicalBlock )
+{
+	
+	const uint8_t *	cdb			= record->fCDB;
+	uint32_t		operation	= kReplaySkip;
+	uint32_t		index		= 0;
+	
+	*logicalBlock = 0;
+	
+	switch ( cdb[0] )
+	{
+	
+		case kOpREAD_6:
+		case kOpWRITE_6:
+		{
+	
+			*logicalBlock = ( ( cdb[1] & 0x1F ) << 16 ) | ( cdb[2] << 8 ) | cdb[3];
+			operation = ( cdb[0] == kOpREAD_6 ) ? kReplayRead : kReplayWrite;
+	
+		}
+		break;
+	
+		case kOpREAD_10:
+		case kOpWRITE_10:
+		case kOpREAD_12:
+		case kOpWRITE_12:
+		{
+	
+			for ( index = 2; index < 6; index++ )
+				*logicalBlock = ( *logicalBlock << 8 ) | cdb[index];
+	
+			operation = ( ( cdb[0] == kOpREAD_10 ) || ( cdb[0] == kOpREAD_12 ) ) ? kReplayRead : kReplayWrite;
+	
+		}
+		break;
+	
+		case kOpREAD_16:
+		case kOpWRITE_16:
+		{
+	
+			for ( index = 2; index < 10; index++ )
+				*logicalBlock = ( *logicalBlock << 8 ) | cdb[index];
+	
+			operation = ( cdb[0] == kOpREAD_16 ) ? kReplayRead : kReplayWrite;
+	
+		}
+		break;
+	
+		case kOpSYNCHRONIZE_CACHE:
+		case kOpSYNCHRONIZE_CACHE_16:
+		{
+			operation = kReplaySync;
+		}
+		break;
+	
+		default:
+			break;
+	
+	}
+	
+	// A transfer of no blocks has nothing to replay.
+	if ( ( ( operation == kReplayRead ) || ( operation == kReplayWrite ) ) &&
+		 ( record->fRequestedTransferCount == 0 ) )
+	{
+		operation = kReplaySkip;
+	}
+	
+	return operation;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		DumpTrace - Prints a trace.
+//-----------------------------------------------------------------------------
+
+static void
+DumpTrace ( const SCSIParallelTraceHeader * header )
+{
+	
+	const SCSIParallelTraceRecord *	records = ( const SCSIParallelTraceRecord * ) ( header + 1 );
+	uint32_t						index	= 0;
+	uint32_t						byte	= 0;
+	
+	printf ( "Target %llu, %u records, %u dropped\n",
+			 ( unsigned long long ) header->fTargetIdentifier,
+			 header->fRecordCount,
+			 header->fDroppedCount );
+	
+	printf ( "%8s %14s %12s %5s %-32s %10s %4s %4s %4s %5s\n",
+			 "record", "submit (us)", "latency (us)", "lun", "cdb", "bytes",
+			 "attr", "resp", "stat", "retry" );
+	
+	for ( index = 0; index < header->fRecordCount; index++ )
+	{
+	
+		const SCSIParallelTraceRecord *	record = &records[index];
+		char							cdb[33];
+	
+		memset ( cdb, 0, sizeof ( cdb ) );
+		for ( byte = 0; ( byte < record->fCDBSize ) && ( byte < 16 ); byte++ )
+			snprintf ( &cdb[byte * 2], 3, "%02X", record->fCDB[byte] );
+	
+		printf ( "%8u %14.1f ", index, record->fSubmitTime / 1000.0 );
+	
+		if ( record->fFlags & kSCSIParallelTraceFlag_Outstanding )
+			printf ( "%12s ", "-" );
+		else
+			printf ( "%12.1f ", ( record->fCompletionTime - record->fSubmitTime ) / 1000.0 );
+	
+		printf ( "%5llu %-32s %10llu %4u %4u %4u %5u\n",
+				 ( unsigned long long ) record->fLogicalUnit,
+				 cdb,
+				 ( unsigned long long ) record->fRequestedTransferCount,
+				 record->fTaskAttribute,
+				 record->fServiceResponse,
+				 record->fTaskStatus,
+				 record->fRetryCount );
+	
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		ReplayTrace - Issues the commands of a trace again, at their recorded
+//		times divided by the scale. A scale of zero issues them as fast as
+//		the threads allow. Commands are always issued in recorded order.
+//-----------------------------------------------------------------------------
+
+static int
+ReplayTrace (
+	const SCSIParallelTraceHeader *	header,
+	double							scale,
+	uint32_t						threadCount,
+	bool							verbose )
+{
+	
+	const SCSIParallelTraceRecord *	records			= ( const SCSIParallelTraceRecord * ) ( header + 1 );
+	pthread_t *						threads			= NULL;
+	uint64_t *						recorded		= NULL;
+	uint64_t *						replayed		= NULL;
+	uint32_t						recordedCount	= 0;
+	uint32_t						replayedCount	= 0;
+	uint32_t						operationMask	= 0;
+	uint32_t						skipped			= 0;
+	uint32_t						resent			= 0;
+	uint32_t						failed			= 0;
+	uint32_t						errors			= 0;
+	uint64_t						maximumLateness	= 0;
+	uint64_t						start			= 0;
+	uint64_t						end				= 0;
+	uint32_t						index			= 0;
+	
+	gCommands = ( ReplayCommand * ) calloc ( header->fRecordCount + 1, sizeof ( ReplayCommand ) );
+	recorded = ( uint64_t * ) calloc ( header->fRecordCount + 1, sizeof ( uint64_t ) );
+	replayed = ( uint64_t * ) calloc ( header->fRecordCount + 1, sizeof ( uint64_t ) );
+	threads = ( pthread_t * ) calloc ( threadCount, sizeof ( pthread_t ) );
+	gQueue = ( uint32_t * ) calloc ( threadCount, sizeof ( uint32_t ) );
+	
+	if ( ( gCommands == NULL ) || ( recorded == NULL ) || ( replayed == NULL ) ||
+		 ( threads == NULL ) || ( gQueue == NULL ) )
+	{
+		fprintf ( stderr, "Could not allocate the replay.\n" );
+		return EX_OSERR;
+	}
+	
+	gQueueSize = threadCount;
+	
+	// Work out what each record turns into before anything is issued.
+	for ( index = 0; index < header->fRecordCount; index++ )
+	{
+	
+		const SCSIParallelTraceRecord *	record	= &records[index];
+		ReplayCommand *					command	= &gCommands[gCommandCount];
+		uint64_t						block	= 0;
+	
+		if ( record->fRetryCount != 0 )
+			resent++;
+	
+		if ( ( ( record->fFlags & kSCSIParallelTraceFlag_Outstanding ) == 0 ) &&
+			 ( ( record->fServiceResponse != kServiceResponseTaskComplete ) || ( record->fTaskStatus != 0 ) ) )
+		{
+			failed++;
+		}
+	
+		command->record		= record;
+		command->operation	= DecodeCommand ( record, &block );
+		command->device		= FindDevice ( record->fLogicalUnit );
+		command->offset		= block;
+	
+		if ( ( command->operation == kReplaySkip ) || ( command->device == NULL ) )
+		{
+	
+			skipped++;
+			continue;
+	
+		}
+	
+		if ( record->fRequestedTransferCount > gLargestTransfer )
+			gLargestTransfer = record->fRequestedTransferCount;
+	
+		operationMask |= ( 1 << command->operation );
+		gCommandCount++;
+	
+	}
+	
+	if ( OpenDevices ( operationMask ) == false )
+		return EX_NOINPUT;
+	
+	// The offsets are in blocks of the device until it is open.
+	for ( index = 0; index < gCommandCount; index++ )
+	{
+		gCommands[index].offset *= gCommands[index].device->blockSize;
+	}
+	
+	for ( index = 0; index < threadCount; index++ )
+	{
+	
+		if ( pthread_create ( &threads[index], NULL, ReplayThreadMain, NULL ) != 0 )
+		{
+			fprintf ( stderr, "Could not start the replay threads.\n" );
+			return EX_OSERR;
+		}
+	
+	}
+	
+	start = GetNanoseconds ( );
+	
+	for ( index = 0; index < gCommandCount; index++ )
+	{
+	
+		ReplayCommand *	command		= &gCommands[index];
+		uint64_t		deadline	= start;
+		uint64_t		now			= 0;
+	
+		if ( scale > 0 )
+		{
+	
+			deadline += ( uint64_t ) ( command->record->fSubmitTime / scale );
+			SleepUntil ( deadline );
+	
+		}
+	
+		pthread_mutex_lock ( &gQueueLock );
+	
+		while ( gQueueCount == gQueueSize )
+			pthread_cond_wait ( &gQueueNotFull, &gQueueLock );
+	
+		// How far behind the recorded timing the command went out.
+		now = GetNanoseconds ( );
+		command->lateness = ( now > deadline ) ? now - deadline : 0;
+	
+		gQueue[( gQueueHead + gQueueCount ) % gQueueSize] = index;
+		gQueueCount++;
+	
+		pthread_cond_signal ( &gQueueNotEmpty );
+		pthread_mutex_unlock ( &gQueueLock );
+	
+	}
+	
+	pthread_mutex_lock ( &gQueueLock );
+	gQueueDone = true;
+	pthread_cond_broadcast ( &gQueueNotEmpty );
+	pthread_mutex_unlock ( &gQueueLock );
+	
+	for ( index = 0; index < threadCount; index++ )
+	{
+		pthread_join ( threads[index], NULL );
+	}
+	
+	end = GetNanoseconds ( );
+	
+	for ( index = 0; index < gCommandCount; index++ )
+	{
+	
+		ReplayCommand *					command	= &gCommands[index];
+		const SCSIParallelTraceRecord *	record	= command->record;
+	
+		if ( command->lateness > maximumLateness )
+			maximumLateness = command->lateness;
+	
+		if ( command->failed )
+			errors++;
+		else
+			replayed[replayedCount++] = command->latency;
+	
+		if ( ( record->fFlags & kSCSIParallelTraceFlag_Outstanding ) == 0 )
+			recorded[recordedCount++] = record->fCompletionTime - record->fSubmitTime;
+	
+		if ( verbose )
+		{
+	
+			printf ( "%8u %14.1f %-5s lun %-5llu offset %-14llu bytes %-8llu",
+					 ( unsigned int ) ( record - records ),
+					 record->fSubmitTime / 1000.0,
+					 ( command->operation == kReplayRead ) ? "read" : ( command->operation == kReplayWrite ) ? "write" : "sync",
+					 ( unsigned long long ) record->fLogicalUnit,
+					 ( unsigned long long ) command->offset,
+					 ( unsigned long long ) record->fRequestedTransferCount );
+	
+			if ( record->fFlags & kSCSIParallelTraceFlag_Outstanding )
+				printf ( " recorded %10s", "-" );
+			else
+				printf ( " recorded %10.1f", ( record->fCompletionTime - record->fSubmitTime ) / 1000.0 );
+	
+			if ( command->failed )
+				printf ( " replayed %10s\n", "error" );
+			else
+				printf ( " replayed %10.1f\n", command->latency / 1000.0 );
+	
+		}
+	
+	}
+	
+	printf ( "Target %llu: %u records, %u dropped by the capture, %u resent, %u failed\n",
+			 ( unsigned long long ) header->fTargetIdentifier,
+			 header->fRecordCount,
+			 header->fDroppedCount,
+			 resent,
+			 failed );
+	
+	printf ( "Replayed %u commands in %.3f seconds (recorded %.3f), %u skipped, %u errors, %.1f us most behind schedule\n",
+			 gCommandCount,
+			 ( end - start ) / 1e9,
+			 ( gCommandCount == 0 ) ? 0.0 : gCommands[gCommandCount - 1].record->fSubmitTime / 1e9,
+			 skipped,
+			 errors,
+			 maximumLateness / 1000.0 );
+	
+	PrintLatencies ( "recorded", recorded, recordedCount );
+	PrintLatencies ( "replayed", replayed, replayedCount );
+	
+	return ( errors == 0 ) ? 0 : 1;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		ReplayThreadMain - Issues commands from the queue until the replay
+//		is done.
+//-----------------------------------------------------------------------------
+
+static void *
+ReplayThreadMain ( void * context )
+{
+	
+	void *	buffer = NULL;
+	
+	( void ) context;
+	
+	if ( posix_memalign ( &buffer, kBufferAlignment, ( gLargestTransfer == 0 ) ? kBufferAlignment : gLargestTransfer ) != 0 )
+		return NULL;
+	
+	memset ( buffer, 0xA5, ( gLargestTransfer == 0 ) ? kBufferAlignment : gLargestTransfer );
+	
+	for ( ;; )
+	{
+	
+		ReplayCommand *	command	= NULL;
+		uint64_t		start	= 0;
+		ssize_t			result	= 0;
+		size_t			size	= 0;
+	
+		pthread_mutex_lock ( &gQueueLock );
+	
+		while ( ( gQueueCount == 0 ) && ( gQueueDone == false ) )
+			pthread_cond_wait ( &gQueueNotEmpty, &gQueueLock );
+	
+		if ( gQueueCount == 0 )
+		{
+	
+			pthread_mutex_unlock ( &gQueueLock );
+			break;
+	
+		}
+	
+		command = &gCommands[gQueue[gQueueHead]];
+		gQueueHead = ( gQueueHead + 1 ) % gQueueSize;
+		gQueueCount--;
+	
+		pthread_cond_signal ( &gQueueNotFull );
+		pthread_mutex_unlock ( &gQueueLock );
+	
+		size = ( size_t ) command->record->fRequestedTransferCount;
+	
+		start = GetNanoseconds ( );
+	
+		switch ( command->operation )
+		{
+	
+			case kReplayRead:
+				result = pread ( command->device->fd, buffer, size, command->offset );
+				break;
+	
+			case kReplayWrite:
+				result = pwrite ( command->device->fd, buffer, size, command->offset );
+				break;
+	
+			default:
+				result = ( fsync ( command->device->fd ) == 0 ) ? ( ssize_t ) size : -1;
+				break;
+	
+		}
+	
+		command->latency	= GetNanoseconds ( ) - start;
+		command->failed		= ( result != ( ssize_t ) size );
+	
+	}
+	
+	free ( buffer );
+	
+	return NULL;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		CompareLatencies - qsort comparison for latencies.
+//-----------------------------------------------------------------------------
+
+static int
+CompareLatencies ( const void * a, const void * b )
+{
+	
+	uint64_t	left	= *( const uint64_t * ) a;
+	uint64_t	right	= *( const uint64_t * ) b;
+	
+	return ( left < right ) ? -1 : ( left > right ) ? 1 : 0;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		PrintLatencies - Prints the distribution of a set of latencies.
+//-----------------------------------------------------------------------------
+
+static void
+PrintLatencies (
+	const char *			name,
+	uint64_t *				latencies,
+	uint32_t				count )
+{
+	
+	uint64_t	total = 0;
+	uint32_t	index = 0;
+	
+	if ( count == 0 )
+		return;
+	
+	qsort ( latencies, count, sizeof ( uint64_t ), CompareLatencies );
+	
+	for ( index = 0; index < count; index++ )
+		total += latencies[index];
+	
+	printf ( "  %-8s latency (us): avg %.1f, p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+			 name,
+			 total / ( double ) count / 1000.0,
+			 latencies[( uint32_t ) ( ( count - 1 ) * 0.50 )] / 1000.0,
+			 latencies[( uint32_t ) ( ( count - 1 ) * 0.90 )] / 1000.0,
+			 latencies[( uint32_t ) ( ( count - 1 ) * 0.99 )] / 1000.0,
+			 latencies[( uint32_t ) ( ( count - 1 ) * 0.999 )] / 1000.0,
+			 latencies[count - 1] / 1000.0 );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		GetNanoseconds - Returns a monotonic time in nanoseconds.
+//-----------------------------------------------------------------------------
+
+static uint64_t
+GetNanoseconds ( void )
+{
+	
+	#if defined(__APPLE__)
+	
+	uint64_t	time = mach_absolute_time ( );
+	
+	// Split the conversion so that it does not overflow on long uptimes.
+	return ( ( time / gTimebase.denom ) * gTimebase.numer ) +
+		   ( ( time % gTimebase.denom ) * gTimebase.numer / gTimebase.denom );
+	
+	#else
+	
+	struct timespec		time;
+	
+	clock_gettime ( CLOCK_MONOTONIC, &time );
+	
+	return ( ( uint64_t ) time.tv_sec * 1000000000ULL ) + time.tv_nsec;
+	
+	#endif
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		SleepUntil - Sleeps until a time from GetNanoseconds.
+//-----------------------------------------------------------------------------
+
+static void
+SleepUntil ( uint64_t deadline )
+{
+	
+	uint64_t	now = GetNanoseconds ( );
+	
+	// Sleep for most of the wait, then spin for the rest, as a sleep may
+	// well overshoot by more than the gap between two commands.
+	while ( now + 100000 < deadline )
+	{
+	
+		usleep ( ( useconds_t ) ( ( deadline - now - 50000 ) / 1000 ) );
+		now = GetNanoseconds ( );
+	
+	}
+	
+	while ( now < deadline )
+		now = GetNanoseconds ( );
+	
+}
+
+
+#if defined(__APPLE__)
+
+//-----------------------------------------------------------------------------
+//		GetTargetDevice - Gets the IOSCSIParallelInterfaceDevice for a target
+//		on the selected port.
+//-----------------------------------------------------------------------------
+
+static io_object_t
+GetTargetDevice ( uint64_t targetID )
+{
+	
+	io_object_t		controller	= IO_OBJECT_NULL;
+	io_object_t		device		= IO_OBJECT_NULL;
+	io_iterator_t	iterator	= IO_OBJECT_NULL;
+	IOReturn		result		= kIOReturnSuccess;
+	
+	result = IOServiceGetMatchingServices (
+		kIOMasterPortDefault,
+		IOServiceMatching ( kAppleSCSIEmulatorAdapterClassString ),
+		&iterator );
+	
+	if ( result != kIOReturnSuccess )
+	{
+		return IO_OBJECT_NULL;
+	}
+	
+	controller = IOIteratorNext ( iterator );
+	
+	while ( controller != IO_OBJECT_NULL )
+	{
+	
+		CFNumberRef		number	= NULL;
+		int				port	= 0;
+	
+		number = ( CFNumberRef ) IORegistryEntryCreateCFProperty ( controller, CFSTR ( kEmulatorPortKey ), kCFAllocatorDefault, 0 );
+		if ( number != NULL )
+		{
+	
+			CFNumberGetValue ( number, kCFNumberIntType, &port );
+			CFRelease ( number );
+			number = NULL;
+	
+		}
+	
+		if ( port == gPort )
+		{
+			break;
+		}
+	
+		IOObjectRelease ( controller );
+		controller = IOIteratorNext ( iterator );
+	
+	}
+	
+	IOObjectRelease ( iterator );
+	iterator = IO_OBJECT_NULL;
+	
+	if ( controller == IO_OBJECT_NULL )
+	{
+		return IO_OBJECT_NULL;
+	}
+	
+	result = IORegistryEntryGetChildIterator ( controller, kIOServicePlane, &iterator );
+	IOObjectRelease ( controller );
+	
+	if ( result != kIOReturnSuccess )
+	{
+		return IO_OBJECT_NULL;
+	}
+	
+	device = IOIteratorNext ( iterator );
+	
+	while ( device != IO_OBJECT_NULL )
+	{
+	
+		if ( IOObjectConformsTo ( device, kIOSCSIParallelInterfaceDeviceString ) )
+		{
+	
+			CFNumberRef		number	= NULL;
+			uint64_t		unit	= 0;
+	
+			number = ( CFNumberRef ) IORegistryEntryCreateCFProperty ( device, CFSTR ( kIOPropertyIOUnitKey ), kCFAllocatorDefault, 0 );
+			if ( number != NULL )
+			{
+	
+				CFNumberGetValue ( number, kCFNumberSInt64Type, &unit );
+				CFRelease ( number );
+				number = NULL;
+	
+				if ( unit == targetID )
+				{
+					break;
+				}
+	
+			}
+	
+		}
+	
+		IOObjectRelease ( device );
+		device = IOIteratorNext ( iterator );
+	
+	}
+	
+	IOObjectRelease ( iterator );
+	
+	return device;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		StartCapture - Starts capturing a command trace on a target.
+//-----------------------------------------------------------------------------
+
+static int
+StartCapture (
+	uint64_t				targetID,
+	uint32_t				recordCount )
+{
+	
+	io_object_t		device	= IO_OBJECT_NULL;
+	CFNumberRef		number	= NULL;
+	IOReturn		result	= kIOReturnSuccess;
+	
+	device = GetTargetDevice ( targetID );
+	if ( device == IO_OBJECT_NULL )
+	{
+		fprintf ( stderr, "Target %llu not found on port %d.\n", ( unsigned long long ) targetID, gPort );
+		return EX_UNAVAILABLE;
+	}
+	
+	number = CFNumberCreate ( kCFAllocatorDefault, kCFNumberSInt32Type, &recordCount );
+	result = IORegistryEntrySetCFProperty ( device, CFSTR ( kIOCommandTraceKey ), number );
+	
+	CFRelease ( number );
+	IOObjectRelease ( device );
+	
+	if ( result != kIOReturnSuccess )
+	{
+		fprintf ( stderr, "Could not start the capture, error 0x%08x. Capture needs administrator privileges.\n", result );
+		return EX_NOPERM;
+	}
+	
+	return 0;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		StopCapture - Stops the command trace capture on a target and saves
+//		the trace.
+//-----------------------------------------------------------------------------
+
+static int
+StopCapture (
+	uint64_t				targetID,
+	const char *			path )
+{
+	
+	io_object_t		device	= IO_OBJECT_NULL;
+	CFDataRef		data	= NULL;
+	FILE *			file	= NULL;
+	IOReturn		result	= kIOReturnSuccess;
+	int				status	= 0;
+	
+	device = GetTargetDevice ( targetID );
+	if ( device == IO_OBJECT_NULL )
+	{
+		fprintf ( stderr, "Target %llu not found on port %d.\n", ( unsigned long long ) targetID, gPort );
+		return EX_UNAVAILABLE;
+	}
+	
+	result = IORegistryEntrySetCFProperty ( device, CFSTR ( kIOCommandTraceKey ), kCFBooleanFalse );
+	if ( result != kIOReturnSuccess )
+	{
+	
+		fprintf ( stderr, "Could not stop the capture, error 0x%08x. Capture needs administrator privileges.\n", result );
+		status = EX_NOPERM;
+		goto ErrorExit;
+	
+	}
+	
+	data = ( CFDataRef ) IORegistryEntryCreateCFProperty ( device, CFSTR ( kIOCommandTraceDataKey ), kCFAllocatorDefault, 0 );
+	if ( data == NULL )
+	{
+	
+		fprintf ( stderr, "No command trace was captured.\n" );
+		status = EX_UNAVAILABLE;
+		goto ErrorExit;
+	
+	}
+	
+	file = fopen ( path, "w" );
+	if ( file == NULL )
+	{
+	
+		fprintf ( stderr, "%s: %s\n", path, strerror ( errno ) );
+		status = EX_CANTCREAT;
+		goto ErrorExit;
+	
+	}
+	
+	if ( fwrite ( CFDataGetBytePtr ( data ), CFDataGetLength ( data ), 1, file ) != 1 )
+	{
+	
+		fprintf ( stderr, "%s: %s\n", path, strerror ( errno ) );
+		status = EX_IOERR;
+	
+	}
+	
+	fclose ( file );
+	
+	
+ErrorExit:
+	
+	
+	if ( data != NULL )
+		CFRelease ( data );
+	
+	IOObjectRelease ( device );
+	
+	return status;
+	
+}
+
+#endif	/* __APPLE__ */
+
+
+//-----------------------------------------------------------------------------
+//		PrintUsage - Prints usage string
+//-----------------------------------------------------------------------------
+
+static void
+PrintUsage ( void )
+{
+	
+	printf ( "Usage: replay --target, -t <target> [--port, -p] --start, -s [--records, -n <count>]\n" );
+	printf ( "       replay --target, -t <target> [--port, -p] --stop, -x --output, -o <file>\n" );
+	printf ( "       replay --input, -i <file> --dump, -D\n" );
+	printf ( "       replay --input, -i <file> --device, -d [<lun>:]<device> ... [--scale, -S] [--threads, -q] [--block-size, -b] [--verbose, -v]\n" );
+	printf ( "       --start and --stop capture the commands sent to an emulator target. They need administrator privileges.\n" );
+	printf ( "       --records is the most commands to capture, %d by default.\n", kSCSIParallelTraceDefaultRecordCount );
+	printf ( "       --dump prints a trace.\n" );
+	printf ( "       --device is the raw device to replay the commands of a LUN on, e.g. 1:/dev/rdisk3. A device without a LUN takes all other LUNs.\n" );
+	printf ( "       Only READ, WRITE and SYNCHRONIZE CACHE are replayed. Replaying writes destroys the contents of the device.\n" );
+	printf ( "       --scale speeds the recorded timing up (2 is twice as fast). 0 issues the commands as fast as possible. 1 by default.\n" );
+	printf ( "       --threads is the most commands outstanding at once, %d by default.\n", kDefaultThreadCount );
+	printf ( "       --block-size overrides the block size of the devices.\n" );
+	fflush ( stdout );
+	
+}
@@ -0,0 +1,1195 @@
+//-----------------------------------------------------------------------------
+//	Includes
+//-----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sysexits.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+
+#if defined(__APPLE__)
+#include <sys/disk.h>
+#include <mach/mach_time.h>
+#else
+#include <time.h>
+#endif
+
+
+//-----------------------------------------------------------------------------
+//	Constants
+//-----------------------------------------------------------------------------
+
+#define kMaximumDeviceCount			32
+#define kMaximumEventCount			16
+#define kMaximumBlockSizeCount		8
+#define kMaximumQueueDepth			256
+#define kBufferAlignment			4096
+
+// The latency histograms have 16 linear buckets for each power of two
+// nanoseconds, so each bucket is within about 6% of the values in it.
+#define kHistogramSubBucketShift	4
+#define kHistogramSubBucketCount	( 1 << kHistogramSubBucketShift )
+#define kHistogramBucketCount		( ( 64 - kHistogramSubBucketShift + 1 ) * kHistogramSubBucketCount )
+
+enum
+{
+	kDirectionRead	= 0,
+	kDirectionWrite	= 1,
+	kDirectionCount	= 2
+};
+
+
+//-----------------------------------------------------------------------------
+//	Structures
+//-----------------------------------------------------------------------------
+
+typedef struct LatencyHistogram
+{
+	uint64_t		count;
+	uint64_t		bytes;
+	uint64_t		total;
+	uint64_t		max;
+	uint64_t		buckets[kHistogramBucketCount];
+} LatencyHistogram;
+
+typedef struct WorkloadStatistics
+{
+	uint64_t			errors;
+	LatencyHistogram	latency[kDirectionCount];
+} WorkloadStatistics;
+
+typedef struct WorkloadDevice
+{
+	
+	const char *		path;
+	int					fd;
+	
+	// The workload for the device, taken from the options given before
+	// the device on the command line.
+	uint32_t			readPercent;
+	uint32_t			randomPercent;
+	uint32_t			queueDepth;
+	uint32_t			blockSizeCount;
+	uint64_t			blockSizes[kMaximumBlockSizeCount];
+	uint64_t			span;
+	
+	// The sequential I/O of all the threads of the device is issued from
+	// one cursor, so a queue depth above one is still a single stream.
+	pthread_mutex_t		cursorLock;
+	uint64_t			cursor;
+	
+	WorkloadStatistics	totals;
+	
+} WorkloadDevice;
+
+typedef struct WorkloadThread
+{
+	
+	pthread_t			thread;
+	WorkloadDevice *	device;
+	uint64_t			seed;
+	void *				buffer;
+	
+	// The statistics since the last report, collected by the main thread
+	// each interval.
+	pthread_mutex_t		lock;
+	WorkloadStatistics	interval;
+	
+} WorkloadThread;
+
+// A shell command run partway through the run, such as taking a port of
+// the emulator down to measure a multipath failover.
+typedef struct WorkloadEvent
+{
+	uint64_t			time;
+	const char *		command;
+	bool				done;
+} WorkloadEvent;
+
+
+//-----------------------------------------------------------------------------
+//	Globals
+//-----------------------------------------------------------------------------
+
+static WorkloadDevice			gDevices[kMaximumDeviceCount];
+static uint32_t					gDeviceCount	= 0;
+static WorkloadThread *			gThreads		= NULL;
+static uint32_t					gThreadCount	= 0;
+static WorkloadEvent			gEvents[kMaximumEventCount];
+static uint32_t					gEventCount		= 0;
+static volatile sig_atomic_t	gStop			= 0;
+
+#if defined(__APPLE__)
+static mach_timebase_info_data_t	gTimebase;
+#endif
+
+
+//-----------------------------------------------------------------------------
+//		Prototypes
+//-----------------------------------------------------------------------------
+
+static bool
+ParseByteCount (
+	const char *			string,
+	uint64_t *				byteCount );
+
+static bool
+ParseBlockSizes (
+	const char *			string,
+	WorkloadDevice *		device );
+
+static bool
+ParseEvent (
+	const char *			string,
+	WorkloadEvent *			event );
+
+static bool
+OpenDevice ( WorkloadDevice * device );
+
+static void *
+WorkloadThreadMain ( void * context );
+
+static uint64_t
+GetNanoseconds ( void );
+
+static uint64_t
+GetRandom ( uint64_t * seed );
+
+static void
+RecordLatency (
+	LatencyHistogram *		histogram,
+	uint64_t				latency,
+	uint64_t				bytes );
+
+static void
+MergeHistogram (
+	LatencyHistogram *			destination,
+	const LatencyHistogram *	source );
+
+static void
+MergeStatistics (
+	WorkloadStatistics *		destination,
+	const WorkloadStatistics *	source );
+
+static uint64_t
+GetPercentile (
+	const LatencyHistogram *	histogram,
+	double						percentile );
+
+static void
+CollectInterval ( WorkloadStatistics * interval );
+
+static void
+RunEvents ( double elapsed );
+
+static void
+PrintInterval (
+	double						elapsed,
+	double						seconds,
+	const WorkloadStatistics *	interval );
+
+static void
+PrintSummary (
+	const char *				name,
+	double						seconds,
+	const WorkloadStatistics *	totals );
+
+static void
+StopWorkload ( int signal );
+
+static void
+PrintUsage ( void );
+
+
+//-----------------------------------------------------------------------------
+//		main - Our main entry point
+//-----------------------------------------------------------------------------
+
+int
+main ( int argc, const char * argv[] )
+{
+	
+	WorkloadDevice		settings;
+	WorkloadStatistics	interval;
+	WorkloadStatistics	totals;
+	uint64_t			duration	= 30;
+	uint64_t			period		= 1;
+	uint64_t			start		= 0;
+	uint64_t			last		= 0;
+	uint64_t			now			= 0;
+	uint64_t			deadline	= 0;
+	uint32_t			index		= 0;
+	uint32_t			thread		= 0;
+	int					c			= 0;
+	
+	static struct option long_options [ ] =
+	{
+		{ "device",			required_argument,	0, 'd' },
+		{ "read",			required_argument,	0, 'r' },
+		{ "random",			required_argument,	0, 'R' },
+		{ "block-size",		required_argument,	0, 'b' },
+		{ "queue-depth",	required_argument,	0, 'q' },
+		{ "span",			required_argument,	0, 's' },
+		{ "time",			required_argument,	0, 't' },
+		{ "interval",		required_argument,	0, 'i' },
+		{ "event",			required_argument,	0, 'e' },
+		{ "help",			no_argument,		0, 'h' },
+		{ 0, 0, 0, 0 }
+	};
+	
+	memset ( &settings, 0, sizeof ( settings ) );
+	settings.readPercent	= 100;
+	settings.randomPercent	= 100;
+	settings.queueDepth		= 1;
+	settings.blockSizeCount	= 1;
+	settings.blockSizes[0]	= 4096;
+	
+	while ( ( c = getopt_long ( argc, ( char * const * ) argv, "d:r:R:b:q:s:t:i:e:h?", long_options, NULL ) ) != -1 )
+	{
+	
+		switch ( c )
+		{
+	
+			case 'd':
+			{
+	
+				if ( gDeviceCount == kMaximumDeviceCount )
+				{
+					fprintf ( stderr, "Too many devices, at most %d can be used.\n", kMaximumDeviceCount );
+					exit ( EX_USAGE );
+				}
+	
+				// The device gets the workload options given so far.
+				gDevices[gDeviceCount] = settings;
+				gDevices[gDeviceCount].path = optarg;
+				gDeviceCount++;
+	
+			}
+			break;
+	
+			case 'r':
+			{
+	
+				settings.readPercent = strtoul ( optarg, ( char ** ) NULL, 10 );
+				if ( settings.readPercent > 100 )
+				{
+					fprintf ( stderr, "Invalid read percentage.\n" );
+					PrintUsage ( );
+					exit ( EX_USAGE );
+				}
+	
+			}
+			break;
+	
+			case 'R':
+			{
+	
+				settings.randomPercent = strtoul ( optarg, ( char ** ) NULL, 10 );
+				if ( settings.randomPercent > 100 )
+				{
+					fprintf ( stderr, "Invalid random percentage.\n" );
+					PrintUsage ( );
+					exit ( EX_USAGE );
+				}
+	
+			}
+			break;
+	
+			case 'b':
+			{
+	
+				if ( ParseBlockSizes ( optarg, &settings ) == false )
+				{
+					fprintf ( stderr, "Invalid block size. Must be a multiple of 512 bytes\n" );
+					PrintUsage ( );
+					exit ( EX_USAGE );
+				}
+	
+			}
+			break;
+	
+			case 'q':
+			{
+	
+				settings.queueDepth = strtoul ( optarg, ( char ** ) NULL, 10 );
+				if ( ( settings.queueDepth == 0 ) || ( settings.queueDepth > kMaximumQueueDepth ) )
+				{
+					fprintf ( stderr, "Invalid queue depth.\n" );
+					PrintUsage ( );
+					exit ( EX_USAGE );
+				}
+	
+			}
+			break;
+	
+			case 's':
+			{
+	
+				if ( ParseByteCount ( optarg, &settings.span ) == false )
+				{
+					fprintf ( stderr, "Invalid span. Must be a multiple of 512 bytes\n" );
+					PrintUsage ( );
+					exit ( EX_USAGE );
+				}
+	
+			}
+			break;
+	
+			case 't':
+			{
+	
+				duration = strtoull ( optarg, ( char ** ) NULL, 10 );
+				if ( duration == 0 )
+				{
+					fprintf ( stderr, "Invalid time.\n" );
+					PrintUsage ( );
+					exit ( EX_USAGE );
+				}
+	
+			}
+			break;
+	
+			case 'i':
+			{
+	
+				period = strtoull ( optarg, ( char ** ) NULL, 10 );
+				if ( period == 0 )
+				{
+					fprintf ( stderr, "Invalid interval.\n" );
+					PrintUsage ( );
+					exit ( EX_USAGE );
+				}
+	
+			}
+			break;
+	
+			case 'e':
+			{
+	
+				if ( gEventCount == kMaximumEventCount )
+				{
+					fprintf ( stderr, "Too many events, at most %d can be given.\n", kMaximumEventCount );
+					exit ( EX_USAGE );
+				}
+	
+				if ( ParseEvent ( optarg, &gEvents[gEventCount] ) == false )
+				{
+					fprintf ( stderr, "Invalid event. Must be <seconds>:<command>\n" );
+					PrintUsage ( );
+					exit ( EX_USAGE );
+				}
+	
+				gEventCount++;
+	
+			}
+			break;
+	
+			case 'h':
+			default:
+			{
+	
+				PrintUsage ( );
+				exit ( EX_USAGE );
+	
+			}
+			break;
+	
+		}
+	
+	}
+	
+	if ( gDeviceCount == 0 )
+	{
+	
+		PrintUsage ( );
+		exit ( EX_USAGE );
+	
+	}
+	
+	#if defined(__APPLE__)
+	mach_timebase_info ( &gTimebase );
+	#endif
+	
+	for ( index = 0; index < gDeviceCount; index++ )
+	{
+	
+		if ( OpenDevice ( &gDevices[index] ) == false )
+			exit ( EX_NOINPUT );
+	
+		gThreadCount += gDevices[index].queueDepth;
+	
+	}
+	
+	gThreads = ( WorkloadThread * ) calloc ( gThreadCount, sizeof ( WorkloadThread ) );
+	if ( gThreads == NULL )
+	{
+		fprintf ( stderr, "Could not allocate the workload threads.\n" );
+		exit ( EX_OSERR );
+	}
+	
+	signal ( SIGINT, StopWorkload );
+	signal ( SIGTERM, StopWorkload );
+	
+	printf ( "%8s %9s %9s %9s %9s %9s %9s %9s %9s %9s %7s\n",
+			 "time", "r/s", "w/s", "rMB/s", "wMB/s", "avg(us)",
+			 "p50", "p90", "p99", "p99.9", "errors" );
+	fflush ( stdout );
+	
+	start = GetNanoseconds ( );
+	
+	for ( index = 0; index < gDeviceCount; index++ )
+	{
+	
+		WorkloadDevice *	device	= &gDevices[index];
+		uint64_t			largest	= 0;
+		uint32_t			size	= 0;
+		uint32_t			depth	= 0;
+	
+		for ( size = 0; size < device->blockSizeCount; size++ )
+		{
+			if ( device->blockSizes[size] > largest )
+				largest = device->blockSizes[size];
+		}
+	
+		for ( depth = 0; depth < device->queueDepth; depth++, thread++ )
+		{
+	
+			WorkloadThread *	workloadThread = &gThreads[thread];
+	
+			workloadThread->device	= device;
+			workloadThread->seed	= ( start ^ ( ( uint64_t ) thread << 32 ) ) | 1;
+	
+			if ( posix_memalign ( &workloadThread->buffer, kBufferAlignment, largest ) != 0 )
+			{
+				fprintf ( stderr, "Could not allocate the I/O buffers.\n" );
+				exit ( EX_OSERR );
+			}
+	
+			memset ( workloadThread->buffer, 0xA5 ^ thread, largest );
+			pthread_mutex_init ( &workloadThread->lock, NULL );
+	
+			if ( pthread_create ( &workloadThread->thread, NULL, WorkloadThreadMain, workloadThread ) != 0 )
+			{
+				fprintf ( stderr, "Could not start the workload threads.\n" );
+				exit ( EX_OSERR );
+			}
+	
+		}
+	
+	}
+	
+	memset ( &totals, 0, sizeof ( totals ) );
+	
+	last		= start;
+	deadline	= start + ( duration * 1000000000ULL );
+	
+	while ( ( gStop == 0 ) && ( last < deadline ) )
+	{
+	
+		uint64_t	next = last + ( period * 1000000000ULL );
+	
+		if ( next > deadline )
+			next = deadline;
+	
+		// Sleep to the end of the interval, in case the sleep is cut short.
+		for ( now = GetNanoseconds ( ); ( gStop == 0 ) && ( now < next ); now = GetNanoseconds ( ) )
+		{
+			usleep ( ( useconds_t ) ( ( next - now + 999 ) / 1000 ) );
+		}
+	
+		CollectInterval ( &interval );
+		MergeStatistics ( &totals, &interval );
+	
+		PrintInterval ( ( now - start ) / 1e9, ( now - last ) / 1e9, &interval );
+		last = now;
+	
+		RunEvents ( ( now - start ) / 1e9 );
+	
+	}
+	
+	gStop = 1;
+	
+	for ( thread = 0; thread < gThreadCount; thread++ )
+	{
+		pthread_join ( gThreads[thread].thread, NULL );
+	}
+	
+	// Pick up the I/O which completed after the last report.
+	now = GetNanoseconds ( );
+	CollectInterval ( &interval );
+	MergeStatistics ( &totals, &interval );
+	
+	printf ( "\n" );
+	
+	for ( index = 0; index < gDeviceCount; index++ )
+	{
+		PrintSummary ( gDevices[index].path, ( now - start ) / 1e9, &gDevices[index].totals );
+	}
+	
+	if ( gDeviceCount > 1 )
+		PrintSummary ( "all devices", ( now - start ) / 1e9, &totals );
+	
+	return ( totals.errors == 0 ) ? 0 : 1;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		ParseByteCount - Parses a byte count, with an optional k, m, or g
+//		suffix as with dd. Returns false if it is not a multiple of 512.
+//-----------------------------------------------------------------------------
+
+static bool
+ParseByteCount (
+	const char *			string,
+	uint64_t *				byteCount )
+{
+	
+	char *	expr;
+	
+	*byteCount = strtoull ( string, &expr, 10 );
+	
+	switch ( *expr )
+	{
+	
+		case 'k':
+			*byteCount *= 1 << 10;
+			expr++;
+			break;
+	
+		case 'm':
+			*byteCount *= 1 << 20;
+			expr++;
+			break;
+	
+		case 'g':
+			*byteCount *= 1 << 30;
+			expr++;
+			break;
+	
+		default:
+			break;
+	
+	}
+	
+	if ( ( *expr != '\0' ) && ( *expr != ',' ) )
+		return false;
+	
+	return ( ( *byteCount != 0 ) && ( ( *byteCount % 512 ) == 0 ) );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		ParseBlockSizes - Parses a comma separated list of block sizes. Each
+//		I/O uses one of them, chosen at random.
+//-----------------------------------------------------------------------------
+
+static bool
+ParseBlockSizes (
+	const char *			string,
+	WorkloadDevice *		device )
+{
+	
+	uint32_t	count = 0;
+	
+	while ( string != NULL )
+	{
+	
+		if ( count == kMaximumBlockSizeCount )
+			return false;
+	
+		if ( ParseByteCount ( string, &device->blockSizes[count] ) == false )
+			return false;
+	
+		count++;
+	
+		string = strchr ( string, ',' );
+		if ( string != NULL )
+			string++;
+	
+	}
+	
+	device->blockSizeCount = count;
+	
+	return true;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		ParseEvent - Parses an event, the number of seconds into the run it
+//		happens at and the command to run then.
+//-----------------------------------------------------------------------------
+
+static bool
+ParseEvent (
+	const char *			string,
+	WorkloadEvent *			event )
+{
+	
+	char *	expr;
+	
+	event->time		= strtoull ( string, &expr, 10 );
+	event->command	= expr + 1;
+	event->done		= false;
+	
+	return ( expr != string ) && ( *expr == ':' ) && ( *event->command != 0 );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		OpenDevice - Opens a device and works out the span to use on it.
+//-----------------------------------------------------------------------------
+
+static bool
+OpenDevice ( WorkloadDevice * device )
+{
+	
+	struct stat		status;
+	uint64_t		size	= 0;
+	uint32_t		index	= 0;
+	int				flags	= ( device->readPercent == 100 ) ? O_RDONLY : O_RDWR;
+	
+	// Bypass the buffer cache where the host allows it, so that the
+	// latencies are those of the device. On Mac OS X the raw disk nodes
+	// (/dev/rdiskN) are uncached already.
+	#if defined(O_DIRECT)
+	device->fd = open ( device->path, flags | O_DIRECT );
+	if ( ( device->fd == -1 ) && ( errno == EINVAL ) )
+	#endif
+	device->fd = open ( device->path, flags );
+	
+	if ( device->fd == -1 )
+	{
+		fprintf ( stderr, "%s: %s\n", device->path, strerror ( errno ) );
+		return false;
+	}
+	
+	#if defined(F_NOCACHE)
+	fcntl ( device->fd, F_NOCACHE, 1 );
+	#endif
+	
+	if ( fstat ( device->fd, &status ) == 0 && S_ISREG ( status.st_mode ) )
+	{
+		size = status.st_size;
+	}
+	
+	else
+	{
+	
+		#if defined(__APPLE__)
+	
+		uint64_t	blockCount	= 0;
+		uint32_t	blockSize	= 0;
+	
+		if ( ( ioctl ( device->fd, DKIOCGETBLOCKCOUNT, &blockCount ) == 0 ) &&
+			 ( ioctl ( device->fd, DKIOCGETBLOCKSIZE, &blockSize ) == 0 ) )
+		{
+			size = blockCount * blockSize;
+		}
+	
+		#else
+	
+		off_t	end = lseek ( device->fd, 0, SEEK_END );
+	
+		if ( end > 0 )
+			size = end;
+	
+		#endif
+	
+	}
+	
+	if ( ( device->span == 0 ) || ( device->span > size ) )
+		device->span = size;
+	
+	for ( index = 0; index < device->blockSizeCount; index++ )
+	{
+	
+		if ( device->blockSizes[index] > device->span )
+		{
+			fprintf ( stderr, "%s: the block size is larger than the device.\n", device->path );
+			return false;
+		}
+	
+	}
+	
+	pthread_mutex_init ( &device->cursorLock, NULL );
+	
+	return true;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		WorkloadThreadMain - Issues I/O to a device until told to stop.
+//-----------------------------------------------------------------------------
+
+static void *
+WorkloadThreadMain ( void * context )
+{
+	
+	WorkloadThread *	thread	= ( WorkloadThread * ) context;
+	WorkloadDevice *	device	= thread->device;
+	
+	while ( gStop == 0 )
+	{
+	
+		uint64_t	size		= device->blockSizes[GetRandom ( &thread->seed ) % device->blockSizeCount];
+		uint32_t	direction	= kDirectionWrite;
+		uint64_t	offset		= 0;
+		uint64_t	start		= 0;
+		uint64_t	latency		= 0;
+		ssize_t		result		= 0;
+	
+		if ( ( GetRandom ( &thread->seed ) % 100 ) < device->readPercent )
+			direction = kDirectionRead;
+	
+		if ( ( GetRandom ( &thread->seed ) % 100 ) < device->randomPercent )
+		{
+			offset = ( GetRandom ( &thread->seed ) % ( device->span / size ) ) * size;
+		}
+	
+		else
+		{
+	
+			pthread_mutex_lock ( &device->cursorLock );
+	
+			if ( device->cursor + size > device->span )
+				device->cursor = 0;
+	
+			offset = device->cursor;
+			device->cursor += size;
+	
+			pthread_mutex_unlock ( &device->cursorLock );
+	
+		}
+	
+		start = GetNanoseconds ( );
+	
+		if ( direction == kDirectionRead )
+			result = pread ( device->fd, thread->buffer, size, offset );
+		else
+			result = pwrite ( device->fd, thread->buffer, size, offset );
+	
+		latency = GetNanoseconds ( ) - start;
+	
+		pthread_mutex_lock ( &thread->lock );
+	
+		if ( result == ( ssize_t ) size )
+			RecordLatency ( &thread->interval.latency[direction], latency, size );
+		else
+			thread->interval.errors++;
+	
+		pthread_mutex_unlock ( &thread->lock );
+	
+	}
+	
+	return NULL;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		GetNanoseconds - Returns a monotonic time in nanoseconds.
+//-----------------------------------------------------------------------------
+
+static uint64_t
+GetNanoseconds ( void )
+{
+	
+	#if defined(__APPLE__)
+	
+	uint64_t	time = mach_absolute_time ( );
+	
+	// Split the conversion so that it does not overflow on long uptimes.
+	return ( ( time / gTimebase.denom ) * gTimebase.numer ) +
+		   ( ( time % gTimebase.denom ) * gTimebase.numer / gTimebase.denom );
+	
+	#else
+	
+	struct timespec		time;
+	
+	clock_gettime ( CLOCK_MONOTONIC, &time );
+	
+	return ( ( uint64_t ) time.tv_sec * 1000000000ULL ) + time.tv_nsec;
+	
+	#endif
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		GetRandom - Returns the next number of a thread's xorshift generator.
+//-----------------------------------------------------------------------------
+
+static uint64_t
+GetRandom ( uint64_t * seed )
+{
+	
+	uint64_t	x = *seed;
+	
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	
+	*seed = x;
+	
+	return x;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		GetBucketIndex - Returns the histogram bucket for a latency.
+//-----------------------------------------------------------------------------
+
+static uint32_t
+GetBucketIndex ( uint64_t latency )
+{
+	
+	uint32_t	msb = 0;
+	
+	if ( latency < kHistogramSubBucketCount )
+		return ( uint32_t ) latency;
+	
+	msb = 63 - __builtin_clzll ( latency );
+	
+	return ( ( msb - kHistogramSubBucketShift + 1 ) << kHistogramSubBucketShift ) +
+		   ( ( latency >> ( msb - kHistogramSubBucketShift ) ) & ( kHistogramSubBucketCount - 1 ) );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		GetBucketLimit - Returns the largest latency in a histogram bucket.
+//-----------------------------------------------------------------------------
+
+static uint64_t
+GetBucketLimit ( uint32_t index )
+{
+	
+	uint32_t	shift	= 0;
+	uint64_t	sub		= 0;
+	
+	if ( index < kHistogramSubBucketCount )
+		return index;
+	
+	shift	= ( index >> kHistogramSubBucketShift ) - 1;
+	sub		= index & ( kHistogramSubBucketCount - 1 );
+	
+	return ( ( ( kHistogramSubBucketCount + sub + 1 ) << shift ) - 1 );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		RecordLatency - Adds a completed I/O to a histogram.
+//-----------------------------------------------------------------------------
+
+static void
+RecordLatency (
+	LatencyHistogram *		histogram,
+	uint64_t				latency,
+	uint64_t				bytes )
+{
+	
+	histogram->count++;
+	histogram->bytes += bytes;
+	histogram->total += latency;
+	histogram->buckets[GetBucketIndex ( latency )]++;
+	
+	if ( latency > histogram->max )
+		histogram->max = latency;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		MergeHistogram - Adds one histogram to another.
+//-----------------------------------------------------------------------------
+
+static void
+MergeHistogram (
+	LatencyHistogram *			destination,
+	const LatencyHistogram *	source )
+{
+	
+	uint32_t	index = 0;
+	
+	if ( source->count == 0 )
+		return;
+	
+	destination->count	+= source->count;
+	destination->bytes	+= source->bytes;
+	destination->total	+= source->total;
+	
+	if ( source->max > destination->max )
+		destination->max = source->max;
+	
+	for ( index = 0; index < kHistogramBucketCount; index++ )
+	{
+		destination->buckets[index] += source->buckets[index];
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		MergeStatistics - Adds one set of statistics to another.
+//-----------------------------------------------------------------------------
+
+static void
+MergeStatistics (
+	WorkloadStatistics *		destination,
+	const WorkloadStatistics *	source )
+{
+	
+	uint32_t	direction = 0;
+	
+	destination->errors += source->errors;
+	
+	for ( direction = 0; direction < kDirectionCount; direction++ )
+	{
+		MergeHistogram ( &destination->latency[direction], &source->latency[direction] );
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		GetPercentile - Returns a latency percentile from a histogram.
+//-----------------------------------------------------------------------------
+
+static uint64_t
+GetPercentile (
+	const LatencyHistogram *	histogram,
+	double						percentile )
+{
+	
+	uint64_t	target	= 0;
+	uint64_t	seen	= 0;
+	uint32_t	index	= 0;
+	
+	if ( histogram->count == 0 )
+		return 0;
+	
+	target = ( uint64_t ) ( histogram->count * percentile / 100.0 );
+	if ( target == 0 )
+		target = 1;
+	
+	for ( index = 0; index < kHistogramBucketCount; index++ )
+	{
+	
+		seen += histogram->buckets[index];
+		if ( seen >= target )
+			break;
+	
+	}
+	
+	// The bucket limit may be above the largest latency seen.
+	if ( GetBucketLimit ( index ) > histogram->max )
+		return histogram->max;
+	
+	return GetBucketLimit ( index );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		CollectInterval - Takes the statistics since the last report from
+//		all the threads, adding them to the totals of their devices.
+//-----------------------------------------------------------------------------
+
+static void
+CollectInterval ( WorkloadStatistics * interval )
+{
+	
+	uint32_t	thread = 0;
+	
+	memset ( interval, 0, sizeof ( *interval ) );
+	
+	for ( thread = 0; thread < gThreadCount; thread++ )
+	{
+	
+		WorkloadThread *	workloadThread = &gThreads[thread];
+	
+		pthread_mutex_lock ( &workloadThread->lock );
+	
+		MergeStatistics ( interval, &workloadThread->interval );
+		MergeStatistics ( &workloadThread->device->totals, &workloadThread->interval );
+		memset ( &workloadThread->interval, 0, sizeof ( workloadThread->interval ) );
+	
+		pthread_mutex_unlock ( &workloadThread->lock );
+	
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		PrintInterval - Prints one line for the I/O of an interval.
+//-----------------------------------------------------------------------------
+
+static void
+PrintInterval (
+	double						elapsed,
+	double						seconds,
+	const WorkloadStatistics *	interval )
+{
+	
+	const LatencyHistogram *	reads	= &interval->latency[kDirectionRead];
+	const LatencyHistogram *	writes	= &interval->latency[kDirectionWrite];
+	LatencyHistogram			all;
+	
+	if ( seconds <= 0 )
+		return;
+	
+	// The latency columns are for reads and writes together.
+	memset ( &all, 0, sizeof ( all ) );
+	MergeHistogram ( &all, reads );
+	MergeHistogram ( &all, writes );
+	
+	printf ( "%8.1f %9.0f %9.0f %9.2f %9.2f %9.1f %9.1f %9.1f %9.1f %9.1f %7llu\n",
+			 elapsed,
+			 reads->count / seconds,
+			 writes->count / seconds,
+			 reads->bytes / seconds / 1048576.0,
+			 writes->bytes / seconds / 1048576.0,
+			 ( all.count == 0 ) ? 0.0 : all.total / ( double ) all.count / 1000.0,
+			 GetPercentile ( &all, 50.0 ) / 1000.0,
+			 GetPercentile ( &all, 90.0 ) / 1000.0,
+			 GetPercentile ( &all, 99.0 ) / 1000.0,
+			 GetPercentile ( &all, 99.9 ) / 1000.0,
+			 ( unsigned long long ) interval->errors );
+	
+	fflush ( stdout );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		PrintSummary - Prints the totals for the whole run.
+//-----------------------------------------------------------------------------
+
+static void
+PrintSummary (
+	const char *				name,
+	double						seconds,
+	const WorkloadStatistics *	totals )
+{
+	
+	static const char *	directions[kDirectionCount] = { "read", "write" };
+	uint32_t			direction = 0;
+	
+	printf ( "%s: %.1f seconds, %llu errors\n", name, seconds, ( unsigned long long ) totals->errors );
+	
+	for ( direction = 0; direction < kDirectionCount; direction++ )
+	{
+	
+		const LatencyHistogram *	histogram = &totals->latency[direction];
+	
+		if ( histogram->count == 0 )
+			continue;
+	
+		printf ( "  %-5s %llu I/Os, %.0f IOPS, %.2f MB/s\n",
+				 directions[direction],
+				 ( unsigned long long ) histogram->count,
+				 histogram->count / seconds,
+				 histogram->bytes / seconds / 1048576.0 );
+	
+		printf ( "        latency (us): avg %.1f, p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+				 histogram->total / ( double ) histogram->count / 1000.0,
+				 GetPercentile ( histogram, 50.0 ) / 1000.0,
+				 GetPercentile ( histogram, 90.0 ) / 1000.0,
+				 GetPercentile ( histogram, 99.0 ) / 1000.0,
+				 GetPercentile ( histogram, 99.9 ) / 1000.0,
+				 histogram->max / 1000.0 );
+	
+	}
+	
+	fflush ( stdout );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		RunEvents - Runs the commands whose time has come. They run at the end
+//		of an interval, so they fall between two reports.
+//-----------------------------------------------------------------------------
+
+static void
+RunEvents ( double elapsed )
+{
+	
+	uint32_t	index	= 0;
+	int			status	= 0;
+	
+	for ( index = 0; index < gEventCount; index++ )
+	{
+	
+		if ( ( gEvents[index].done == true ) || ( gEvents[index].time > elapsed ) )
+			continue;
+	
+		gEvents[index].done = true;
+	
+		printf ( "%8.1f event: %s\n", elapsed, gEvents[index].command );
+		fflush ( stdout );
+	
+		status = system ( gEvents[index].command );
+		if ( status != 0 )
+			fprintf ( stderr, "The event command failed, status = %d.\n", status );
+	
+	}
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		StopWorkload - Ends the run early on SIGINT or SIGTERM.
+//-----------------------------------------------------------------------------
+
+static void
+StopWorkload ( int signal )
+{
+	
+	( void ) signal;
+	gStop = 1;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//		PrintUsage - Prints usage string
+//-----------------------------------------------------------------------------
+
+static void
+PrintUsage ( void )
+{
+	
+	printf ( "Usage: workload [--read, -r] [--random, -R] [--block-size, -b] [--queue-depth, -q] [--span, -s] [--time, -t] [--interval, -i] [--event, -e] --device, -d <device> ...\n" );
+	printf ( "       --device is the raw device of an emulator logical unit, e.g. /dev/rdisk3. It can be given more than once.\n" );
+	printf ( "       --read, --random, --block-size, --queue-depth and --span apply to the devices given after them, so each device can have its own workload.\n" );
+	printf ( "       --read is the percentage of I/O that is reads, 100 by default. Anything less writes to the device and destroys its contents.\n" );
+	printf ( "       --random is the percentage of I/O at random offsets, 100 by default. The rest is sequential.\n" );
+	printf ( "       --block-size is a comma separated list of I/O sizes, suffix usage similar to dd. Each I/O uses one at random. 4k by default.\n" );
+	printf ( "       --queue-depth is the number of I/Os kept outstanding on the device, one thread each. 1 by default.\n" );
+	printf ( "       --span limits the I/O to the start of the device, suffix usage similar to dd.\n" );
+	printf ( "       --time is the length of the run in seconds, 30 by default. --interval is the reporting interval in seconds, 1 by default.\n" );
+	printf ( "       --event is <seconds>:<command>, a shell command run at the end of the interval that many seconds into the run. It can be given more than once.\n" );
+	printf ( "       To benchmark multipathing, run against the disk of an emulator logical unit, which is reachable through both emulator ports, and take a port down and up again, e.g. --event '10:emulator --port 0 --offline' --event '20:emulator --port 0 --online'. The reports show the throughput and latency of the failover and failback. The path selection policy is the Multipath Policy of the emulator's personality.\n" );
+	fflush ( stdout );
+	
+}
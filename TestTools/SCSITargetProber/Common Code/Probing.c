@@ -41,8 +41,12 @@
 #include "Probing.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <mach/mach_time.h>
 #include <CoreFoundation/CoreFoundation.h>
 #include <IOKit/IOKitLib.h>
 #include <IOKit/storage/IOStorageProtocolCharacteristics.h>
@@ -110,14 +114,55 @@ DebugAssert ( const char *	componentNameString,
 //-----------------------------------------------------------------------------
 
 #define kIOSCSIParallelInterfaceControllerClassString	"IOSCSIParallelInterfaceController"
+#define kIOSCSIParallelInterfaceDeviceClassString		"IOSCSIParallelInterfaceDevice"
+
+// The number of probes outstanding at once when the caller does not say.
+#define kDefaultMaxParallelProbes						16
+
+
+//-----------------------------------------------------------------------------
+//	Structures
+//-----------------------------------------------------------------------------
+
+// An entry in the index of the target devices on a domain.
+typedef struct TargetIndexEntry
+{
+	SCSITargetIdentifier	targetID;
+	io_service_t			service;
+} TargetIndexEntry;
+
+// The state shared by the threads of a bulk reprobe.
+typedef struct ReprobeContext
+{
+	pthread_mutex_t			lock;
+	SCSITargetReprobe *		targets;
+	UInt32					targetCount;
+	UInt32					nextTarget;
+	TargetIndexEntry *		index;
+	UInt32					indexCount;
+} ReprobeContext;
 
 
 //-----------------------------------------------------------------------------
 //	Prototypes
 //-----------------------------------------------------------------------------
 
+static io_service_t
+FindDomainController ( UInt64 domainID );
+
 static IOReturn
-ReprobeTargetDevice ( io_service_t controller, SCSITargetIdentifier targetID );
+BuildTargetIndex ( io_service_t			controller,
+				   TargetIndexEntry **	index,
+				   UInt32 *				indexCount );
+
+static void
+ReleaseTargetIndex ( TargetIndexEntry * index, UInt32 indexCount );
+
+static int
+CompareTargetIndexEntries ( const void * a, const void * b );
+
+static void *
+ReprobeThread ( void * arg );
 
 
 //-----------------------------------------------------------------------------
@@ -130,10 +175,136 @@ ReprobeDomainTarget ( UInt64				domainID,
 					  SCSITargetIdentifier	targetID )
 {
 	
+	SCSITargetReprobe	target = { targetID, kIOReturnSuccess, 0 };
+	
+	return ReprobeDomainTargets ( domainID, &target, 1, 1 );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	ReprobeDomainTargets - Reprobes a set of target devices on a SCSI Domain
+//-----------------------------------------------------------------------------
+
+IOReturn
+ReprobeDomainTargets ( UInt64				domainID,
+					   SCSITargetReprobe *	targets,
+					   UInt32				targetCount,
+					   UInt32				maxParallel )
+{
+	
+	IOReturn			result		= kIOReturnSuccess;
+	io_service_t		controller	= MACH_PORT_NULL;
+	pthread_t *			threads		= NULL;
+	UInt32				threadCount	= 0;
+	UInt32				index		= 0;
+	ReprobeContext		context;
+	
+	bzero ( &context, sizeof ( context ) );
+	pthread_mutex_init ( &context.lock, NULL );
+	
+	context.targets		= targets;
+	context.targetCount	= targetCount;
+	
+	controller = FindDomainController ( domainID );
+	require_action ( ( controller != MACH_PORT_NULL ), ErrorExit, result = kIOReturnNoDevice );
+	
+	// Look the devices on the domain up once for the whole set of targets,
+	// rather than once per target.
+	result = BuildTargetIndex ( controller, &context.index, &context.indexCount );
+	IOObjectRelease ( controller );
+	require ( ( result == kIOReturnSuccess ), ErrorExit );
+	
+	if ( maxParallel == 0 )
+		maxParallel = kDefaultMaxParallelProbes;
+	
+	threadCount = ( targetCount < maxParallel ) ? targetCount : maxParallel;
+	
+	// This thread works on the probes as well, so it is one of them.
+	if ( threadCount > 0 )
+		threadCount--;
+	
+	// Each probe waits on its device for the INQUIRY and the like, so
+	// the probes are issued from several threads at once. If a thread
+	// can't be started, the ones which could take its share.
+	if ( threadCount > 0 )
+	{
+		
+		threads = ( pthread_t * ) calloc ( threadCount, sizeof ( pthread_t ) );
+		if ( threads != NULL )
+		{
+			
+			for ( index = 0; index < threadCount; index++ )
+			{
+				
+				if ( pthread_create ( &threads[index], NULL, ReprobeThread, &context ) != 0 )
+					break;
+				
+			}
+			
+			threadCount = index;
+			
+		}
+		
+		else
+		{
+			threadCount = 0;
+		}
+		
+	}
+	
+	// Work on the probes from this thread as well. This also covers
+	// a single target, and the case where no thread could be started.
+	ReprobeThread ( &context );
+	
+	for ( index = 0; index < threadCount; index++ )
+	{
+		pthread_join ( threads[index], NULL );
+	}
+	
+	if ( threads != NULL )
+		free ( threads );
+	
+	// Report the first error of any of the targets.
+	for ( index = 0; index < targetCount; index++ )
+	{
+		
+		if ( targets[index].result != kIOReturnSuccess )
+		{
+			
+			result = targets[index].result;
+			break;
+			
+		}
+		
+	}
+	
+	ReleaseTargetIndex ( context.index, context.indexCount );
+	
+	
+ErrorExit:
+	
+	
+	pthread_mutex_destroy ( &context.lock );
+	
+	return result;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	FindDomainController - 	Finds the IOSCSIParallelInterfaceController for
+//							a SCSI Domain. Only the protocol characteristics
+//							of each controller are read.
+//-----------------------------------------------------------------------------
+
+static io_service_t
+FindDomainController ( UInt64 domainID )
+{
+	
 	IOReturn			result		= kIOReturnSuccess;
 	io_service_t		service		= MACH_PORT_NULL;
 	io_iterator_t		iterator	= MACH_PORT_NULL;
-	boolean_t			found		= false;
 	
 	// First, let's find all the SCSI Parallel Controllers.
 	result = IOServiceGetMatchingServices ( kIOMasterPortDefault,
@@ -146,58 +317,38 @@ ReprobeDomainTarget ( UInt64				domainID,
 	while ( service != MACH_PORT_NULL )
 	{
 		
-		// Have we found the one with the specified domainID yet?
-		if ( found == false )
+		CFDictionaryRef		subDict		= NULL;
+		UInt64				deviceDomainID = 0;
+		boolean_t			found		= false;
+		
+		// Get the protocol characteristics dictionary
+		subDict = ( CFDictionaryRef ) IORegistryEntryCreateCFProperty ( service,
+																		CFSTR ( kIOPropertyProtocolCharacteristicsKey ),
+																		kCFAllocatorDefault,
+																		0 );
+		if ( subDict != NULL )
 		{
 			
-			CFMutableDictionaryRef	deviceDict	= NULL;
-			CFDictionaryRef			subDict		= NULL;
-			
-			// Get the properties for this node from the IORegistry
-			result = IORegistryEntryCreateCFProperties ( service,
-														 &deviceDict,
-														 kCFAllocatorDefault,
-														 0 );
+			CFNumberRef		deviceDomainIDRef = 0;
 			
-			// Get the protocol characteristics dictionary
-			subDict = ( CFDictionaryRef ) CFDictionaryGetValue ( deviceDict, CFSTR ( kIOPropertyProtocolCharacteristicsKey ) );
-			if ( subDict != NULL )
+			// Get the SCSI Domain Identifier value
+			deviceDomainIDRef = ( CFNumberRef ) CFDictionaryGetValue ( subDict, CFSTR ( kIOPropertySCSIDomainIdentifierKey ) );
+			if ( deviceDomainIDRef != 0 )
 			{
 				
-				CFNumberRef		deviceDomainIDRef = 0;
-				
-				// Get the SCSI Domain Identifier value
-				deviceDomainIDRef = ( CFNumberRef ) CFDictionaryGetValue ( subDict, CFSTR ( kIOPropertySCSIDomainIdentifierKey ) );
-				if ( deviceDomainIDRef != 0 )
-				{
-					
-					UInt64	deviceDomainID = 0;
-					
-					// Get the value from the CFNumberRef.
-					if ( CFNumberGetValue ( deviceDomainIDRef, kCFNumberLongLongType, &deviceDomainID ) )
-					{
-						
-						// Does the domainID match?
-						if ( domainID == deviceDomainID )
-						{
-							
-							// Find the target device and reprobe it.
-							result = ReprobeTargetDevice ( service, targetID );
-							found = true;
-							
-						}
-						
-					}
-				
-				}
+				// Does the domainID match?
+				if ( CFNumberGetValue ( deviceDomainIDRef, kCFNumberLongLongType, &deviceDomainID ) )
+					found = ( domainID == deviceDomainID );
 				
 			}
 			
-			if ( deviceDict != NULL )
-				CFRelease ( deviceDict );
+			CFRelease ( subDict );
 			
 		}
 		
+		if ( found == true )
+			break;
+		
 		IOObjectRelease ( service );
 		
 		service = IOIteratorNext ( iterator );
@@ -207,96 +358,73 @@ ReprobeDomainTarget ( UInt64				domainID,
 	IOObjectRelease ( iterator );
 	iterator = MACH_PORT_NULL;
 	
-	if ( found == false )
-		result = kIOReturnNoDevice;
-	
 	
 ErrorExit:
 	
 	
-	return result;
+	return service;
 	
 }
 
 
 //-----------------------------------------------------------------------------
-//	ReprobeTargetDevice - 	Actually performs the reprobe if it can find the
-//							IOSCSIParallelInterfaceDevice at the targetID.
+//	BuildTargetIndex - 	Builds an index, sorted by targetID, of the
+//						IOSCSIParallelInterfaceDevices on a controller.
 //-----------------------------------------------------------------------------
 
 static IOReturn
-ReprobeTargetDevice ( io_service_t controller, SCSITargetIdentifier targetID )
+BuildTargetIndex ( io_service_t			controller,
+				   TargetIndexEntry **	index,
+				   UInt32 *				indexCount )
 {
 	
-	IOReturn		result 		= kIOReturnSuccess;
-	io_iterator_t	childIter	= MACH_PORT_NULL;
-	io_service_t	service		= MACH_PORT_NULL;
-	boolean_t		found		= false;
+	IOReturn			result 		= kIOReturnSuccess;
+	io_iterator_t		childIter	= MACH_PORT_NULL;
+	io_service_t		service		= MACH_PORT_NULL;
+	TargetIndexEntry *	entries		= NULL;
+	UInt32				count		= 0;
+	UInt32				capacity	= 0;
+	
+	*index		= NULL;
+	*indexCount	= 0;
 	
-	// We find the children for the controller and iterate over them looking for the
-	// one which has a targetID which matches.
 	result = IORegistryEntryGetChildIterator ( controller, kIOServicePlane, &childIter );
 	require ( ( result == kIOReturnSuccess ), ErrorExit );
 	
 	service = IOIteratorNext ( childIter );	
 	while ( service != MACH_PORT_NULL )
 	{
-
-		// Did we find our device yet? If not, then try to find it. If we have already
-		// found it, we still need to call IOObjectRelease on the io_service_t
-		// or it will have an artificial retain count on it.
-		if ( found == false )
+		
+		io_name_t	location;
+		
+		// The target devices use their targetID, in hex, as their location
+		// in the service plane, so no properties need to be read.
+		if ( IOObjectConformsTo ( service, kIOSCSIParallelInterfaceDeviceClassString ) &&
+			 ( IORegistryEntryGetLocationInPlane ( service, kIOServicePlane, location ) == kIOReturnSuccess ) )
 		{
 			
-			CFMutableDictionaryRef	deviceDict	= NULL;
-			CFDictionaryRef			subDict		= NULL;
-			
-			// Get the properties for this node from the IORegistry
-			result = IORegistryEntryCreateCFProperties ( service,
-														 &deviceDict,
-														 kCFAllocatorDefault,
-														 0 );
-			
-			// Get the protocol characteristics dictionary
-			subDict = ( CFDictionaryRef ) CFDictionaryGetValue ( deviceDict, CFSTR ( kIOPropertyProtocolCharacteristicsKey ) );
-			if ( subDict != NULL )
+			if ( count == capacity )
 			{
 				
-				CFNumberRef		deviceTargetIDRef = 0;
+				TargetIndexEntry *	newEntries = NULL;
 				
-				// Get the targetID value
-				deviceTargetIDRef = ( CFNumberRef ) CFDictionaryGetValue ( subDict, CFSTR ( kIOPropertySCSITargetIdentifierKey ) );
-				if ( deviceTargetIDRef != 0 )
-				{
-					
-					UInt64	deviceTargetID = 0;
-					
-					// Get the value from the CFNumberRef.
-					if ( CFNumberGetValue ( deviceTargetIDRef, kCFNumberLongLongType, &deviceTargetID ) )
-					{
-						
-						// Does it match?
-						if ( targetID == deviceTargetID )
-						{
-							
-							// Reprobe the device.
-							result = IOServiceRequestProbe ( service, 0 );
-							found = true;
-							
-						}
-						
-					}
-					
-				}
+				capacity = ( capacity == 0 ) ? 64 : capacity * 2;
+				newEntries = ( TargetIndexEntry * ) realloc ( entries, capacity * sizeof ( TargetIndexEntry ) );
+				require_action ( ( newEntries != NULL ), AllocationFailure, result = kIOReturnNoMemory );
+				entries = newEntries;
 				
 			}
 			
-			if ( deviceDict != NULL )
-				CFRelease ( deviceDict );
+			entries[count].targetID	= strtoull ( location, ( char ** ) NULL, 16 );
+			entries[count].service	= service;
+			count++;
 			
 		}
 		
-		IOObjectRelease ( service );
+		else
+		{
+			IOObjectRelease ( service );
+		}
 		
 		service = IOIteratorNext ( childIter );
 		
@@ -305,8 +433,21 @@ ReprobeTargetDevice ( io_service_t controller, SCSITargetIdentifier targetID )
 	IOObjectRelease ( childIter );
 	childIter = MACH_PORT_NULL;
 	
-	if ( found == false )
-		result = kIOReturnNoDevice;
+	if ( count != 0 )
+		qsort ( entries, count, sizeof ( TargetIndexEntry ), CompareTargetIndexEntries );
+	
+	*index		= entries;
+	*indexCount	= count;
+	
+	return kIOReturnSuccess;
+	
+	
+AllocationFailure:
+	
+	
+	IOObjectRelease ( service );
+	IOObjectRelease ( childIter );
+	ReleaseTargetIndex ( entries, count );
 	
 	
 ErrorExit:
@@ -314,4 +455,108 @@ ErrorExit:
 	
 	return result;
 	
-}
\ No newline at end of file
+}
+
+
+//-----------------------------------------------------------------------------
+//	ReleaseTargetIndex - Releases an index built by BuildTargetIndex.
+//-----------------------------------------------------------------------------
+
+static void
+ReleaseTargetIndex ( TargetIndexEntry * index, UInt32 indexCount )
+{
+	
+	UInt32	entry = 0;
+	
+	for ( entry = 0; entry < indexCount; entry++ )
+		IOObjectRelease ( index[entry].service );
+	
+	if ( index != NULL )
+		free ( index );
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	CompareTargetIndexEntries - Orders index entries by targetID.
+//-----------------------------------------------------------------------------
+
+static int
+CompareTargetIndexEntries ( const void * a, const void * b )
+{
+	
+	SCSITargetIdentifier	left	= ( ( const TargetIndexEntry * ) a )->targetID;
+	SCSITargetIdentifier	right	= ( ( const TargetIndexEntry * ) b )->targetID;
+	
+	if ( left < right )
+		return -1;
+	
+	if ( left > right )
+		return 1;
+	
+	return 0;
+	
+}
+
+
+//-----------------------------------------------------------------------------
+//	ReprobeThread - 	Takes targets from the set one at a time and
+//						reprobes them, until the set is done.
+//-----------------------------------------------------------------------------
+
+static void *
+ReprobeThread ( void * arg )
+{
+	
+	ReprobeContext *			context		= ( ReprobeContext * ) arg;
+	mach_timebase_info_data_t	timebase;
+	
+	mach_timebase_info ( &timebase );
+	
+	for ( ;; )
+	{
+		
+		SCSITargetReprobe *		target	= NULL;
+		TargetIndexEntry *		entry	= NULL;
+		TargetIndexEntry		key;
+		uint64_t				start	= 0;
+		
+		pthread_mutex_lock ( &context->lock );
+		
+		if ( context->nextTarget < context->targetCount )
+			target = &context->targets[context->nextTarget++];
+		
+		pthread_mutex_unlock ( &context->lock );
+		
+		if ( target == NULL )
+			break;
+		
+		key.targetID = target->targetID;
+		entry = ( TargetIndexEntry * ) bsearch ( &key,
+												 context->index,
+												 context->indexCount,
+												 sizeof ( TargetIndexEntry ),
+												 CompareTargetIndexEntries );
+		
+		start = mach_absolute_time ( );
+		
+		if ( entry != NULL )
+		{
+			
+			// Reprobe the device.
+			target->result = IOServiceRequestProbe ( entry->service, 0 );
+			
+		}
+		
+		else
+		{
+			target->result = kIOReturnNoDevice;
+		}
+		
+		target->duration = ( mach_absolute_time ( ) - start ) * timebase.numer / timebase.denom;
+		
+	}
+	
+	return NULL;
+	
+}
@@ -50,4 +50,25 @@
 // targetID on a particular SCSI Domain specified by domainID.
 IOReturn
 ReprobeDomainTarget ( UInt64				domainID,
-					  SCSITargetIdentifier	targetID );
\ No newline at end of file
+					  SCSITargetIdentifier	targetID );
+
+// The entry for one target of a bulk reprobe. The caller fills in targetID,
+// ReprobeDomainTargets fills in the result and the time the probe took, in
+// nanoseconds.
+typedef struct SCSITargetReprobe
+{
+	SCSITargetIdentifier	targetID;
+	IOReturn				result;
+	UInt64					duration;
+} SCSITargetReprobe;
+
+// This method is called to reprobe a set of target devices on a particular
+// SCSI Domain specified by domainID. The devices on the domain are only
+// looked up once for the whole set, and up to maxParallel probes are issued
+// at the same time (0 picks a default). Returns kIOReturnNoDevice if there is
+// no such domain, otherwise the first error of any of the targets.
+IOReturn
+ReprobeDomainTargets ( UInt64				domainID,
+					   SCSITargetReprobe *	targets,
+					   UInt32				targetCount,
+					   UInt32				maxParallel );
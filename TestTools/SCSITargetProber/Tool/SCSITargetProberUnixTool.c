@@ -39,6 +39,7 @@
 //-----------------------------------------------------------------------------
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <mach/mach_error.h>
@@ -108,7 +109,12 @@ DebugAssert ( const char *	componentNameString,
 
 static IOReturn
 ParseArguments ( int argc, const char * argv[],
-				 UInt64 * domainID, SCSITargetIdentifier * targetID );
+				 UInt64 * domainID, SCSITargetReprobe ** targets,
+				 UInt32 * targetCount, UInt32 * maxParallel );
+
+static IOReturn
+ParseTargets ( const char * string,
+			   SCSITargetReprobe ** targets, UInt32 * targetCount );
 
 static void
 PrintUsage ( void );
@@ -125,15 +131,66 @@ main ( int argc, const char * argv[] )
 	int						returnCode	= 0;
 	IOReturn				result		= kIOReturnSuccess;
 	UInt64					domainID	= 0;
-	SCSITargetIdentifier	targetID	= 0;
+	SCSITargetReprobe *		targets		= NULL;
+	UInt32					targetCount	= 0;
+	UInt32					maxParallel	= 0;
+	UInt32					index		= 0;
 	
-	result = ParseArguments ( argc, argv, &domainID, &targetID );
+	result = ParseArguments ( argc, argv, &domainID, &targets, &targetCount, &maxParallel );
 	require_action ( ( result == 0 ), ErrorExit, PrintUsage ( ); returnCode = 1 );
 	
-	printf ( "SCSITargetProber: Probing device for domain = %lld, targetID = %lld\n", domainID, targetID );
+	if ( targetCount == 1 )
+	{
+		
+		printf ( "SCSITargetProber: Probing device for domain = %lld, targetID = %lld\n", domainID, targets[0].targetID );
+		
+		result = ReprobeDomainTarget ( domainID, targets[0].targetID );
+		require_action ( ( result == 0 ), ErrorExit, printf ( "Error = %s (0x%08x) reprobing device\n", mach_error_string ( result ), result ); returnCode = 2 );
+		
+	}
 	
-	result = ReprobeDomainTarget ( domainID, targetID );
-	require_action ( ( result == 0 ), ErrorExit, printf ( "Error = %s (0x%08x) reprobing device\n", mach_error_string ( result ), result ); returnCode = 2 );
+	else
+	{
+		
+		UInt64		total	= 0;
+		UInt32		failed	= 0;
+		
+		printf ( "SCSITargetProber: Probing %u devices for domain = %lld\n", ( unsigned int ) targetCount, domainID );
+		
+		result = ReprobeDomainTargets ( domainID, targets, targetCount, maxParallel );
+		
+		for ( index = 0; index < targetCount; index++ )
+		{
+			
+			if ( targets[index].result != kIOReturnSuccess )
+				failed++;
+			
+		}
+		
+		// An error without any failed target means the domain wasn't found.
+		require_action ( ( result == 0 ) || ( failed != 0 ), ErrorExit, printf ( "Error = %s (0x%08x) finding domain\n", mach_error_string ( result ), result ); returnCode = 2 );
+		
+		for ( index = 0; index < targetCount; index++ )
+		{
+			
+			printf ( "targetID = %lld: %8.3f ms", targets[index].targetID, targets[index].duration / 1000000.0 );
+			
+			if ( targets[index].result != kIOReturnSuccess )
+				printf ( ", error = %s (0x%08x)", mach_error_string ( targets[index].result ), targets[index].result );
+			
+			printf ( "\n" );
+			
+			total += targets[index].duration;
+			
+		}
+		
+		printf ( "Total probe time = %.3f ms, %u failed\n", total / 1000000.0, ( unsigned int ) failed );
+		
+		require_action ( ( result == 0 ), ErrorExit, returnCode = 2 );
+		
+	}
+	
+	free ( targets );
 	
 	return 0;
 	
@@ -141,6 +198,9 @@ main ( int argc, const char * argv[] )
 ErrorExit:
 	
 	
+	if ( targets != NULL )
+		free ( targets );
+	
 	return returnCode;
 	
 }
@@ -152,13 +212,14 @@ ErrorExit:
 
 static IOReturn
 ParseArguments ( int argc, const char * argv[],
-				 UInt64 * domainID, SCSITargetIdentifier * targetID )
+				 UInt64 * domainID, SCSITargetReprobe ** targets,
+				 UInt32 * targetCount, UInt32 * maxParallel )
 {
 	
 	IOReturn	result	= kIOReturnSuccess;
 	int			ch;
 	
-	while ( ( ch = getopt ( argc, ( char * const * ) argv, "d:t:" ) ) != -1 )
+	while ( ( ch = getopt ( argc, ( char * const * ) argv, "d:t:j:" ) ) != -1 )
 	{
 		
 		switch ( ch )
@@ -169,7 +230,12 @@ ParseArguments ( int argc, const char * argv[],
 				break;
 			
 			case 't':
-				*targetID = strtoull ( optarg, ( char ** ) NULL, 10 );
+				if ( ParseTargets ( optarg, targets, targetCount ) != kIOReturnSuccess )
+					result = kIOReturnBadArgument;
+				break;
+			
+			case 'j':
+				*maxParallel = strtoul ( optarg, ( char ** ) NULL, 10 );
 				break;
 			
 			default:
@@ -180,11 +246,86 @@ ParseArguments ( int argc, const char * argv[],
 		
 	}
 	
+	// Probe targetID 0 if no target was given.
+	if ( ( result == kIOReturnSuccess ) && ( *targetCount == 0 ) )
+		result = ParseTargets ( "0", targets, targetCount );
+	
 	return result;
 	
 }
 
 
+//-----------------------------------------------------------------------------
+//	ParseTargets - 	Parses a list of targetIDs and targetID ranges, such as
+//					"0-15,32", adding them to the set of targets.
+//-----------------------------------------------------------------------------
+
+static IOReturn
+ParseTargets ( const char * string,
+			   SCSITargetReprobe ** targets, UInt32 * targetCount )
+{
+	
+	const char *	next	= string;
+	char *			end		= NULL;
+	
+	while ( *next != '\0' )
+	{
+		
+		SCSITargetIdentifier	first	= 0;
+		SCSITargetIdentifier	last	= 0;
+		SCSITargetIdentifier	target	= 0;
+		SCSITargetReprobe *		newTargets = NULL;
+		
+		first = strtoull ( next, &end, 10 );
+		require ( ( end != next ), ErrorExit );
+		
+		last = first;
+		next = end;
+		
+		if ( *next == '-' )
+		{
+			
+			next++;
+			last = strtoull ( next, &end, 10 );
+			require ( ( end != next ) && ( last >= first ), ErrorExit );
+			next = end;
+			
+		}
+		
+		require ( ( last - first ) < 0x10000, ErrorExit );
+		
+		newTargets = ( SCSITargetReprobe * ) realloc ( *targets, ( *targetCount + ( last - first ) + 1 ) * sizeof ( SCSITargetReprobe ) );
+		require ( ( newTargets != NULL ), ErrorExit );
+		*targets = newTargets;
+		
+		for ( target = first; target <= last; target++ )
+		{
+			
+			( *targets )[*targetCount].targetID	= target;
+			( *targets )[*targetCount].result	= kIOReturnSuccess;
+			( *targets )[*targetCount].duration	= 0;
+			( *targetCount )++;
+			
+		}
+		
+		if ( *next == ',' )
+			next++;
+		else
+			require ( ( *next == '\0' ), ErrorExit );
+		
+	}
+	
+	return kIOReturnSuccess;
+	
+	
+ErrorExit:
+	
+	
+	return kIOReturnBadArgument;
+	
+}
+
+
 //-----------------------------------------------------------------------------
 //	PrintUsage - Prints out usage
 //-----------------------------------------------------------------------------
@@ -194,11 +335,13 @@ PrintUsage ( void )
 {
 	
 	printf ( "\n" );
-	printf ( "Usage: stp -d domainID -t targetID\n" );
+	printf ( "Usage: stp -d domainID -t targetID[-targetID][,...] [-j count]\n" );
 	printf ( "\t\t" );
 	printf ( "-d This option specifies which SCSI Domain on which to find the target for probing\n" );
 	printf ( "\t\t" );
-	printf ( "-t This option specifices which SCSI Target Identifier should be probed\n" );
+	printf ( "-t This option specifices which SCSI Target Identifiers should be probed, e.g. 3 or 0-15,32\n" );
+	printf ( "\t\t" );
+	printf ( "-j This option specifies how many targets may be probed at the same time\n" );
 	printf ( "\n" );
 	
-}
\ No newline at end of file
+}